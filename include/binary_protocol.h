@@ -0,0 +1,320 @@
+#ifndef BINARY_PROTOCOL_H
+#define BINARY_PROTOCOL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "net_compat.h"
+
+// Optional binary framing, entered by sending the text command BINARY after
+// WELCOME; the server answers "OK Binary protocol" as a text line and every
+// byte after that line (and after the client's BINARY line) is framed:
+//
+//   frame := opcode (1 byte) | varint body length | body
+//   body  := fields in the order listed below; a text field is a varint
+//            length followed by that many bytes (no terminator, no NUL
+//            allowed), an integer field is a bare varint.
+//
+// Varints are unsigned LEB128. A body may be up to BINARY_MAX_FRAME bytes,
+// so messages may be far longer than a text line and may contain newlines.
+//
+// Any opcode may be or'ed with BINARY_TAGGED; its body then starts with a
+// varint request id ahead of the usual fields, and every reply to it is
+// tagged the same way.
+//
+// After BINARY_COMPRESS 1 the server may pack a run of history or inbox
+// frames into one BINARY_DEFLATE frame, whose body is not made of fields but
+// is a varint length followed by the raw deflate stream of that many bytes
+// of ordinary frames, to be read exactly as if they had arrived unpacked.
+#define BINARY_MAX_FRAME (1u << 20)
+#define BINARY_MAX_VARINT 10
+#define BINARY_MAX_HEADER (1 + BINARY_MAX_VARINT)
+#define BINARY_TAGGED 0x80
+
+typedef enum {
+    // client -> server
+    BINARY_AUTH = 0x01,   // name[, token]
+    BINARY_SEND = 0x02,   // user, body
+    BINARY_GET = 0x03,    // user, limit (0 = whole conversation), before_id (0 = newest)
+    BINARY_DELETE = 0x04, // user
+    BINARY_USERS = 0x05,  // (no fields) for the list, or since_version
+    BINARY_QUIT = 0x06,   // (no fields)
+    BINARY_GROUP = 0x07,  // count, that many users, body
+    BINARY_INBOX = 0x08,  // (no fields)
+    BINARY_STATS = 0x09,  // (no fields)
+    BINARY_PRESENCE = 0x0A, // 1 = push JOIN/LEAVE, 0 = stop
+    BINARY_PING = 0x0B,   // (no fields); answered with PONG
+    BINARY_PONG = 0x0C,   // (no fields); the answer to a server PING
+    BINARY_COMPRESS = 0x0D, // 1 = allow BINARY_DEFLATE, 0 = stop
+    BINARY_SYNC = 0x0E,   // user, after_id; answered with BINARY_HISTORY rows
+    // server -> client: status lines carry the text after the keyword
+    BINARY_OK = 0x41,
+    BINARY_ERROR = 0x42,
+    BINARY_INFO = 0x43,
+    BINARY_BYE = 0x44,
+    BINARY_SHUTDOWN = 0x45,
+    BINARY_USERS_BEGIN = 0x46,
+    BINARY_USER = 0x47,
+    BINARY_USERS_END = 0x48,
+    BINARY_STATS_BEGIN = 0x49,
+    BINARY_STAT = 0x4A,
+    BINARY_STATS_END = 0x4B,
+    BINARY_JOIN = 0x4C,  // "<user> <version>"
+    BINARY_LEAVE = 0x4D, // "<user> <version>"
+    BINARY_HEARTBEAT = 0x4E,     // PING: answer with BINARY_PONG
+    BINARY_HEARTBEAT_ACK = 0x4F, // PONG: the answer to BINARY_PING
+    BINARY_MESSAGE = 0x50, // sender, body
+    BINARY_HISTORY = 0x51, // id, timestamp, sender, body
+    BINARY_MISSED = 0x52,  // id, timestamp, sender, body: an INBOX row
+    BINARY_DEFLATE = 0x53, // plain length, raw deflate of whole frames
+} binary_opcode_t;
+
+// Keyword of the text line each status opcode stands for.
+static const struct {
+    binary_opcode_t opcode;
+    const char *keyword;
+} binary_status_keywords[] = {
+    {BINARY_OK, "OK"},
+    {BINARY_ERROR, "ERROR"},
+    {BINARY_INFO, "INFO"},
+    {BINARY_BYE, "BYE"},
+    {BINARY_SHUTDOWN, "SHUTDOWN"},
+    {BINARY_USERS_BEGIN, "USERS_BEGIN"},
+    {BINARY_USER, "USER"},
+    {BINARY_USERS_END, "USERS_END"},
+    {BINARY_STATS_BEGIN, "STATS_BEGIN"},
+    {BINARY_STAT, "STAT"},
+    {BINARY_STATS_END, "STATS_END"},
+    {BINARY_JOIN, "JOIN"},
+    {BINARY_LEAVE, "LEAVE"},
+    {BINARY_HEARTBEAT, "PING"},
+    {BINARY_HEARTBEAT_ACK, "PONG"},
+};
+
+#define BINARY_STATUS_COUNT (sizeof(binary_status_keywords) / sizeof(binary_status_keywords[0]))
+
+static inline int binary_status_opcode(const char *keyword, size_t len) {
+    for (size_t i = 0; i < BINARY_STATUS_COUNT; ++i) {
+        if (strlen(binary_status_keywords[i].keyword) == len &&
+            memcmp(binary_status_keywords[i].keyword, keyword, len) == 0) {
+            return (int)binary_status_keywords[i].opcode;
+        }
+    }
+    return -1;
+}
+
+static inline const char *binary_status_keyword(int opcode) {
+    for (size_t i = 0; i < BINARY_STATUS_COUNT; ++i) {
+        if ((int)binary_status_keywords[i].opcode == opcode) {
+            return binary_status_keywords[i].keyword;
+        }
+    }
+    return NULL;
+}
+
+typedef struct {
+    const char *text; // NULL for an integer field
+    size_t len;
+    uint64_t value;
+} binary_field_t;
+
+#define BINARY_TEXT(s, n) ((binary_field_t){(s), (n), 0})
+#define BINARY_INT(v) ((binary_field_t){NULL, 0, (uint64_t)(v)})
+
+static inline size_t binary_varint_size(uint64_t value) {
+    size_t size = 1;
+    while (value >= 0x80) {
+        value >>= 7;
+        ++size;
+    }
+    return size;
+}
+
+static inline unsigned char *binary_put_varint(unsigned char *out, uint64_t value) {
+    while (value >= 0x80) {
+        *out++ = (unsigned char)(value | 0x80);
+        value >>= 7;
+    }
+    *out++ = (unsigned char)value;
+    return out;
+}
+
+static inline size_t binary_body_size(const binary_field_t *fields, size_t count) {
+    size_t size = 0;
+    for (size_t i = 0; i < count; ++i) {
+        size += fields[i].text ? binary_varint_size(fields[i].len) + fields[i].len
+                               : binary_varint_size(fields[i].value);
+    }
+    return size;
+}
+
+static inline size_t binary_frame_size(const binary_field_t *fields, size_t count) {
+    size_t body = binary_body_size(fields, count);
+    return 1 + binary_varint_size(body) + body;
+}
+
+// Writes a whole frame to `out`, which must hold binary_frame_size() bytes.
+// Returns the number of bytes written.
+static inline size_t binary_encode(unsigned char *out, binary_opcode_t opcode, const binary_field_t *fields,
+                                   size_t count) {
+    unsigned char *cursor = out;
+    *cursor++ = (unsigned char)opcode;
+    cursor = binary_put_varint(cursor, binary_body_size(fields, count));
+    for (size_t i = 0; i < count; ++i) {
+        if (fields[i].text) {
+            cursor = binary_put_varint(cursor, fields[i].len);
+            memcpy(cursor, fields[i].text, fields[i].len);
+            cursor += fields[i].len;
+        } else {
+            cursor = binary_put_varint(cursor, fields[i].value);
+        }
+    }
+    return (size_t)(cursor - out);
+}
+
+// Reads one varint from [*p, end). Returns 1 and advances *p, 0 if more bytes
+// are needed, -1 if the encoding is longer than any 64-bit value.
+static inline int binary_get_varint(const unsigned char **p, const unsigned char *end, uint64_t *value) {
+    uint64_t result = 0;
+    const unsigned char *cursor = *p;
+    for (int shift = 0; shift < 7 * BINARY_MAX_VARINT; shift += 7) {
+        if (cursor == end) {
+            return 0;
+        }
+        unsigned char byte = *cursor++;
+        result |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            *value = result;
+            *p = cursor;
+            return 1;
+        }
+    }
+    return -1;
+}
+
+// Field cursor over one received frame body.
+typedef struct {
+    const unsigned char *p;
+    const unsigned char *end;
+} binary_cursor_t;
+
+static inline bool binary_next_int(binary_cursor_t *cur, uint64_t *value) {
+    return binary_get_varint(&cur->p, cur->end, value) == 1;
+}
+
+static inline bool binary_next_text(binary_cursor_t *cur, const char **text, size_t *len) {
+    uint64_t n;
+    if (binary_get_varint(&cur->p, cur->end, &n) != 1 || n > (uint64_t)(cur->end - cur->p) ||
+        memchr(cur->p, '\0', (size_t)n)) {
+        return false;
+    }
+    *text = (const char *)cur->p;
+    *len = (size_t)n;
+    cur->p += n;
+    return true;
+}
+
+// Receive buffer for framed input. Grows on demand up to one maximal frame;
+// consumed bytes are reclaimed by sliding the remainder down before a fill.
+typedef struct {
+    unsigned char *data;
+    size_t head; // next byte to parse
+    size_t tail; // next byte to fill
+    size_t capacity;
+} frame_reader_t;
+
+static inline void frame_reader_init(frame_reader_t *fr) {
+    fr->data = NULL;
+    fr->head = 0;
+    fr->tail = 0;
+    fr->capacity = 0;
+}
+
+static inline void frame_reader_free(frame_reader_t *fr) {
+    free(fr->data);
+    frame_reader_init(fr);
+}
+
+// Makes room for at least `need` more bytes after tail.
+static inline int frame_reader_reserve(frame_reader_t *fr, size_t need) {
+    if (fr->head > 0 && fr->capacity - fr->tail < need) {
+        memmove(fr->data, fr->data + fr->head, fr->tail - fr->head);
+        fr->tail -= fr->head;
+        fr->head = 0;
+    }
+    if (fr->capacity - fr->tail >= need) {
+        return 0;
+    }
+    size_t capacity = fr->capacity ? fr->capacity : 4096;
+    while (capacity - fr->tail < need) {
+        capacity *= 2;
+    }
+    unsigned char *data = realloc(fr->data, capacity);
+    if (!data) {
+        return -1;
+    }
+    fr->data = data;
+    fr->capacity = capacity;
+    return 0;
+}
+
+static inline int frame_reader_append(frame_reader_t *fr, const void *bytes, size_t len) {
+    if (len == 0) {
+        return 0;
+    }
+    if (frame_reader_reserve(fr, len) != 0) {
+        return -1;
+    }
+    memcpy(fr->data + fr->tail, bytes, len);
+    fr->tail += len;
+    return 0;
+}
+
+// Performs one recv(). Returns the recv() result; 0 also when no buffer space
+// can be allocated, which callers treat like a closed connection.
+static inline ssize_t frame_reader_fill(frame_reader_t *fr, socket_handle_t fd) {
+    size_t pending = fr->tail - fr->head;
+    size_t want = pending < 4096 ? 4096 : pending; // grow geometrically while a big frame arrives
+    if (frame_reader_reserve(fr, want > BINARY_MAX_FRAME ? BINARY_MAX_FRAME : want) != 0) {
+        return 0;
+    }
+    ssize_t n = recv(fd, (char *)fr->data + fr->tail, fr->capacity - fr->tail, 0);
+    if (n > 0) {
+        fr->tail += (size_t)n;
+    }
+    return n;
+}
+
+// Extracts the next complete frame. Returns 1 with `body` pointing into the
+// buffer (valid until the next fill or append), 0 if the frame is incomplete
+// and -1 if the stream is malformed and cannot be resynchronized.
+static inline int frame_reader_next(frame_reader_t *fr, int *opcode, const unsigned char **body, size_t *len) {
+    const unsigned char *start = fr->data + fr->head;
+    const unsigned char *end = fr->data + fr->tail;
+    if (start == end) {
+        return 0;
+    }
+    const unsigned char *cursor = start + 1;
+    uint64_t body_len = 0;
+    int rc = binary_get_varint(&cursor, end, &body_len);
+    if (rc <= 0) {
+        return rc;
+    }
+    if (body_len > BINARY_MAX_FRAME) {
+        return -1;
+    }
+    if ((uint64_t)(end - cursor) < body_len) {
+        return 0;
+    }
+    *opcode = start[0];
+    *body = cursor;
+    *len = (size_t)body_len;
+    fr->head += (size_t)(cursor - start) + (size_t)body_len;
+    return 1;
+}
+
+#endif /* BINARY_PROTOCOL_H */
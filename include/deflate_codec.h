@@ -0,0 +1,106 @@
+#ifndef DEFLATE_CODEC_H
+#define DEFLATE_CODEC_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// Raw deflate streams (no zlib header or checksum: every container that uses
+// them already records the inflated length), shared by body compression in
+// storage and the compressed history frames of the binary protocol. A stream
+// is set up once and reset per buffer, so the costly init is paid once per
+// owner. Builds without zlib (CHAT_USE_ZLIB=0, as on Windows) keep the API
+// but every call fails, and callers fall back to plain bytes.
+#ifndef CHAT_USE_ZLIB
+#define CHAT_USE_ZLIB 1
+#endif
+
+#if CHAT_USE_ZLIB
+#include <zlib.h>
+#endif
+
+#define DEFLATE_CODEC_LEVEL 6
+#define DEFLATE_CODEC_WINDOW_BITS 15
+
+typedef struct {
+#if CHAT_USE_ZLIB
+    z_stream z;
+#endif
+    bool ready;
+    bool inflating;
+} deflate_codec_t;
+
+static inline int deflate_codec_init(deflate_codec_t *codec, bool inflating) {
+    codec->ready = false;
+    codec->inflating = inflating;
+#if CHAT_USE_ZLIB
+    memset(&codec->z, 0, sizeof(codec->z));
+    int rc = inflating ? inflateInit2(&codec->z, -DEFLATE_CODEC_WINDOW_BITS)
+                       : deflateInit2(&codec->z, DEFLATE_CODEC_LEVEL, Z_DEFLATED, -DEFLATE_CODEC_WINDOW_BITS, 8,
+                                      Z_DEFAULT_STRATEGY);
+    codec->ready = rc == Z_OK;
+#endif
+    return codec->ready ? 0 : -1;
+}
+
+static inline void deflate_codec_end(deflate_codec_t *codec) {
+#if CHAT_USE_ZLIB
+    if (codec->ready) {
+        if (codec->inflating) {
+            inflateEnd(&codec->z);
+        } else {
+            deflateEnd(&codec->z);
+        }
+    }
+#endif
+    codec->ready = false;
+}
+
+// Compresses `in` into at most `capacity` bytes of `out`, priming the window
+// with `dict` when given. Returns 0 with the size in *out_len, or -1 when the
+// result would not fit (incompressible input included).
+static inline int deflate_codec_compress(deflate_codec_t *codec, const void *dict, size_t dict_len, const void *in,
+                                         size_t in_len, void *out, size_t capacity, size_t *out_len) {
+#if CHAT_USE_ZLIB
+    if (!codec->ready || codec->inflating || deflateReset(&codec->z) != Z_OK ||
+        (dict_len > 0 && deflateSetDictionary(&codec->z, (const Bytef *)dict, (uInt)dict_len) != Z_OK)) {
+        return -1;
+    }
+    codec->z.next_in = (Bytef *)(uintptr_t)in;
+    codec->z.avail_in = (uInt)in_len;
+    codec->z.next_out = (Bytef *)out;
+    codec->z.avail_out = (uInt)capacity;
+    if (deflate(&codec->z, Z_FINISH) != Z_STREAM_END) {
+        return -1;
+    }
+    *out_len = capacity - codec->z.avail_out;
+    return 0;
+#else
+    (void)codec, (void)dict, (void)dict_len, (void)in, (void)in_len, (void)out, (void)capacity, (void)out_len;
+    return -1;
+#endif
+}
+
+// Inflates `in`, which must expand to exactly `out_len` bytes, with the same
+// dictionary it was compressed with. Returns 0 or -1 for corrupt input.
+static inline int deflate_codec_inflate(deflate_codec_t *codec, const void *dict, size_t dict_len, const void *in,
+                                        size_t in_len, void *out, size_t out_len) {
+#if CHAT_USE_ZLIB
+    if (!codec->ready || !codec->inflating || inflateReset(&codec->z) != Z_OK ||
+        (dict_len > 0 && inflateSetDictionary(&codec->z, (const Bytef *)dict, (uInt)dict_len) != Z_OK)) {
+        return -1;
+    }
+    codec->z.next_in = (Bytef *)(uintptr_t)in;
+    codec->z.avail_in = (uInt)in_len;
+    codec->z.next_out = (Bytef *)out;
+    codec->z.avail_out = (uInt)out_len;
+    int rc = inflate(&codec->z, Z_FINISH);
+    return (rc == Z_STREAM_END && codec->z.avail_out == 0 && codec->z.avail_in == 0) ? 0 : -1;
+#else
+    (void)codec, (void)dict, (void)dict_len, (void)in, (void)in_len, (void)out, (void)out_len;
+    return -1;
+#endif
+}
+
+#endif /* DEFLATE_CODEC_H */
@@ -0,0 +1,83 @@
+#ifndef LATENCY_HISTOGRAM_H
+#define LATENCY_HISTOGRAM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Log-linear latency buckets in the style of HdrHistogram, shared by the
+// server's metrics and the benchmark tools: values below 16 ns get a bucket
+// each, and every power of two above is split into 8 equal ranges, so any
+// percentile read back is within 12.5% of the recorded value. Anything
+// beyond 2^41 ns (about 36 minutes) lands in the last bucket.
+#define LATENCY_SUB_BITS 3u
+#define LATENCY_SUB_BUCKETS (1u << LATENCY_SUB_BITS)
+#define LATENCY_MAX_MAGNITUDE 40u
+#define LATENCY_BUCKETS ((LATENCY_MAX_MAGNITUDE - LATENCY_SUB_BITS + 1u) * LATENCY_SUB_BUCKETS + LATENCY_SUB_BUCKETS)
+
+static inline size_t latency_bucket(uint64_t ns) {
+    if (ns < 2 * LATENCY_SUB_BUCKETS) {
+        return (size_t)ns;
+    }
+    unsigned msb = 0;
+    for (uint64_t v = ns; v >>= 1;) {
+        ++msb;
+    }
+    if (msb > LATENCY_MAX_MAGNITUDE) {
+        return LATENCY_BUCKETS - 1;
+    }
+    return (size_t)(msb - LATENCY_SUB_BITS) * LATENCY_SUB_BUCKETS + (size_t)(ns >> (msb - LATENCY_SUB_BITS));
+}
+
+// Highest value that lands in `bucket`.
+static inline uint64_t latency_bucket_ceiling(size_t bucket) {
+    if (bucket < 2 * LATENCY_SUB_BUCKETS) {
+        return bucket;
+    }
+    unsigned shift = (unsigned)(bucket / LATENCY_SUB_BUCKETS) - 1u;
+    uint64_t top = bucket % LATENCY_SUB_BUCKETS + LATENCY_SUB_BUCKETS + 1u;
+    return (top << shift) - 1u;
+}
+
+// Plain single-writer histogram; merge per-thread copies before reading.
+typedef struct {
+    uint64_t buckets[LATENCY_BUCKETS];
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+} latency_histogram_t;
+
+static inline void latency_histogram_record(latency_histogram_t *h, uint64_t ns) {
+    h->buckets[latency_bucket(ns)]++;
+    h->count++;
+    h->sum += ns;
+    if (ns > h->max) {
+        h->max = ns;
+    }
+}
+
+static inline void latency_histogram_merge(latency_histogram_t *into, const latency_histogram_t *from) {
+    for (size_t b = 0; b < LATENCY_BUCKETS; ++b) {
+        into->buckets[b] += from->buckets[b];
+    }
+    into->count += from->count;
+    into->sum += from->sum;
+    if (from->max > into->max) {
+        into->max = from->max;
+    }
+}
+
+// Upper bound of the bucket holding the `quantile` (0..1) value, capped at
+// the largest value seen; 0 for an empty histogram.
+static inline uint64_t latency_histogram_percentile(const latency_histogram_t *h, double quantile) {
+    uint64_t seen = 0;
+    for (size_t b = 0; b < LATENCY_BUCKETS && h->count > 0; ++b) {
+        seen += h->buckets[b];
+        if ((double)seen >= quantile * (double)h->count) {
+            uint64_t ceiling = latency_bucket_ceiling(b);
+            return ceiling < h->max ? ceiling : h->max;
+        }
+    }
+    return 0;
+}
+
+#endif /* LATENCY_HISTOGRAM_H */
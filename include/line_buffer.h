@@ -0,0 +1,130 @@
+#ifndef LINE_BUFFER_H
+#define LINE_BUFFER_H
+
+#include <stddef.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "net_compat.h"
+
+// Receive ring buffer plus newline framing shared by the server sessions and
+// the client receiver. Bytes arrive through bulk recv() calls and complete
+// lines are handed out one at a time, so a command costs one syscall per
+// buffer fill rather than one per character.
+#define LINE_BUFFER_CAPACITY 4096u /* power of two, larger than any line */
+#define LINE_BUFFER_MASK (LINE_BUFFER_CAPACITY - 1u)
+
+typedef struct {
+    char data[LINE_BUFFER_CAPACITY];
+    size_t head;    // next byte to consume (monotonic)
+    size_t tail;    // next byte to fill (monotonic)
+    size_t scanned; // bytes after head already known to hold no newline
+} line_buffer_t;
+
+static inline void line_buffer_init(line_buffer_t *lb) {
+    lb->head = 0;
+    lb->tail = 0;
+    lb->scanned = 0;
+}
+
+static inline size_t line_buffer_pending(const line_buffer_t *lb) {
+    return lb->tail - lb->head;
+}
+
+// Performs one recv() into the free space of the ring. Returns the recv()
+// result: bytes added, 0 on orderly shutdown, negative on error.
+static inline ssize_t line_buffer_fill(line_buffer_t *lb, socket_handle_t fd) {
+    size_t pending = lb->tail - lb->head;
+    size_t offset = lb->tail & LINE_BUFFER_MASK;
+    size_t space = LINE_BUFFER_CAPACITY - pending;
+    if (space > LINE_BUFFER_CAPACITY - offset) {
+        space = LINE_BUFFER_CAPACITY - offset;
+    }
+    if (space == 0) {
+        return 0;
+    }
+    ssize_t n = recv(fd, lb->data + offset, space, 0);
+    if (n > 0) {
+        lb->tail += (size_t)n;
+    }
+    return n;
+}
+
+// Extracts the next complete line into `line` with the framing the protocol
+// has always used: carriage returns are dropped, the newline is consumed and a
+// line longer than max_len - 1 bytes is cut into several. Returns the line
+// length, or -1 if no complete line is buffered yet.
+static inline ssize_t line_buffer_next(line_buffer_t *lb, char *line, size_t max_len) {
+    size_t pending = lb->tail - lb->head;
+    size_t limit = max_len - 1;
+    size_t found = pending;
+    size_t pos = lb->scanned;
+    while (pos < pending && pos < limit) {
+        size_t offset = (lb->head + pos) & LINE_BUFFER_MASK;
+        size_t run = LINE_BUFFER_CAPACITY - offset;
+        if (run > pending - pos) {
+            run = pending - pos;
+        }
+        const char *nl = memchr(lb->data + offset, '\n', run);
+        if (nl) {
+            found = pos + (size_t)(nl - (lb->data + offset));
+            break;
+        }
+        pos += run;
+    }
+    size_t take;
+    size_t consume;
+    if (found < pending && found <= limit) {
+        take = found;
+        consume = found + 1;
+    } else if (pending >= limit) {
+        take = limit;
+        consume = limit;
+    } else {
+        lb->scanned = pending;
+        return -1;
+    }
+    size_t out = 0;
+    for (size_t i = 0; i < take; ++i) {
+        char c = lb->data[(lb->head + i) & LINE_BUFFER_MASK];
+        if (c != '\r') {
+            line[out++] = c;
+        }
+    }
+    line[out] = '\0';
+    lb->head += consume;
+    lb->scanned = 0;
+    return (ssize_t)out;
+}
+
+// Moves every unconsumed byte to `out` (which must hold LINE_BUFFER_CAPACITY
+// bytes) and empties the ring; used when the stream stops being line-framed.
+static inline size_t line_buffer_drain(line_buffer_t *lb, char *out) {
+    size_t pending = lb->tail - lb->head;
+    for (size_t i = 0; i < pending; ++i) {
+        out[i] = lb->data[(lb->head + i) & LINE_BUFFER_MASK];
+    }
+    line_buffer_init(lb);
+    return pending;
+}
+
+// Blocking convenience wrapper: returns the next line, refilling from the
+// socket as needed. Returns -1 when the peer closes or the read fails before
+// a full line arrives; an empty line is returned as 0.
+static inline ssize_t line_buffer_read_line(line_buffer_t *lb, socket_handle_t fd, char *line, size_t max_len) {
+    for (;;) {
+        ssize_t len = line_buffer_next(lb, line, max_len);
+        if (len >= 0) {
+            return len;
+        }
+        ssize_t n = line_buffer_fill(lb, fd);
+        if (n < 0 && net_was_interrupted()) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+    }
+}
+
+#endif /* LINE_BUFFER_H */
@@ -3,12 +3,18 @@
 
 #include <errno.h>
 #include <stdbool.h>
+#include <stddef.h>
 
 #ifdef _WIN32
 #define WIN32_LEAN_AND_MEAN
+#ifndef _WIN32_WINNT
+#define _WIN32_WINNT 0x0600 /* WSAPoll */
+#endif
 #include <winsock2.h>
 #include <ws2tcpip.h>
 typedef SOCKET socket_handle_t;
+typedef WSAPOLLFD net_pollfd_t;
+typedef WSABUF net_iovec_t;
 #define NET_INVALID_SOCKET INVALID_SOCKET
 #define NET_SOCKET_ERROR SOCKET_ERROR
 #ifndef SHUT_RDWR
@@ -28,13 +34,46 @@ static inline bool net_was_interrupted(void) {
     int err = WSAGetLastError();
     return err == WSAEINTR || err == WSAEWOULDBLOCK || err == WSAEINPROGRESS;
 }
+static inline bool net_would_block(void) {
+    return WSAGetLastError() == WSAEWOULDBLOCK;
+}
+// A non-blocking connect() that has started and will finish in the background.
+static inline bool net_connect_pending(void) {
+    return WSAGetLastError() == WSAEWOULDBLOCK;
+}
+static inline int net_set_nonblocking(socket_handle_t sock) {
+    u_long mode = 1;
+    return ioctlsocket(sock, FIONBIO, &mode);
+}
+static inline int net_poll(net_pollfd_t *fds, unsigned long count, int timeout_ms) {
+    return WSAPoll(fds, count, timeout_ms);
+}
+static inline void net_sleep_ms(int ms) {
+    Sleep((DWORD)ms);
+}
+static inline void net_iov_set(net_iovec_t *iov, const void *base, size_t len) {
+    iov->buf = (char *)base;
+    iov->len = (ULONG)len;
+}
+static inline long net_writev(socket_handle_t sock, net_iovec_t *iov, int count) {
+    DWORD sent = 0;
+    if (WSASend(sock, iov, (DWORD)count, &sent, 0, NULL, NULL) != 0) {
+        return -1;
+    }
+    return (long)sent;
+}
 #else
 #include <arpa/inet.h>
+#include <fcntl.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 typedef int socket_handle_t;
+typedef struct pollfd net_pollfd_t;
+typedef struct iovec net_iovec_t;
 #define NET_INVALID_SOCKET -1
 #define NET_SOCKET_ERROR -1
 static inline int net_init(void) {
@@ -47,6 +86,32 @@ static inline int net_close(socket_handle_t sock) {
 static inline bool net_was_interrupted(void) {
     return errno == EINTR;
 }
+static inline bool net_would_block(void) {
+    return errno == EAGAIN || errno == EWOULDBLOCK;
+}
+static inline bool net_connect_pending(void) {
+    return errno == EINPROGRESS;
+}
+static inline int net_set_nonblocking(socket_handle_t sock) {
+    int flags = fcntl(sock, F_GETFL, 0);
+    if (flags == -1) {
+        return -1;
+    }
+    return fcntl(sock, F_SETFL, flags | O_NONBLOCK);
+}
+static inline int net_poll(net_pollfd_t *fds, unsigned long count, int timeout_ms) {
+    return poll(fds, (nfds_t)count, timeout_ms);
+}
+static inline void net_sleep_ms(int ms) {
+    poll(NULL, 0, ms);
+}
+static inline void net_iov_set(net_iovec_t *iov, const void *base, size_t len) {
+    iov->iov_base = (void *)base;
+    iov->iov_len = len;
+}
+static inline long net_writev(socket_handle_t sock, net_iovec_t *iov, int count) {
+    return (long)writev(sock, iov, count);
+}
 #endif
 
 #endif /* NET_COMPAT_H */
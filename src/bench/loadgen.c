@@ -0,0 +1,512 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifndef _WIN32
+#include <netinet/tcp.h>
+#endif
+
+#include "latency_histogram.h"
+#include "line_buffer.h"
+#include "net_compat.h"
+
+// Load generator: opens N authenticated sessions, drives a SEND/GET/USERS mix
+// at a fixed aggregate rate from a few threads and reports throughput and
+// latency percentiles. Every command is tagged with its send time and type,
+// so command latency is read off the tagged reply; SEND bodies carry the same
+// timestamp, so delivery latency is measured where the push arrives.
+#define MAX_LINE 2048
+#define OUT_CAPACITY (64u * 1024u)
+#define CONNECT_WAIT_MS 5000
+#define DRAIN_MS 3000
+#define MAX_THREADS 64
+
+typedef enum {
+    OP_SEND,
+    OP_GET,
+    OP_USERS,
+    OP_COUNT,
+} op_t;
+
+static const char *const op_names[OP_COUNT] = {"send", "get", "users"};
+
+typedef struct {
+    const char *host;
+    uint16_t port;
+    int sessions;
+    int threads;
+    double rate;     // commands per second across all threads
+    double duration; // seconds
+    unsigned mix[OP_COUNT];
+    size_t body;      // SEND body length in bytes
+    int history_page; // GET limit
+    char prefix[16];  // username prefix, unique per run
+} bench_config_t;
+
+typedef struct {
+    socket_handle_t fd;
+    int index;
+    line_buffer_t input;
+    char out[OUT_CAPACITY];
+    size_t out_len;
+    bool dead;
+} bench_session_t;
+
+typedef struct {
+    pthread_t thread;
+    bench_session_t *sessions; // this worker's slice
+    int count;
+    double rate;
+    uint64_t seed;
+    latency_histogram_t ops[OP_COUNT];
+    latency_histogram_t delivery;
+    uint64_t issued[OP_COUNT];
+    uint64_t errors;
+    uint64_t skipped; // ops not issued because the session's buffer was full
+    uint64_t delivered;
+    uint64_t acked_sends;
+} bench_worker_t;
+
+static bench_config_t config = {
+    .host = "127.0.0.1",
+    .sessions = 100,
+    .threads = 4,
+    .rate = 1000.0,
+    .duration = 10.0,
+    .mix = {80, 15, 5},
+    .body = 64,
+    .history_page = 20,
+};
+static uint64_t run_start;
+static uint64_t run_end;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t next_random(uint64_t *state) {
+    // xorshift64*
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 2685821657736338717ull;
+}
+
+static void user_name(char *out, size_t size, int index) {
+    snprintf(out, size, "%s%d", config.prefix, index);
+}
+
+// Writes as much of the session's buffer as the socket takes.
+static void flush_session(bench_session_t *session) {
+    size_t sent = 0;
+    while (sent < session->out_len) {
+        ssize_t n = send(session->fd, session->out + sent, session->out_len - sent, 0);
+        if (n > 0) {
+            sent += (size_t)n;
+        } else if (n < 0 && net_was_interrupted()) {
+            continue;
+        } else {
+            if (n == 0 || !net_would_block()) {
+                session->dead = true;
+            }
+            break;
+        }
+    }
+    memmove(session->out, session->out + sent, session->out_len - sent);
+    session->out_len -= sent;
+}
+
+static bool queue_line(bench_session_t *session, const char *line, size_t len) {
+    if (session->dead || session->out_len + len > OUT_CAPACITY) {
+        return false;
+    }
+    memcpy(session->out + session->out_len, line, len);
+    session->out_len += len;
+    if (session->out_len == len) {
+        flush_session(session);
+    }
+    return true;
+}
+
+static bool issue(bench_worker_t *worker, bench_session_t *session, op_t op) {
+    char line[MAX_LINE];
+    char peer[32];
+    uint64_t start = now_ns();
+    // Type in the low bits; monotonic nanoseconds fit the rest for a century.
+    unsigned long long tag = (unsigned long long)(start << 2 | (uint64_t)op);
+    int len;
+    if (op == OP_USERS) {
+        len = snprintf(line, sizeof(line), "#%llu USERS\n", tag);
+    } else {
+        int other = (int)(next_random(&worker->seed) % (uint64_t)config.sessions);
+        user_name(peer, sizeof(peer), other);
+        if (op == OP_GET) {
+            len = snprintf(line, sizeof(line), "#%llu GET %s %d\n", tag, peer, config.history_page);
+        } else {
+            len = snprintf(line, sizeof(line), "#%llu SEND %s ", tag, peer);
+            size_t body_end = (size_t)len + config.body;
+            len += snprintf(line + len, sizeof(line) - (size_t)len, "t%llu ", (unsigned long long)start);
+            while ((size_t)len < body_end) {
+                line[len++] = 'x';
+            }
+            line[len++] = '\n';
+        }
+    }
+    return queue_line(session, line, (size_t)len);
+}
+
+// Tagged replies finish a command once its final line arrives; untagged
+// MESSAGE lines are deliveries. Heartbeats are answered so sessions that go
+// quiet in a long run are not reaped.
+static void handle_line(bench_worker_t *worker, bench_session_t *session, const char *line) {
+    uint64_t now = now_ns();
+    if (line[0] == '#') {
+        char *rest;
+        unsigned long long tag = strtoull(line + 1, &rest, 10);
+        if (*rest != ' ') {
+            return;
+        }
+        ++rest;
+        op_t op = (op_t)(tag & 3u);
+        uint64_t start = (uint64_t)(tag >> 2);
+        bool done;
+        if (strncmp(rest, "ERROR", 5) == 0) {
+            worker->errors++;
+            return;
+        }
+        switch (op) {
+        case OP_SEND:
+            done = strncmp(rest, "OK", 2) == 0;
+            if (done) {
+                worker->acked_sends++;
+            }
+            break;
+        case OP_GET:
+            done = strncmp(rest, "OK History", 10) == 0 || strncmp(rest, "INFO ", 5) == 0;
+            break;
+        case OP_USERS:
+            done = strcmp(rest, "USERS_END") == 0;
+            break;
+        default:
+            return;
+        }
+        if (done && start <= now) {
+            latency_histogram_record(&worker->ops[op], now - start);
+        }
+        return;
+    }
+    if (strcmp(line, "PING") == 0) {
+        queue_line(session, "PONG\n", 5);
+        return;
+    }
+    if (strncmp(line, "MESSAGE ", 8) == 0) {
+        const char *body = strchr(line + 8, ' ');
+        if (body && body[1] == 't') {
+            uint64_t sent = strtoull(body + 2, NULL, 10);
+            worker->delivered++;
+            if (sent <= now) {
+                latency_histogram_record(&worker->delivery, now - sent);
+            }
+        }
+    }
+}
+
+static void read_session(bench_worker_t *worker, bench_session_t *session) {
+    char line[MAX_LINE];
+    for (;;) {
+        ssize_t n = line_buffer_fill(&session->input, session->fd);
+        if (n <= 0) {
+            if (n == 0 || !(net_would_block() || net_was_interrupted())) {
+                session->dead = true;
+            }
+            return;
+        }
+        while (line_buffer_next(&session->input, line, sizeof(line)) >= 0) {
+            handle_line(worker, session, line);
+        }
+    }
+}
+
+static op_t pick_op(bench_worker_t *worker) {
+    unsigned total = config.mix[OP_SEND] + config.mix[OP_GET] + config.mix[OP_USERS];
+    unsigned roll = (unsigned)(next_random(&worker->seed) % total);
+    for (int op = 0; op < OP_COUNT; ++op) {
+        if (roll < config.mix[op]) {
+            return (op_t)op;
+        }
+        roll -= config.mix[op];
+    }
+    return OP_SEND;
+}
+
+static uint64_t issued_total(const bench_worker_t *worker) {
+    return worker->issued[OP_SEND] + worker->issued[OP_GET] + worker->issued[OP_USERS] + worker->skipped;
+}
+
+static uint64_t completed_total(const bench_worker_t *worker) {
+    return worker->ops[OP_SEND].count + worker->ops[OP_GET].count + worker->ops[OP_USERS].count + worker->errors;
+}
+
+// Open loop: commands are issued on schedule whether or not earlier ones
+// were answered, so a slow server shows up as latency, not as a lower rate.
+static void *worker_main(void *arg) {
+    bench_worker_t *worker = (bench_worker_t *)arg;
+    net_pollfd_t *pfds = calloc((size_t)worker->count, sizeof(*pfds));
+    if (!pfds) {
+        return NULL;
+    }
+    uint64_t drain_until = run_end + (uint64_t)DRAIN_MS * 1000000u;
+    int next_session = 0;
+    for (;;) {
+        uint64_t now = now_ns();
+        if (now < run_end) {
+            uint64_t due = (uint64_t)((double)(now - run_start) * worker->rate / 1e9);
+            while (issued_total(worker) < due) {
+                bench_session_t *session = &worker->sessions[next_session];
+                next_session = (next_session + 1) % worker->count;
+                op_t op = pick_op(worker);
+                if (issue(worker, session, op)) {
+                    worker->issued[op]++;
+                } else {
+                    worker->skipped++;
+                }
+            }
+        } else if (now >= drain_until || (completed_total(worker) >= issued_total(worker) - worker->skipped)) {
+            break;
+        }
+        for (int i = 0; i < worker->count; ++i) {
+            bench_session_t *session = &worker->sessions[i];
+            pfds[i].fd = session->dead ? NET_INVALID_SOCKET : session->fd;
+            pfds[i].events = POLLIN | (session->out_len > 0 ? POLLOUT : 0);
+            pfds[i].revents = 0;
+        }
+        // Never spin: above 1000 commands/s per thread they go out in
+        // per-millisecond bursts, which leaves the CPU to the server when
+        // both share a machine.
+        int timeout = 1;
+        if (now < run_end) {
+            double gap_ms = 1000.0 / worker->rate;
+            timeout = gap_ms < 1.0 ? 1 : (gap_ms > 100.0 ? 100 : (int)gap_ms);
+        }
+        if (net_poll(pfds, (unsigned long)worker->count, timeout) <= 0) {
+            continue;
+        }
+        for (int i = 0; i < worker->count; ++i) {
+            bench_session_t *session = &worker->sessions[i];
+            if (pfds[i].revents & POLLOUT) {
+                flush_session(session);
+            }
+            if (pfds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+                read_session(worker, session);
+            }
+        }
+    }
+    free(pfds);
+    return NULL;
+}
+
+// Blocking connect and login; the caller switches the socket to non-blocking
+// afterwards. Retries refused connects while the server is still starting.
+static int open_session(bench_session_t *session, int index) {
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(config.port);
+    if (inet_pton(AF_INET, config.host, &addr.sin_addr) != 1) {
+        fprintf(stderr, "Invalid server IP %s\n", config.host);
+        return -1;
+    }
+    uint64_t give_up = now_ns() + (uint64_t)CONNECT_WAIT_MS * 1000000u;
+    for (;;) {
+        session->fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (session->fd == NET_INVALID_SOCKET) {
+            perror("socket");
+            return -1;
+        }
+        if (connect(session->fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+            break;
+        }
+        net_close(session->fd);
+        if (now_ns() > give_up) {
+            perror("connect");
+            return -1;
+        }
+        net_sleep_ms(50);
+    }
+    // Commands are small and latency is what is measured: no Nagle delay.
+    int nodelay = 1;
+    setsockopt(session->fd, IPPROTO_TCP, TCP_NODELAY, (const char *)&nodelay, sizeof(nodelay));
+    session->index = index;
+    line_buffer_init(&session->input);
+    char line[MAX_LINE];
+    char name[32];
+    user_name(name, sizeof(name), index);
+    bool ok = line_buffer_read_line(&session->input, session->fd, line, sizeof(line)) >= 0; // WELCOME
+    int len = snprintf(line, sizeof(line), "AUTH %s\n", name);
+    ok = ok && send(session->fd, line, (size_t)len, 0) == len &&
+         line_buffer_read_line(&session->input, session->fd, line, sizeof(line)) >= 0 && strncmp(line, "OK", 2) == 0;
+    if (!ok) {
+        fprintf(stderr, "Login failed for %s\n", name);
+        net_close(session->fd);
+        return -1;
+    }
+    return 0;
+}
+
+static void print_latency(const char *name, const latency_histogram_t *h) {
+    printf("%-10s %10" PRIu64 " %10.1f %10.1f %10.1f %10.1f %10.1f\n", name, h->count,
+           latency_histogram_percentile(h, 0.5) / 1e3, latency_histogram_percentile(h, 0.99) / 1e3,
+           latency_histogram_percentile(h, 0.999) / 1e3, h->max / 1e3,
+           h->count ? (double)h->sum / (double)h->count / 1e3 : 0.0);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s <server_ip> <port> [--sessions=N] [--threads=N] [--rate=OPS]\n"
+            "          [--duration=SECONDS] [--mix=SEND:GET:USERS] [--body=BYTES] [--page=N]\n",
+            prog);
+}
+
+static int parse_options(int argc, char **argv) {
+    if (argc < 3) {
+        return -1;
+    }
+    config.host = argv[1];
+    config.port = (uint16_t)atoi(argv[2]);
+    for (int i = 3; i < argc; ++i) {
+        const char *arg = argv[i];
+        if (strncmp(arg, "--sessions=", 11) == 0) {
+            config.sessions = atoi(arg + 11);
+        } else if (strncmp(arg, "--threads=", 10) == 0) {
+            config.threads = atoi(arg + 10);
+        } else if (strncmp(arg, "--rate=", 7) == 0) {
+            config.rate = atof(arg + 7);
+        } else if (strncmp(arg, "--duration=", 11) == 0) {
+            config.duration = atof(arg + 11);
+        } else if (strncmp(arg, "--mix=", 6) == 0) {
+            if (sscanf(arg + 6, "%u:%u:%u", &config.mix[OP_SEND], &config.mix[OP_GET], &config.mix[OP_USERS]) != 3) {
+                return -1;
+            }
+        } else if (strncmp(arg, "--body=", 7) == 0) {
+            config.body = (size_t)atol(arg + 7);
+        } else if (strncmp(arg, "--page=", 7) == 0) {
+            config.history_page = atoi(arg + 7);
+        } else {
+            return -1;
+        }
+    }
+    bool valid = config.port != 0 && config.sessions >= 1 && config.threads >= 1 && config.threads <= MAX_THREADS &&
+                 config.rate > 0 && config.duration > 0 && config.body < MAX_LINE - 100 &&
+                 config.history_page >= 1 && config.history_page <= 1000 &&
+                 config.mix[OP_SEND] + config.mix[OP_GET] + config.mix[OP_USERS] > 0;
+    return valid ? 0 : -1;
+}
+
+int main(int argc, char **argv) {
+    if (parse_options(argc, argv) != 0) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (config.threads > config.sessions) {
+        config.threads = config.sessions;
+    }
+    if (net_init() != 0) {
+        fprintf(stderr, "Failed to initialize networking\n");
+        return EXIT_FAILURE;
+    }
+#ifndef _WIN32
+    signal(SIGPIPE, SIG_IGN);
+#endif
+    snprintf(config.prefix, sizeof(config.prefix), "lg%llx_", (unsigned long long)(now_ns() & 0xffffff));
+
+    bench_session_t *sessions = calloc((size_t)config.sessions, sizeof(*sessions));
+    bench_worker_t *workers = calloc((size_t)config.threads, sizeof(*workers));
+    if (!sessions || !workers) {
+        fprintf(stderr, "Out of memory\n");
+        return EXIT_FAILURE;
+    }
+    uint64_t login_start = now_ns();
+    for (int i = 0; i < config.sessions; ++i) {
+        if (open_session(&sessions[i], i) != 0) {
+            return EXIT_FAILURE;
+        }
+    }
+    for (int i = 0; i < config.sessions; ++i) {
+        net_set_nonblocking(sessions[i].fd);
+    }
+    printf("loadgen: %d sessions logged in in %.2f s; %d threads, %.0f commands/s for %.1f s, "
+           "mix send %u get %u users %u, %zu-byte bodies\n",
+           config.sessions, (now_ns() - login_start) / 1e9, config.threads, config.rate, config.duration,
+           config.mix[OP_SEND], config.mix[OP_GET], config.mix[OP_USERS], config.body);
+
+    run_start = now_ns();
+    run_end = run_start + (uint64_t)(config.duration * 1e9);
+    int per_thread = config.sessions / config.threads;
+    int extra = config.sessions % config.threads;
+    int first = 0;
+    for (int t = 0; t < config.threads; ++t) {
+        bench_worker_t *worker = &workers[t];
+        worker->sessions = &sessions[first];
+        worker->count = per_thread + (t < extra ? 1 : 0);
+        worker->rate = config.rate * worker->count / config.sessions;
+        worker->seed = 0x9e3779b97f4a7c15ull * (uint64_t)(t + 1);
+        first += worker->count;
+        if (pthread_create(&worker->thread, NULL, worker_main, worker) != 0) {
+            fprintf(stderr, "Failed to create worker thread\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    bench_worker_t total;
+    memset(&total, 0, sizeof(total));
+    for (int t = 0; t < config.threads; ++t) {
+        bench_worker_t *worker = &workers[t];
+        pthread_join(worker->thread, NULL);
+        for (int op = 0; op < OP_COUNT; ++op) {
+            latency_histogram_merge(&total.ops[op], &worker->ops[op]);
+            total.issued[op] += worker->issued[op];
+        }
+        latency_histogram_merge(&total.delivery, &worker->delivery);
+        total.errors += worker->errors;
+        total.skipped += worker->skipped;
+        total.delivered += worker->delivered;
+        total.acked_sends += worker->acked_sends;
+    }
+    uint64_t issued = total.issued[OP_SEND] + total.issued[OP_GET] + total.issued[OP_USERS];
+    uint64_t completed = completed_total(&total);
+    int dead = 0;
+    for (int i = 0; i < config.sessions; ++i) {
+        dead += sessions[i].dead;
+        if (!sessions[i].dead) {
+            send(sessions[i].fd, "QUIT\n", 5, 0);
+        }
+        net_close(sessions[i].fd);
+    }
+
+    printf("commands: %" PRIu64 " issued, %" PRIu64 " completed (%.1f/s), %" PRIu64 " errors, %" PRIu64
+           " skipped, %" PRIu64 " unanswered\n",
+           issued, completed, completed / config.duration, total.errors, total.skipped,
+           issued > completed ? issued - completed : 0);
+    printf("messages: %" PRIu64 " acknowledged, %" PRIu64 " delivered (%.1f/s)\n", total.acked_sends,
+           total.delivered, total.delivered / config.duration);
+    if (dead > 0) {
+        printf("sessions: %d closed by the server\n", dead);
+    }
+    printf("%-10s %10s %10s %10s %10s %10s %10s\n", "latency_us", "count", "p50", "p99", "p999", "max", "mean");
+    print_latency("delivery", &total.delivery);
+    for (int op = 0; op < OP_COUNT; ++op) {
+        print_latency(op_names[op], &total.ops[op]);
+    }
+    free(sessions);
+    free(workers);
+    net_cleanup();
+    return total.errors == 0 && dead == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,221 @@
+#define _POSIX_C_SOURCE 200809L
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "latency_histogram.h"
+#include "storage.h"
+
+// Storage micro-benchmarks, run in-process against the storage API with no
+// sockets involved. Built once per backend: the SQLite build and the
+// flat-file build (STORAGE_USE_SQLITE=0) run the same phases.
+#define BODY_LEN 64
+#define INBOX_LIMIT 1000
+
+typedef struct {
+    long messages;
+    int conversations;
+    int page;
+    int samples;
+    int shards;
+} bench_config_t;
+
+typedef struct {
+    size_t rows;
+    int64_t oldest_id;
+} fetch_result_t;
+
+static bench_config_t config = {
+    .messages = 100000,
+    .conversations = 100,
+    .page = 50,
+    .samples = 1000,
+    .shards = 1,
+};
+
+// Completions still outstanding from the throughput phase.
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t drain_cond = PTHREAD_COND_INITIALIZER;
+static int drain_pending = 0;
+static int drain_failed = 0;
+static char drain_error[256]; // the first failure, from a writer thread
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static void count_row(int64_t id, const char *timestamp, const char *sender, const char *body, void *ctx) {
+    (void)timestamp;
+    (void)sender;
+    (void)body;
+    fetch_result_t *result = (fetch_result_t *)ctx;
+    if (result->rows++ == 0) {
+        result->oldest_id = id;
+    }
+}
+
+static void drained(int status, const char *error, void *ctx) {
+    (void)ctx;
+    pthread_mutex_lock(&drain_lock);
+    if (status != 0 && !drain_failed) {
+        snprintf(drain_error, sizeof(drain_error), "%s", error);
+    }
+    drain_failed |= status != 0;
+    if (--drain_pending == 0) {
+        pthread_cond_signal(&drain_cond);
+    }
+    pthread_mutex_unlock(&drain_lock);
+}
+
+static void conversation(int index, char *sender, char *receiver) {
+    snprintf(sender, 32, "sender%d", index);
+    snprintf(receiver, 32, "receiver%d", index);
+}
+
+static void print_latency(const char *name, const latency_histogram_t *h) {
+    printf("%-14s %10" PRIu64 " %10.1f %10.1f %10.1f %10.1f %10.1f\n", name, h->count,
+           latency_histogram_percentile(h, 0.5) / 1e3, latency_histogram_percentile(h, 0.99) / 1e3,
+           latency_histogram_percentile(h, 0.999) / 1e3, h->max / 1e3,
+           h->count ? (double)h->sum / (double)h->count / 1e3 : 0.0);
+}
+
+static int run(void) {
+    char body[BODY_LEN + 1];
+    memset(body, 'x', BODY_LEN);
+    body[BODY_LEN] = '\0';
+    char sender[32];
+    char receiver[32];
+    static latency_histogram_t store, newest, older, inbox;
+
+    // Write-behind throughput: everything queued at once, timed until the
+    // last batch commits. The final message of each conversation reports its
+    // commit, and each one is queued behind all the others on its shard.
+    uint64_t start = now_ns();
+    drain_pending = config.conversations;
+    for (long i = 0; i < config.messages + config.conversations; ++i) {
+        conversation((int)(i % config.conversations), sender, receiver);
+        bool last = i >= config.messages;
+        if (storage_submit_message(sender, receiver, body, last ? drained : NULL, NULL) != 0) {
+            fprintf(stderr, "submit failed: %s\n", storage_last_error());
+            return -1;
+        }
+    }
+    pthread_mutex_lock(&drain_lock);
+    while (drain_pending > 0) {
+        pthread_cond_wait(&drain_cond, &drain_lock);
+    }
+    pthread_mutex_unlock(&drain_lock);
+    if (drain_failed) {
+        fprintf(stderr, "store failed: %s\n", drain_error);
+        return -1;
+    }
+    double elapsed = (now_ns() - start) / 1e9;
+    printf("submit: %ld messages over %d conversations on %d shard(s) in %.2f s (%.0f messages/s)\n",
+           config.messages, config.conversations, config.shards, elapsed, config.messages / elapsed);
+
+    // One message per commit: the latency a lone sender sees with --ack=commit.
+    for (int i = 0; i < config.samples; ++i) {
+        conversation(i % config.conversations, sender, receiver);
+        uint64_t t = now_ns();
+        if (storage_store_message(sender, receiver, body) != 0) {
+            fprintf(stderr, "store failed: %s\n", storage_last_error());
+            return -1;
+        }
+        latency_histogram_record(&store, now_ns() - t);
+    }
+
+    // Newest pages come from the history cache once warm; the page behind
+    // each one has to be read from the backend.
+    for (int i = 0; i < config.samples; ++i) {
+        conversation(i % config.conversations, sender, receiver);
+        fetch_result_t result = {0, 0};
+        uint64_t t = now_ns();
+        if (storage_fetch_conversation(sender, receiver, 0, config.page, count_row, &result) != 0) {
+            fprintf(stderr, "fetch failed: %s\n", storage_last_error());
+            return -1;
+        }
+        latency_histogram_record(&newest, now_ns() - t);
+        if (result.rows == 0) {
+            continue;
+        }
+        int64_t before = result.oldest_id;
+        result.rows = 0;
+        t = now_ns();
+        if (storage_fetch_conversation(sender, receiver, before, config.page, count_row, &result) != 0) {
+            fprintf(stderr, "fetch failed: %s\n", storage_last_error());
+            return -1;
+        }
+        latency_histogram_record(&older, now_ns() - t);
+    }
+
+    // Every receiver starts with a full inbox; each fetch moves its cursor.
+    size_t inbox_rows = 0;
+    for (int i = 0; i < config.conversations; ++i) {
+        conversation(i, sender, receiver);
+        fetch_result_t result = {0, 0};
+        uint64_t t = now_ns();
+        if (storage_fetch_inbox(receiver, INBOX_LIMIT, count_row, &result) != 0) {
+            fprintf(stderr, "inbox failed: %s\n", storage_last_error());
+            return -1;
+        }
+        latency_histogram_record(&inbox, now_ns() - t);
+        inbox_rows += result.rows;
+    }
+
+    printf("%-14s %10s %10s %10s %10s %10s %10s\n", "latency_us", "count", "p50", "p99", "p999", "max", "mean");
+    print_latency("store_sync", &store);
+    print_latency("fetch_newest", &newest);
+    print_latency("fetch_older", &older);
+    print_latency("fetch_inbox", &inbox);
+    printf("inbox: %zu rows across %d receivers (page limit %d)\n", inbox_rows, config.conversations, INBOX_LIMIT);
+    return 0;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s <db_path> [--messages=N] [--conversations=N] [--page=N] [--samples=N] [--shards=N]\n"
+            "Point db_path at a scratch location (a directory with --shards above 1); the data is left behind.\n",
+            prog);
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    for (int i = 2; i < argc; ++i) {
+        const char *arg = argv[i];
+        if (strncmp(arg, "--messages=", 11) == 0) {
+            config.messages = atol(arg + 11);
+        } else if (strncmp(arg, "--conversations=", 16) == 0) {
+            config.conversations = atoi(arg + 16);
+        } else if (strncmp(arg, "--page=", 7) == 0) {
+            config.page = atoi(arg + 7);
+        } else if (strncmp(arg, "--samples=", 10) == 0) {
+            config.samples = atoi(arg + 10);
+        } else if (strncmp(arg, "--shards=", 9) == 0) {
+            config.shards = atoi(arg + 9);
+        } else {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (config.messages < 0 || config.conversations < 1 || config.page < 1 || config.samples < 1 ||
+        config.shards < 1 || config.shards > STORAGE_MAX_SHARDS) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (storage_init(argv[1], (size_t)config.shards, NULL) != 0) {
+        fprintf(stderr, "Storage init failed: %s\n", storage_last_error());
+        return EXIT_FAILURE;
+    }
+    int rc = run();
+    storage_shutdown();
+    return rc == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
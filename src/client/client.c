@@ -13,6 +13,9 @@
 #include <unistd.h>
 #endif
 
+#include "binary_protocol.h"
+#include "deflate_codec.h"
+#include "line_buffer.h"
 #include "net_compat.h"
 
 #define MAX_USERNAME 32
@@ -22,6 +25,28 @@ static socket_handle_t server_fd = NET_INVALID_SOCKET;
 static pthread_t receiver_thread;
 static volatile sig_atomic_t running = 1;
 static pthread_mutex_t stdout_lock = PTHREAD_MUTEX_INITIALIZER;
+// The receiver thread answers heartbeats while the input thread may be
+// sending a command.
+static pthread_mutex_t send_lock = PTHREAD_MUTEX_INITIALIZER;
+static line_buffer_t server_input;
+static bool binary_mode = false;
+static frame_reader_t server_frames = {NULL, 0, 0, 0}; // used once binary_mode is on
+static deflate_codec_t history_inflater; // receiver thread only
+static const char *own_name = "";
+
+// Local history (--history-dir): one append-only file per conversation holding
+// its rows as BINARY_HISTORY frames in id order, so getmessages prints the
+// copy and asks the server (SYNC, tagged) only for what came after its newest
+// id. The receiver thread appends the rows as they arrive; the input thread
+// waits for one sync to finish before it starts another.
+#define SYNC_TAG 1
+static const char *history_dir = NULL;
+static pthread_mutex_t sync_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sync_done = PTHREAD_COND_INITIALIZER;
+static bool sync_pending = false;
+static char sync_peer[MAX_USERNAME];
+static FILE *sync_file = NULL;
+static int64_t sync_last_id = 0;
 
 static void safe_print(const char *fmt, ...) {
     pthread_mutex_lock(&stdout_lock);
@@ -66,24 +91,8 @@ static ssize_t portable_getline(char **lineptr, size_t *n, FILE *stream) {
 #endif
 }
 
-static ssize_t read_line(socket_handle_t fd, char *buffer, size_t max_len) {
-    size_t offset = 0;
-    while (offset < max_len - 1) {
-        char c;
-        ssize_t n = recv(fd, &c, 1, 0);
-        if (n <= 0) {
-            return n;
-        }
-        if (c == '\r') {
-            continue;
-        }
-        if (c == '\n') {
-            break;
-        }
-        buffer[offset++] = c;
-    }
-    buffer[offset] = '\0';
-    return (ssize_t)offset;
+static ssize_t read_line(char *buffer, size_t max_len) {
+    return line_buffer_read_line(&server_input, server_fd, buffer, max_len);
 }
 
 static void send_command(const char *fmt, ...) {
@@ -99,11 +108,264 @@ static void send_command(const char *fmt, ...) {
     }
     buffer[len] = '\n';
     buffer[len + 1] = '\0';
+    pthread_mutex_lock(&send_lock);
     send(server_fd, buffer, strlen(buffer), 0);
+    pthread_mutex_unlock(&send_lock);
+}
+
+static void send_frame(binary_opcode_t opcode, const binary_field_t *fields, size_t count) {
+    size_t size = binary_frame_size(fields, count);
+    unsigned char *frame = malloc(size);
+    if (!frame) {
+        return;
+    }
+    binary_encode(frame, opcode, fields, count);
+    pthread_mutex_lock(&send_lock);
+    send(server_fd, (const char *)frame, size, 0);
+    pthread_mutex_unlock(&send_lock);
+    free(frame);
+}
+
+// Blocks until a whole frame is buffered. Returns 1, or -1 once the server
+// closes or sends something that is not a frame.
+static int read_frame(int *opcode, const unsigned char **body, size_t *len) {
+    for (;;) {
+        int rc = frame_reader_next(&server_frames, opcode, body, len);
+        if (rc != 0) {
+            return rc;
+        }
+        ssize_t n = frame_reader_fill(&server_frames, server_fd);
+        if (n < 0 && net_was_interrupted()) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+    }
+}
+
+// "<dir>/<own name>-<peer>.history", with every byte of the names that is not
+// alphanumeric, '.' or '_' written as %XX so any name makes one safe path.
+static char *local_history_path(const char *peer) {
+    size_t dir_len = strlen(history_dir);
+    char *path = malloc(dir_len + 3 * (strlen(own_name) + strlen(peer)) + sizeof("/-.history"));
+    if (!path) {
+        return NULL;
+    }
+    char *out = path + dir_len;
+    memcpy(path, history_dir, dir_len);
+    *out++ = '/';
+    const char *names[2] = {own_name, peer};
+    for (int n = 0; n < 2; ++n) {
+        for (const unsigned char *c = (const unsigned char *)names[n]; *c; ++c) {
+            if ((*c >= '0' && *c <= '9') || (*c >= 'A' && *c <= 'Z') || (*c >= 'a' && *c <= 'z') || *c == '.' ||
+                *c == '_') {
+                *out++ = (char)*c;
+            } else {
+                out += sprintf(out, "%%%02X", *c);
+            }
+        }
+        *out++ = n == 0 ? '-' : '.';
+    }
+    strcpy(out, "history");
+    return path;
+}
+
+// Prints the local copy of the conversation with `peer` and opens it for
+// appending. A torn or corrupt tail (the client died mid-write) is cut off.
+// Returns the newest id it holds (0 for none yet), or -1 if it is unusable.
+static int64_t open_local_history(const char *peer, FILE **out) {
+    char *path = local_history_path(peer);
+    if (!path) {
+        return -1;
+    }
+    frame_reader_t rows;
+    frame_reader_init(&rows);
+    bool read_ok = true;
+    FILE *fp = fopen(path, "rb");
+    if (fp) {
+        char chunk[16384];
+        size_t n;
+        while (read_ok && (n = fread(chunk, 1, sizeof(chunk), fp)) > 0) {
+            read_ok = frame_reader_append(&rows, chunk, n) == 0;
+        }
+        read_ok = read_ok && !ferror(fp);
+        fclose(fp);
+    }
+    int64_t last_id = 0;
+    size_t valid = 0;
+    int opcode;
+    const unsigned char *body;
+    size_t len;
+    while (read_ok && frame_reader_next(&rows, &opcode, &body, &len) == 1) {
+        binary_cursor_t cur = {body, body + len};
+        uint64_t id;
+        const char *text[3];
+        size_t text_len[3];
+        if (opcode != BINARY_HISTORY || !binary_next_int(&cur, &id) || (int64_t)id <= last_id ||
+            !binary_next_text(&cur, &text[0], &text_len[0]) || !binary_next_text(&cur, &text[1], &text_len[1]) ||
+            !binary_next_text(&cur, &text[2], &text_len[2])) {
+            break;
+        }
+        safe_print("%.*s %.*s %.*s\n", (int)text_len[0], text[0], (int)text_len[1], text[1], (int)text_len[2],
+                   text[2]);
+        last_id = (int64_t)id;
+        valid = rows.head;
+    }
+    fp = NULL;
+    if (read_ok && valid < rows.tail) {
+        fp = fopen(path, "wb");
+        if (fp && fwrite(rows.data, 1, valid, fp) != valid) {
+            fclose(fp);
+            fp = NULL;
+        }
+    } else if (read_ok) {
+        fp = fopen(path, "ab");
+    }
+    frame_reader_free(&rows);
+    free(path);
+    *out = fp;
+    return fp ? last_id : -1;
+}
+
+static void send_sync(const char *peer, int64_t after_id) {
+    if (binary_mode) {
+        binary_field_t fields[] = {BINARY_INT(SYNC_TAG), BINARY_TEXT(peer, strlen(peer)), BINARY_INT(after_id)};
+        send_frame((binary_opcode_t)(BINARY_SYNC | BINARY_TAGGED), fields, 3);
+    } else {
+        send_command("#%d SYNC %s %lld", SYNC_TAG, peer, (long long)after_id);
+    }
+}
+
+// Waits until no sync is running; false once the client is shutting down.
+static bool wait_for_sync(void) {
+    pthread_mutex_lock(&sync_lock);
+    while (sync_pending && running) {
+        pthread_cond_wait(&sync_done, &sync_lock);
+    }
+    pthread_mutex_unlock(&sync_lock);
+    return running;
+}
+
+// Input thread: prints the local copy and fetches what is newer. Returns
+// false if there is no usable copy, so the caller falls back to a plain GET.
+static bool start_sync(const char *peer) {
+    if (!wait_for_sync()) {
+        return true;
+    }
+    FILE *fp;
+    int64_t last_id = open_local_history(peer, &fp);
+    if (last_id < 0) {
+        safe_print("Local history for %s unavailable, fetching all of it\n", peer);
+        return false;
+    }
+    pthread_mutex_lock(&sync_lock);
+    sync_pending = true;
+    sync_file = fp;
+    sync_last_id = last_id;
+    snprintf(sync_peer, sizeof(sync_peer), "%s", peer);
+    pthread_mutex_unlock(&sync_lock);
+    send_sync(peer, last_id);
+    return true;
+}
+
+static void finish_sync(void) {
+    pthread_mutex_lock(&sync_lock);
+    if (sync_file) {
+        fclose(sync_file);
+        sync_file = NULL;
+    }
+    sync_pending = false;
+    pthread_cond_broadcast(&sync_done);
+    pthread_mutex_unlock(&sync_lock);
+}
+
+// Receiver thread: one row of the running sync, appended and printed.
+static void sync_row(uint64_t id, const char *timestamp, size_t ts_len, const char *sender, size_t sender_len,
+                     const char *body, size_t body_len) {
+    binary_field_t fields[] = {BINARY_INT(id), BINARY_TEXT(timestamp, ts_len), BINARY_TEXT(sender, sender_len),
+                               BINARY_TEXT(body, body_len)};
+    size_t size = binary_frame_size(fields, 4);
+    unsigned char *frame = malloc(size);
+    pthread_mutex_lock(&sync_lock);
+    bool fresh = sync_pending && (int64_t)id > sync_last_id;
+    if (fresh) {
+        sync_last_id = (int64_t)id;
+        if (sync_file && frame) {
+            binary_encode(frame, BINARY_HISTORY, fields, 4);
+            fwrite(frame, 1, size, sync_file);
+        }
+    }
+    pthread_mutex_unlock(&sync_lock);
+    free(frame);
+    if (fresh) {
+        safe_print("%.*s %.*s %.*s\n", (int)ts_len, timestamp, (int)sender_len, sender, (int)body_len, body);
+    }
+}
+
+// Receiver thread: the sync's trailer, the text after OK or ERROR. A full
+// page ("Sync more <id>") asks for the next one straight away.
+static void sync_status(bool ok, const char *text) {
+    unsigned long long next_id;
+    char peer[MAX_USERNAME];
+    if (ok && sscanf(text, "Sync more %llu", &next_id) == 1) {
+        pthread_mutex_lock(&sync_lock);
+        if (sync_file) {
+            fflush(sync_file);
+        }
+        memcpy(peer, sync_peer, sizeof(peer));
+        pthread_mutex_unlock(&sync_lock);
+        send_sync(peer, (int64_t)next_id);
+        return;
+    }
+    finish_sync();
+    safe_print(ok ? "OK %s\n" : "Server error: %s\n", text);
+}
+
+// Text SYNC rows: "<id> <date> <time> <sender> <body>".
+static void sync_line(const char *row) {
+    char *end;
+    unsigned long long id = strtoull(row, &end, 10);
+    const char *timestamp = end + 1;
+    const char *sender = *end == ' ' ? strchr(timestamp, ' ') : NULL;
+    sender = sender ? strchr(sender + 1, ' ') : NULL;
+    const char *body = sender ? strchr(sender + 1, ' ') : NULL;
+    if (!body) {
+        safe_print("Server: unreadable sync row %s\n", row);
+        return;
+    }
+    ++sender;
+    ++body;
+    sync_row(id, timestamp, (size_t)(sender - 1 - timestamp), sender, (size_t)(body - 1 - sender), body,
+             strlen(body));
+}
+
+static void handle_server_line(const char *line);
+
+// Only SYNC is sent tagged; anything else tagged is handled as if it were not.
+static void handle_tagged_line(const char *line) {
+    char *rest;
+    unsigned long long tag = strtoull(line + 1, &rest, 10);
+    if (*rest != ' ') {
+        safe_print("Server: %s\n", line);
+        return;
+    }
+    ++rest;
+    if (tag != SYNC_TAG) {
+        handle_server_line(rest);
+    } else if (strncmp(rest, "SYNC ", 5) == 0) {
+        sync_line(rest + 5);
+    } else if (strncmp(rest, "OK ", 3) == 0 || strncmp(rest, "ERROR ", 6) == 0) {
+        sync_status(rest[0] == 'O', rest + (rest[0] == 'O' ? 3 : 6));
+    } else {
+        handle_server_line(rest);
+    }
 }
 
 static void handle_server_line(const char *line) {
-    if (strncmp(line, "MESSAGE ", 8) == 0) {
+    if (line[0] == '#') {
+        handle_tagged_line(line);
+    } else if (strncmp(line, "MESSAGE ", 8) == 0) {
         const char *payload = line + 8;
         const char *space = strchr(payload, ' ');
         if (space) {
@@ -121,6 +383,8 @@ static void handle_server_line(const char *line) {
         }
     } else if (strncmp(line, "HISTORY ", 8) == 0) {
         safe_print("%s\n", line + 8);
+    } else if (strncmp(line, "INBOX ", 6) == 0) {
+        safe_print("Missed %s\n", line + 6);
     } else if (strncmp(line, "INFO ", 5) == 0) {
         safe_print("%s\n", line + 5);
     } else if (strncmp(line, "ERROR ", 6) == 0) {
@@ -133,6 +397,26 @@ static void handle_server_line(const char *line) {
         safe_print("Active users:\n");
     } else if (strncmp(line, "USERS_END", 9) == 0) {
         safe_print("-- end of list --\n");
+    } else if (strncmp(line, "JOIN ", 5) == 0 || strncmp(line, "LEAVE ", 6) == 0) {
+        // "<user> <version>"; the version only matters to clients that keep
+        // their own list.
+        const char *user = strchr(line, ' ') + 1;
+        safe_print("User %s: %.*s\n", line[0] == 'J' ? "joined" : "left", (int)strcspn(user, " "), user);
+    } else if (strncmp(line, "STAT ", 5) == 0) {
+        safe_print("  %s\n", line + 5);
+    } else if (strcmp(line, "STATS_BEGIN") == 0) {
+        safe_print("Server statistics:\n");
+    } else if (strcmp(line, "STATS_END") == 0) {
+        safe_print("-- end of statistics --\n");
+    } else if (strcmp(line, "PING") == 0) {
+        // Heartbeat from the server; answer quietly.
+        if (binary_mode) {
+            send_frame(BINARY_PONG, NULL, 0);
+        } else {
+            send_command("PONG");
+        }
+    } else if (strcmp(line, "PONG") == 0) {
+        safe_print("PONG\n");
     } else if (strncmp(line, "BYE", 3) == 0) {
         safe_print("Disconnected by server\n");
         running = 0;
@@ -146,18 +430,110 @@ static void handle_server_line(const char *line) {
     }
 }
 
+// Status frames are turned back into the text line they stand for, so both
+// modes print the same; messages and history keep their full bodies.
+static void handle_server_frame(int opcode, const unsigned char *body, size_t len) {
+    binary_cursor_t cur = {body, body + len};
+    const char *text[3];
+    size_t text_len[3];
+    uint64_t id;
+    uint64_t tag;
+    if ((opcode & BINARY_TAGGED) && binary_next_int(&cur, &tag)) {
+        // Only SYNC is sent tagged; anything else tagged is handled as if it were not.
+        opcode &= ~BINARY_TAGGED;
+        if (tag == SYNC_TAG && opcode == BINARY_HISTORY && binary_next_int(&cur, &id) &&
+            binary_next_text(&cur, &text[0], &text_len[0]) && binary_next_text(&cur, &text[1], &text_len[1]) &&
+            binary_next_text(&cur, &text[2], &text_len[2])) {
+            sync_row(id, text[0], text_len[0], text[1], text_len[1], text[2], text_len[2]);
+            return;
+        }
+        if (tag == SYNC_TAG && (opcode == BINARY_OK || opcode == BINARY_ERROR) &&
+            binary_next_text(&cur, &text[0], &text_len[0])) {
+            char status[MAX_LINE];
+            snprintf(status, sizeof(status), "%.*s", (int)text_len[0], text[0]);
+            sync_status(opcode == BINARY_OK, status);
+            return;
+        }
+    }
+    if (opcode == BINARY_MESSAGE) {
+        if (binary_next_text(&cur, &text[0], &text_len[0]) && binary_next_text(&cur, &text[1], &text_len[1])) {
+            safe_print("Message from %.*s: %.*s\n", (int)text_len[0], text[0], (int)text_len[1], text[1]);
+            return;
+        }
+    } else if (opcode == BINARY_HISTORY || opcode == BINARY_MISSED) {
+        if (binary_next_int(&cur, &id) && binary_next_text(&cur, &text[0], &text_len[0]) &&
+            binary_next_text(&cur, &text[1], &text_len[1]) && binary_next_text(&cur, &text[2], &text_len[2])) {
+            safe_print("%s%.*s %.*s %.*s\n", opcode == BINARY_MISSED ? "Missed " : "", (int)text_len[0], text[0],
+                       (int)text_len[1], text[1], (int)text_len[2], text[2]);
+            return;
+        }
+    } else if (binary_status_keyword(opcode) && binary_next_text(&cur, &text[0], &text_len[0])) {
+        char line[MAX_LINE];
+        if (text_len[0] > 0) {
+            snprintf(line, sizeof(line), "%s %.*s", binary_status_keyword(opcode), (int)text_len[0], text[0]);
+        } else {
+            snprintf(line, sizeof(line), "%s", binary_status_keyword(opcode));
+        }
+        handle_server_line(line);
+        return;
+    }
+    safe_print("Server: unreadable frame 0x%02x\n", opcode);
+}
+
+// Unpacks a BINARY_DEFLATE frame and handles the frames inside in order.
+static void handle_deflated_frames(const unsigned char *body, size_t len) {
+    const unsigned char *p = body;
+    uint64_t plain_len;
+    unsigned char *plain = NULL;
+    if (binary_get_varint(&p, body + len, &plain_len) == 1 && plain_len > 0 && plain_len <= BINARY_MAX_FRAME) {
+        plain = malloc((size_t)plain_len);
+    }
+    if (!plain || (!history_inflater.ready && deflate_codec_init(&history_inflater, true) != 0) ||
+        deflate_codec_inflate(&history_inflater, NULL, 0, p, (size_t)(body + len - p), plain, (size_t)plain_len) != 0) {
+        safe_print("Server: unreadable compressed frame\n");
+        free(plain);
+        return;
+    }
+    frame_reader_t inner;
+    frame_reader_init(&inner);
+    frame_reader_append(&inner, plain, (size_t)plain_len);
+    int opcode;
+    const unsigned char *frame;
+    size_t frame_len;
+    while (frame_reader_next(&inner, &opcode, &frame, &frame_len) == 1) {
+        handle_server_frame(opcode, frame, frame_len);
+    }
+    frame_reader_free(&inner);
+    free(plain);
+}
+
 static void *receiver(void *arg) {
     (void)arg;
     char line[MAX_LINE];
+    while (running && binary_mode) {
+        int opcode;
+        const unsigned char *body;
+        size_t len;
+        if (read_frame(&opcode, &body, &len) < 0) {
+            safe_print("Connection closed by server\n");
+            running = 0;
+            break;
+        }
+        if (opcode == BINARY_DEFLATE) {
+            handle_deflated_frames(body, len);
+        } else {
+            handle_server_frame(opcode, body, len);
+        }
+    }
     while (running) {
-        ssize_t len = read_line(server_fd, line, sizeof(line));
-        if (len <= 0) {
+        if (read_line(line, sizeof(line)) < 0) {
             safe_print("Connection closed by server\n");
             running = 0;
             break;
         }
         handle_server_line(line);
     }
+    finish_sync(); // nothing more will arrive for a running sync
     return NULL;
 }
 
@@ -177,17 +553,28 @@ static void handle_sigint(int signum) {
 }
 
 static void usage(const char *prog) {
-    fprintf(stderr, "Usage: %s <server_ip> <port> <username>\n", prog);
+    fprintf(stderr, "Usage: %s <server_ip> <port> <username> [--binary] [--history-dir=DIR]\n", prog);
 }
 
 int main(int argc, char **argv) {
-    if (argc != 4) {
+    if (argc < 4) {
         usage(argv[0]);
         return EXIT_FAILURE;
     }
+    for (int i = 4; i < argc; ++i) {
+        if (strcmp(argv[i], "--binary") == 0) {
+            binary_mode = true;
+        } else if (strncmp(argv[i], "--history-dir=", 14) == 0 && argv[i][14] != '\0') {
+            history_dir = argv[i] + 14;
+        } else {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
     const char *server_ip = argv[1];
     uint16_t port = (uint16_t)atoi(argv[2]);
     const char *username = argv[3];
+    own_name = username;
     if (strlen(username) == 0 || strlen(username) >= MAX_USERNAME) {
         fprintf(stderr, "Username must be 1-%d characters\n", MAX_USERNAME - 1);
         return EXIT_FAILURE;
@@ -231,28 +618,78 @@ int main(int argc, char **argv) {
         return EXIT_FAILURE;
     }
 
+    line_buffer_init(&server_input);
     char line[MAX_LINE];
-    if (read_line(server_fd, line, sizeof(line)) <= 0) {
+    if (read_line(line, sizeof(line)) < 0) {
         fprintf(stderr, "Failed to read server greeting\n");
         cleanup();
         net_cleanup();
         return EXIT_FAILURE;
     }
     printf("%s\n", line);
-    send_command("AUTH %s", username);
-    if (read_line(server_fd, line, sizeof(line)) <= 0) {
-        fprintf(stderr, "Server closed during auth\n");
-        cleanup();
-        net_cleanup();
-        return EXIT_FAILURE;
-    }
-    if (strncmp(line, "OK", 2) != 0) {
-        fprintf(stderr, "Authentication failed: %s\n", line);
-        cleanup();
-        net_cleanup();
-        return EXIT_FAILURE;
+    if (binary_mode) {
+        send_command("BINARY");
+        if (read_line(line, sizeof(line)) < 0 || strncmp(line, "OK", 2) != 0) {
+            fprintf(stderr, "Server refused binary protocol\n");
+            cleanup();
+            net_cleanup();
+            return EXIT_FAILURE;
+        }
+        char rest[LINE_BUFFER_CAPACITY];
+        frame_reader_init(&server_frames);
+        frame_reader_append(&server_frames, rest, line_buffer_drain(&server_input, rest));
+        int opcode;
+        const unsigned char *body;
+        size_t len;
+        binary_cursor_t cur;
+        const char *text = "";
+        size_t text_len = 0;
+        // Large histories then arrive deflated; a server without zlib says
+        // ERROR and everything stays plain.
+        if (CHAT_USE_ZLIB) {
+            binary_field_t on = BINARY_INT(1);
+            send_frame(BINARY_COMPRESS, &on, 1);
+            if (read_frame(&opcode, &body, &len) < 0) {
+                fprintf(stderr, "Server closed during setup\n");
+                cleanup();
+                net_cleanup();
+                return EXIT_FAILURE;
+            }
+        }
+        binary_field_t name = BINARY_TEXT(username, strlen(username));
+        send_frame(BINARY_AUTH, &name, 1);
+        if (read_frame(&opcode, &body, &len) < 0) {
+            fprintf(stderr, "Server closed during auth\n");
+            cleanup();
+            net_cleanup();
+            return EXIT_FAILURE;
+        }
+        cur.p = body;
+        cur.end = body + len;
+        binary_next_text(&cur, &text, &text_len);
+        if (opcode != BINARY_OK) {
+            fprintf(stderr, "Authentication failed: %.*s\n", (int)text_len, text);
+            cleanup();
+            net_cleanup();
+            return EXIT_FAILURE;
+        }
+        printf("OK %.*s\n", (int)text_len, text);
+    } else {
+        send_command("AUTH %s", username);
+        if (read_line(line, sizeof(line)) < 0) {
+            fprintf(stderr, "Server closed during auth\n");
+            cleanup();
+            net_cleanup();
+            return EXIT_FAILURE;
+        }
+        if (strncmp(line, "OK", 2) != 0) {
+            fprintf(stderr, "Authentication failed: %s\n", line);
+            cleanup();
+            net_cleanup();
+            return EXIT_FAILURE;
+        }
+        printf("%s\n", line);
     }
-    printf("%s\n", line);
 
     if (pthread_create(&receiver_thread, NULL, receiver, NULL) != 0) {
         fprintf(stderr, "Failed to create receiver thread\n");
@@ -282,23 +719,117 @@ int main(int argc, char **argv) {
             *space = '\0';
             const char *target = rest;
             const char *message = space + 1;
-            send_command("SEND %s %s", target, message);
+            if (binary_mode) {
+                binary_field_t fields[] = {BINARY_TEXT(target, strlen(target)), BINARY_TEXT(message, strlen(message))};
+                send_frame(BINARY_SEND, fields, 2);
+            } else {
+                send_command("SEND %s %s", target, message);
+            }
+        } else if (strncmp(input, "sendgroup ", 10) == 0) {
+            char *rest = input + 10;
+            char *space = strchr(rest, ' ');
+            if (!space) {
+                printf("Usage: sendgroup <user>[,<user>...] <message>\n");
+                continue;
+            }
+            *space = '\0';
+            const char *message = space + 1;
+            if (binary_mode) {
+                size_t count = 1;
+                for (const char *c = rest; *c; ++c) {
+                    count += (*c == ',');
+                }
+                binary_field_t *fields = malloc((count + 2) * sizeof(binary_field_t));
+                if (!fields) {
+                    continue;
+                }
+                fields[0] = BINARY_INT(count);
+                const char *name = rest;
+                for (size_t i = 1; i <= count; ++i) {
+                    size_t name_len = strcspn(name, ",");
+                    fields[i] = BINARY_TEXT(name, name_len);
+                    name += name_len + 1;
+                }
+                fields[count + 1] = BINARY_TEXT(message, strlen(message));
+                send_frame(BINARY_GROUP, fields, count + 2);
+                free(fields);
+            } else {
+                send_command("GROUP %s %s", rest, message);
+            }
         } else if (strncmp(input, "getmessages ", 12) == 0) {
             const char *user = input + 12;
-            send_command("GET %s", user);
+            // A plain "getmessages <user>" is served from the local copy.
+            if (history_dir && user[0] && !strchr(user, ' ') && strlen(user) < MAX_USERNAME && start_sync(user)) {
+                continue;
+            }
+            if (binary_mode) {
+                // "<user> [limit] [before_id]", as the text command takes it.
+                const char *space = strchr(user, ' ');
+                unsigned long long limit = 0;
+                unsigned long long before_id = 0;
+                if (space && sscanf(space + 1, "%llu %llu", &limit, &before_id) < 1) {
+                    printf("Usage: getmessages <user> [limit] [before_id]\n");
+                    continue;
+                }
+                size_t user_len = space ? (size_t)(space - user) : strlen(user);
+                binary_field_t fields[] = {BINARY_TEXT(user, user_len), BINARY_INT(limit), BINARY_INT(before_id)};
+                send_frame(BINARY_GET, fields, 3);
+            } else {
+                send_command("GET %s", user);
+            }
         } else if (strncmp(input, "deletemessages ", 15) == 0) {
             const char *user = input + 15;
-            send_command("DELETE %s", user);
+            if (history_dir && wait_for_sync()) {
+                char *path = local_history_path(user);
+                if (path) {
+                    remove(path);
+                    free(path);
+                }
+            }
+            if (binary_mode) {
+                binary_field_t field = BINARY_TEXT(user, strlen(user));
+                send_frame(BINARY_DELETE, &field, 1);
+            } else {
+                send_command("DELETE %s", user);
+            }
         } else if (strcmp(input, "getuserlist") == 0) {
-            send_command("USERS");
+            if (binary_mode) {
+                send_frame(BINARY_USERS, NULL, 0);
+            } else {
+                send_command("USERS");
+            }
+        } else if (strcmp(input, "watchusers on") == 0 || strcmp(input, "watchusers off") == 0) {
+            bool on = strcmp(input + 11, "on") == 0;
+            if (binary_mode) {
+                binary_field_t field = BINARY_INT(on ? 1 : 0);
+                send_frame(BINARY_PRESENCE, &field, 1);
+            } else {
+                send_command("PRESENCE %s", on ? "ON" : "OFF");
+            }
+        } else if (strcmp(input, "getinbox") == 0) {
+            if (binary_mode) {
+                send_frame(BINARY_INBOX, NULL, 0);
+            } else {
+                send_command("INBOX");
+            }
+        } else if (strcmp(input, "getstats") == 0) {
+            if (binary_mode) {
+                send_frame(BINARY_STATS, NULL, 0);
+            } else {
+                send_command("STATS");
+            }
         } else if (strcmp(input, "quit") == 0) {
-            send_command("QUIT");
+            if (binary_mode) {
+                send_frame(BINARY_QUIT, NULL, 0);
+            } else {
+                send_command("QUIT");
+            }
             running = 0;
             break;
         } else if (strlen(input) == 0) {
             continue;
         } else {
-            printf("Unknown command. Use sendmessage/getmessages/deletemessages/getuserlist/quit\n");
+            printf("Unknown command. Use sendmessage/sendgroup/getmessages/deletemessages/getuserlist/watchusers/getinbox/getstats/quit\n");
         }
     }
     free(input);
@@ -307,6 +838,8 @@ int main(int argc, char **argv) {
         shutdown(server_fd, SHUT_RDWR);
     }
     pthread_join(receiver_thread, NULL);
+    frame_reader_free(&server_frames);
+    deflate_codec_end(&history_inflater);
     cleanup();
     net_cleanup();
     return EXIT_SUCCESS;
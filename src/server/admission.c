@@ -0,0 +1,69 @@
+#include "admission.h"
+
+#include <stdatomic.h>
+
+#include "storage.h"
+
+static admission_options_t options = {
+    .rate = {0, 0, 0},
+    .burst_seconds = 1,
+};
+static atomic_bool outbound_shedding;
+
+void admission_configure(const admission_options_t *config) {
+    options = *config;
+    atomic_store(&outbound_shedding, false);
+}
+
+void admission_sample_outbound(uint64_t queued_bytes) {
+    if (options.outbound_limit == 0) {
+        return;
+    }
+    bool shedding = atomic_load_explicit(&outbound_shedding, memory_order_relaxed);
+    if (!shedding && queued_bytes > options.outbound_limit) {
+        atomic_store_explicit(&outbound_shedding, true, memory_order_relaxed);
+    } else if (shedding && queued_bytes < options.outbound_limit / 4 * 3) {
+        atomic_store_explicit(&outbound_shedding, false, memory_order_relaxed);
+    }
+}
+
+static bool overloaded(admit_class_t kind) {
+    if (kind == ADMIT_USERS) {
+        return false; // served from a shared snapshot, cheap either way
+    }
+    if (atomic_load_explicit(&outbound_shedding, memory_order_relaxed)) {
+        return true;
+    }
+    return kind == ADMIT_SEND && options.storage_queue_limit != 0 &&
+           storage_queue_depth() > options.storage_queue_limit;
+}
+
+admit_result_t admission_check(rate_limiter_t *limiter, admit_class_t kind, uint64_t now, uint64_t *retry_ms) {
+    if (overloaded(kind)) {
+        return ADMIT_BUSY;
+    }
+    double rate = options.rate[kind];
+    if (rate <= 0) {
+        return ADMIT_OK;
+    }
+    double burst = rate * options.burst_seconds;
+    if (burst < 1) {
+        burst = 1;
+    }
+    token_bucket_t *bucket = &limiter->buckets[kind];
+    if (bucket->updated == 0) {
+        bucket->tokens = burst;
+    } else if (now > bucket->updated) {
+        bucket->tokens += (double)(now - bucket->updated) / 1e9 * rate;
+        if (bucket->tokens > burst) {
+            bucket->tokens = burst;
+        }
+    }
+    bucket->updated = now;
+    if (bucket->tokens >= 1) {
+        bucket->tokens -= 1;
+        return ADMIT_OK;
+    }
+    *retry_ms = (uint64_t)((1 - bucket->tokens) / rate * 1e3) + 1;
+    return ADMIT_RATE_LIMITED;
+}
@@ -0,0 +1,53 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Admission control for the commands that create work: per-session token
+// buckets, plus server-wide load shedding while the storage writer or the
+// clients' send queues are backed up. A shed command is refused outright
+// without taking a token, so a client that retries after "ERROR Busy" is not
+// also rate limited for it.
+typedef enum {
+    ADMIT_SEND,  // SEND and GROUP
+    ADMIT_GET,   // GET and INBOX
+    ADMIT_USERS, // USERS
+    ADMIT_CLASS_COUNT
+} admit_class_t;
+
+typedef enum {
+    ADMIT_OK,
+    ADMIT_RATE_LIMITED,
+    ADMIT_BUSY,
+} admit_result_t;
+
+typedef struct {
+    double rate[ADMIT_CLASS_COUNT]; // commands per second per session; 0 = unlimited
+    double burst_seconds;           // bucket depth, in seconds of rate
+    size_t storage_queue_limit;     // shed SEND beyond this many queued writes; 0 = never
+    uint64_t outbound_limit;        // shed SEND/GET beyond this many queued bytes; 0 = never
+} admission_options_t;
+
+typedef struct {
+    double tokens;
+    uint64_t updated; // ns; 0 = never used, i.e. full
+} token_bucket_t;
+
+// Owned by one session and only touched by the thread running its commands.
+typedef struct {
+    token_bucket_t buckets[ADMIT_CLASS_COUNT];
+} rate_limiter_t;
+
+void admission_configure(const admission_options_t *options);
+
+// `now` is monotonic ns. On ADMIT_RATE_LIMITED, `*retry_ms` is how long
+// until a token is due.
+admit_result_t admission_check(rate_limiter_t *limiter, admit_class_t kind, uint64_t now, uint64_t *retry_ms);
+
+// Fed periodically with the bytes waiting in all send queues. Shedding starts
+// above the limit and stops once the total falls below three quarters of it.
+void admission_sample_outbound(uint64_t queued_bytes);
+
+#endif /* ADMISSION_H */
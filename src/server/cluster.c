@@ -0,0 +1,1431 @@
+#define _POSIX_C_SOURCE 200809L
+#include "cluster.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifndef _WIN32
+#include <netinet/tcp.h>
+#endif
+
+#include "binary_protocol.h"
+#include "crypto.h"
+#include "listener.h"
+#include "net_compat.h"
+#include "registry.h"
+
+#define CLUSTER_PROTOCOL_VERSION 3
+#define CLUSTER_BACKLOG 16
+#define CLUSTER_TICK_MS 200 /* how often blocked cluster threads look for shutdown */
+#define CLUSTER_CONNECT_TIMEOUT_MS 1000
+#define CLUSTER_RETRY_MS 500
+#define CLUSTER_HELLO_TIMEOUT_MS 2000 /* for each handshake frame */
+#define CLUSTER_NONCE_LEN 16
+#define CLUSTER_CLAIM_TIMEOUT_MS 2000
+#define CLUSTER_READ_TIMEOUT_MS 5000
+#define CLUSTER_QUEUE_LIMIT (16u * 1024u * 1024u) /* bytes waiting per peer */
+#define CLUSTER_REPLY_LIMIT (4u * 1024u * 1024u)  /* rows in one read reply */
+#define CLUSTER_PUSH_RING 4096                    /* push stamps kept per peer */
+#define CLUSTER_MISS_SLOTS 256                    /* hashed names, per peer */
+#define CLUSTER_ERROR_MAX 256
+#define PEER_NAME_MAX 32 /* as MAX_USERNAME */
+
+// Node-to-node frames, in the client binary framing but on their own
+// connections, so the opcodes never meet client ones. The accepting side
+// opens with CHALLENGE and sends nothing else; the dialing side answers with
+// HELLO and everything after it.
+typedef enum {
+    PEER_HELLO = 0x01,   // version, member count, node index, MAC of the challenge and the rest
+    PEER_JOIN = 0x02,    // name: a user of the sending node logged in
+    PEER_LEAVE = 0x03,   // name: it logged out, releasing its claim too
+    PEER_CLAIM = 0x04,   // seq, name: may the name log in at the sender?
+    PEER_CLAIMED = 0x05, // seq, 1 = granted or 0 = taken
+    PEER_MESSAGE = 0x06, // push seq, sender, receiver, body: a live push from the owner
+    PEER_CHALLENGE = 0x07, // nonce
+    PEER_STORE = 0x08,     // seq (0 = no reply), sender, count, that many receivers, body
+    PEER_STORED = 0x09,    // seq, 0 = committed or 1 = failed, error
+    PEER_DELIVERED = 0x0a, // name, push seq: written up to there before the logout
+    PEER_READ = 0x0b,      // seq, kind, user, other, id, limit
+    PEER_ROW = 0x0c,       // seq, id, timestamp, sender, body
+    PEER_READ_DONE = 0x0d, // seq, 0 = ok or 1 = failed, 1 = inbox page cut short, error
+    PEER_ADVANCE = 0x0e,   // name, count, that many ids delivered from the inbox
+} peer_opcode_t;
+
+typedef struct {
+    unsigned char *data;
+    size_t len;
+    size_t capacity;
+} peer_buffer_t;
+
+typedef struct {
+    int index;
+    // Outgoing link, owned by `writer`. Frames are appended to `queued` under
+    // `lock` and the thread writes everything queued in one go, so whatever
+    // piles up during a write leaves with the next one.
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    peer_buffer_t queued;
+    bool connected; // guarded by lock; frames are refused while false
+    pthread_t writer;
+    bool writer_started;
+    // Pushes sent on the link, and the stamp each went out under, by seq.
+    uint64_t push_seq;
+    uint64_t *stamps; // CLUSTER_PUSH_RING * stamp_len
+    // Incoming link, accepted from the peer and read by `reader`. The
+    // acceptor joins the previous reader before it starts the next.
+    socket_handle_t inbound;
+    frame_reader_t input;
+    char *scratch; // NUL-terminated copy of a forwarded body
+    size_t scratch_capacity;
+    peer_buffer_t reply; // rows read for the peer
+    pthread_t reader;
+    bool reader_started;
+    bool inbound_up; // guarded by lock: replies can arrive
+    // cluster_push_losses(): incoming links opened or closed, and pushes
+    // that found no session, by hashed name.
+    atomic_uint_fast64_t link_changes;
+    atomic_uint_fast64_t misses[CLUSTER_MISS_SLOTS];
+} peer_t;
+
+// A session blocked in cluster_claim(), on its own stack.
+typedef struct claim_wait {
+    struct claim_wait *next;
+    uint64_t seq;
+    int result; // -1 until CLAIMED arrives
+} claim_wait_t;
+
+static cluster_options_t members;
+static cluster_hooks_t hooks;
+static peer_t peers[CLUSTER_MAX_NODES];
+static socket_handle_t listener = NET_INVALID_SOCKET;
+static pthread_t acceptor;
+static bool acceptor_started = false;
+static atomic_bool enabled = false;
+static atomic_bool running = false;
+static pthread_mutex_t claim_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t claim_cond = PTHREAD_COND_INITIALIZER;
+static claim_wait_t *claims = NULL; // guarded by claim_lock
+static uint64_t claim_seq = 0;      // guarded by claim_lock
+
+// A message relayed by cluster_store(), until its owner answers.
+typedef struct store_wait {
+    struct store_wait *next;
+    uint64_t seq;
+    int node;
+    cluster_store_callback done;
+    void *ctx;
+} store_wait_t;
+
+// A session blocked in cluster_read(), on its own stack. The reader thread
+// copies each ROW body in, after its length.
+typedef struct read_wait {
+    struct read_wait *next;
+    uint64_t seq;
+    int node;
+    bool finished;
+    int status;
+    bool partial;
+    char error[CLUSTER_ERROR_MAX];
+    peer_buffer_t rows;
+} read_wait_t;
+
+// Taken after a peer's lock where both are held: a request is registered
+// under its link's lock, so a link that goes down fails it or never saw it.
+static pthread_mutex_t request_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t request_cond = PTHREAD_COND_INITIALIZER;
+static store_wait_t *stores = NULL; // guarded by request_lock
+static read_wait_t *reads = NULL;   // guarded by request_lock
+static uint64_t request_seq = 0;    // guarded by request_lock
+
+static void deadline_after_ms(struct timespec *ts, int ms) {
+    clock_gettime(CLOCK_REALTIME, ts);
+    ts->tv_sec += ms / 1000;
+    ts->tv_nsec += (long)(ms % 1000) * 1000000L;
+    if (ts->tv_nsec >= 1000000000L) {
+        ts->tv_sec += 1;
+        ts->tv_nsec -= 1000000000L;
+    }
+}
+
+static void sleep_while_running(int ms) {
+    for (int waited = 0; waited < ms && atomic_load(&running); waited += CLUSTER_TICK_MS) {
+        net_sleep_ms(CLUSTER_TICK_MS);
+    }
+}
+
+// Returns >0 once `fd` is ready for `events`, 0 on timeout, <0 on error.
+static int wait_ready(socket_handle_t fd, short events, int timeout_ms) {
+    net_pollfd_t pfd;
+    pfd.fd = fd;
+    pfd.events = events;
+    pfd.revents = 0;
+    return net_poll(&pfd, 1, timeout_ms);
+}
+
+// A nonce or MAC: a text field that may hold any byte, NUL included.
+static bool next_bytes(binary_cursor_t *cur, const char **data, size_t *len) {
+    uint64_t n;
+    if (binary_get_varint(&cur->p, cur->end, &n) != 1 || n > (uint64_t)(cur->end - cur->p)) {
+        return false;
+    }
+    *data = (const char *)cur->p;
+    *len = (size_t)n;
+    cur->p += n;
+    return true;
+}
+
+// What HELLO proves knowledge of the secret with: an HMAC over the
+// acceptor's nonce and the HELLO fields, so it cannot be replayed on another
+// link or under another node index.
+static void hello_mac(const unsigned char *nonce, uint64_t version, uint64_t count, uint64_t node,
+                      unsigned char out[CRYPTO_SHA256_LEN]) {
+    unsigned char data[CLUSTER_NONCE_LEN + 3 * 8];
+    memcpy(data, nonce, CLUSTER_NONCE_LEN);
+    uint64_t fields[3] = {version, count, node};
+    for (int i = 0; i < 3; ++i) {
+        for (int b = 0; b < 8; ++b) {
+            data[CLUSTER_NONCE_LEN + 8 * i + b] = (unsigned char)(fields[i] >> (56 - 8 * b));
+        }
+    }
+    crypto_hmac_sha256(members.secret, strlen(members.secret), data, sizeof(data), out);
+}
+
+static uint32_t fnv1a(uint32_t hash, const char *text) {
+    for (const unsigned char *p = (const unsigned char *)text; *p; ++p) {
+        hash ^= *p;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Rendezvous hashing: every node computes the same member for a key, and
+// only the keys placed on a member move if the list changes.
+static int rendezvous(uint32_t base) {
+    int best = 0;
+    uint32_t best_score = 0;
+    for (int i = 0; i < members.count; ++i) {
+        uint32_t h = base ^ ((uint32_t)(i + 1) * 0x9e3779b9u);
+        h ^= h >> 16; // murmur3 finalizer
+        h *= 0x85ebca6bu;
+        h ^= h >> 13;
+        h *= 0xc2b2ae35u;
+        h ^= h >> 16;
+        if (i == 0 || h > best_score) {
+            best = i;
+            best_score = h;
+        }
+    }
+    return best;
+}
+
+static int home_node(const char *name) {
+    return rendezvous(fnv1a(2166136261u, name));
+}
+
+int cluster_owner(const char *user_a, const char *user_b) {
+    if (strcmp(user_a, user_b) > 0) {
+        const char *tmp = user_a;
+        user_a = user_b;
+        user_b = tmp;
+    }
+    return rendezvous(fnv1a(fnv1a(fnv1a(2166136261u, user_a), "\n"), user_b));
+}
+
+int cluster_parse_members(const char *list, cluster_options_t *options) {
+    options->count = 0;
+    const char *item = list;
+    while (*item) {
+        const char *end = strchr(item, ',');
+        size_t len = end ? (size_t)(end - item) : strlen(item);
+        const char *colon = memchr(item, ':', len);
+        if (!colon || colon == item || (size_t)(colon - item) >= CLUSTER_HOST_MAX ||
+            options->count == CLUSTER_MAX_NODES) {
+            return -1;
+        }
+        cluster_member_t *member = &options->members[options->count];
+        memcpy(member->host, item, (size_t)(colon - item));
+        member->host[colon - item] = '\0';
+        char digits[8];
+        size_t digits_len = len - (size_t)(colon + 1 - item);
+        if (digits_len == 0 || digits_len >= sizeof(digits)) {
+            return -1;
+        }
+        memcpy(digits, colon + 1, digits_len);
+        digits[digits_len] = '\0';
+        char *stop;
+        long port = strtol(digits, &stop, 10);
+        struct in_addr addr;
+        if (*stop != '\0' || port < 1 || port > 65535 || inet_pton(AF_INET, member->host, &addr) != 1) {
+            return -1;
+        }
+        member->port = (uint16_t)port;
+        options->count++;
+        item = end ? end + 1 : item + len;
+    }
+    return options->count > 0 ? 0 : -1;
+}
+
+static int buffer_reserve(peer_buffer_t *buffer, size_t need) {
+    if (buffer->capacity - buffer->len >= need) {
+        return 0;
+    }
+    size_t capacity = buffer->capacity ? buffer->capacity : 4096;
+    while (capacity - buffer->len < need) {
+        capacity *= 2;
+    }
+    unsigned char *data = realloc(buffer->data, capacity);
+    if (!data) {
+        return -1;
+    }
+    buffer->data = data;
+    buffer->capacity = capacity;
+    return 0;
+}
+
+// Caller holds peer->lock. Frames that do not fit on a link that is up
+// reset it, so the other side notices the gap (its reader sees the link
+// close) instead of reading on past it.
+static int reserve_locked(peer_t *peer, size_t size) {
+    if (!peer->connected) {
+        return -1;
+    }
+    if (peer->queued.len + size > CLUSTER_QUEUE_LIMIT || buffer_reserve(&peer->queued, size) != 0) {
+        peer->connected = false;
+        pthread_cond_signal(&peer->wake);
+        return -1;
+    }
+    return 0;
+}
+
+// Caller holds peer->lock.
+static int append_locked(peer_t *peer, peer_opcode_t opcode, const binary_field_t *fields, size_t count) {
+    size_t size = binary_frame_size(fields, count);
+    if (reserve_locked(peer, size) != 0) {
+        return -1;
+    }
+    peer->queued.len += binary_encode(peer->queued.data + peer->queued.len, (binary_opcode_t)opcode, fields, count);
+    return 0;
+}
+
+static int queue_frame(peer_t *peer, peer_opcode_t opcode, const binary_field_t *fields, size_t count) {
+    pthread_mutex_lock(&peer->lock);
+    int rc = append_locked(peer, opcode, fields, count);
+    if (rc == 0) {
+        pthread_cond_signal(&peer->wake);
+    }
+    pthread_mutex_unlock(&peer->lock);
+    return rc;
+}
+
+// Queues frames encoded already, in one piece.
+static int queue_encoded(peer_t *peer, const unsigned char *data, size_t len) {
+    pthread_mutex_lock(&peer->lock);
+    int rc = reserve_locked(peer, len);
+    if (rc == 0) {
+        memcpy(peer->queued.data + peer->queued.len, data, len);
+        peer->queued.len += len;
+        pthread_cond_signal(&peer->wake);
+    }
+    pthread_mutex_unlock(&peer->lock);
+    return rc;
+}
+
+// Caller holds the lock of the link to `node`, which just went down one way
+// or the other: nothing more will be answered for requests sent on it.
+// Waiting reads fail now; relayed stores are moved to `*failed` for
+// finish_stores() to report once the lock is released.
+static void fail_requests_locked(int node, store_wait_t **failed) {
+    pthread_mutex_lock(&request_lock);
+    for (store_wait_t **link = &stores; *link;) {
+        store_wait_t *wait = *link;
+        if (wait->node == node) {
+            *link = wait->next;
+            wait->next = *failed;
+            *failed = wait;
+        } else {
+            link = &wait->next;
+        }
+    }
+    for (read_wait_t *wait = reads; wait; wait = wait->next) {
+        if (wait->node == node && !wait->finished) {
+            wait->finished = true;
+            wait->status = -1;
+            snprintf(wait->error, sizeof(wait->error), "lost the link to cluster node %d", node);
+        }
+    }
+    pthread_cond_broadcast(&request_cond);
+    pthread_mutex_unlock(&request_lock);
+}
+
+static void finish_stores(store_wait_t *failed, int status, const char *error) {
+    while (failed) {
+        store_wait_t *next = failed->next;
+        failed->done(status, error, failed->ctx);
+        free(failed);
+        failed = next;
+    }
+}
+
+static void fail_stores(store_wait_t *failed, int node) {
+    char error[CLUSTER_ERROR_MAX];
+    snprintf(error, sizeof(error), "lost the link to cluster node %d, the message may not be stored", node);
+    finish_stores(failed, -1, error);
+}
+
+static void announce_local_user(registry_node_t *node, void *ctx) {
+    binary_field_t field = BINARY_TEXT(node->key, strlen(node->key));
+    append_locked((peer_t *)ctx, PEER_JOIN, &field, 1);
+}
+
+// Non-blocking connect with a timeout; the socket stays non-blocking.
+static socket_handle_t dial(const cluster_member_t *member) {
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(member->port);
+    if (inet_pton(AF_INET, member->host, &addr.sin_addr) != 1) {
+        return NET_INVALID_SOCKET;
+    }
+    socket_handle_t fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == NET_INVALID_SOCKET) {
+        return NET_INVALID_SOCKET;
+    }
+    bool ok = net_set_nonblocking(fd) == 0;
+    if (ok && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        int err = 0;
+        socklen_t err_len = sizeof(err);
+        ok = net_connect_pending() && wait_ready(fd, POLLOUT, CLUSTER_CONNECT_TIMEOUT_MS) > 0 &&
+             getsockopt(fd, SOL_SOCKET, SO_ERROR, (char *)&err, &err_len) == 0 && err == 0;
+    }
+    if (!ok) {
+        net_close(fd);
+        return NET_INVALID_SOCKET;
+    }
+    int opt = 1; // frames are batched already
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (const char *)&opt, sizeof(opt));
+    return fd;
+}
+
+static int send_all(socket_handle_t fd, const unsigned char *data, size_t len) {
+    while (len > 0) {
+        int chunk = len > INT_MAX ? INT_MAX : (int)len;
+        int sent = (int)send(fd, (const char *)data, chunk, 0);
+        if (sent > 0) {
+            data += sent;
+            len -= (size_t)sent;
+        } else if (sent < 0 && (net_would_block() || net_was_interrupted()) && atomic_load(&running)) {
+            wait_ready(fd, POLLOUT, CLUSTER_TICK_MS);
+        } else {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Nothing is sent back on an outgoing link after the challenge, so readable
+// means closed.
+static bool link_closed(socket_handle_t fd) {
+    return wait_ready(fd, POLLIN, 0) != 0;
+}
+
+// Waits for the next frame on a link being set up, which must be `expected`.
+// Returns 0 with `cur` over its body (valid until `input` is read again), or
+// -1 on anything else, on timeout or at shutdown.
+static int read_handshake(socket_handle_t fd, frame_reader_t *input, int expected, binary_cursor_t *cur) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (;;) {
+        int opcode;
+        const unsigned char *body;
+        size_t len;
+        int rc = frame_reader_next(input, &opcode, &body, &len);
+        if (rc < 0) {
+            return -1;
+        }
+        if (rc > 0) {
+            if (opcode != expected) {
+                return -1;
+            }
+            *cur = (binary_cursor_t){body, body + len};
+            return 0;
+        }
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long elapsed = (long)(now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+        if (elapsed >= CLUSTER_HELLO_TIMEOUT_MS || !atomic_load(&running) ||
+            wait_ready(fd, POLLIN, CLUSTER_TICK_MS) < 0) {
+            return -1;
+        }
+        ssize_t n = frame_reader_fill(input, fd);
+        if (n == 0 || (n < 0 && !net_would_block() && !net_was_interrupted())) {
+            return -1;
+        }
+    }
+}
+
+// Reads the peer's challenge and computes the MAC our HELLO answers it with.
+static int answer_challenge(socket_handle_t fd, unsigned char mac[CRYPTO_SHA256_LEN]) {
+    frame_reader_t input;
+    frame_reader_init(&input);
+    binary_cursor_t cur;
+    const char *nonce;
+    size_t nonce_len;
+    int rc = -1;
+    if (read_handshake(fd, &input, PEER_CHALLENGE, &cur) == 0 && next_bytes(&cur, &nonce, &nonce_len) &&
+        nonce_len == CLUSTER_NONCE_LEN) {
+        hello_mac((const unsigned char *)nonce, CLUSTER_PROTOCOL_VERSION, (uint64_t)members.count,
+                  (uint64_t)members.self, mac);
+        rc = 0;
+    }
+    frame_reader_free(&input);
+    return rc;
+}
+
+static void *writer_main(void *arg) {
+    peer_t *peer = (peer_t *)arg;
+    peer_buffer_t sending = {NULL, 0, 0};
+    while (atomic_load(&running)) {
+        socket_handle_t fd = dial(&members.members[peer->index]);
+        unsigned char mac[CRYPTO_SHA256_LEN];
+        if (fd != NET_INVALID_SOCKET && answer_challenge(fd, mac) != 0) {
+            net_close(fd);
+            fd = NET_INVALID_SOCKET;
+        }
+        if (fd == NET_INVALID_SOCKET) {
+            sleep_while_running(CLUSTER_RETRY_MS);
+            continue;
+        }
+        // HELLO, then every local user: the peer forgot them when the last
+        // link went down. Logins from here on are queued behind the list.
+        pthread_mutex_lock(&peer->lock);
+        peer->connected = true;
+        peer->queued.len = 0;
+        binary_field_t hello[] = {BINARY_INT(CLUSTER_PROTOCOL_VERSION), BINARY_INT(members.count),
+                                  BINARY_INT(members.self), BINARY_TEXT((const char *)mac, sizeof(mac))};
+        append_locked(peer, PEER_HELLO, hello, 4);
+        registry_for_each(announce_local_user, peer);
+        bool ok = true;
+        while (ok) {
+            while (ok && atomic_load(&running) && peer->connected && peer->queued.len == 0) {
+                if (link_closed(fd)) {
+                    ok = false;
+                    break;
+                }
+                struct timespec deadline;
+                deadline_after_ms(&deadline, CLUSTER_TICK_MS);
+                pthread_cond_timedwait(&peer->wake, &peer->lock, &deadline);
+            }
+            if (!atomic_load(&running) || !ok || !peer->connected) {
+                break;
+            }
+            peer_buffer_t swap = peer->queued;
+            peer->queued = sending;
+            sending = swap;
+            pthread_mutex_unlock(&peer->lock);
+            ok = send_all(fd, sending.data, sending.len) == 0;
+            sending.len = 0;
+            pthread_mutex_lock(&peer->lock);
+        }
+        peer->connected = false;
+        peer->queued.len = 0;
+        store_wait_t *failed = NULL;
+        fail_requests_locked(peer->index, &failed);
+        pthread_mutex_unlock(&peer->lock);
+        net_close(fd);
+        fail_stores(failed, peer->index);
+        sleep_while_running(CLUSTER_RETRY_MS);
+    }
+    free(sending.data);
+    return NULL;
+}
+
+static bool next_name(binary_cursor_t *cur, char *out) {
+    const char *text;
+    size_t len;
+    if (!binary_next_text(cur, &text, &len) || len == 0 || len >= PEER_NAME_MAX) {
+        return false;
+    }
+    memcpy(out, text, len);
+    out[len] = '\0';
+    return true;
+}
+
+static void answer_claim(uint64_t seq, int result) {
+    pthread_mutex_lock(&claim_lock);
+    for (claim_wait_t *wait = claims; wait; wait = wait->next) {
+        if (wait->seq == seq) {
+            wait->result = result;
+            pthread_cond_broadcast(&claim_cond);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&claim_lock);
+}
+
+// A NUL-terminated copy of a frame's text, valid until the next frame.
+static const char *scratch_copy(peer_t *peer, const char *text, size_t len) {
+    if (len + 1 > peer->scratch_capacity) {
+        char *scratch = realloc(peer->scratch, len + 1);
+        if (!scratch) {
+            return NULL;
+        }
+        peer->scratch = scratch;
+        peer->scratch_capacity = len + 1;
+    }
+    memcpy(peer->scratch, text, len);
+    peer->scratch[len] = '\0';
+    return peer->scratch;
+}
+
+static void note_miss(peer_t *peer, const char *name) {
+    atomic_fetch_add(&peer->misses[fnv1a(2166136261u, name) % CLUSTER_MISS_SLOTS], 1);
+}
+
+static bool handle_push(peer_t *peer, binary_cursor_t *cur) {
+    uint64_t seq;
+    char sender[PEER_NAME_MAX];
+    char receiver[PEER_NAME_MAX];
+    const char *text;
+    size_t text_len;
+    if (!binary_next_int(cur, &seq) || !next_name(cur, sender) || !next_name(cur, receiver) ||
+        !binary_next_text(cur, &text, &text_len)) {
+        return false;
+    }
+    const char *body = scratch_copy(peer, text, text_len);
+    if (!body || !hooks.deliver(peer->index, seq, sender, receiver, body)) {
+        note_miss(peer, receiver); // stored all the same, so it waits in the inbox
+    }
+    return true;
+}
+
+// The receivers travel as in a client GROUP frame: a count, then the names.
+static bool handle_store(peer_t *peer, binary_cursor_t *cur) {
+    uint64_t seq;
+    uint64_t count;
+    char sender[PEER_NAME_MAX];
+    if (!binary_next_int(cur, &seq) || !next_name(cur, sender) || !binary_next_int(cur, &count) || count == 0 ||
+        count > (uint64_t)(cur->end - cur->p)) {
+        return false;
+    }
+    // One block for the pointers, the names and the body: what is left of
+    // the frame plus a terminator for each.
+    size_t rest = (size_t)(cur->end - cur->p);
+    const char **receivers = malloc((size_t)count * sizeof(*receivers) + rest + (size_t)count + 1);
+    if (!receivers) {
+        cluster_stored(peer->index, seq, -1, "out of memory on the owner node");
+        return true;
+    }
+    char *at = (char *)(receivers + count);
+    const char *text;
+    size_t len;
+    for (uint64_t i = 0; i < count; ++i) {
+        if (!binary_next_text(cur, &text, &len) || len == 0 || len >= PEER_NAME_MAX) {
+            free(receivers);
+            return false;
+        }
+        memcpy(at, text, len);
+        at[len] = '\0';
+        receivers[i] = at;
+        at += len + 1;
+    }
+    if (!binary_next_text(cur, &text, &len)) {
+        free(receivers);
+        return false;
+    }
+    memcpy(at, text, len);
+    at[len] = '\0';
+    hooks.store(peer->index, seq, sender, receivers, (size_t)count, at);
+    free(receivers);
+    return true;
+}
+
+static bool handle_stored(binary_cursor_t *cur) {
+    uint64_t seq;
+    uint64_t failed;
+    const char *text;
+    size_t text_len;
+    if (!binary_next_int(cur, &seq) || !binary_next_int(cur, &failed) || !binary_next_text(cur, &text, &text_len)) {
+        return false;
+    }
+    pthread_mutex_lock(&request_lock);
+    store_wait_t *wait = NULL;
+    for (store_wait_t **link = &stores; *link; link = &(*link)->next) {
+        if ((*link)->seq == seq) {
+            wait = *link;
+            *link = wait->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&request_lock);
+    if (wait) {
+        char error[CLUSTER_ERROR_MAX];
+        size_t len = text_len < sizeof(error) ? text_len : sizeof(error) - 1;
+        memcpy(error, text, len);
+        error[len] = '\0';
+        wait->next = NULL;
+        finish_stores(wait, failed ? -1 : 0, failed ? error : NULL);
+    }
+    return true;
+}
+
+// Only a push still in the ring has its stamp; an older one moves nothing.
+static bool handle_delivered(peer_t *peer, binary_cursor_t *cur) {
+    char name[PEER_NAME_MAX];
+    uint64_t seq;
+    if (!next_name(cur, name) || !binary_next_int(cur, &seq)) {
+        return false;
+    }
+    uint64_t stamp[CLUSTER_STAMP_MAX];
+    bool known = false;
+    pthread_mutex_lock(&peer->lock);
+    if (peer->stamps && seq > 0 && seq <= peer->push_seq && peer->push_seq - seq < CLUSTER_PUSH_RING) {
+        memcpy(stamp, peer->stamps + (seq % CLUSTER_PUSH_RING) * members.stamp_len,
+               members.stamp_len * sizeof(uint64_t));
+        known = true;
+    }
+    pthread_mutex_unlock(&peer->lock);
+    if (known) {
+        hooks.delivered(name, stamp);
+    }
+    return true;
+}
+
+typedef struct {
+    peer_t *peer;
+    uint64_t seq;
+    bool full;
+} reply_t;
+
+// Once a row does not fit, none after it is sent either, so an inbox page
+// cut short is still a prefix of the page.
+static void reply_row(int64_t id, const char *timestamp, const char *sender, const char *body, void *ctx) {
+    reply_t *reply = (reply_t *)ctx;
+    peer_buffer_t *out = &reply->peer->reply;
+    binary_field_t fields[] = {BINARY_INT(reply->seq), BINARY_INT((uint64_t)id),
+                               BINARY_TEXT(timestamp, strlen(timestamp)), BINARY_TEXT(sender, strlen(sender)),
+                               BINARY_TEXT(body, strlen(body))};
+    size_t size = binary_frame_size(fields, 5);
+    if (reply->full || binary_body_size(fields, 5) > BINARY_MAX_FRAME || out->len + size > CLUSTER_REPLY_LIMIT ||
+        buffer_reserve(out, size) != 0) {
+        reply->full = true;
+        return;
+    }
+    out->len += binary_encode(out->data + out->len, (binary_opcode_t)PEER_ROW, fields, 5);
+}
+
+// The rows and READ_DONE are queued as one piece. A reply the queue cannot
+// take resets the link, which fails the read at the asking node.
+static void serve_read(peer_t *peer, uint64_t seq, const cluster_read_t *request) {
+    reply_t reply = {peer, seq, false};
+    char error[CLUSTER_ERROR_MAX] = "";
+    peer->reply.len = 0;
+    int rc = hooks.read(request, reply_row, &reply, error, sizeof(error));
+    bool partial = rc == 0 && reply.full && request->kind == CLUSTER_READ_INBOX;
+    if (rc == 0 && reply.full && !partial) {
+        rc = -1;
+        snprintf(error, sizeof(error), "too many messages for one cluster read, ask for fewer");
+    }
+    if (rc != 0) {
+        peer->reply.len = 0;
+    }
+    binary_field_t done[] = {BINARY_INT(seq), BINARY_INT(rc != 0 ? 1 : 0), BINARY_INT(partial ? 1 : 0),
+                             BINARY_TEXT(error, strlen(error))};
+    size_t size = binary_frame_size(done, 4);
+    if (buffer_reserve(&peer->reply, size) == 0) {
+        peer->reply.len += binary_encode(peer->reply.data + peer->reply.len, (binary_opcode_t)PEER_READ_DONE, done, 4);
+        queue_encoded(peer, peer->reply.data, peer->reply.len);
+    }
+    if (peer->reply.capacity > CLUSTER_REPLY_LIMIT / 4) {
+        free(peer->reply.data); // a big reply is rare; do not keep its buffer
+        peer->reply = (peer_buffer_t){NULL, 0, 0};
+    }
+}
+
+static bool handle_read(peer_t *peer, binary_cursor_t *cur) {
+    uint64_t seq;
+    uint64_t kind;
+    uint64_t id;
+    uint64_t limit;
+    char user[PEER_NAME_MAX];
+    char other[PEER_NAME_MAX] = "";
+    const char *text;
+    size_t text_len;
+    if (!binary_next_int(cur, &seq) || !binary_next_int(cur, &kind) || !next_name(cur, user) ||
+        !binary_next_text(cur, &text, &text_len) || text_len >= PEER_NAME_MAX || !binary_next_int(cur, &id) ||
+        !binary_next_int(cur, &limit) || kind < CLUSTER_READ_HISTORY || kind > CLUSTER_READ_DELETE ||
+        id > INT64_MAX || limit > INT_MAX) {
+        return false;
+    }
+    memcpy(other, text, text_len);
+    other[text_len] = '\0';
+    cluster_read_t request = {(cluster_read_kind_t)kind, user, other, (int64_t)id, (int)limit};
+    serve_read(peer, seq, &request);
+    return true;
+}
+
+static read_wait_t *find_read_locked(uint64_t seq) {
+    for (read_wait_t *wait = reads; wait; wait = wait->next) {
+        if (wait->seq == seq && !wait->finished) {
+            return wait;
+        }
+    }
+    return NULL;
+}
+
+// Rows for a read that has given up are dropped.
+static bool handle_row(const unsigned char *body, size_t len) {
+    binary_cursor_t cur = {body, body + len};
+    uint64_t seq;
+    if (!binary_next_int(&cur, &seq)) {
+        return false;
+    }
+    pthread_mutex_lock(&request_lock);
+    read_wait_t *wait = find_read_locked(seq);
+    uint32_t row_len = (uint32_t)len;
+    if (wait && buffer_reserve(&wait->rows, sizeof(row_len) + len) == 0) {
+        memcpy(wait->rows.data + wait->rows.len, &row_len, sizeof(row_len));
+        memcpy(wait->rows.data + wait->rows.len + sizeof(row_len), body, len);
+        wait->rows.len += sizeof(row_len) + len;
+    } else if (wait) {
+        wait->finished = true;
+        wait->status = -1;
+        snprintf(wait->error, sizeof(wait->error), "out of memory reading from cluster node %d", wait->node);
+        pthread_cond_broadcast(&request_cond);
+    }
+    pthread_mutex_unlock(&request_lock);
+    return true;
+}
+
+static bool handle_read_done(binary_cursor_t *cur) {
+    uint64_t seq;
+    uint64_t failed;
+    uint64_t partial;
+    const char *text;
+    size_t text_len;
+    if (!binary_next_int(cur, &seq) || !binary_next_int(cur, &failed) || !binary_next_int(cur, &partial) ||
+        !binary_next_text(cur, &text, &text_len)) {
+        return false;
+    }
+    pthread_mutex_lock(&request_lock);
+    read_wait_t *wait = find_read_locked(seq);
+    if (wait) {
+        size_t len = text_len < sizeof(wait->error) ? text_len : sizeof(wait->error) - 1;
+        memcpy(wait->error, text, len);
+        wait->error[len] = '\0';
+        wait->status = failed ? -1 : 0;
+        wait->partial = partial != 0;
+        wait->finished = true;
+        pthread_cond_broadcast(&request_cond);
+    }
+    pthread_mutex_unlock(&request_lock);
+    return true;
+}
+
+static bool handle_advance(binary_cursor_t *cur) {
+    char name[PEER_NAME_MAX];
+    uint64_t count;
+    if (!next_name(cur, name) || !binary_next_int(cur, &count) || count > (uint64_t)(cur->end - cur->p)) {
+        return false;
+    }
+    int64_t *ids = malloc(count ? (size_t)count * sizeof(*ids) : 1);
+    if (!ids) {
+        return true; // the rows come again at the next login
+    }
+    for (uint64_t i = 0; i < count; ++i) {
+        uint64_t id;
+        if (!binary_next_int(cur, &id)) {
+            free(ids);
+            return false;
+        }
+        ids[i] = (int64_t)id;
+    }
+    hooks.advance(name, ids, (size_t)count);
+    free(ids);
+    return true;
+}
+
+// Returns false for a frame that does not parse, which closes the link.
+static bool handle_frame(peer_t *peer, int opcode, const unsigned char *body, size_t len) {
+    binary_cursor_t cur = {body, body + len};
+    char name[PEER_NAME_MAX];
+    uint64_t seq;
+    uint64_t value;
+    switch (opcode) {
+    case PEER_JOIN:
+        if (!next_name(&cur, name)) {
+            return false;
+        }
+        hooks.join(name, peer->index, false);
+        return true;
+    case PEER_LEAVE:
+        if (!next_name(&cur, name)) {
+            return false;
+        }
+        hooks.leave(name, peer->index);
+        return true;
+    case PEER_CLAIM: {
+        if (!binary_next_int(&cur, &seq) || !next_name(&cur, name)) {
+            return false;
+        }
+        bool granted = hooks.join(name, peer->index, true) == 0;
+        binary_field_t fields[] = {BINARY_INT(seq), BINARY_INT(granted ? 1 : 0)};
+        if (queue_frame(peer, PEER_CLAIMED, fields, 2) != 0 && granted) {
+            hooks.leave(name, peer->index); // the asker will time out
+        }
+        return true;
+    }
+    case PEER_CLAIMED:
+        if (!binary_next_int(&cur, &seq) || !binary_next_int(&cur, &value)) {
+            return false;
+        }
+        answer_claim(seq, value ? 1 : 0);
+        return true;
+    case PEER_MESSAGE:
+        return handle_push(peer, &cur);
+    case PEER_STORE:
+        return handle_store(peer, &cur);
+    case PEER_STORED:
+        return handle_stored(&cur);
+    case PEER_DELIVERED:
+        return handle_delivered(peer, &cur);
+    case PEER_READ:
+        return handle_read(peer, &cur);
+    case PEER_ROW:
+        return handle_row(body, len);
+    case PEER_READ_DONE:
+        return handle_read_done(&cur);
+    case PEER_ADVANCE:
+        return handle_advance(&cur);
+    default:
+        return true; // HELLO again, or something newer: skip it
+    }
+}
+
+static void *reader_main(void *arg) {
+    peer_t *peer = (peer_t *)arg;
+    bool open = true;
+    while (open && atomic_load(&running)) {
+        int opcode;
+        const unsigned char *body;
+        size_t len;
+        int rc;
+        while (open && (rc = frame_reader_next(&peer->input, &opcode, &body, &len)) != 0) {
+            open = rc > 0 && handle_frame(peer, opcode, body, len);
+        }
+        if (!open) {
+            break;
+        }
+        int ready = wait_ready(peer->inbound, POLLIN, CLUSTER_TICK_MS);
+        if (ready <= 0) {
+            open = ready == 0 || net_was_interrupted();
+            continue;
+        }
+        ssize_t n = frame_reader_fill(&peer->input, peer->inbound);
+        open = n > 0 || (n < 0 && (net_would_block() || net_was_interrupted()));
+    }
+    pthread_mutex_lock(&peer->lock);
+    peer->inbound_up = false;
+    store_wait_t *failed = NULL;
+    fail_requests_locked(peer->index, &failed);
+    pthread_mutex_unlock(&peer->lock);
+    fail_stores(failed, peer->index);
+    atomic_fetch_add(&peer->link_changes, 1);
+    hooks.drop(peer->index);
+    return NULL;
+}
+
+// Whether the link comes from the configured address of member `node`.
+static bool from_member(socket_handle_t fd, int node) {
+    struct sockaddr_in peer;
+    socklen_t peer_len = sizeof(peer);
+    struct in_addr expected;
+    return getpeername(fd, (struct sockaddr *)&peer, &peer_len) == 0 && peer.sin_family == AF_INET &&
+           inet_pton(AF_INET, members.members[node].host, &expected) == 1 &&
+           peer.sin_addr.s_addr == expected.s_addr;
+}
+
+// Challenges a new inbound link and reads the HELLO it answers with. Returns
+// the peer's index, or -1 for anything that is not a member of this cluster:
+// a wrong version or member list, a bad MAC, or a source address other than
+// that member's. Also -1 when no nonce could be drawn: a predictable one
+// would let a recorded HELLO be replayed.
+static int read_hello(socket_handle_t fd, frame_reader_t *input) {
+    unsigned char nonce[CLUSTER_NONCE_LEN];
+    if (crypto_random(nonce, sizeof(nonce)) != 0) {
+        fprintf(stderr, "No system randomness for a cluster challenge, refusing the link\n");
+        return -1;
+    }
+    binary_field_t challenge = BINARY_TEXT((const char *)nonce, sizeof(nonce));
+    unsigned char frame[BINARY_MAX_HEADER + 1 + CLUSTER_NONCE_LEN];
+    size_t frame_len = binary_encode(frame, (binary_opcode_t)PEER_CHALLENGE, &challenge, 1);
+    binary_cursor_t cur;
+    uint64_t version, count, node;
+    const char *mac;
+    size_t mac_len;
+    if (send_all(fd, frame, frame_len) != 0 || read_handshake(fd, input, PEER_HELLO, &cur) != 0 ||
+        !binary_next_int(&cur, &version) || !binary_next_int(&cur, &count) || !binary_next_int(&cur, &node) ||
+        !next_bytes(&cur, &mac, &mac_len) || version != CLUSTER_PROTOCOL_VERSION ||
+        count != (uint64_t)members.count || node >= count || node == (uint64_t)members.self ||
+        mac_len != CRYPTO_SHA256_LEN) {
+        return -1;
+    }
+    unsigned char expected[CRYPTO_SHA256_LEN];
+    hello_mac(nonce, version, count, node, expected);
+    if (!crypto_equal((const unsigned char *)mac, expected, sizeof(expected)) || !from_member(fd, (int)node)) {
+        return -1;
+    }
+    return (int)node;
+}
+
+// Caller is the acceptor or cluster_shutdown(), with the reader told to stop.
+static void join_reader(peer_t *peer) {
+    if (peer->reader_started) {
+        pthread_join(peer->reader, NULL);
+        peer->reader_started = false;
+        net_close(peer->inbound);
+        peer->inbound = NET_INVALID_SOCKET;
+        frame_reader_free(&peer->input);
+    }
+}
+
+static void *acceptor_main(void *arg) {
+    (void)arg;
+    while (atomic_load(&running)) {
+        if (wait_ready(listener, POLLIN, CLUSTER_TICK_MS) <= 0) {
+            continue;
+        }
+        socket_handle_t fd = listener_accept(listener);
+        if (fd == NET_INVALID_SOCKET) {
+            continue;
+        }
+        frame_reader_t input;
+        frame_reader_init(&input);
+        int node = read_hello(fd, &input);
+        if (node < 0) {
+            frame_reader_free(&input);
+            net_close(fd);
+            continue;
+        }
+        // The peer reconnected: its old link is dead or about to be. Wake
+        // that reader (it drops the node's users on the way out) before the
+        // new one reads the fresh list.
+        peer_t *peer = &peers[node];
+        if (peer->reader_started) {
+            shutdown(peer->inbound, SHUT_RDWR);
+            join_reader(peer);
+        }
+        // Pushes that went missing on the old link are behind this.
+        atomic_fetch_add(&peer->link_changes, 1);
+        peer->inbound = fd;
+        peer->input = input;
+        pthread_mutex_lock(&peer->lock);
+        peer->inbound_up = true;
+        pthread_mutex_unlock(&peer->lock);
+        if (pthread_create(&peer->reader, NULL, reader_main, peer) == 0) {
+            peer->reader_started = true;
+        } else {
+            pthread_mutex_lock(&peer->lock);
+            peer->inbound_up = false;
+            pthread_mutex_unlock(&peer->lock);
+            frame_reader_free(&peer->input);
+            net_close(fd);
+            peer->inbound = NET_INVALID_SOCKET;
+        }
+    }
+    return NULL;
+}
+
+int cluster_init(const cluster_options_t *options, const cluster_hooks_t *cluster_hooks) {
+    if (options->count == 0) {
+        return 0;
+    }
+    if (options->stamp_len > CLUSTER_STAMP_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+    members = *options;
+    hooks = *cluster_hooks;
+    for (int i = 0; i < members.count; ++i) {
+        peer_t *peer = &peers[i];
+        memset(peer, 0, sizeof(*peer));
+        peer->index = i;
+        peer->inbound = NET_INVALID_SOCKET;
+        pthread_mutex_init(&peer->lock, NULL);
+        pthread_cond_init(&peer->wake, NULL);
+        frame_reader_init(&peer->input);
+        if (i != members.self && members.stamp_len > 0 &&
+            !(peer->stamps = calloc((size_t)CLUSTER_PUSH_RING * members.stamp_len, sizeof(uint64_t)))) {
+            members.count = i + 1; // what cluster_shutdown() tears down
+            atomic_store(&enabled, true);
+            cluster_shutdown();
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+    atomic_store(&enabled, true);
+    atomic_store(&running, true);
+    listener = listener_open(members.members[members.self].port, CLUSTER_BACKLOG, false, true);
+    if (listener == NET_INVALID_SOCKET) {
+        int err = errno;
+        cluster_shutdown();
+        errno = err;
+        return -1;
+    }
+    acceptor_started = pthread_create(&acceptor, NULL, acceptor_main, NULL) == 0;
+    bool ok = acceptor_started;
+    for (int i = 0; ok && i < members.count; ++i) {
+        if (i != members.self) {
+            ok = peers[i].writer_started = pthread_create(&peers[i].writer, NULL, writer_main, &peers[i]) == 0;
+        }
+    }
+    if (!ok) {
+        cluster_shutdown();
+        errno = EAGAIN;
+        return -1;
+    }
+    return 0;
+}
+
+void cluster_shutdown(void) {
+    if (!atomic_load(&enabled)) {
+        return;
+    }
+    atomic_store(&running, false);
+    if (acceptor_started) {
+        pthread_join(acceptor, NULL);
+        acceptor_started = false;
+    }
+    for (int i = 0; i < members.count; ++i) {
+        peer_t *peer = &peers[i];
+        pthread_mutex_lock(&peer->lock);
+        pthread_cond_broadcast(&peer->wake);
+        pthread_mutex_unlock(&peer->lock);
+        if (peer->writer_started) {
+            pthread_join(peer->writer, NULL);
+            peer->writer_started = false;
+        }
+        join_reader(peer);
+        // The lock outlives the links: a session still draining may queue
+        // a LEAVE, which is refused now that nothing is connected.
+        pthread_mutex_lock(&peer->lock);
+        free(peer->queued.data);
+        peer->queued = (peer_buffer_t){NULL, 0, 0};
+        peer->inbound_up = false;
+        store_wait_t *failed = NULL;
+        fail_requests_locked(i, &failed);
+        free(peer->stamps);
+        peer->stamps = NULL;
+        pthread_mutex_unlock(&peer->lock);
+        fail_stores(failed, i);
+        free(peer->scratch);
+        peer->scratch = NULL;
+        free(peer->reply.data);
+        peer->reply = (peer_buffer_t){NULL, 0, 0};
+    }
+    if (listener != NET_INVALID_SOCKET) {
+        net_close(listener);
+        listener = NET_INVALID_SOCKET;
+    }
+    atomic_store(&enabled, false);
+}
+
+bool cluster_enabled(void) {
+    return atomic_load(&enabled);
+}
+
+size_t cluster_connected_peers(void) {
+    size_t connected = 0;
+    for (int i = 0; atomic_load(&enabled) && i < members.count; ++i) {
+        if (i != members.self) {
+            pthread_mutex_lock(&peers[i].lock);
+            connected += peers[i].connected ? 1 : 0;
+            pthread_mutex_unlock(&peers[i].lock);
+        }
+    }
+    return connected;
+}
+
+cluster_claim_t cluster_claim(const char *name) {
+    int home = home_node(name);
+    if (home == members.self) {
+        return CLUSTER_HOME;
+    }
+    claim_wait_t wait = {NULL, 0, -1};
+    pthread_mutex_lock(&claim_lock);
+    wait.seq = ++claim_seq;
+    wait.next = claims;
+    claims = &wait;
+    pthread_mutex_unlock(&claim_lock);
+
+    binary_field_t fields[] = {BINARY_INT(wait.seq), BINARY_TEXT(name, strlen(name))};
+    bool sent = queue_frame(&peers[home], PEER_CLAIM, fields, 2) == 0;
+    struct timespec deadline;
+    deadline_after_ms(&deadline, CLUSTER_CLAIM_TIMEOUT_MS);
+    pthread_mutex_lock(&claim_lock);
+    while (sent && wait.result < 0 && pthread_cond_timedwait(&claim_cond, &claim_lock, &deadline) != ETIMEDOUT) {
+    }
+    claim_wait_t **link = &claims;
+    while (*link != &wait) {
+        link = &(*link)->next;
+    }
+    *link = wait.next;
+    pthread_mutex_unlock(&claim_lock);
+
+    if (wait.result < 0) {
+        if (sent) {
+            // Queued behind the claim, so a grant that arrives late is
+            // released rather than pinning the name.
+            queue_frame(&peers[home], PEER_LEAVE, &fields[1], 1);
+        }
+        return CLUSTER_UNAVAILABLE;
+    }
+    return wait.result ? CLUSTER_GRANTED : CLUSTER_TAKEN;
+}
+
+void cluster_announce(const char *name, bool joined) {
+    binary_field_t field = BINARY_TEXT(name, strlen(name));
+    for (int i = 0; atomic_load(&enabled) && i < members.count; ++i) {
+        if (i != members.self) {
+            queue_frame(&peers[i], joined ? PEER_JOIN : PEER_LEAVE, &field, 1);
+        }
+    }
+}
+
+static bool valid_peer(int node) {
+    return atomic_load(&enabled) && node >= 0 && node < members.count && node != members.self;
+}
+
+uint64_t cluster_push_losses(int node, const char *name) {
+    if (!valid_peer(node)) {
+        return 0;
+    }
+    peer_t *peer = &peers[node];
+    uint64_t losses = atomic_load(&peer->link_changes);
+    if (name) {
+        losses += atomic_load(&peer->misses[fnv1a(2166136261u, name) % CLUSTER_MISS_SLOTS]);
+    }
+    return losses;
+}
+
+int cluster_store(int node, const char *sender, const char *const *receivers, size_t count, const char *body,
+                  cluster_store_callback done, void *ctx) {
+    if (!valid_peer(node) || count == 0) {
+        return -1;
+    }
+    binary_field_t *fields = malloc((count + 4) * sizeof(*fields));
+    store_wait_t *wait = done ? malloc(sizeof(*wait)) : NULL;
+    if (!fields || (done && !wait)) {
+        free(fields);
+        free(wait);
+        return -1;
+    }
+    peer_t *peer = &peers[node];
+    pthread_mutex_lock(&peer->lock);
+    uint64_t seq = 0;
+    if (wait) {
+        pthread_mutex_lock(&request_lock);
+        seq = ++request_seq;
+        pthread_mutex_unlock(&request_lock);
+    }
+    fields[0] = BINARY_INT(seq);
+    fields[1] = BINARY_TEXT(sender, strlen(sender));
+    fields[2] = BINARY_INT(count);
+    for (size_t i = 0; i < count; ++i) {
+        fields[3 + i] = BINARY_TEXT(receivers[i], strlen(receivers[i]));
+    }
+    fields[3 + count] = BINARY_TEXT(body, strlen(body));
+    int rc = -1;
+    if ((!wait || peer->inbound_up) && binary_body_size(fields, count + 4) <= BINARY_MAX_FRAME) {
+        rc = append_locked(peer, PEER_STORE, fields, count + 4);
+    }
+    if (rc == 0) {
+        pthread_cond_signal(&peer->wake);
+        if (wait) {
+            *wait = (store_wait_t){NULL, seq, node, done, ctx};
+            pthread_mutex_lock(&request_lock);
+            wait->next = stores;
+            stores = wait;
+            pthread_mutex_unlock(&request_lock);
+        }
+    }
+    pthread_mutex_unlock(&peer->lock);
+    if (rc != 0) {
+        free(wait);
+    }
+    free(fields);
+    return rc;
+}
+
+void cluster_stored(int node, uint64_t seq, int status, const char *error) {
+    if (seq == 0 || !valid_peer(node)) {
+        return;
+    }
+    error = status == 0 || !error ? "" : error;
+    binary_field_t fields[] = {BINARY_INT(seq), BINARY_INT(status == 0 ? 0 : 1), BINARY_TEXT(error, strlen(error))};
+    queue_frame(&peers[node], PEER_STORED, fields, 3);
+}
+
+int cluster_push(int node, const char *sender, const char *receiver, const char *body, const uint64_t *stamp) {
+    if (!valid_peer(node)) {
+        return -1;
+    }
+    peer_t *peer = &peers[node];
+    pthread_mutex_lock(&peer->lock);
+    uint64_t seq = peer->push_seq + 1;
+    binary_field_t fields[] = {BINARY_INT(seq), BINARY_TEXT(sender, strlen(sender)),
+                               BINARY_TEXT(receiver, strlen(receiver)), BINARY_TEXT(body, strlen(body))};
+    int rc;
+    if (binary_body_size(fields, 4) > BINARY_MAX_FRAME) {
+        rc = -1;
+        if (peer->connected) {
+            peer->connected = false; // as for a full queue: the push is lost
+            pthread_cond_signal(&peer->wake);
+        }
+    } else {
+        rc = append_locked(peer, PEER_MESSAGE, fields, 4);
+    }
+    if (rc == 0) {
+        peer->push_seq = seq;
+        if (peer->stamps) {
+            memcpy(peer->stamps + (seq % CLUSTER_PUSH_RING) * members.stamp_len, stamp,
+                   members.stamp_len * sizeof(uint64_t));
+        }
+        pthread_cond_signal(&peer->wake);
+    }
+    pthread_mutex_unlock(&peer->lock);
+    return rc;
+}
+
+void cluster_delivered(int node, const char *name, uint64_t seq) {
+    if (!valid_peer(node) || seq == 0) {
+        return;
+    }
+    binary_field_t fields[] = {BINARY_TEXT(name, strlen(name)), BINARY_INT(seq)};
+    queue_frame(&peers[node], PEER_DELIVERED, fields, 2);
+}
+
+// Each buffered ROW body: seq, id, timestamp, sender, body.
+static int emit_rows(const peer_buffer_t *rows, cluster_row_callback emit, void *ctx) {
+    char *text = NULL;
+    size_t capacity = 0;
+    for (size_t at = 0; at < rows->len;) {
+        uint32_t len;
+        memcpy(&len, rows->data + at, sizeof(len));
+        binary_cursor_t cur = {rows->data + at + sizeof(len), rows->data + at + sizeof(len) + len};
+        at += sizeof(len) + len;
+        uint64_t seq;
+        uint64_t id;
+        const char *fields[3];
+        size_t lengths[3];
+        if (!binary_next_int(&cur, &seq) || !binary_next_int(&cur, &id) ||
+            !binary_next_text(&cur, &fields[0], &lengths[0]) || !binary_next_text(&cur, &fields[1], &lengths[1]) ||
+            !binary_next_text(&cur, &fields[2], &lengths[2])) {
+            free(text);
+            return -1;
+        }
+        size_t need = lengths[0] + lengths[1] + lengths[2] + 3;
+        if (need > capacity) {
+            char *grown = realloc(text, need);
+            if (!grown) {
+                free(text);
+                return -1;
+            }
+            text = grown;
+            capacity = need;
+        }
+        char *out[3];
+        for (size_t i = 0, used = 0; i < 3; ++i) {
+            out[i] = text + used;
+            memcpy(out[i], fields[i], lengths[i]);
+            out[i][lengths[i]] = '\0';
+            used += lengths[i] + 1;
+        }
+        emit((int64_t)id, out[0], out[1], out[2], ctx);
+    }
+    free(text);
+    return 0;
+}
+
+int cluster_read(int node, const cluster_read_t *request, cluster_row_callback emit, void *ctx, bool *partial,
+                 char *error, size_t error_len) {
+    *partial = false;
+    if (!valid_peer(node)) {
+        snprintf(error, error_len, "no cluster node %d", node);
+        return -1;
+    }
+    read_wait_t wait;
+    memset(&wait, 0, sizeof(wait));
+    wait.node = node;
+    peer_t *peer = &peers[node];
+    pthread_mutex_lock(&peer->lock);
+    pthread_mutex_lock(&request_lock);
+    wait.seq = ++request_seq;
+    pthread_mutex_unlock(&request_lock);
+    binary_field_t fields[] = {BINARY_INT(wait.seq),
+                               BINARY_INT(request->kind),
+                               BINARY_TEXT(request->user, strlen(request->user)),
+                               BINARY_TEXT(request->other, strlen(request->other)),
+                               BINARY_INT(request->id > 0 ? (uint64_t)request->id : 0),
+                               BINARY_INT(request->limit > 0 ? (uint64_t)request->limit : 0)};
+    bool sent = peer->inbound_up && append_locked(peer, PEER_READ, fields, 6) == 0;
+    if (sent) {
+        pthread_cond_signal(&peer->wake);
+        pthread_mutex_lock(&request_lock);
+        wait.next = reads;
+        reads = &wait;
+        pthread_mutex_unlock(&request_lock);
+    }
+    pthread_mutex_unlock(&peer->lock);
+    if (!sent) {
+        snprintf(error, error_len, "cluster node %d is unavailable", node);
+        return -1;
+    }
+
+    struct timespec deadline;
+    deadline_after_ms(&deadline, CLUSTER_READ_TIMEOUT_MS);
+    pthread_mutex_lock(&request_lock);
+    while (!wait.finished && pthread_cond_timedwait(&request_cond, &request_lock, &deadline) != ETIMEDOUT) {
+    }
+    read_wait_t **link = &reads;
+    while (*link != &wait) {
+        link = &(*link)->next;
+    }
+    *link = wait.next;
+    pthread_mutex_unlock(&request_lock);
+
+    int rc = -1;
+    if (!wait.finished) {
+        snprintf(error, error_len, "cluster node %d did not answer in time", node);
+    } else if (wait.status != 0) {
+        snprintf(error, error_len, "%s", wait.error);
+    } else if (emit_rows(&wait.rows, emit, ctx) != 0) {
+        snprintf(error, error_len, "bad reply from cluster node %d", node);
+    } else {
+        *partial = wait.partial;
+        rc = 0;
+    }
+    free(wait.rows.data);
+    return rc;
+}
+
+void cluster_advance(int node, const char *name, const int64_t *ids, size_t count) {
+    if (!valid_peer(node) || count == 0) {
+        return;
+    }
+    binary_field_t *fields = malloc((count + 2) * sizeof(*fields));
+    if (!fields) {
+        return; // the rows come again at the next login
+    }
+    fields[0] = BINARY_TEXT(name, strlen(name));
+    fields[1] = BINARY_INT(count);
+    for (size_t i = 0; i < count; ++i) {
+        fields[2 + i] = BINARY_INT(ids[i]);
+    }
+    queue_frame(&peers[node], PEER_ADVANCE, fields, count + 2);
+    free(fields);
+}
@@ -0,0 +1,163 @@
+#ifndef CLUSTER_H
+#define CLUSTER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Several servers behind one load balancer, acting as one chat service. Every
+// node is started with the same member list and its own index in it, and
+// keeps one persistent connection to each peer for what it sends them
+// (accepting theirs for what they send back), with frames pipelined through a
+// per-peer queue:
+//
+//   - each node reports its own users joining and leaving to every peer, so
+//     every node's presence directory knows where everyone is connected;
+//   - a username's home node (a rendezvous hash of the name over the
+//     members) arbitrates AUTH for that name, which keeps names unique
+//     cluster-wide without a central coordinator;
+//   - every node has its own storage, and a conversation lives on its owner
+//     node (the same hash over the pair of names). A SEND is relayed to the
+//     owner, which stores it and pushes it to the receiver wherever they are
+//     connected; GET, SYNC, DELETE and the inbox are read from the owner.
+//
+// A peer whose link drops is taken to be gone together with its users; when
+// it reconnects it reports them again. Names whose home node is unreachable
+// cannot log in until it is back, and conversations whose owner is
+// unreachable can neither be written nor read.
+//
+// Pushes carry a per-link sequence number, and the owner keeps the delivery
+// mark each was sent under. A logout reports the last push written to the
+// user's socket, and only that mark moves the user's cursor on the owner, so
+// a push lost on the way is found in the inbox at the next login.
+//
+// A link is only accepted from the address of the member it claims to be,
+// and only once the dialing node has answered a fresh challenge with an
+// HMAC-SHA-256 keyed by the shared secret.
+#define CLUSTER_MAX_NODES 16
+#define CLUSTER_HOST_MAX 64
+#define CLUSTER_SECRET_MAX 256
+#define CLUSTER_STAMP_MAX 64 /* values per push stamp, as STORAGE_MAX_SHARDS */
+
+typedef struct {
+    char host[CLUSTER_HOST_MAX];
+    uint16_t port;
+} cluster_member_t;
+
+typedef struct {
+    cluster_member_t members[CLUSTER_MAX_NODES];
+    int count; // 0 = standalone
+    int self;  // this node's index in members
+    // Shared by all members; NUL-terminated, required when count > 0.
+    char secret[CLUSTER_SECRET_MAX + 1];
+    // Values in the stamp kept for each push (the storage delivery mark).
+    size_t stamp_len;
+} cluster_options_t;
+
+// Reads served by a conversation's owner node for a user of another node.
+typedef enum {
+    CLUSTER_READ_HISTORY = 1, // GET: `limit` newest below `id` (0, 0 = all)
+    CLUSTER_READ_SINCE = 2,   // SYNC: `limit` oldest above `id`
+    CLUSTER_READ_INBOX = 3,   // `limit` oldest inbox rows, cursor left alone
+    CLUSTER_READ_DELETE = 4,  // DELETE: no rows
+} cluster_read_kind_t;
+
+typedef struct {
+    cluster_read_kind_t kind;
+    const char *user;  // who reads
+    const char *other; // the other side of the conversation; "" for the inbox
+    int64_t id;
+    int limit;
+} cluster_read_t;
+
+// As storage's history_callback.
+typedef void (*cluster_row_callback)(int64_t id, const char *timestamp, const char *sender, const char *body,
+                                     void *ctx);
+// Completion of cluster_store(): 0, or -1 with the reason in `error`.
+typedef void (*cluster_store_callback)(int status, const char *error, void *ctx);
+
+// Called on the peer's reader thread.
+typedef struct {
+    // A message `node` stores, pushed for a user connected here as push `seq`
+    // of that link. Returns false when no session took it.
+    bool (*deliver)(int node, uint64_t seq, const char *sender, const char *receiver, const char *body);
+    // A SEND or GROUP from a user of `node` to receivers whose conversations
+    // with the sender live here. Unless `seq` is 0 the result must be passed
+    // to cluster_stored(node, seq, ...), from any thread.
+    void (*store)(int node, uint64_t seq, const char *sender, const char *const *receivers, size_t count,
+                  const char *body);
+    // A read for a user of another node. Returns 0, or -1 with the reason in
+    // `error`.
+    int (*read)(const cluster_read_t *request, cluster_row_callback emit, void *ctx, char *error, size_t error_len);
+    // The user of another node was delivered these inbox rows.
+    void (*advance)(const char *name, const int64_t *ids, size_t count);
+    // `name` logged out of another node after every push up to the one sent
+    // under `stamp` was written to its socket.
+    void (*delivered)(const char *name, const uint64_t *stamp);
+    // Presence reports from `node`, for presence_join_remote() and friends;
+    // `exclusive` marks a claim this node arbitrates. join returns 0 or -1.
+    int (*join)(const char *name, int node, bool exclusive);
+    void (*leave)(const char *name, int node);
+    // The link from `node` went down: forget all of its users.
+    void (*drop)(int node);
+} cluster_hooks_t;
+
+typedef enum {
+    CLUSTER_UNAVAILABLE = -1, // the home node could not be asked
+    CLUSTER_TAKEN = 0,        // the home node has the name online
+    CLUSTER_HOME = 1,         // this node is the home node: decide locally
+    CLUSTER_GRANTED = 2,      // the home node reserved the name for this node
+} cluster_claim_t;
+
+// Parses "ip:port,ip:port,..." (IPv4 addresses, as everywhere else) into
+// options->members. Returns 0 or -1.
+int cluster_parse_members(const char *list, cluster_options_t *options);
+
+// Listens on the port of this node's member entry and starts connecting to
+// the peers. Returns 0, also when options->count is 0 and there is nothing
+// to do, or -1 with errno set.
+int cluster_init(const cluster_options_t *options, const cluster_hooks_t *hooks);
+void cluster_shutdown(void);
+bool cluster_enabled(void);
+// Peers this node currently has an outgoing link to.
+size_t cluster_connected_peers(void);
+
+// Asks the home node of `name` whether it may log in here; blocks for at most
+// a couple of seconds. A granted name must be announced or released.
+cluster_claim_t cluster_claim(const char *name);
+// Tells every peer that the local user `name` joined or left; a leave also
+// releases the name at its home node.
+void cluster_announce(const char *name, bool joined);
+// The node that stores the conversation between `user_a` and `user_b`.
+int cluster_owner(const char *user_a, const char *user_b);
+// Counts what may have cost this node a push from `node`: its link opening
+// or closing, or a push for `name` finding no session (name NULL: only the
+// link). A session that reads the same value at logout as at login was
+// written every push it was sent.
+uint64_t cluster_push_losses(int node, const char *name);
+
+// Asks `node`, the owner, to store and push a message. `done` runs once the
+// owner committed it or failed, or the link to it was lost, on a cluster
+// thread; with `done` NULL nothing is reported. Returns -1 (and never calls
+// `done`) when the message cannot be queued for the owner.
+int cluster_store(int node, const char *sender, const char *const *receivers, size_t count, const char *body,
+                  cluster_store_callback done, void *ctx);
+// Reports the outcome of a store hook call.
+void cluster_stored(int node, uint64_t seq, int status, const char *error);
+// Queues the live push of a message this node stores for `receiver`,
+// connected at `node`, keeping `stamp` (stamp_len values) for the delivered
+// hook. Returns -1 when the link is down; a push refused on a link that is
+// up resets it, so that `node` learns pushes were lost.
+int cluster_push(int node, const char *sender, const char *receiver, const char *body, const uint64_t *stamp);
+// Tells `node` that push `seq` was the last one it sent `name`, now logging
+// out, and everything up to it was written to the socket.
+void cluster_delivered(int node, const char *name, uint64_t seq);
+// Runs `request` on `node`, passing the rows to `emit` on the calling thread;
+// blocks for at most a few seconds. `*partial` is set when an inbox page was
+// cut short to fit the link. Returns 0, or -1 with the reason in `error`.
+int cluster_read(int node, const cluster_read_t *request, cluster_row_callback emit, void *ctx, bool *partial,
+                 char *error, size_t error_len);
+// Moves `name`'s inbox cursors on `node` past rows a cluster_read() returned.
+void cluster_advance(int node, const char *name, const int64_t *ids, size_t count);
+
+#endif /* CLUSTER_H */
@@ -0,0 +1,193 @@
+#define _POSIX_C_SOURCE 200809L
+#ifdef _WIN32
+#define _CRT_RAND_S /* rand_s() */
+#endif
+#include "crypto.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__linux__)
+#include <errno.h>
+#include <sys/random.h>
+#endif
+
+#define SHA256_BLOCK 64
+
+typedef struct {
+    uint32_t state[8];
+    uint64_t bytes;
+    unsigned char block[SHA256_BLOCK];
+    size_t used;
+} sha256_t;
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98u, 0x71374491u, 0xb5c0fbcfu, 0xe9b5dba5u, 0x3956c25bu, 0x59f111f1u, 0x923f82a4u, 0xab1c5ed5u,
+    0xd807aa98u, 0x12835b01u, 0x243185beu, 0x550c7dc3u, 0x72be5d74u, 0x80deb1feu, 0x9bdc06a7u, 0xc19bf174u,
+    0xe49b69c1u, 0xefbe4786u, 0x0fc19dc6u, 0x240ca1ccu, 0x2de92c6fu, 0x4a7484aau, 0x5cb0a9dcu, 0x76f988dau,
+    0x983e5152u, 0xa831c66du, 0xb00327c8u, 0xbf597fc7u, 0xc6e00bf3u, 0xd5a79147u, 0x06ca6351u, 0x14292967u,
+    0x27b70a85u, 0x2e1b2138u, 0x4d2c6dfcu, 0x53380d13u, 0x650a7354u, 0x766a0abbu, 0x81c2c92eu, 0x92722c85u,
+    0xa2bfe8a1u, 0xa81a664bu, 0xc24b8b70u, 0xc76c51a3u, 0xd192e819u, 0xd6990624u, 0xf40e3585u, 0x106aa070u,
+    0x19a4c116u, 0x1e376c08u, 0x2748774cu, 0x34b0bcb5u, 0x391c0cb3u, 0x4ed8aa4au, 0x5b9cca4fu, 0x682e6ff3u,
+    0x748f82eeu, 0x78a5636fu, 0x84c87814u, 0x8cc70208u, 0x90befffau, 0xa4506cebu, 0xbef9a3f7u, 0xc67178f2u,
+};
+
+#if !defined(_WIN32) && !defined(__linux__)
+static pthread_mutex_t random_lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *urandom = NULL; // guarded by random_lock
+#endif
+
+static uint32_t rotr(uint32_t x, int n) {
+    return (x >> n) | (x << (32 - n));
+}
+
+static void sha256_compress(sha256_t *ctx, const unsigned char *p) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; ++i) {
+        w[i] = (uint32_t)p[4 * i] << 24 | (uint32_t)p[4 * i + 1] << 16 | (uint32_t)p[4 * i + 2] << 8 | p[4 * i + 3];
+    }
+    for (int i = 16; i < 64; ++i) {
+        uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    uint32_t s[8];
+    memcpy(s, ctx->state, sizeof(s));
+    for (int i = 0; i < 64; ++i) {
+        uint32_t t1 = s[7] + (rotr(s[4], 6) ^ rotr(s[4], 11) ^ rotr(s[4], 25)) + ((s[4] & s[5]) ^ (~s[4] & s[6])) +
+                      sha256_k[i] + w[i];
+        uint32_t t2 = (rotr(s[0], 2) ^ rotr(s[0], 13) ^ rotr(s[0], 22)) +
+                      ((s[0] & s[1]) ^ (s[0] & s[2]) ^ (s[1] & s[2]));
+        memmove(s + 1, s, 7 * sizeof(s[0]));
+        s[4] += t1;
+        s[0] = t1 + t2;
+    }
+    for (int i = 0; i < 8; ++i) {
+        ctx->state[i] += s[i];
+    }
+}
+
+static void sha256_init(sha256_t *ctx) {
+    static const uint32_t initial[8] = {0x6a09e667u, 0xbb67ae85u, 0x3c6ef372u, 0xa54ff53au,
+                                        0x510e527fu, 0x9b05688cu, 0x1f83d9abu, 0x5be0cd19u};
+    memcpy(ctx->state, initial, sizeof(initial));
+    ctx->bytes = 0;
+    ctx->used = 0;
+}
+
+static void sha256_update(sha256_t *ctx, const void *data, size_t len) {
+    const unsigned char *p = (const unsigned char *)data;
+    ctx->bytes += len;
+    while (len > 0) {
+        size_t take = SHA256_BLOCK - ctx->used < len ? SHA256_BLOCK - ctx->used : len;
+        memcpy(ctx->block + ctx->used, p, take);
+        ctx->used += take;
+        p += take;
+        len -= take;
+        if (ctx->used == SHA256_BLOCK) {
+            sha256_compress(ctx, ctx->block);
+            ctx->used = 0;
+        }
+    }
+}
+
+static void sha256_final(sha256_t *ctx, unsigned char out[CRYPTO_SHA256_LEN]) {
+    uint64_t bits = ctx->bytes * 8;
+    unsigned char pad[SHA256_BLOCK + 8] = {0x80};
+    size_t pad_len = (ctx->used < 56 ? 56 : 120) - ctx->used;
+    for (int i = 0; i < 8; ++i) {
+        pad[pad_len + (size_t)i] = (unsigned char)(bits >> (56 - 8 * i));
+    }
+    sha256_update(ctx, pad, pad_len + 8);
+    for (int i = 0; i < 8; ++i) {
+        out[4 * i] = (unsigned char)(ctx->state[i] >> 24);
+        out[4 * i + 1] = (unsigned char)(ctx->state[i] >> 16);
+        out[4 * i + 2] = (unsigned char)(ctx->state[i] >> 8);
+        out[4 * i + 3] = (unsigned char)ctx->state[i];
+    }
+}
+
+void crypto_hmac_sha256(const void *key, size_t key_len, const void *data, size_t len,
+                        unsigned char out[CRYPTO_SHA256_LEN]) {
+    unsigned char block[SHA256_BLOCK] = {0};
+    sha256_t ctx;
+    if (key_len > SHA256_BLOCK) {
+        sha256_init(&ctx);
+        sha256_update(&ctx, key, key_len);
+        sha256_final(&ctx, block);
+    } else if (key_len > 0) {
+        memcpy(block, key, key_len);
+    }
+    unsigned char pad[SHA256_BLOCK];
+    for (int i = 0; i < SHA256_BLOCK; ++i) {
+        pad[i] = block[i] ^ 0x36;
+    }
+    sha256_init(&ctx);
+    sha256_update(&ctx, pad, sizeof(pad));
+    sha256_update(&ctx, data, len);
+    unsigned char inner[CRYPTO_SHA256_LEN];
+    sha256_final(&ctx, inner);
+    for (int i = 0; i < SHA256_BLOCK; ++i) {
+        pad[i] = block[i] ^ 0x5c;
+    }
+    sha256_init(&ctx);
+    sha256_update(&ctx, pad, sizeof(pad));
+    sha256_update(&ctx, inner, sizeof(inner));
+    sha256_final(&ctx, out);
+}
+
+bool crypto_equal(const unsigned char *a, const unsigned char *b, size_t len) {
+    unsigned char diff = 0;
+    for (size_t i = 0; i < len; ++i) {
+        diff |= a[i] ^ b[i];
+    }
+    return diff == 0;
+}
+
+int crypto_random(unsigned char *out, size_t len) {
+#if defined(_WIN32)
+    for (size_t i = 0; i < len; ++i) {
+        unsigned int value;
+        if (rand_s(&value) != 0) {
+            return -1;
+        }
+        out[i] = (unsigned char)value;
+    }
+    return 0;
+#elif defined(__linux__)
+    while (len > 0) {
+        ssize_t n = getrandom(out, len, 0);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        out += n;
+        len -= (size_t)n;
+    }
+    return 0;
+#else
+    pthread_mutex_lock(&random_lock);
+    if (!urandom) {
+        urandom = fopen("/dev/urandom", "rb");
+    }
+    int rc = (urandom && fread(out, 1, len, urandom) == len) ? 0 : -1;
+    pthread_mutex_unlock(&random_lock);
+    return rc;
+#endif
+}
+
+void crypto_shutdown(void) {
+#if !defined(_WIN32) && !defined(__linux__)
+    pthread_mutex_lock(&random_lock);
+    if (urandom) {
+        fclose(urandom);
+        urandom = NULL;
+    }
+    pthread_mutex_unlock(&random_lock);
+#endif
+}
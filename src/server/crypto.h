@@ -0,0 +1,26 @@
+#ifndef CRYPTO_H
+#define CRYPTO_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// The little cryptography the server needs, without a library for it:
+// unpredictable bytes for session tokens and handshake nonces, and
+// HMAC-SHA-256 for the cluster handshake. All functions are thread-safe.
+#define CRYPTO_SHA256_LEN 32
+
+// Fills `out` from the system source: getrandom() on Linux, rand_s on
+// Windows, /dev/urandom elsewhere. Returns 0, or -1 if that source failed;
+// there is no weaker fallback, so callers must not use `out` then.
+int crypto_random(unsigned char *out, size_t len);
+
+void crypto_hmac_sha256(const void *key, size_t key_len, const void *data, size_t len,
+                        unsigned char out[CRYPTO_SHA256_LEN]);
+
+// Compares in time that depends only on `len`, for MACs.
+bool crypto_equal(const unsigned char *a, const unsigned char *b, size_t len);
+
+// Closes the system source; crypto_random() reopens it if called again.
+void crypto_shutdown(void);
+
+#endif /* CRYPTO_H */
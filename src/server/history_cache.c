@@ -0,0 +1,587 @@
+#include "history_cache.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define INITIAL_BUCKETS 64u
+#define GENERATION_STRIPES 64u
+
+// Immutable once built. A group message is one row shared by the rings of
+// all its conversations, and fetch lends rows to the caller by reference, so
+// the text is copied once when it enters the cache and never again.
+typedef struct {
+    atomic_size_t refs; // rings holding the row plus fetches still emitting it
+    size_t rings;       // under cache_lock; the row counts once in total_bytes
+    int64_t id;
+    size_t size;
+    char *timestamp;
+    char *sender;
+    char *body;
+    char text[];
+} cached_row_t;
+
+typedef struct cache_entry {
+    struct cache_entry *next;     // hash chain
+    struct cache_entry *lru_prev; // towards most recently used
+    struct cache_entry *lru_next;
+    uint32_t hash;
+    char *key;
+    cached_row_t **rows; // ring of `per_conversation` slots
+    size_t head;         // slot of the oldest row
+    size_t count;
+    bool complete;
+} cache_entry_t;
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t per_conversation = 0;
+static size_t budget = 0;
+static cache_entry_t **buckets = NULL;
+static size_t bucket_count = 0;
+static size_t entry_count = 0;
+static size_t total_bytes = 0;
+static cache_entry_t *lru_head = NULL; // most recently used
+static cache_entry_t *lru_tail = NULL;
+static uint64_t hits = 0;
+static uint64_t misses = 0;
+// Bumped whenever a conversation hashing to the stripe changes, so a fill can
+// tell that a write landed while its backend read was running.
+static uint64_t generations[GENERATION_STRIPES];
+// Per storage shard, which a row's id names (id % floor_stride): rows at or
+// below their shard's floor are skipped and count as absent.
+static int64_t floor_ids[STORAGE_MAX_SHARDS];
+static size_t floor_stride = 1;
+
+static char *make_key(const char *user_a, const char *user_b) {
+    if (strcmp(user_a, user_b) > 0) {
+        const char *tmp = user_a;
+        user_a = user_b;
+        user_b = tmp;
+    }
+    size_t a_len = strlen(user_a);
+    size_t b_len = strlen(user_b);
+    char *key = malloc(a_len + b_len + 2);
+    if (key) {
+        memcpy(key, user_a, a_len);
+        key[a_len] = '\n';
+        memcpy(key + a_len + 1, user_b, b_len + 1);
+    }
+    return key;
+}
+
+static uint32_t hash_key(const char *key) {
+    uint32_t hash = 2166136261u; // FNV-1a
+    for (const unsigned char *p = (const unsigned char *)key; *p; ++p) {
+        hash ^= *p;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static void bump_all_generations(void) {
+    for (size_t i = 0; i < GENERATION_STRIPES; ++i) {
+        ++generations[i];
+    }
+}
+
+static cache_entry_t *find_entry(const char *key, uint32_t hash) {
+    if (bucket_count == 0) {
+        return NULL;
+    }
+    for (cache_entry_t *entry = buckets[hash & (bucket_count - 1)]; entry; entry = entry->next) {
+        if (entry->hash == hash && strcmp(entry->key, key) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+static void lru_unlink(cache_entry_t *entry) {
+    if (entry->lru_prev) {
+        entry->lru_prev->lru_next = entry->lru_next;
+    } else {
+        lru_head = entry->lru_next;
+    }
+    if (entry->lru_next) {
+        entry->lru_next->lru_prev = entry->lru_prev;
+    } else {
+        lru_tail = entry->lru_prev;
+    }
+    entry->lru_prev = entry->lru_next = NULL;
+}
+
+static void lru_touch(cache_entry_t *entry) {
+    if (lru_head == entry) {
+        return;
+    }
+    if (entry->lru_prev || entry->lru_next || lru_tail == entry) {
+        lru_unlink(entry);
+    }
+    entry->lru_next = lru_head;
+    if (lru_head) {
+        lru_head->lru_prev = entry;
+    }
+    lru_head = entry;
+    if (!lru_tail) {
+        lru_tail = entry;
+    }
+}
+
+static cached_row_t *row_at(const cache_entry_t *entry, size_t i) {
+    return entry->rows[(entry->head + i) % per_conversation];
+}
+
+static void release_row(cached_row_t *row) {
+    if (atomic_fetch_sub(&row->refs, 1) == 1) {
+        free(row);
+    }
+}
+
+// Caller holds cache_lock.
+static void link_row(cached_row_t *row) {
+    if (row->rings++ == 0) {
+        total_bytes += row->size;
+    }
+    atomic_fetch_add(&row->refs, 1);
+}
+
+// Caller holds cache_lock.
+static void unlink_row(cached_row_t *row) {
+    if (--row->rings == 0) {
+        total_bytes -= row->size;
+    }
+    release_row(row);
+}
+
+static void drop_rows(cache_entry_t *entry) {
+    for (size_t i = 0; i < entry->count; ++i) {
+        unlink_row(row_at(entry, i));
+    }
+    entry->head = 0;
+    entry->count = 0;
+}
+
+static void remove_entry(cache_entry_t *entry) {
+    cache_entry_t **cur = &buckets[entry->hash & (bucket_count - 1)];
+    while (*cur != entry) {
+        cur = &(*cur)->next;
+    }
+    *cur = entry->next;
+    lru_unlink(entry);
+    drop_rows(entry);
+    free(entry->rows);
+    free(entry->key);
+    free(entry);
+    --entry_count;
+}
+
+static int grow_buckets(void) {
+    size_t new_count = bucket_count ? bucket_count * 2 : INITIAL_BUCKETS;
+    cache_entry_t **fresh = calloc(new_count, sizeof(cache_entry_t *));
+    if (!fresh) {
+        return -1;
+    }
+    for (size_t i = 0; i < bucket_count; ++i) {
+        cache_entry_t *entry = buckets[i];
+        while (entry) {
+            cache_entry_t *next = entry->next;
+            size_t b = entry->hash & (new_count - 1);
+            entry->next = fresh[b];
+            fresh[b] = entry;
+            entry = next;
+        }
+    }
+    free(buckets);
+    buckets = fresh;
+    bucket_count = new_count;
+    return 0;
+}
+
+// Takes ownership of `key`.
+static cache_entry_t *intern_entry(char *key, uint32_t hash) {
+    cache_entry_t *entry = find_entry(key, hash);
+    if (entry) {
+        free(key);
+        return entry;
+    }
+    if (entry_count >= bucket_count && grow_buckets() != 0) {
+        free(key);
+        return NULL;
+    }
+    entry = calloc(1, sizeof(cache_entry_t));
+    cached_row_t **rows = entry ? calloc(per_conversation, sizeof(cached_row_t *)) : NULL;
+    if (!rows) {
+        free(entry);
+        free(key);
+        return NULL;
+    }
+    entry->key = key;
+    entry->hash = hash;
+    entry->rows = rows;
+    size_t b = hash & (bucket_count - 1);
+    entry->next = buckets[b];
+    buckets[b] = entry;
+    ++entry_count;
+    lru_touch(entry);
+    return entry;
+}
+
+static cached_row_t *copy_row(const history_row_t *row) {
+    size_t ts_len = strlen(row->timestamp) + 1;
+    size_t sender_len = strlen(row->sender) + 1;
+    size_t body_len = strlen(row->body) + 1;
+    size_t size = sizeof(cached_row_t) + ts_len + sender_len + body_len;
+    cached_row_t *copy = malloc(size);
+    if (!copy) {
+        return NULL;
+    }
+    atomic_init(&copy->refs, 1);
+    copy->rings = 0;
+    copy->id = row->id;
+    copy->size = size;
+    copy->timestamp = memcpy(copy->text, row->timestamp, ts_len);
+    copy->sender = memcpy(copy->timestamp + ts_len, row->sender, sender_len);
+    copy->body = memcpy(copy->sender + sender_len, row->body, body_len);
+    return copy;
+}
+
+// Appends to the ring, overwriting the oldest row once it is full (the ring
+// then no longer reaches the start of the conversation).
+static void push_row(cache_entry_t *entry, cached_row_t *row) {
+    if (entry->count == per_conversation) {
+        unlink_row(entry->rows[entry->head]);
+        entry->head = (entry->head + 1) % per_conversation;
+        --entry->count;
+        entry->complete = false;
+    }
+    entry->rows[(entry->head + entry->count) % per_conversation] = row;
+    ++entry->count;
+    link_row(row);
+}
+
+// The entry just touched sits at the LRU head, so it only goes itself when it
+// alone exceeds the budget.
+static void enforce_budget(void) {
+    while (total_bytes > budget && lru_tail) {
+        remove_entry(lru_tail);
+    }
+}
+
+void history_cache_configure(size_t conversation_rows, size_t budget_bytes, size_t shards) {
+    pthread_mutex_lock(&cache_lock);
+    while (lru_tail) {
+        remove_entry(lru_tail);
+    }
+    per_conversation = budget_bytes ? conversation_rows : 0;
+    budget = budget_bytes;
+    floor_stride = shards > 0 && shards <= STORAGE_MAX_SHARDS ? shards : 1;
+    memset(floor_ids, 0, sizeof(floor_ids));
+    bump_all_generations();
+    pthread_mutex_unlock(&cache_lock);
+}
+
+size_t history_cache_capacity(void) {
+    pthread_mutex_lock(&cache_lock);
+    size_t rows = per_conversation;
+    pthread_mutex_unlock(&cache_lock);
+    return rows;
+}
+
+void history_cache_clear(void) {
+    pthread_mutex_lock(&cache_lock);
+    while (lru_tail) {
+        remove_entry(lru_tail);
+    }
+    free(buckets);
+    buckets = NULL;
+    bucket_count = 0;
+    bump_all_generations();
+    pthread_mutex_unlock(&cache_lock);
+}
+
+uint64_t history_cache_generation(const char *user_a, const char *user_b) {
+    char *key = make_key(user_a, user_b);
+    if (!key) {
+        return UINT64_MAX; // never matches, so the fill is skipped
+    }
+    uint32_t hash = hash_key(key);
+    free(key);
+    pthread_mutex_lock(&cache_lock);
+    uint64_t generation = generations[hash % GENERATION_STRIPES];
+    pthread_mutex_unlock(&cache_lock);
+    return generation;
+}
+
+void history_cache_append(const char *sender, const char *const *receivers, size_t count, const history_row_t *row) {
+    pthread_mutex_lock(&cache_lock);
+    if (per_conversation == 0) {
+        pthread_mutex_unlock(&cache_lock);
+        return;
+    }
+    cached_row_t *copy = copy_row(row);
+    for (size_t i = 0; i < count; ++i) {
+        char *key = make_key(sender, receivers[i]);
+        if (!key) {
+            // Cannot name the ring that would now have a gap; drop them all.
+            while (lru_tail) {
+                remove_entry(lru_tail);
+            }
+            bump_all_generations();
+            break;
+        }
+        uint32_t hash = hash_key(key);
+        ++generations[hash % GENERATION_STRIPES];
+        // The newest message on its own is a valid suffix, so a ring can start here.
+        cache_entry_t *entry = intern_entry(key, hash);
+        if (entry && copy) {
+            push_row(entry, copy);
+            lru_touch(entry);
+            enforce_budget();
+        } else if (entry) {
+            remove_entry(entry); // the ring would have a gap
+        }
+    }
+    if (copy) {
+        release_row(copy);
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+void history_cache_fill(const char *user_a, const char *user_b, const history_row_t *rows, size_t count,
+                        bool complete, uint64_t generation) {
+    char *key = make_key(user_a, user_b);
+    if (!key) {
+        return;
+    }
+    uint32_t hash = hash_key(key);
+    pthread_mutex_lock(&cache_lock);
+    if (per_conversation == 0 || generations[hash % GENERATION_STRIPES] != generation) {
+        pthread_mutex_unlock(&cache_lock);
+        free(key);
+        return;
+    }
+    cache_entry_t *entry = intern_entry(key, hash);
+    if (entry) {
+        drop_rows(entry);
+        size_t first = count > per_conversation ? count - per_conversation : 0;
+        for (size_t i = first; i < count; ++i) {
+            cached_row_t *copy = copy_row(&rows[i]);
+            if (!copy) {
+                remove_entry(entry);
+                entry = NULL;
+                break;
+            }
+            push_row(entry, copy);
+            release_row(copy);
+        }
+        if (entry) {
+            entry->complete = complete && count <= per_conversation;
+            lru_touch(entry);
+            enforce_budget();
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+void history_cache_invalidate(const char *user_a, const char *user_b) {
+    char *key = make_key(user_a, user_b);
+    if (!key) {
+        history_cache_clear(); // cannot name the entry; drop everything to stay correct
+        return;
+    }
+    uint32_t hash = hash_key(key);
+    pthread_mutex_lock(&cache_lock);
+    ++generations[hash % GENERATION_STRIPES];
+    cache_entry_t *entry = find_entry(key, hash);
+    if (entry) {
+        remove_entry(entry);
+    }
+    pthread_mutex_unlock(&cache_lock);
+    free(key);
+}
+
+void history_cache_set_floor(size_t shard, int64_t id) {
+    pthread_mutex_lock(&cache_lock);
+    if (shard < floor_stride && id > floor_ids[shard]) {
+        floor_ids[shard] = id;
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+// Index of the oldest row a read may still return. Caller holds cache_lock.
+static size_t first_usable(const cache_entry_t *entry, size_t end) {
+    // A conversation lives on one shard, so every row has the same floor.
+    int64_t floor = end > 0 ? floor_ids[row_at(entry, 0)->id % (int64_t)floor_stride] : 0;
+    size_t oldest = 0;
+    while (oldest < end && row_at(entry, oldest)->id <= floor) {
+        ++oldest;
+    }
+    return oldest;
+}
+
+// Emits rows [start, end) of `entry` and releases cache_lock, which the
+// caller holds. Returns false (a miss) if out of memory.
+static bool serve_rows(cache_entry_t *entry, size_t start, size_t end, history_callback cb, void *ctx) {
+    // Borrow the rows so the callbacks (socket writes) run without the lock;
+    // rows evicted meanwhile stay valid until released here.
+    size_t count = end - start;
+    cached_row_t **out = malloc((count ? count : 1) * sizeof(cached_row_t *));
+    if (!out) {
+        ++misses;
+        pthread_mutex_unlock(&cache_lock);
+        return false;
+    }
+    ++hits;
+    lru_touch(entry);
+    for (size_t i = 0; i < count; ++i) {
+        out[i] = row_at(entry, start + i);
+        atomic_fetch_add(&out[i]->refs, 1);
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    for (size_t i = 0; i < count; ++i) {
+        cb(out[i]->id, out[i]->timestamp, out[i]->sender, out[i]->body, ctx);
+        release_row(out[i]);
+    }
+    free(out);
+    return true;
+}
+
+bool history_cache_fetch(const char *user_a, const char *user_b, int64_t before_id, int limit,
+                         history_callback cb, void *ctx) {
+    char *key = make_key(user_a, user_b);
+    if (!key) {
+        return false;
+    }
+    pthread_mutex_lock(&cache_lock);
+    cache_entry_t *entry = (per_conversation > 0) ? find_entry(key, hash_key(key)) : NULL;
+    free(key);
+    size_t end = 0;
+    size_t start = 0;
+    bool served = false;
+    if (entry) {
+        end = entry->count;
+        while (before_id > 0 && end > 0 && row_at(entry, end - 1)->id >= before_id) {
+            --end;
+        }
+        size_t oldest = first_usable(entry, end);
+        if (limit > 0 && end - oldest >= (size_t)limit) {
+            start = end - (size_t)limit;
+            served = true;
+        } else {
+            start = oldest;
+            served = entry->complete || oldest > 0; // nothing older survives the floor
+        }
+    }
+    if (!served) {
+        ++misses;
+        pthread_mutex_unlock(&cache_lock);
+        return false;
+    }
+    return serve_rows(entry, start, end, cb, ctx);
+}
+
+bool history_cache_fetch_since(const char *user_a, const char *user_b, int64_t after_id, int limit,
+                               history_callback cb, void *ctx) {
+    char *key = make_key(user_a, user_b);
+    if (!key) {
+        return false;
+    }
+    pthread_mutex_lock(&cache_lock);
+    cache_entry_t *entry = (per_conversation > 0) ? find_entry(key, hash_key(key)) : NULL;
+    free(key);
+    size_t start = 0;
+    size_t end = 0;
+    bool served = false;
+    if (entry) {
+        size_t oldest = first_usable(entry, entry->count);
+        start = entry->count;
+        while (start > oldest && row_at(entry, start - 1)->id > after_id) {
+            --start;
+        }
+        // The ring holds the newest rows, so it has every row above after_id
+        // once it reaches down to it or nothing older exists.
+        served = start > oldest || entry->complete || oldest > 0;
+        end = (limit > 0 && entry->count - start > (size_t)limit) ? start + (size_t)limit : entry->count;
+    }
+    if (!served) {
+        ++misses;
+        pthread_mutex_unlock(&cache_lock);
+        return false;
+    }
+    return serve_rows(entry, start, end, cb, ctx);
+}
+
+typedef struct {
+    char *key;
+    cached_row_t **rows;
+    size_t count;
+    bool complete;
+} exported_ring_t;
+
+// Borrows every ring's rows under the lock, like fetch, and visits them after
+// it is released, least recently used first.
+void history_cache_export(history_cache_visit visit, void *ctx) {
+    pthread_mutex_lock(&cache_lock);
+    exported_ring_t *rings = calloc(entry_count ? entry_count : 1, sizeof(exported_ring_t));
+    size_t ring_count = 0;
+    size_t most_rows = 0;
+    for (cache_entry_t *entry = lru_tail; rings && entry; entry = entry->lru_prev) {
+        int64_t floor = entry->count > 0 ? floor_ids[row_at(entry, 0)->id % (int64_t)floor_stride] : 0;
+        size_t oldest = 0;
+        while (oldest < entry->count && row_at(entry, oldest)->id <= floor) {
+            ++oldest;
+        }
+        exported_ring_t *ring = &rings[ring_count];
+        ring->count = entry->count - oldest;
+        ring->complete = entry->complete || oldest > 0;
+        size_t key_len = strlen(entry->key) + 1;
+        if ((ring->key = malloc(key_len))) {
+            memcpy(ring->key, entry->key, key_len);
+        }
+        ring->rows = malloc((ring->count ? ring->count : 1) * sizeof(cached_row_t *));
+        if (!ring->key || !ring->rows) {
+            free(ring->key);
+            free(ring->rows);
+            continue; // a ring left out is only a cold start for it
+        }
+        for (size_t i = 0; i < ring->count; ++i) {
+            ring->rows[i] = row_at(entry, oldest + i);
+            atomic_fetch_add(&ring->rows[i]->refs, 1);
+        }
+        most_rows = ring->count > most_rows ? ring->count : most_rows;
+        ++ring_count;
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    history_row_t *rows = malloc((most_rows ? most_rows : 1) * sizeof(history_row_t));
+    for (size_t r = 0; r < ring_count; ++r) {
+        exported_ring_t *ring = &rings[r];
+        if (rows && ring->count > 0) {
+            for (size_t i = 0; i < ring->count; ++i) {
+                cached_row_t *row = ring->rows[i];
+                rows[i] = (history_row_t){row->id, row->timestamp, row->sender, row->body};
+            }
+            char *user_b = strchr(ring->key, '\n');
+            *user_b++ = '\0';
+            visit(ring->key, user_b, rows, ring->count, ring->complete, ctx);
+        }
+        for (size_t i = 0; i < ring->count; ++i) {
+            release_row(ring->rows[i]);
+        }
+        free(ring->rows);
+        free(ring->key);
+    }
+    free(rows);
+    free(rings);
+}
+
+void history_cache_stats(storage_cache_stats_t *stats) {
+    pthread_mutex_lock(&cache_lock);
+    stats->hits = hits;
+    stats->misses = misses;
+    stats->conversations = entry_count;
+    stats->bytes = total_bytes;
+    pthread_mutex_unlock(&cache_lock);
+}
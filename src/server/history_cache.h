@@ -0,0 +1,62 @@
+#ifndef HISTORY_CACHE_H
+#define HISTORY_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "storage.h"
+
+// In-memory ring of the newest messages per conversation, kept in front of
+// the storage backend. Each ring always holds a contiguous newest suffix of
+// its conversation; a ring that also reaches back to the first message is
+// "complete" and can answer any request. Rings share one byte budget and are
+// evicted least-recently-used first. All functions are thread-safe.
+typedef struct {
+    int64_t id;
+    const char *timestamp;
+    const char *sender;
+    const char *body;
+} history_row_t;
+
+// `per_conversation` == 0 or `budget_bytes` == 0 disables the cache. Ids are
+// interleaved across `shards` storage shards (see storage.c).
+void history_cache_configure(size_t per_conversation, size_t budget_bytes, size_t shards);
+size_t history_cache_capacity(void);
+void history_cache_clear(void);
+
+// A message was committed to the conversations between `sender` and each of
+// `receivers`; the rings all share one copy of it. The caller guarantees ids
+// arrive in order.
+void history_cache_append(const char *sender, const char *const *receivers, size_t count, const history_row_t *row);
+// Taken before a backend read that may become a fill; it changes whenever
+// the conversation is appended to or invalidated.
+uint64_t history_cache_generation(const char *user_a, const char *user_b);
+// Replaces a conversation's ring with the newest rows a backend read just
+// returned (ascending ids). `complete` means nothing older exists. Ignored if
+// the conversation's generation moved on since the read started.
+void history_cache_fill(const char *user_a, const char *user_b, const history_row_t *rows, size_t count,
+                        bool complete, uint64_t generation);
+void history_cache_invalidate(const char *user_a, const char *user_b);
+// Messages of `shard` with ids up to `id` no longer exist (retention removed
+// them); cached copies are never served again. The floor only rises.
+void history_cache_set_floor(size_t shard, int64_t id);
+
+// Serves the request if the cached rows cover it exactly as the backend
+// would answer it. Returns false (a miss) otherwise; nothing is emitted then.
+bool history_cache_fetch(const char *user_a, const char *user_b, int64_t before_id, int limit,
+                         history_callback cb, void *ctx);
+// The same for the oldest `limit` (0 = no bound) rows above `after_id`.
+bool history_cache_fetch_since(const char *user_a, const char *user_b, int64_t after_id, int limit,
+                               history_callback cb, void *ctx);
+
+// Reports every ring's usable rows (ascending ids) for a checkpoint, least
+// recently used first, so that filling them back in that order restores the
+// eviction order too.
+typedef void (*history_cache_visit)(const char *user_a, const char *user_b, const history_row_t *rows, size_t count,
+                                    bool complete, void *ctx);
+void history_cache_export(history_cache_visit visit, void *ctx);
+
+void history_cache_stats(storage_cache_stats_t *stats);
+
+#endif /* HISTORY_CACHE_H */
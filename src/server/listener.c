@@ -0,0 +1,88 @@
+#if defined(__linux__)
+#define _GNU_SOURCE /* accept4(), pthread_setaffinity_np() */
+#endif
+#include "listener.h"
+
+#include <errno.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+socket_handle_t listener_open(uint16_t port, int backlog, bool reuseport, bool nonblocking) {
+#ifndef SO_REUSEPORT
+    if (reuseport) {
+        errno = ENOTSUP;
+        return NET_INVALID_SOCKET;
+    }
+#endif
+    socket_handle_t fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == NET_INVALID_SOCKET) {
+        return NET_INVALID_SOCKET;
+    }
+    int opt = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (const char *)&opt, sizeof(opt));
+#ifdef SO_REUSEPORT
+    if (reuseport && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (const char *)&opt, sizeof(opt)) != 0) {
+        int err = errno;
+        net_close(fd);
+        errno = err;
+        return NET_INVALID_SOCKET;
+    }
+#endif
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = htons(port);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(fd, backlog) == -1 ||
+        (nonblocking && net_set_nonblocking(fd) != 0)) {
+        int err = errno;
+        net_close(fd);
+        errno = err;
+        return NET_INVALID_SOCKET;
+    }
+    return fd;
+}
+
+socket_handle_t listener_accept(socket_handle_t listener) {
+#if defined(__linux__)
+    socket_handle_t fd = accept4(listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd == NET_INVALID_SOCKET) {
+        return NET_INVALID_SOCKET;
+    }
+#else
+    socket_handle_t fd = accept(listener, NULL, NULL);
+    if (fd == NET_INVALID_SOCKET) {
+        return NET_INVALID_SOCKET;
+    }
+    if (net_set_nonblocking(fd) != 0) {
+        net_close(fd);
+        return NET_INVALID_SOCKET;
+    }
+#endif
+    // Replies are already batched per wakeup; Nagle would only hold back the
+    // tail of a multi-line reply until the peer's delayed ACK.
+    int opt = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (const char *)&opt, sizeof(opt));
+    return fd;
+}
+
+int listener_pin_thread(int index) {
+#if defined(__linux__)
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1) {
+        return -1;
+    }
+    int cpu = (int)(index % cpus);
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0 ? cpu : -1;
+#else
+    (void)index;
+    return -1;
+#endif
+}
@@ -0,0 +1,26 @@
+#ifndef LISTENER_H
+#define LISTENER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "net_compat.h"
+
+// Listening sockets and the per-connection socket setup that goes with them.
+// With `reuseport` several sockets can be bound to the same port
+// (SO_REUSEPORT) and the kernel spreads incoming connections across them, so
+// each event loop can accept on its own socket. Returns NET_INVALID_SOCKET on
+// failure with errno set; reuseport fails with ENOTSUP where the platform has
+// no SO_REUSEPORT.
+socket_handle_t listener_open(uint16_t port, int backlog, bool reuseport, bool nonblocking);
+
+// Accepts one connection as a non-blocking socket with Nagle disabled
+// (accept4() on Linux, accept() plus fcntl() elsewhere). On failure returns
+// NET_INVALID_SOCKET; net_would_block() tells an empty queue from an error.
+socket_handle_t listener_accept(socket_handle_t listener);
+
+// Pins the calling thread to CPU `index` modulo the online CPUs. Returns the
+// CPU or -1 where pinning is unsupported or fails.
+int listener_pin_thread(int index);
+
+#endif /* LISTENER_H */
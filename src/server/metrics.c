@@ -0,0 +1,256 @@
+#define _POSIX_C_SOURCE 200809L
+#include "metrics.h"
+#include "latency_histogram.h"
+#include "profile.h"
+
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define METRICS_SHARDS 16u /* power of two */
+
+typedef struct {
+    _Alignas(64) atomic_ullong counters[METRIC_COUNTER_COUNT];
+    atomic_ullong sum[METRIC_HISTOGRAM_COUNT];
+    atomic_ullong max[METRIC_HISTOGRAM_COUNT];
+    atomic_ullong buckets[METRIC_HISTOGRAM_COUNT][LATENCY_BUCKETS];
+} metrics_shard_t;
+
+typedef struct {
+    const char *name;
+    const char *help;
+    metric_kind_t kind;
+    uint64_t (*read)(void);
+} external_metric_t;
+
+static metrics_shard_t shards[METRICS_SHARDS];
+static atomic_uint next_shard;
+static _Thread_local metrics_shard_t *thread_shard = NULL;
+static external_metric_t externals[METRICS_MAX_EXTERNAL];
+static size_t external_count = 0;
+
+static const struct {
+    const char *name;
+    const char *help;
+} counter_info[METRIC_COUNTER_COUNT] = {
+    {"connections", "Client connections accepted."},
+    {"commands", "Commands dispatched."},
+    {"messages", "SEND and GROUP messages accepted."},
+    {"bytes_received", "Bytes read from clients."},
+    {"bytes_sent", "Bytes written to clients."},
+    {"slow_consumers", "Sessions disconnected for a full send queue."},
+    {"pings", "Heartbeat PINGs sent to idle sessions."},
+    {"idle_timeouts", "Sessions closed for not answering a PING."},
+    {"rate_limited", "Commands refused by a per-session rate limit."},
+    {"shed", "Commands refused with ERROR Busy while overloaded."},
+    {"cluster_forwarded", "Messages forwarded to the cluster node of an online recipient."},
+    {"cluster_forward_failed", "Pushes for a recipient on another cluster node that could not be queued."},
+};
+
+static const struct {
+    const char *name;
+    const char *help;
+} histogram_info[METRIC_HISTOGRAM_COUNT] = {
+    {"command", "Time to parse and handle one command."},
+    {"deliver", "Time to push a message to online recipients and queue it for storage."},
+    {"commit_latency", "Time from queueing a message to its batch committing."},
+    {"history_fetch", "Time for one conversation history read."},
+    {"clients_lock_wait", "Time spent acquiring clients_lock."},
+    {"storage_lock_wait", "Time spent acquiring storage_lock."},
+};
+
+static metrics_shard_t *shard(void) {
+    if (!thread_shard) {
+        thread_shard = &shards[atomic_fetch_add(&next_shard, 1) & (METRICS_SHARDS - 1)];
+    }
+    return thread_shard;
+}
+
+uint64_t metrics_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+void metrics_count(metric_counter_t counter, uint64_t n) {
+    atomic_fetch_add_explicit(&shard()->counters[counter], n, memory_order_relaxed);
+}
+
+void metrics_record(metric_histogram_t histogram, uint64_t ns) {
+    metrics_shard_t *s = shard();
+    atomic_fetch_add_explicit(&s->buckets[histogram][latency_bucket(ns)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&s->sum[histogram], ns, memory_order_relaxed);
+    unsigned long long seen = atomic_load_explicit(&s->max[histogram], memory_order_relaxed);
+    while (ns > seen &&
+           !atomic_compare_exchange_weak_explicit(&s->max[histogram], &seen, ns, memory_order_relaxed,
+                                                  memory_order_relaxed)) {
+    }
+}
+
+void metrics_lock(pthread_mutex_t *lock, metric_histogram_t histogram) {
+    profile_lock_t profiled = histogram == METRIC_STORAGE_LOCK_WAIT ? PROFILE_STORAGE_LOCK : PROFILE_CLIENTS_LOCK;
+    if (pthread_mutex_trylock(lock) == 0) {
+        metrics_record(histogram, 0);
+        profile_lock_acquired(profiled, 0, 0);
+        return;
+    }
+    uint64_t start = metrics_now();
+    pthread_mutex_lock(lock);
+    uint64_t end = metrics_now();
+    metrics_record(histogram, end - start);
+    profile_lock_acquired(profiled, start, end);
+}
+
+void metrics_register(const char *name, const char *help, metric_kind_t kind, uint64_t (*read)(void)) {
+    if (external_count < METRICS_MAX_EXTERNAL) {
+        externals[external_count++] = (external_metric_t){name, help, kind, read};
+    }
+}
+
+static uint64_t counter_total(metric_counter_t counter) {
+    uint64_t total = 0;
+    for (size_t i = 0; i < METRICS_SHARDS; ++i) {
+        total += atomic_load_explicit(&shards[i].counters[counter], memory_order_relaxed);
+    }
+    return total;
+}
+
+typedef struct {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t p50;
+    uint64_t p90;
+    uint64_t p99;
+    uint64_t p999;
+} summary_t;
+
+static void summarize(metric_histogram_t histogram, summary_t *out) {
+    static latency_histogram_t merged; // callers render one at a time under render_lock
+    merged = (latency_histogram_t){{0}, 0, 0, 0};
+    for (size_t i = 0; i < METRICS_SHARDS; ++i) {
+        metrics_shard_t *s = &shards[i];
+        for (size_t b = 0; b < LATENCY_BUCKETS; ++b) {
+            uint64_t n = atomic_load_explicit(&s->buckets[histogram][b], memory_order_relaxed);
+            merged.buckets[b] += n;
+            merged.count += n;
+        }
+        merged.sum += atomic_load_explicit(&s->sum[histogram], memory_order_relaxed);
+        uint64_t max = atomic_load_explicit(&s->max[histogram], memory_order_relaxed);
+        if (max > merged.max) {
+            merged.max = max;
+        }
+    }
+    out->count = merged.count;
+    out->sum = merged.sum;
+    out->max = merged.max;
+    out->p50 = latency_histogram_percentile(&merged, 0.5);
+    out->p90 = latency_histogram_percentile(&merged, 0.9);
+    out->p99 = latency_histogram_percentile(&merged, 0.99);
+    out->p999 = latency_histogram_percentile(&merged, 0.999);
+}
+
+typedef struct {
+    char *data;
+    size_t len;
+    size_t capacity;
+    bool failed;
+} text_buffer_t;
+
+static void append(text_buffer_t *buffer, const char *fmt, ...) {
+    if (buffer->failed) {
+        return;
+    }
+    for (;;) {
+        size_t room = buffer->capacity - buffer->len;
+        va_list args;
+        va_start(args, fmt);
+        int written = vsnprintf(buffer->data ? buffer->data + buffer->len : NULL, room, fmt, args);
+        va_end(args);
+        if (written < 0) {
+            buffer->failed = true;
+            return;
+        }
+        if ((size_t)written < room) {
+            buffer->len += (size_t)written;
+            return;
+        }
+        size_t capacity = buffer->capacity ? buffer->capacity * 2 : 4096;
+        while (capacity - buffer->len <= (size_t)written) {
+            capacity *= 2;
+        }
+        char *data = realloc(buffer->data, capacity);
+        if (!data) {
+            buffer->failed = true;
+            return;
+        }
+        buffer->data = data;
+        buffer->capacity = capacity;
+    }
+}
+
+static char *finish(text_buffer_t *buffer, size_t *len) {
+    if (buffer->failed) {
+        free(buffer->data);
+        return NULL;
+    }
+    *len = buffer->len;
+    return buffer->data;
+}
+
+static pthread_mutex_t render_lock = PTHREAD_MUTEX_INITIALIZER;
+
+char *metrics_render_text(size_t *len) {
+    text_buffer_t out = {NULL, 0, 0, false};
+    pthread_mutex_lock(&render_lock);
+    for (size_t i = 0; i < METRIC_COUNTER_COUNT; ++i) {
+        append(&out, "%s %llu\n", counter_info[i].name, (unsigned long long)counter_total((metric_counter_t)i));
+    }
+    for (size_t i = 0; i < external_count; ++i) {
+        append(&out, "%s %llu\n", externals[i].name, (unsigned long long)externals[i].read());
+    }
+    for (size_t i = 0; i < METRIC_HISTOGRAM_COUNT; ++i) {
+        summary_t s;
+        summarize((metric_histogram_t)i, &s);
+        append(&out, "%s_us count=%llu p50=%.1f p90=%.1f p99=%.1f p999=%.1f max=%.1f\n", histogram_info[i].name,
+               (unsigned long long)s.count, s.p50 / 1e3, s.p90 / 1e3, s.p99 / 1e3, s.p999 / 1e3, s.max / 1e3);
+    }
+    pthread_mutex_unlock(&render_lock);
+    return finish(&out, len);
+}
+
+char *metrics_render_prometheus(size_t *len) {
+    text_buffer_t out = {NULL, 0, 0, false};
+    pthread_mutex_lock(&render_lock);
+    for (size_t i = 0; i < METRIC_COUNTER_COUNT; ++i) {
+        append(&out, "# HELP chat_%s_total %s\n# TYPE chat_%s_total counter\nchat_%s_total %llu\n",
+               counter_info[i].name, counter_info[i].help, counter_info[i].name, counter_info[i].name,
+               (unsigned long long)counter_total((metric_counter_t)i));
+    }
+    for (size_t i = 0; i < external_count; ++i) {
+        const external_metric_t *m = &externals[i];
+        const char *suffix = m->kind == METRIC_COUNTER ? "_total" : "";
+        const char *type = m->kind == METRIC_COUNTER ? "counter" : "gauge";
+        append(&out, "# HELP chat_%s%s %s\n# TYPE chat_%s%s %s\nchat_%s%s %llu\n", m->name, suffix, m->help,
+               m->name, suffix, type, m->name, suffix, (unsigned long long)m->read());
+    }
+    for (size_t i = 0; i < METRIC_HISTOGRAM_COUNT; ++i) {
+        summary_t s;
+        summarize((metric_histogram_t)i, &s);
+        const char *name = histogram_info[i].name;
+        append(&out, "# HELP chat_%s_seconds %s\n# TYPE chat_%s_seconds summary\n", name, histogram_info[i].help,
+               name);
+        append(&out,
+               "chat_%s_seconds{quantile=\"0.5\"} %.9f\nchat_%s_seconds{quantile=\"0.9\"} %.9f\n"
+               "chat_%s_seconds{quantile=\"0.99\"} %.9f\nchat_%s_seconds{quantile=\"0.999\"} %.9f\n"
+               "chat_%s_seconds{quantile=\"1\"} %.9f\n",
+               name, s.p50 / 1e9, name, s.p90 / 1e9, name, s.p99 / 1e9, name, s.p999 / 1e9, name, s.max / 1e9);
+        append(&out, "chat_%s_seconds_sum %.9f\nchat_%s_seconds_count %llu\n", name, s.sum / 1e9, name,
+               (unsigned long long)s.count);
+    }
+    pthread_mutex_unlock(&render_lock);
+    return finish(&out, len);
+}
@@ -0,0 +1,72 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Process-wide counters and latency histograms, read by the STATS command and
+// the Prometheus listener. Updates land in one of METRICS_SHARDS shards picked
+// per thread, as relaxed atomic adds on cache lines few threads share, so
+// recording on a hot path costs a few nanoseconds; readers sum the shards.
+//
+// Histograms are log-linear like HdrHistogram: 8 sub-buckets per power of two
+// of nanoseconds, so every reported percentile is within 12.5% of the truth.
+typedef enum {
+    METRIC_CONNECTIONS,    // sockets accepted
+    METRIC_COMMANDS,       // text lines or frames dispatched
+    METRIC_MESSAGES,       // SEND and GROUP messages accepted
+    METRIC_BYTES_IN,       // bytes read from clients
+    METRIC_BYTES_OUT,      // bytes written to clients
+    METRIC_SLOW_CONSUMERS, // sessions disconnected for a full send queue
+    METRIC_PINGS,          // heartbeat PINGs sent to idle sessions
+    METRIC_IDLE_TIMEOUTS,  // sessions closed for not answering a PING
+    METRIC_RATE_LIMITED,   // commands refused by a session's token bucket
+    METRIC_SHED,           // commands refused with ERROR Busy
+    METRIC_FORWARDED,      // messages handed to another cluster node for delivery
+    METRIC_FORWARD_FAILED, // pushes for another cluster node that could not be queued
+    METRIC_COUNTER_COUNT
+} metric_counter_t;
+
+typedef enum {
+    METRIC_COMMAND_TIME,      // parsing and handling one command
+    METRIC_DELIVER_TIME,      // live fan-out plus queueing for storage
+    METRIC_COMMIT_LATENCY,    // message submitted until its batch committed
+    METRIC_FETCH_TIME,        // one storage_fetch_conversation()
+    METRIC_CLIENTS_LOCK_WAIT, // acquiring clients_lock
+    METRIC_STORAGE_LOCK_WAIT, // acquiring storage_lock
+    METRIC_HISTOGRAM_COUNT
+} metric_histogram_t;
+
+typedef enum {
+    METRIC_GAUGE,   // current level, may go down
+    METRIC_COUNTER, // monotonic total kept elsewhere
+} metric_kind_t;
+
+// Monotonic clock in nanoseconds.
+uint64_t metrics_now(void);
+void metrics_count(metric_counter_t counter, uint64_t n);
+void metrics_record(metric_histogram_t histogram, uint64_t ns);
+
+static inline void metrics_record_since(metric_histogram_t histogram, uint64_t start) {
+    metrics_record(histogram, metrics_now() - start);
+}
+
+// Locks `lock`, recording the wait; an uncontended lock records zero without
+// reading the clock.
+void metrics_lock(pthread_mutex_t *lock, metric_histogram_t histogram);
+
+// Values owned by other modules (sessions online, queue depths, cache hits),
+// sampled through `read` whenever the metrics are rendered. Register before
+// any rendering starts; at most METRICS_MAX_EXTERNAL.
+#define METRICS_MAX_EXTERNAL 16
+void metrics_register(const char *name, const char *help, metric_kind_t kind, uint64_t (*read)(void));
+
+// Renders everything into a malloc'd buffer the caller frees, or NULL.
+// The text form has one "name value" or "name count=.. p50=.." line per
+// metric (latencies in microseconds) for STATS; the Prometheus form is the
+// text exposition format with latencies as summaries in seconds.
+char *metrics_render_text(size_t *len);
+char *metrics_render_prometheus(size_t *len);
+
+#endif /* METRICS_H */
@@ -0,0 +1,189 @@
+#include "outbound.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pool.h"
+
+// Queue entries and shared frames come from size-class pools; the largest
+// class fits a maximal 2048-byte text line with its header, so only history
+// chunks and big binary frames still go to malloc.
+static const size_t class_sizes[] = {64, 256, 1024, 2048 + 64};
+#define CLASS_COUNT (sizeof(class_sizes) / sizeof(class_sizes[0]))
+
+static pool_t class_pools[CLASS_COUNT];
+static pthread_once_t pools_once = PTHREAD_ONCE_INIT;
+// Sum of every queue's `bytes`, kept alongside it under each queue's lock.
+static atomic_ullong queued_total = 0;
+
+static void init_pools(void) {
+    for (size_t i = 0; i < CLASS_COUNT; ++i) {
+        pool_init(&class_pools[i], class_sizes[i]);
+    }
+}
+
+// The size alone picks the class, so a block is freed without a tag.
+static pool_t *pool_for(size_t size) {
+    for (size_t i = 0; i < CLASS_COUNT; ++i) {
+        if (size <= class_sizes[i]) {
+            return &class_pools[i];
+        }
+    }
+    return NULL;
+}
+
+static void *block_alloc(size_t size) {
+    pool_t *pool = pool_for(size);
+    if (!pool) {
+        return malloc(size);
+    }
+    pthread_once(&pools_once, init_pools);
+    return pool_alloc(pool);
+}
+
+static void block_free(void *block, size_t size) {
+    pool_t *pool = pool_for(size);
+    if (pool) {
+        pool_free(pool, block);
+    } else {
+        free(block);
+    }
+}
+
+void outbound_init(outbound_queue_t *queue) {
+    memset(queue, 0, sizeof(*queue));
+}
+
+outbound_shared_t *outbound_shared_alloc(size_t len) {
+    outbound_shared_t *shared = block_alloc(sizeof(outbound_shared_t) + len);
+    if (!shared) {
+        return NULL;
+    }
+    atomic_init(&shared->refs, 1);
+    shared->len = len;
+    return shared;
+}
+
+void outbound_shared_release(outbound_shared_t *shared) {
+    if (shared && atomic_fetch_sub(&shared->refs, 1) == 1) {
+        block_free(shared, sizeof(outbound_shared_t) + shared->len);
+    }
+}
+
+static const char *msg_bytes(const outbound_msg_t *msg) {
+    return msg->shared ? msg->shared->data : msg->data;
+}
+
+static void free_msg(outbound_msg_t *msg) {
+    if (msg->shared) {
+        outbound_shared_release(msg->shared);
+        block_free(msg, sizeof(outbound_msg_t));
+    } else {
+        block_free(msg, sizeof(outbound_msg_t) + msg->len);
+    }
+}
+
+void outbound_clear(outbound_queue_t *queue) {
+    atomic_fetch_sub_explicit(&queued_total, queue->bytes, memory_order_relaxed);
+    outbound_msg_t *cur = queue->head;
+    while (cur) {
+        outbound_msg_t *next = cur->next;
+        free_msg(cur);
+        cur = next;
+    }
+    outbound_init(queue);
+}
+
+static void append_msg(outbound_queue_t *queue, outbound_msg_t *msg) {
+    msg->next = NULL;
+    if (queue->tail) {
+        queue->tail->next = msg;
+    } else {
+        queue->head = msg;
+    }
+    queue->tail = msg;
+    queue->bytes += msg->len;
+    atomic_fetch_add_explicit(&queued_total, msg->len, memory_order_relaxed);
+    queue->count++;
+}
+
+int outbound_push(outbound_queue_t *queue, const char *data, size_t len) {
+    outbound_msg_t *msg = block_alloc(sizeof(outbound_msg_t) + len);
+    if (!msg) {
+        return -1;
+    }
+    msg->len = len;
+    msg->shared = NULL;
+    memcpy(msg->data, data, len);
+    append_msg(queue, msg);
+    return 0;
+}
+
+int outbound_push_shared(outbound_queue_t *queue, outbound_shared_t *shared) {
+    outbound_msg_t *msg = block_alloc(sizeof(outbound_msg_t));
+    if (!msg) {
+        return -1;
+    }
+    atomic_fetch_add(&shared->refs, 1);
+    msg->len = shared->len;
+    msg->shared = shared;
+    append_msg(queue, msg);
+    return 0;
+}
+
+long outbound_flush(outbound_queue_t *queue, socket_handle_t fd) {
+    long total = 0;
+    while (queue->head) {
+        net_iovec_t iov[OUTBOUND_MAX_IOV];
+        int count = 0;
+        size_t offset = queue->head_offset;
+        size_t requested = 0;
+        for (outbound_msg_t *cur = queue->head; cur && count < OUTBOUND_MAX_IOV; cur = cur->next) {
+            net_iov_set(&iov[count++], msg_bytes(cur) + offset, cur->len - offset);
+            requested += cur->len - offset;
+            offset = 0;
+        }
+        long n = net_writev(fd, iov, count);
+        if (n < 0) {
+            if (net_would_block()) {
+                break;
+            }
+            if (net_was_interrupted()) {
+                continue;
+            }
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        total += n;
+        size_t written = (size_t)n;
+        queue->bytes -= written;
+        atomic_fetch_sub_explicit(&queued_total, written, memory_order_relaxed);
+        while (written > 0) {
+            outbound_msg_t *head = queue->head;
+            size_t remaining = head->len - queue->head_offset;
+            if (written < remaining) {
+                queue->head_offset += written;
+                break;
+            }
+            written -= remaining;
+            queue->head = head->next;
+            queue->head_offset = 0;
+            queue->count--;
+            free_msg(head);
+        }
+        if (!queue->head) {
+            queue->tail = NULL;
+        }
+        if ((size_t)n < requested) {
+            break; // socket buffer is full; wait for the next writable event
+        }
+    }
+    return total;
+}
+
+uint64_t outbound_queued_bytes(void) {
+    return atomic_load_explicit(&queued_total, memory_order_relaxed);
+}
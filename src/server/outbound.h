@@ -0,0 +1,58 @@
+#ifndef OUTBOUND_H
+#define OUTBOUND_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "net_compat.h"
+
+// Per-session FIFO of encoded protocol lines waiting for the socket. Writers
+// append under the session's send_lock; flushing gathers up to
+// OUTBOUND_MAX_IOV queued lines into a single writev()/WSASend() call.
+#define OUTBOUND_MAX_IOV 64
+
+// Encoded bytes queued on several sessions at once (group fan-out). Built
+// once, never modified, freed by whoever drops the last reference.
+typedef struct {
+    atomic_size_t refs;
+    size_t len;
+    char data[];
+} outbound_shared_t;
+
+typedef struct outbound_msg {
+    struct outbound_msg *next;
+    size_t len;
+    outbound_shared_t *shared; // bytes live there instead of in data[]
+    char data[];
+} outbound_msg_t;
+
+typedef struct {
+    outbound_msg_t *head;
+    outbound_msg_t *tail;
+    size_t head_offset; // bytes of head already written
+    size_t bytes;       // unsent bytes across the queue
+    size_t count;
+} outbound_queue_t;
+
+void outbound_init(outbound_queue_t *queue);
+void outbound_clear(outbound_queue_t *queue);
+int outbound_push(outbound_queue_t *queue, const char *data, size_t len);
+// Queues a reference to `shared` without copying its bytes.
+int outbound_push_shared(outbound_queue_t *queue, outbound_shared_t *shared);
+// Writes as much as the socket accepts without blocking. Returns the number of
+// bytes written (0 if the socket is full) or -1 on a hard socket error.
+long outbound_flush(outbound_queue_t *queue, socket_handle_t fd);
+// Unsent bytes across all queues, read without taking any of their locks.
+uint64_t outbound_queued_bytes(void);
+
+// Returns an unfilled `len`-byte buffer holding one reference, or NULL.
+outbound_shared_t *outbound_shared_alloc(size_t len);
+void outbound_shared_release(outbound_shared_t *shared);
+
+static inline bool outbound_empty(const outbound_queue_t *queue) {
+    return queue->head == NULL;
+}
+
+#endif /* OUTBOUND_H */
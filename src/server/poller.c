@@ -0,0 +1,246 @@
+#include "poller.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__linux__)
+#include <sys/epoll.h>
+
+struct poller {
+    int epoll_fd;
+};
+
+static uint32_t to_epoll(unsigned events) {
+    uint32_t mask = 0;
+    if (events & POLLER_READ) {
+        mask |= EPOLLIN;
+    }
+    if (events & POLLER_WRITE) {
+        mask |= EPOLLOUT;
+    }
+    return mask;
+}
+
+poller_t *poller_create(void) {
+    poller_t *poller = calloc(1, sizeof(poller_t));
+    if (!poller) {
+        return NULL;
+    }
+    poller->epoll_fd = epoll_create1(0);
+    if (poller->epoll_fd == -1) {
+        free(poller);
+        return NULL;
+    }
+    return poller;
+}
+
+void poller_destroy(poller_t *poller) {
+    if (!poller) {
+        return;
+    }
+    close(poller->epoll_fd);
+    free(poller);
+}
+
+static int poller_ctl(poller_t *poller, int op, socket_handle_t fd, unsigned events, void *data) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = to_epoll(events);
+    ev.data.ptr = data;
+    return epoll_ctl(poller->epoll_fd, op, fd, &ev);
+}
+
+int poller_add(poller_t *poller, socket_handle_t fd, unsigned events, void *data) {
+    return poller_ctl(poller, EPOLL_CTL_ADD, fd, events, data);
+}
+
+int poller_modify(poller_t *poller, socket_handle_t fd, unsigned events, void *data) {
+    return poller_ctl(poller, EPOLL_CTL_MOD, fd, events, data);
+}
+
+int poller_remove(poller_t *poller, socket_handle_t fd) {
+    return poller_ctl(poller, EPOLL_CTL_DEL, fd, 0, NULL);
+}
+
+int poller_wait(poller_t *poller, poller_event_t *events, int max_events, int timeout_ms) {
+    struct epoll_event ready[64];
+    if (max_events > (int)(sizeof(ready) / sizeof(ready[0]))) {
+        max_events = (int)(sizeof(ready) / sizeof(ready[0]));
+    }
+    int n = epoll_wait(poller->epoll_fd, ready, max_events, timeout_ms);
+    if (n <= 0) {
+        return (n < 0 && net_was_interrupted()) ? 0 : n;
+    }
+    for (int i = 0; i < n; ++i) {
+        unsigned mask = 0;
+        if (ready[i].events & EPOLLIN) {
+            mask |= POLLER_READ;
+        }
+        if (ready[i].events & EPOLLOUT) {
+            mask |= POLLER_WRITE;
+        }
+        if (ready[i].events & (EPOLLHUP | EPOLLERR)) {
+            mask |= POLLER_HANGUP;
+        }
+        events[i].data = ready[i].data.ptr;
+        events[i].events = mask;
+    }
+    return n;
+}
+
+#else
+
+// Portable fallback: the registration table is copied into a pollfd array on
+// every wait, so additions from other threads are picked up on the next tick.
+typedef struct {
+    socket_handle_t fd;
+    unsigned events;
+    void *data;
+} poller_entry_t;
+
+struct poller {
+    pthread_mutex_t lock;
+    poller_entry_t *entries;
+    size_t count;
+    size_t capacity;
+    net_pollfd_t *scratch;
+    void **scratch_data;
+    size_t scratch_capacity;
+};
+
+poller_t *poller_create(void) {
+    poller_t *poller = calloc(1, sizeof(poller_t));
+    if (!poller) {
+        return NULL;
+    }
+    pthread_mutex_init(&poller->lock, NULL);
+    return poller;
+}
+
+void poller_destroy(poller_t *poller) {
+    if (!poller) {
+        return;
+    }
+    pthread_mutex_destroy(&poller->lock);
+    free(poller->entries);
+    free(poller->scratch);
+    free(poller->scratch_data);
+    free(poller);
+}
+
+static poller_entry_t *find_entry(poller_t *poller, socket_handle_t fd) {
+    for (size_t i = 0; i < poller->count; ++i) {
+        if (poller->entries[i].fd == fd) {
+            return &poller->entries[i];
+        }
+    }
+    return NULL;
+}
+
+int poller_add(poller_t *poller, socket_handle_t fd, unsigned events, void *data) {
+    pthread_mutex_lock(&poller->lock);
+    if (poller->count == poller->capacity) {
+        size_t new_cap = poller->capacity ? poller->capacity * 2 : 64;
+        poller_entry_t *tmp = realloc(poller->entries, new_cap * sizeof(poller_entry_t));
+        if (!tmp) {
+            pthread_mutex_unlock(&poller->lock);
+            return -1;
+        }
+        poller->entries = tmp;
+        poller->capacity = new_cap;
+    }
+    poller_entry_t *entry = &poller->entries[poller->count++];
+    entry->fd = fd;
+    entry->events = events;
+    entry->data = data;
+    pthread_mutex_unlock(&poller->lock);
+    return 0;
+}
+
+int poller_modify(poller_t *poller, socket_handle_t fd, unsigned events, void *data) {
+    pthread_mutex_lock(&poller->lock);
+    poller_entry_t *entry = find_entry(poller, fd);
+    if (entry) {
+        entry->events = events;
+        entry->data = data;
+    }
+    pthread_mutex_unlock(&poller->lock);
+    return entry ? 0 : -1;
+}
+
+int poller_remove(poller_t *poller, socket_handle_t fd) {
+    pthread_mutex_lock(&poller->lock);
+    poller_entry_t *entry = find_entry(poller, fd);
+    if (entry) {
+        *entry = poller->entries[--poller->count];
+    }
+    pthread_mutex_unlock(&poller->lock);
+    return entry ? 0 : -1;
+}
+
+int poller_wait(poller_t *poller, poller_event_t *events, int max_events, int timeout_ms) {
+    pthread_mutex_lock(&poller->lock);
+    size_t count = poller->count;
+    if (count > poller->scratch_capacity) {
+        net_pollfd_t *fds = realloc(poller->scratch, count * sizeof(net_pollfd_t));
+        void **data = fds ? realloc(poller->scratch_data, count * sizeof(void *)) : NULL;
+        if (fds) {
+            poller->scratch = fds;
+        }
+        if (!data) {
+            pthread_mutex_unlock(&poller->lock);
+            return -1;
+        }
+        poller->scratch_data = data;
+        poller->scratch_capacity = count;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        poller->scratch[i].fd = poller->entries[i].fd;
+        poller->scratch[i].events = 0;
+        poller->scratch[i].revents = 0;
+        if (poller->entries[i].events & POLLER_READ) {
+            poller->scratch[i].events |= POLLIN;
+        }
+        if (poller->entries[i].events & POLLER_WRITE) {
+            poller->scratch[i].events |= POLLOUT;
+        }
+        poller->scratch_data[i] = poller->entries[i].data;
+    }
+    pthread_mutex_unlock(&poller->lock);
+
+    if (count == 0) {
+        // Nothing registered yet; sleep through the timeout so callers keep
+        // their shutdown-polling cadence.
+        net_sleep_ms(timeout_ms);
+        return 0;
+    }
+    int rc = net_poll(poller->scratch, (unsigned long)count, timeout_ms);
+    if (rc <= 0) {
+        return (rc < 0 && net_was_interrupted()) ? 0 : rc;
+    }
+    int n = 0;
+    for (size_t i = 0; i < count && n < max_events; ++i) {
+        short revents = poller->scratch[i].revents;
+        if (!revents) {
+            continue;
+        }
+        unsigned mask = 0;
+        if (revents & POLLIN) {
+            mask |= POLLER_READ;
+        }
+        if (revents & POLLOUT) {
+            mask |= POLLER_WRITE;
+        }
+        if (revents & (POLLHUP | POLLERR | POLLNVAL)) {
+            mask |= POLLER_HANGUP;
+        }
+        events[n].data = poller->scratch_data[i];
+        events[n].events = mask;
+        ++n;
+    }
+    return n;
+}
+
+#endif
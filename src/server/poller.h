@@ -0,0 +1,27 @@
+#ifndef POLLER_H
+#define POLLER_H
+
+#include "net_compat.h"
+
+#define POLLER_READ 0x1u
+#define POLLER_WRITE 0x2u
+#define POLLER_HANGUP 0x4u
+
+typedef struct poller poller_t;
+
+typedef struct {
+    void *data;
+    unsigned events;
+} poller_event_t;
+
+// Readiness multiplexer used by the event-driven I/O mode. Backed by epoll on
+// Linux and by poll()/WSAPoll() elsewhere. Registration calls are safe from any
+// thread; poller_wait() is meant to be driven by a single loop thread.
+poller_t *poller_create(void);
+void poller_destroy(poller_t *poller);
+int poller_add(poller_t *poller, socket_handle_t fd, unsigned events, void *data);
+int poller_modify(poller_t *poller, socket_handle_t fd, unsigned events, void *data);
+int poller_remove(poller_t *poller, socket_handle_t fd);
+int poller_wait(poller_t *poller, poller_event_t *events, int max_events, int timeout_ms);
+
+#endif /* POLLER_H */
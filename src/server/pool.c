@@ -0,0 +1,112 @@
+#include "pool.h"
+
+#include <stdatomic.h>
+#include <stdlib.h>
+
+#define SLAB_BYTES (64u * 1024u)
+
+// One word at the front of each slab links it to the next; objects follow,
+// rounded up so each stays suitably aligned for any type.
+#define SLAB_HEADER sizeof(max_align_t)
+
+static atomic_uint next_stripe;
+static _Thread_local unsigned thread_stripe = POOL_STRIPES;
+
+static pool_stripe_t *stripe_for_thread(pool_t *pool) {
+    if (thread_stripe == POOL_STRIPES) {
+        thread_stripe = atomic_fetch_add(&next_stripe, 1) & (POOL_STRIPES - 1);
+    }
+    return &pool->stripes[thread_stripe];
+}
+
+void pool_init(pool_t *pool, size_t object_size) {
+    size_t align = sizeof(max_align_t);
+    if (object_size < sizeof(pool_object_t)) {
+        object_size = sizeof(pool_object_t);
+    }
+    pool->object_size = (object_size + align - 1) / align * align;
+    pool->per_slab = (SLAB_BYTES - SLAB_HEADER) / pool->object_size;
+    if (pool->per_slab == 0) {
+        pool->per_slab = 1;
+    }
+    for (size_t i = 0; i < POOL_STRIPES; ++i) {
+        pthread_mutex_init(&pool->stripes[i].lock, NULL);
+        pool->stripes[i].free = NULL;
+        pool->stripes[i].slabs = NULL;
+    }
+}
+
+// Caller holds the stripe lock.
+static int grow_locked(pool_t *pool, pool_stripe_t *stripe) {
+    char *slab = malloc(SLAB_HEADER + pool->per_slab * pool->object_size);
+    if (!slab) {
+        return -1;
+    }
+    *(void **)slab = stripe->slabs;
+    stripe->slabs = slab;
+    for (size_t i = pool->per_slab; i-- > 0;) {
+        pool_object_t *object = (pool_object_t *)(slab + SLAB_HEADER + i * pool->object_size);
+        object->next = stripe->free;
+        stripe->free = object;
+    }
+    return 0;
+}
+
+// Takes another stripe's whole free list, so objects that keep being freed
+// on one thread and allocated on another circulate instead of making the
+// allocating stripe grow without bound. Never holds two stripe locks.
+static pool_object_t *steal(pool_t *pool, pool_stripe_t *own) {
+    for (size_t i = 0; i < POOL_STRIPES; ++i) {
+        pool_stripe_t *other = &pool->stripes[i];
+        if (other == own) {
+            continue;
+        }
+        pthread_mutex_lock(&other->lock);
+        pool_object_t *list = other->free;
+        other->free = NULL;
+        pthread_mutex_unlock(&other->lock);
+        if (list) {
+            return list;
+        }
+    }
+    return NULL;
+}
+
+void *pool_alloc(pool_t *pool) {
+    pool_stripe_t *stripe = stripe_for_thread(pool);
+    pthread_mutex_lock(&stripe->lock);
+    pool_object_t *object = stripe->free;
+    if (object) {
+        stripe->free = object->next;
+    }
+    pthread_mutex_unlock(&stripe->lock);
+    if (object) {
+        return object;
+    }
+    object = steal(pool, stripe);
+    pthread_mutex_lock(&stripe->lock);
+    if (object) {
+        pool_object_t *tail = object;
+        while (tail->next) {
+            tail = tail->next;
+        }
+        tail->next = stripe->free;
+        stripe->free = object->next;
+    } else if (grow_locked(pool, stripe) == 0) {
+        object = stripe->free;
+        stripe->free = object->next;
+    }
+    pthread_mutex_unlock(&stripe->lock);
+    return object;
+}
+
+void pool_free(pool_t *pool, void *object) {
+    if (!object) {
+        return;
+    }
+    pool_stripe_t *stripe = stripe_for_thread(pool);
+    pthread_mutex_lock(&stripe->lock);
+    ((pool_object_t *)object)->next = stripe->free;
+    stripe->free = object;
+    pthread_mutex_unlock(&stripe->lock);
+}
@@ -0,0 +1,40 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+// Fixed-size object pool for allocations that churn: sessions and outbound
+// frames. Objects are carved from 64 KiB slabs that are never handed back to
+// malloc, so connect/disconnect storms neither fragment the heap nor contend
+// on its locks. Free objects sit on POOL_STRIPES lists, each behind its own
+// mutex; a thread always uses the same stripe, so threads only collide when
+// they happen to share one. An object freed on another thread than the one
+// that took it simply joins the freeing thread's stripe.
+//
+// Pools live as long as the process: sessions of thread-mode workers may
+// still be draining when main() returns, so there is no destroy.
+#define POOL_STRIPES 8u /* power of two */
+
+typedef struct pool_object {
+    struct pool_object *next;
+} pool_object_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pool_object_t *free;
+    void *slabs; // chained through their first word, kept reachable
+} pool_stripe_t;
+
+typedef struct {
+    size_t object_size;
+    size_t per_slab;
+    pool_stripe_t stripes[POOL_STRIPES];
+} pool_t;
+
+void pool_init(pool_t *pool, size_t object_size);
+// Returns uninitialized memory for one object, or NULL.
+void *pool_alloc(pool_t *pool);
+void pool_free(pool_t *pool, void *object);
+
+#endif /* POOL_H */
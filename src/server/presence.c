@@ -0,0 +1,376 @@
+#define _POSIX_C_SOURCE 200809L
+#include "presence.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PRESENCE_LOG_MASK (PRESENCE_LOG_EVENTS - 1u)
+#define REMOTE_INITIAL_BUCKETS 64u /* power of two */
+
+static pthread_mutex_t presence_lock = PTHREAD_MUTEX_INITIALIZER;
+// All guarded by presence_lock. The event with version v sits in
+// log[v & PRESENCE_LOG_MASK]; the newest min(version, PRESENCE_LOG_EVENTS)
+// versions are present.
+static presence_event_t event_log[PRESENCE_LOG_EVENTS];
+static uint64_t version = 0;
+static size_t online = 0;
+static presence_subscriber_t *subscribers = NULL;
+static presence_snapshot_t *cached = NULL; // snapshot of `cached->version`
+
+typedef struct remote_user {
+    struct remote_user *next;
+    uint32_t hash;
+    int node;
+    char name[PRESENCE_NAME_MAX];
+} remote_user_t;
+
+// Users on other cluster nodes. Changed with both presence_lock and
+// remote_lock (for writing) held and read under either, so routing a message
+// through presence_locate() only contends with other remote changes.
+static pthread_rwlock_t remote_lock = PTHREAD_RWLOCK_INITIALIZER;
+static remote_user_t **remote_buckets = NULL;
+static size_t remote_bucket_count = 0;
+static size_t remote_count = 0;
+
+typedef struct {
+    const char **names;
+    size_t count;
+    size_t capacity;
+    size_t bytes;
+    bool failed;
+} name_list_t;
+
+// Caller holds presence_lock.
+static presence_event_t *record(const char *name, bool joined) {
+    presence_event_t *event = &event_log[++version & PRESENCE_LOG_MASK];
+    event->version = version;
+    event->joined = joined;
+    snprintf(event->name, sizeof(event->name), "%s", name);
+    return event;
+}
+
+static uint32_t hash_name(const char *name) {
+    uint32_t hash = 2166136261u; // FNV-1a, as in the registry
+    for (const unsigned char *p = (const unsigned char *)name; *p; ++p) {
+        hash ^= *p;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Caller holds presence_lock or remote_lock. Returns the link pointing at the
+// entry, or NULL.
+static remote_user_t **find_remote(const char *name) {
+    if (remote_count == 0) {
+        return NULL;
+    }
+    uint32_t hash = hash_name(name);
+    remote_user_t **link = &remote_buckets[hash & (remote_bucket_count - 1)];
+    while (*link && ((*link)->hash != hash || strcmp((*link)->name, name) != 0)) {
+        link = &(*link)->next;
+    }
+    return *link ? link : NULL;
+}
+
+// Caller holds presence_lock and remote_lock for writing.
+static int grow_remote_locked(void) {
+    size_t count = remote_bucket_count ? remote_bucket_count * 2 : REMOTE_INITIAL_BUCKETS;
+    remote_user_t **buckets = calloc(count, sizeof(*buckets));
+    if (!buckets) {
+        return remote_bucket_count ? 0 : -1; // keep the longer chains if there are any
+    }
+    for (size_t i = 0; i < remote_bucket_count; ++i) {
+        remote_user_t *cur = remote_buckets[i];
+        while (cur) {
+            remote_user_t *next = cur->next;
+            cur->next = buckets[cur->hash & (count - 1)];
+            buckets[cur->hash & (count - 1)] = cur;
+            cur = next;
+        }
+    }
+    free(remote_buckets);
+    remote_buckets = buckets;
+    remote_bucket_count = count;
+    return 0;
+}
+
+// Caller holds presence_lock.
+static int insert_remote(const char *name, int node) {
+    remote_user_t *user = malloc(sizeof(*user));
+    if (!user) {
+        return -1;
+    }
+    user->hash = hash_name(name);
+    user->node = node;
+    snprintf(user->name, sizeof(user->name), "%s", name);
+    pthread_rwlock_wrlock(&remote_lock);
+    if (remote_count >= remote_bucket_count * 2 && grow_remote_locked() != 0) {
+        pthread_rwlock_unlock(&remote_lock);
+        free(user);
+        return -1;
+    }
+    remote_user_t **bucket = &remote_buckets[user->hash & (remote_bucket_count - 1)];
+    user->next = *bucket;
+    *bucket = user;
+    ++remote_count;
+    pthread_rwlock_unlock(&remote_lock);
+    return 0;
+}
+
+// Caller holds presence_lock.
+static void notify_all(const presence_event_t *event, presence_notify_fn notify, void *ctx) {
+    for (presence_subscriber_t *sub = subscribers; sub && notify; sub = sub->next) {
+        notify(sub, event, ctx);
+    }
+}
+
+// Caller holds presence_lock; `link` comes from find_remote().
+static void remove_remote(remote_user_t **link, presence_notify_fn notify, void *ctx) {
+    pthread_rwlock_wrlock(&remote_lock);
+    remote_user_t *user = *link;
+    *link = user->next;
+    --remote_count;
+    pthread_rwlock_unlock(&remote_lock);
+    --online;
+    notify_all(record(user->name, false), notify, ctx);
+    free(user);
+}
+
+int presence_join(registry_node_t *node, const char *name, bool claimed, presence_notify_fn notify, void *ctx) {
+    pthread_mutex_lock(&presence_lock);
+    remote_user_t **remote = find_remote(name);
+    int rc = remote && !claimed ? -1 : registry_insert(node, name);
+    if (rc == 0) {
+        if (remote) {
+            remove_remote(remote, notify, ctx);
+        }
+        ++online;
+        notify_all(record(name, true), notify, ctx);
+    }
+    pthread_mutex_unlock(&presence_lock);
+    return rc;
+}
+
+int presence_join_remote(const char *name, int node, bool exclusive, presence_notify_fn notify, void *ctx) {
+    if (strlen(name) >= PRESENCE_NAME_MAX) {
+        return -1;
+    }
+    pthread_mutex_lock(&presence_lock);
+    remote_user_t **remote = find_remote(name);
+    int rc = 0;
+    if (registry_contains(name) || (remote && exclusive)) {
+        rc = -1;
+    } else if (remote && (*remote)->node != node) {
+        // Reconnected elsewhere before its old node's LEAVE arrived.
+        notify_all(record(name, false), notify, ctx);
+        pthread_rwlock_wrlock(&remote_lock);
+        (*remote)->node = node;
+        pthread_rwlock_unlock(&remote_lock);
+        notify_all(record(name, true), notify, ctx);
+    } else if (!remote && (rc = insert_remote(name, node)) == 0) {
+        ++online;
+        notify_all(record(name, true), notify, ctx);
+    }
+    pthread_mutex_unlock(&presence_lock);
+    return rc;
+}
+
+void presence_leave_remote(const char *name, int node, presence_notify_fn notify, void *ctx) {
+    pthread_mutex_lock(&presence_lock);
+    remote_user_t **remote = find_remote(name);
+    if (remote && (*remote)->node == node) {
+        remove_remote(remote, notify, ctx);
+    }
+    pthread_mutex_unlock(&presence_lock);
+}
+
+void presence_drop_node(int node, presence_notify_fn notify, void *ctx) {
+    pthread_mutex_lock(&presence_lock);
+    for (size_t i = 0; i < remote_bucket_count && remote_count > 0; ++i) {
+        remote_user_t **link = &remote_buckets[i];
+        while (*link) {
+            if ((*link)->node == node) {
+                remove_remote(link, notify, ctx);
+            } else {
+                link = &(*link)->next;
+            }
+        }
+    }
+    pthread_mutex_unlock(&presence_lock);
+}
+
+int presence_locate(const char *name) {
+    pthread_rwlock_rdlock(&remote_lock);
+    remote_user_t **remote = find_remote(name);
+    int node = remote ? (*remote)->node : -1;
+    pthread_rwlock_unlock(&remote_lock);
+    return node;
+}
+
+void presence_leave(registry_node_t *node, presence_notify_fn notify, void *ctx) {
+    pthread_mutex_lock(&presence_lock);
+    registry_remove(node);
+    --online;
+    notify_all(record(node->key, false), notify, ctx);
+    pthread_mutex_unlock(&presence_lock);
+}
+
+void presence_subscribe(presence_subscriber_t *subscriber) {
+    pthread_mutex_lock(&presence_lock);
+    if (!subscriber->subscribed) {
+        subscriber->prev = NULL;
+        subscriber->next = subscribers;
+        if (subscribers) {
+            subscribers->prev = subscriber;
+        }
+        subscribers = subscriber;
+        subscriber->subscribed = true;
+    }
+    pthread_mutex_unlock(&presence_lock);
+}
+
+void presence_unsubscribe(presence_subscriber_t *subscriber) {
+    pthread_mutex_lock(&presence_lock);
+    if (subscriber->subscribed) {
+        if (subscriber->prev) {
+            subscriber->prev->next = subscriber->next;
+        } else {
+            subscribers = subscriber->next;
+        }
+        if (subscriber->next) {
+            subscriber->next->prev = subscriber->prev;
+        }
+        subscriber->prev = subscriber->next = NULL;
+        subscriber->subscribed = false;
+    }
+    pthread_mutex_unlock(&presence_lock);
+}
+
+uint64_t presence_version(void) {
+    pthread_mutex_lock(&presence_lock);
+    uint64_t current = version;
+    pthread_mutex_unlock(&presence_lock);
+    return current;
+}
+
+static void add_name(name_list_t *list, const char *name) {
+    if (list->failed) {
+        return;
+    }
+    if (list->count == list->capacity) {
+        size_t capacity = list->capacity ? list->capacity * 2 : 64;
+        const char **names = realloc(list->names, capacity * sizeof(*names));
+        if (!names) {
+            list->failed = true;
+            return;
+        }
+        list->names = names;
+        list->capacity = capacity;
+    }
+    list->names[list->count++] = name;
+    list->bytes += strlen(name) + 1;
+}
+
+static void collect_name(registry_node_t *node, void *ctx) {
+    add_name((name_list_t *)ctx, node->key);
+}
+
+// Caller holds presence_lock, so no login or logout can change the registry
+// or the remote users while the names are copied; the copy is one block of
+// pointers and strings.
+static presence_snapshot_t *build_snapshot(void) {
+    name_list_t list = {NULL, 0, 0, 0, false};
+    registry_for_each(collect_name, &list);
+    for (size_t i = 0; i < remote_bucket_count; ++i) {
+        for (remote_user_t *user = remote_buckets[i]; user; user = user->next) {
+            add_name(&list, user->name);
+        }
+    }
+    presence_snapshot_t *snapshot = NULL;
+    if (!list.failed) {
+        snapshot = malloc(sizeof(*snapshot) + list.count * sizeof(const char *) + list.bytes);
+    }
+    if (snapshot) {
+        atomic_init(&snapshot->refs, 1);
+        snapshot->version = version;
+        snapshot->count = list.count;
+        snapshot->names = (const char **)(void *)(snapshot + 1);
+        char *out = (char *)(snapshot->names + list.count);
+        for (size_t i = 0; i < list.count; ++i) {
+            size_t len = strlen(list.names[i]) + 1;
+            snapshot->names[i] = memcpy(out, list.names[i], len);
+            out += len;
+        }
+    }
+    free(list.names);
+    return snapshot;
+}
+
+presence_snapshot_t *presence_snapshot(void) {
+    pthread_mutex_lock(&presence_lock);
+    if (!cached || cached->version != version) {
+        presence_snapshot_t *fresh = build_snapshot();
+        if (fresh) {
+            presence_snapshot_release(cached);
+            cached = fresh;
+        }
+    }
+    presence_snapshot_t *snapshot = NULL;
+    if (cached && cached->version == version) {
+        snapshot = cached;
+        atomic_fetch_add(&snapshot->refs, 1);
+    }
+    pthread_mutex_unlock(&presence_lock);
+    return snapshot;
+}
+
+void presence_snapshot_release(presence_snapshot_t *snapshot) {
+    if (snapshot && atomic_fetch_sub(&snapshot->refs, 1) == 1) {
+        free(snapshot);
+    }
+}
+
+int presence_changes(uint64_t since, presence_event_t **events, size_t *count, uint64_t *current) {
+    pthread_mutex_lock(&presence_lock);
+    *current = version;
+    uint64_t wanted = version - since;
+    if (since > version || wanted > PRESENCE_LOG_EVENTS || wanted > online) {
+        pthread_mutex_unlock(&presence_lock);
+        return 0;
+    }
+    presence_event_t *copy = malloc((wanted ? wanted : 1) * sizeof(*copy));
+    if (!copy) {
+        pthread_mutex_unlock(&presence_lock);
+        return -1;
+    }
+    for (uint64_t i = 0; i < wanted; ++i) {
+        copy[i] = event_log[(since + 1 + i) & PRESENCE_LOG_MASK];
+    }
+    pthread_mutex_unlock(&presence_lock);
+    *events = copy;
+    *count = (size_t)wanted;
+    return 1;
+}
+
+void presence_shutdown(void) {
+    pthread_mutex_lock(&presence_lock);
+    presence_snapshot_release(cached);
+    cached = NULL;
+    subscribers = NULL;
+    pthread_rwlock_wrlock(&remote_lock);
+    for (size_t i = 0; i < remote_bucket_count; ++i) {
+        while (remote_buckets[i]) {
+            remote_user_t *user = remote_buckets[i];
+            remote_buckets[i] = user->next;
+            free(user);
+        }
+    }
+    free(remote_buckets);
+    remote_buckets = NULL;
+    remote_bucket_count = 0;
+    remote_count = 0;
+    pthread_rwlock_unlock(&remote_lock);
+    pthread_mutex_unlock(&presence_lock);
+}
@@ -0,0 +1,84 @@
+#ifndef PRESENCE_H
+#define PRESENCE_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "registry.h"
+
+// Who is online, as a versioned stream of JOIN/LEAVE events. Every login and
+// logout goes through here: it updates the registry, bumps the presence
+// version and appends to a bounded log, all under one lock, so a snapshot or
+// a delta is always exact for the version it reports. Subscribers are told
+// about each event while that lock is held, which keeps pushes in version
+// order; the callback must only append to queues, leaving socket writes to
+// its caller once the presence call has returned.
+//
+// In a cluster the directory also holds the users connected to other nodes,
+// by name and node index, as their nodes report them. Local and remote names
+// share one namespace: a name is online at most once across both.
+#define PRESENCE_NAME_MAX 32
+#define PRESENCE_LOG_EVENTS 4096u /* power of two */
+
+typedef struct {
+    uint64_t version;
+    bool joined;
+    char name[PRESENCE_NAME_MAX];
+} presence_event_t;
+
+// Embedded in the subscribing session, like registry_node_t.
+typedef struct presence_subscriber {
+    struct presence_subscriber *prev;
+    struct presence_subscriber *next;
+    bool subscribed;
+} presence_subscriber_t;
+
+typedef void (*presence_notify_fn)(presence_subscriber_t *subscriber, const presence_event_t *event, void *ctx);
+
+// Immutable list of the users online at `version`, shared by every USERS
+// request until the next event; the lines are sent from it with no lock held.
+typedef struct {
+    atomic_int refs;
+    uint64_t version;
+    size_t count;
+    const char **names;
+} presence_snapshot_t;
+
+// Registers `node` under `name` (see registry_insert()) and, on success,
+// tells every subscriber. Returns 0 or -1 if the name is taken. A remote user
+// of the same name counts as taking it unless `claimed`: the name's home node
+// has just granted it here, so that entry is stale and is replaced.
+int presence_join(registry_node_t *node, const char *name, bool claimed, presence_notify_fn notify, void *ctx);
+void presence_leave(registry_node_t *node, presence_notify_fn notify, void *ctx);
+void presence_subscribe(presence_subscriber_t *subscriber);
+// No-op for a subscriber that is not subscribed.
+void presence_unsubscribe(presence_subscriber_t *subscriber);
+uint64_t presence_version(void);
+
+// Records `name` as connected to cluster node `node`. Returns -1 if the name
+// is online here, or, when `exclusive` (a claim this node arbitrates), online
+// anywhere; otherwise an entry for another node is moved over and 0 returned.
+int presence_join_remote(const char *name, int node, bool exclusive, presence_notify_fn notify, void *ctx);
+// Forgets `name` if it is recorded at `node`.
+void presence_leave_remote(const char *name, int node, presence_notify_fn notify, void *ctx);
+// Forgets every user recorded at `node`, whose link went down.
+void presence_drop_node(int node, presence_notify_fn notify, void *ctx);
+// The node a remote user is connected to, or -1. Never waits behind logins.
+int presence_locate(const char *name);
+
+// Returns a reference the caller drops with presence_snapshot_release(), or
+// NULL when out of memory.
+presence_snapshot_t *presence_snapshot(void);
+void presence_snapshot_release(presence_snapshot_t *snapshot);
+
+// Copies the events after `since` into a malloc'd array the caller frees and
+// returns 1. Returns 0 when a snapshot is called for instead: `since` is
+// older than the log, newer than the current version (the server restarted),
+// or the delta would be longer than the list itself. -1 when out of memory.
+int presence_changes(uint64_t since, presence_event_t **events, size_t *count, uint64_t *version);
+
+void presence_shutdown(void);
+
+#endif /* PRESENCE_H */
@@ -0,0 +1,390 @@
+#define _POSIX_C_SOURCE 200809L
+#include "profile.h"
+
+#if CHAT_PROFILE
+#ifdef _WIN32
+#error "The profiling build needs POSIX signals"
+#endif
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "binary_protocol.h"
+
+#define RING_EVENTS 4096u /* power of two; 64 KiB per ring */
+
+enum {
+    KIND_NONE,
+    KIND_AUTH,
+    KIND_SEND,
+    KIND_GROUP,
+    KIND_GET,
+    KIND_SYNC,
+    KIND_DELETE,
+    KIND_USERS,
+    KIND_PRESENCE,
+    KIND_INBOX,
+    KIND_STATS,
+    KIND_PING,
+    KIND_PONG,
+    KIND_QUIT,
+    KIND_BINARY,
+    KIND_COMPRESS,
+    KIND_OTHER,
+    KIND_COUNT // lock waits are named KIND_COUNT + their profile_lock_t
+};
+
+static const char *const kind_names[KIND_COUNT] = {
+    "background", "AUTH", "SEND", "GROUP", "GET", "SYNC", "DELETE", "USERS", "PRESENCE", "INBOX", "STATS", "PING",
+    "PONG", "QUIT", "BINARY", "COMPRESS", "other",
+};
+
+static const char *const lock_names[PROFILE_LOCK_COUNT] = {"clients_lock", "storage_lock", "send_lock"};
+
+typedef struct {
+    atomic_ullong start;    // ns since profile_start()
+    atomic_uint duration;   // ns, saturating
+    atomic_ushort name;     // kind, or KIND_COUNT + lock for a wait
+    atomic_ushort parent;   // the command a wait happened in
+} profile_event_t;
+
+typedef struct profile_ring {
+    struct profile_ring *next; // rings are never unlinked
+    atomic_bool owned;
+    unsigned index;            // the trace's tid
+    atomic_ullong claimed;     // events whose writing has started
+    atomic_ullong head;        // events completely written
+    atomic_ullong acquisitions[PROFILE_LOCK_COUNT];
+    atomic_ullong contended[PROFILE_LOCK_COUNT];
+    atomic_ullong wait_ns[PROFILE_LOCK_COUNT];
+    atomic_ullong max_wait_ns[PROFILE_LOCK_COUNT];
+    profile_event_t events[RING_EVENTS];
+} profile_ring_t;
+
+static _Atomic(profile_ring_t *) rings = NULL;
+static atomic_uint ring_count;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t ring_key;
+static _Thread_local profile_ring_t *thread_ring = NULL;
+static _Thread_local unsigned current_command = KIND_NONE;
+static uint64_t epoch;
+static pthread_t dumper;
+static atomic_bool dumper_running;
+static unsigned dump_count = 0; // dumper thread, then main() after the join
+
+static void release_ring(void *ring) {
+    atomic_store(&((profile_ring_t *)ring)->owned, false);
+}
+
+static void create_key(void) {
+    pthread_key_create(&ring_key, release_ring);
+}
+
+// The calling thread's ring: one a finished thread released, or a new one.
+static profile_ring_t *own_ring(void) {
+    if (thread_ring) {
+        return thread_ring;
+    }
+    for (profile_ring_t *ring = atomic_load(&rings); ring && !thread_ring; ring = ring->next) {
+        bool owned = false;
+        if (atomic_compare_exchange_strong(&ring->owned, &owned, true)) {
+            thread_ring = ring;
+        }
+    }
+    if (!thread_ring) {
+        profile_ring_t *ring = calloc(1, sizeof(profile_ring_t));
+        if (!ring) {
+            return NULL;
+        }
+        atomic_store(&ring->owned, true);
+        ring->index = atomic_fetch_add(&ring_count, 1) + 1;
+        ring->next = atomic_load(&rings);
+        while (!atomic_compare_exchange_weak(&rings, &ring->next, ring)) {
+        }
+        thread_ring = ring;
+    }
+    pthread_once(&key_once, create_key);
+    pthread_setspecific(ring_key, thread_ring);
+    return thread_ring;
+}
+
+// Owner only, so plain load-and-store suffices.
+static void bump(atomic_ullong *value, uint64_t n) {
+    atomic_store_explicit(value, atomic_load_explicit(value, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+// Seqlock-style: the claim is published before the slot is overwritten, so a
+// dump that copied the slot meanwhile can tell and drop it.
+static void record(profile_ring_t *ring, unsigned name, unsigned parent, uint64_t start, uint64_t end) {
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    atomic_store_explicit(&ring->claimed, head + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    profile_event_t *event = &ring->events[head & (RING_EVENTS - 1)];
+    uint64_t duration = end - start;
+    atomic_store_explicit(&event->start, start - epoch, memory_order_relaxed);
+    atomic_store_explicit(&event->duration, duration > UINT32_MAX ? UINT32_MAX : (unsigned)duration,
+                          memory_order_relaxed);
+    atomic_store_explicit(&event->name, (unsigned short)name, memory_order_relaxed);
+    atomic_store_explicit(&event->parent, (unsigned short)parent, memory_order_relaxed);
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+void profile_lock_acquired(profile_lock_t lock, uint64_t wait_start, uint64_t wait_end) {
+    profile_ring_t *ring = own_ring();
+    if (!ring) {
+        return;
+    }
+    bump(&ring->acquisitions[lock], 1);
+    if (wait_start == 0) {
+        return;
+    }
+    uint64_t wait = wait_end - wait_start;
+    bump(&ring->contended[lock], 1);
+    bump(&ring->wait_ns[lock], wait);
+    if (wait > atomic_load_explicit(&ring->max_wait_ns[lock], memory_order_relaxed)) {
+        atomic_store_explicit(&ring->max_wait_ns[lock], wait, memory_order_relaxed);
+    }
+    record(ring, KIND_COUNT + lock, current_command, wait_start, wait_end);
+}
+
+static profile_span_t begin_span(unsigned kind) {
+    current_command = kind;
+    return (profile_span_t){metrics_now(), kind};
+}
+
+profile_span_t profile_command_begin(const char *line) {
+    static const char *const keywords[] = {"AUTH", "SEND", "GROUP", "GET", "SYNC", "DELETE", "USERS", "PRESENCE",
+                                           "INBOX", "STATS", "PING", "PONG", "QUIT", "BINARY"};
+    if (line[0] == '#') {
+        const char *space = strchr(line, ' ');
+        line = space ? space + 1 : "";
+    }
+    size_t len = strcspn(line, " ");
+    for (size_t i = 0; i < sizeof(keywords) / sizeof(keywords[0]); ++i) {
+        if (strlen(keywords[i]) == len && memcmp(line, keywords[i], len) == 0) {
+            return begin_span(KIND_AUTH + (unsigned)i);
+        }
+    }
+    return begin_span(KIND_OTHER);
+}
+
+profile_span_t profile_frame_begin(int opcode) {
+    switch (opcode & ~BINARY_TAGGED) {
+    case BINARY_AUTH:
+        return begin_span(KIND_AUTH);
+    case BINARY_SEND:
+        return begin_span(KIND_SEND);
+    case BINARY_GROUP:
+        return begin_span(KIND_GROUP);
+    case BINARY_GET:
+        return begin_span(KIND_GET);
+    case BINARY_SYNC:
+        return begin_span(KIND_SYNC);
+    case BINARY_DELETE:
+        return begin_span(KIND_DELETE);
+    case BINARY_USERS:
+        return begin_span(KIND_USERS);
+    case BINARY_PRESENCE:
+        return begin_span(KIND_PRESENCE);
+    case BINARY_INBOX:
+        return begin_span(KIND_INBOX);
+    case BINARY_STATS:
+        return begin_span(KIND_STATS);
+    case BINARY_PING:
+        return begin_span(KIND_PING);
+    case BINARY_PONG:
+        return begin_span(KIND_PONG);
+    case BINARY_QUIT:
+        return begin_span(KIND_QUIT);
+    case BINARY_COMPRESS:
+        return begin_span(KIND_COMPRESS);
+    default:
+        return begin_span(KIND_OTHER);
+    }
+}
+
+void profile_command_end(profile_span_t span) {
+    current_command = KIND_NONE;
+    profile_ring_t *ring = own_ring();
+    if (ring) {
+        record(ring, span.kind, KIND_NONE, span.start, metrics_now());
+    }
+}
+
+typedef struct {
+    uint64_t start;
+    uint64_t duration;
+    unsigned name;
+    unsigned parent;
+} event_copy_t;
+
+// Copies the events `ring` still holds into `out` (RING_EVENTS entries) and
+// returns how many, oldest first.
+static size_t copy_ring(profile_ring_t *ring, event_copy_t *out) {
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    uint64_t from = head > RING_EVENTS ? head - RING_EVENTS : 0;
+    for (uint64_t i = from; i < head; ++i) {
+        profile_event_t *event = &ring->events[i & (RING_EVENTS - 1)];
+        event_copy_t *copy = &out[i - from];
+        copy->start = atomic_load_explicit(&event->start, memory_order_relaxed);
+        copy->duration = atomic_load_explicit(&event->duration, memory_order_relaxed);
+        copy->name = atomic_load_explicit(&event->name, memory_order_relaxed);
+        copy->parent = atomic_load_explicit(&event->parent, memory_order_relaxed);
+    }
+    atomic_thread_fence(memory_order_acquire);
+    // Slots reused by claims made during the copy may be torn.
+    uint64_t claimed = atomic_load_explicit(&ring->claimed, memory_order_relaxed);
+    uint64_t valid = claimed > RING_EVENTS && claimed - RING_EVENTS > from ? claimed - RING_EVENTS : from;
+    if (valid >= head) {
+        return 0;
+    }
+    memmove(out, out + (valid - from), (size_t)(head - valid) * sizeof(event_copy_t));
+    return (size_t)(head - valid);
+}
+
+static const char *event_name(unsigned name) {
+    return name < KIND_COUNT ? kind_names[name] : lock_names[name - KIND_COUNT];
+}
+
+// Writes profile-<pid>-<n>.trace.json (Chrome trace events) and
+// profile-<pid>-<n>.folded (command;lock microseconds, for flamegraph.pl)
+// and prints the lock totals.
+static void write_dump(void) {
+    char trace_path[64];
+    char folded_path[64];
+    ++dump_count;
+    snprintf(trace_path, sizeof(trace_path), "profile-%ld-%u.trace.json", (long)getpid(), dump_count);
+    snprintf(folded_path, sizeof(folded_path), "profile-%ld-%u.folded", (long)getpid(), dump_count);
+    event_copy_t *events = malloc(RING_EVENTS * sizeof(event_copy_t));
+    FILE *trace = fopen(trace_path, "w");
+    FILE *folded = fopen(folded_path, "w");
+    if (!events || !trace || !folded) {
+        fprintf(stderr, "Failed to write profile %s\n", trace_path);
+        free(events);
+        if (trace) {
+            fclose(trace);
+        }
+        if (folded) {
+            fclose(folded);
+        }
+        return;
+    }
+    uint64_t totals[PROFILE_LOCK_COUNT][4] = {{0}};
+    uint64_t command_ns[KIND_COUNT] = {0};
+    uint64_t wait_ns[KIND_COUNT][PROFILE_LOCK_COUNT] = {{0}};
+    size_t written = 0;
+    long pid = (long)getpid();
+    fprintf(trace, "{\"traceEvents\":[");
+    for (profile_ring_t *ring = atomic_load(&rings); ring; ring = ring->next) {
+        for (int lock = 0; lock < PROFILE_LOCK_COUNT; ++lock) {
+            totals[lock][0] += atomic_load_explicit(&ring->acquisitions[lock], memory_order_relaxed);
+            totals[lock][1] += atomic_load_explicit(&ring->contended[lock], memory_order_relaxed);
+            totals[lock][2] += atomic_load_explicit(&ring->wait_ns[lock], memory_order_relaxed);
+            uint64_t max = atomic_load_explicit(&ring->max_wait_ns[lock], memory_order_relaxed);
+            totals[lock][3] = max > totals[lock][3] ? max : totals[lock][3];
+        }
+        fprintf(trace, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%ld,\"tid\":%u,"
+                "\"args\":{\"name\":\"ring %u\"}}", written++ ? "," : "", pid, ring->index, ring->index);
+        size_t count = copy_ring(ring, events);
+        for (size_t i = 0; i < count; ++i) {
+            const event_copy_t *event = &events[i];
+            bool wait = event->name >= KIND_COUNT;
+            fprintf(trace, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":%ld,\"tid\":%u,"
+                    "\"ts\":%.3f,\"dur\":%.3f", event_name(event->name), wait ? "lock_wait" : "command", pid,
+                    ring->index, event->start / 1000.0, event->duration / 1000.0);
+            if (wait) {
+                fprintf(trace, ",\"args\":{\"command\":\"%s\"}}", kind_names[event->parent]);
+                wait_ns[event->parent][event->name - KIND_COUNT] += event->duration;
+            } else {
+                fputc('}', trace);
+                command_ns[event->name] += event->duration;
+            }
+        }
+    }
+    fprintf(trace, "\n],\"otherData\":{");
+    for (int lock = 0; lock < PROFILE_LOCK_COUNT; ++lock) {
+        fprintf(trace, "%s\"%s\":{\"acquisitions\":%llu,\"contended\":%llu,\"wait_us\":%.3f,\"max_wait_us\":%.3f}",
+                lock ? "," : "", lock_names[lock], (unsigned long long)totals[lock][0],
+                (unsigned long long)totals[lock][1], totals[lock][2] / 1000.0, totals[lock][3] / 1000.0);
+        fprintf(stderr, "Profile: %s acquisitions=%llu contended=%llu wait_us=%.1f max_wait_us=%.1f\n",
+                lock_names[lock], (unsigned long long)totals[lock][0], (unsigned long long)totals[lock][1],
+                totals[lock][2] / 1000.0, totals[lock][3] / 1000.0);
+    }
+    fprintf(trace, "}}\n");
+    // A command's own frame gets its time minus the waits inside it; waits
+    // outside any command hang off "background".
+    for (unsigned kind = 0; kind < KIND_COUNT; ++kind) {
+        uint64_t self = command_ns[kind];
+        for (int lock = 0; lock < PROFILE_LOCK_COUNT; ++lock) {
+            if (wait_ns[kind][lock] >= 1000) {
+                fprintf(folded, "%s;%s %llu\n", kind_names[kind], lock_names[lock],
+                        (unsigned long long)(wait_ns[kind][lock] / 1000));
+            }
+            self = self > wait_ns[kind][lock] ? self - wait_ns[kind][lock] : 0;
+        }
+        if (self >= 1000) {
+            fprintf(folded, "%s %llu\n", kind_names[kind], (unsigned long long)(self / 1000));
+        }
+    }
+    bool failed = ferror(trace) || ferror(folded);
+    failed = (fclose(trace) != 0) || failed;
+    failed = (fclose(folded) != 0) || failed;
+    free(events);
+    if (failed) {
+        fprintf(stderr, "Failed to write profile %s\n", trace_path);
+    } else {
+        fprintf(stderr, "Profile written to %s and %s\n", trace_path, folded_path);
+    }
+}
+
+static void *dumper_main(void *arg) {
+    (void)arg;
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    for (;;) {
+        int signum;
+        if (sigwait(&set, &signum) != 0) {
+            continue;
+        }
+        if (!atomic_load(&dumper_running)) {
+            break;
+        }
+        write_dump();
+    }
+    return NULL;
+}
+
+int profile_start(void) {
+    epoch = metrics_now();
+    // Every thread started later inherits the blocked SIGUSR1, so only the
+    // dumper ever sees it and no system call elsewhere is interrupted.
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    atomic_store(&dumper_running, true);
+    if (pthread_create(&dumper, NULL, dumper_main, NULL) != 0) {
+        atomic_store(&dumper_running, false);
+        fprintf(stderr, "Failed to start profile dumper\n");
+        return -1;
+    }
+    printf("Profiling: kill -USR1 %ld writes profile-%ld-<n>.trace.json and .folded\n", (long)getpid(),
+           (long)getpid());
+    return 0;
+}
+
+void profile_stop(void) {
+    if (!atomic_load(&dumper_running)) {
+        return;
+    }
+    atomic_store(&dumper_running, false);
+    pthread_kill(dumper, SIGUSR1);
+    pthread_join(dumper, NULL);
+    write_dump();
+}
+#endif
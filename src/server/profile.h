@@ -0,0 +1,93 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "metrics.h"
+
+// Instrumentation for `make profile` (CHAT_PROFILE=1); in every other build
+// the functions below are empty inlines and nothing is recorded.
+//
+// Each thread records into a ring of its own, claimed on first use and handed
+// to a later thread when it exits: the span of every command it handles and
+// of every contended wait for clients_lock, storage_lock or a send_lock, plus
+// per-lock acquisition, contention and wait-time totals. Only the owning
+// thread writes a ring, with relaxed atomic stores published by its head
+// index, so recording takes no lock. SIGUSR1, and the end of the run, dump
+// the rings as a Chrome trace (chrome://tracing, Perfetto) and as folded
+// stacks of command and lock-wait time for flamegraph.pl.
+#ifndef CHAT_PROFILE
+#define CHAT_PROFILE 0
+#endif
+
+typedef enum {
+    PROFILE_CLIENTS_LOCK,
+    PROFILE_STORAGE_LOCK,
+    PROFILE_SEND_LOCK, // every session's, counted as one
+    PROFILE_LOCK_COUNT
+} profile_lock_t;
+
+typedef struct {
+    uint64_t start;
+    unsigned kind;
+} profile_span_t;
+
+#if CHAT_PROFILE
+// Starts the dump thread. Call once from main() before the first connection.
+int profile_start(void);
+// Writes the final dump and stops the thread.
+void profile_stop(void);
+// One acquisition of `lock`; `wait_start` is 0 if it was not contended,
+// otherwise the wait ran from there to `wait_end`.
+void profile_lock_acquired(profile_lock_t lock, uint64_t wait_start, uint64_t wait_end);
+// Brackets one command: a text line (classified before the handler can
+// modify it) or a frame's opcode.
+profile_span_t profile_command_begin(const char *line);
+profile_span_t profile_frame_begin(int opcode);
+void profile_command_end(profile_span_t span);
+
+static inline void profile_mutex_lock(pthread_mutex_t *mutex, profile_lock_t lock) {
+    if (pthread_mutex_trylock(mutex) == 0) {
+        profile_lock_acquired(lock, 0, 0);
+        return;
+    }
+    uint64_t start = metrics_now();
+    pthread_mutex_lock(mutex);
+    profile_lock_acquired(lock, start, metrics_now());
+}
+#else
+static inline int profile_start(void) {
+    return 0;
+}
+
+static inline void profile_stop(void) {
+}
+
+static inline void profile_lock_acquired(profile_lock_t lock, uint64_t wait_start, uint64_t wait_end) {
+    (void)lock;
+    (void)wait_start;
+    (void)wait_end;
+}
+
+static inline profile_span_t profile_command_begin(const char *line) {
+    (void)line;
+    return (profile_span_t){0, 0};
+}
+
+static inline profile_span_t profile_frame_begin(int opcode) {
+    (void)opcode;
+    return (profile_span_t){0, 0};
+}
+
+static inline void profile_command_end(profile_span_t span) {
+    (void)span;
+}
+
+static inline void profile_mutex_lock(pthread_mutex_t *mutex, profile_lock_t lock) {
+    (void)lock;
+    pthread_mutex_lock(mutex);
+}
+#endif
+
+#endif /* PROFILE_H */
@@ -0,0 +1,174 @@
+#define _POSIX_C_SOURCE 200809L
+#include "registry.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define REGISTRY_SHARDS 64u /* power of two */
+#define REGISTRY_INITIAL_BUCKETS 16u
+
+typedef struct {
+    pthread_rwlock_t lock;
+    registry_node_t **buckets;
+    size_t bucket_count;
+    size_t count;
+} registry_shard_t;
+
+static registry_shard_t shards[REGISTRY_SHARDS];
+static registry_hold_fn hold_fn = NULL;
+
+static uint32_t hash_key(const char *key) {
+    uint32_t hash = 2166136261u; // FNV-1a
+    for (const unsigned char *p = (const unsigned char *)key; *p; ++p) {
+        hash ^= *p;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static registry_shard_t *shard_for(uint32_t hash) {
+    return &shards[hash & (REGISTRY_SHARDS - 1)];
+}
+
+static size_t bucket_for(const registry_shard_t *shard, uint32_t hash) {
+    return (hash / REGISTRY_SHARDS) & (shard->bucket_count - 1);
+}
+
+static registry_node_t *find_locked(registry_shard_t *shard, uint32_t hash, const char *key) {
+    registry_node_t *cur = shard->buckets[bucket_for(shard, hash)];
+    while (cur) {
+        if (cur->hash == hash && strcmp(cur->key, key) == 0) {
+            return cur;
+        }
+        cur = cur->next;
+    }
+    return NULL;
+}
+
+static void grow_locked(registry_shard_t *shard) {
+    size_t new_count = shard->bucket_count * 2;
+    registry_node_t **buckets = calloc(new_count, sizeof(registry_node_t *));
+    if (!buckets) {
+        return; // keep the longer chains rather than fail the insert
+    }
+    for (size_t i = 0; i < shard->bucket_count; ++i) {
+        registry_node_t *cur = shard->buckets[i];
+        while (cur) {
+            registry_node_t *next = cur->next;
+            size_t idx = (cur->hash / REGISTRY_SHARDS) & (new_count - 1);
+            cur->next = buckets[idx];
+            buckets[idx] = cur;
+            cur = next;
+        }
+    }
+    free(shard->buckets);
+    shard->buckets = buckets;
+    shard->bucket_count = new_count;
+}
+
+int registry_init(registry_hold_fn hold) {
+    hold_fn = hold;
+    for (size_t i = 0; i < REGISTRY_SHARDS; ++i) {
+        registry_shard_t *shard = &shards[i];
+        shard->buckets = calloc(REGISTRY_INITIAL_BUCKETS, sizeof(registry_node_t *));
+        if (!shard->buckets) {
+            return -1;
+        }
+        shard->bucket_count = REGISTRY_INITIAL_BUCKETS;
+        shard->count = 0;
+        pthread_rwlock_init(&shard->lock, NULL);
+    }
+    return 0;
+}
+
+void registry_shutdown(void) {
+    for (size_t i = 0; i < REGISTRY_SHARDS; ++i) {
+        pthread_rwlock_destroy(&shards[i].lock);
+        free(shards[i].buckets);
+        shards[i].buckets = NULL;
+        shards[i].bucket_count = 0;
+        shards[i].count = 0;
+    }
+}
+
+int registry_insert(registry_node_t *node, const char *key) {
+    uint32_t hash = hash_key(key);
+    registry_shard_t *shard = shard_for(hash);
+    pthread_rwlock_wrlock(&shard->lock);
+    if (find_locked(shard, hash, key)) {
+        pthread_rwlock_unlock(&shard->lock);
+        return -1;
+    }
+    if (shard->count >= shard->bucket_count * 2) {
+        grow_locked(shard);
+    }
+    node->hash = hash;
+    node->key = key;
+    size_t idx = bucket_for(shard, hash);
+    node->next = shard->buckets[idx];
+    shard->buckets[idx] = node;
+    shard->count++;
+    pthread_rwlock_unlock(&shard->lock);
+    return 0;
+}
+
+void registry_remove(registry_node_t *node) {
+    registry_shard_t *shard = shard_for(node->hash);
+    pthread_rwlock_wrlock(&shard->lock);
+    registry_node_t **cur = &shard->buckets[bucket_for(shard, node->hash)];
+    while (*cur) {
+        if (*cur == node) {
+            *cur = node->next;
+            shard->count--;
+            break;
+        }
+        cur = &(*cur)->next;
+    }
+    pthread_rwlock_unlock(&shard->lock);
+    node->next = NULL;
+}
+
+registry_node_t *registry_acquire(const char *key) {
+    uint32_t hash = hash_key(key);
+    registry_shard_t *shard = shard_for(hash);
+    pthread_rwlock_rdlock(&shard->lock);
+    registry_node_t *node = find_locked(shard, hash, key);
+    if (node && hold_fn) {
+        hold_fn(node);
+    }
+    pthread_rwlock_unlock(&shard->lock);
+    return node;
+}
+
+bool registry_contains(const char *key) {
+    uint32_t hash = hash_key(key);
+    registry_shard_t *shard = shard_for(hash);
+    pthread_rwlock_rdlock(&shard->lock);
+    bool found = find_locked(shard, hash, key) != NULL;
+    pthread_rwlock_unlock(&shard->lock);
+    return found;
+}
+
+size_t registry_count(void) {
+    size_t total = 0;
+    for (size_t i = 0; i < REGISTRY_SHARDS; ++i) {
+        pthread_rwlock_rdlock(&shards[i].lock);
+        total += shards[i].count;
+        pthread_rwlock_unlock(&shards[i].lock);
+    }
+    return total;
+}
+
+void registry_for_each(registry_visit_fn visit, void *ctx) {
+    for (size_t i = 0; i < REGISTRY_SHARDS; ++i) {
+        registry_shard_t *shard = &shards[i];
+        pthread_rwlock_rdlock(&shard->lock);
+        for (size_t b = 0; b < shard->bucket_count; ++b) {
+            for (registry_node_t *cur = shard->buckets[b]; cur; cur = cur->next) {
+                visit(cur, ctx);
+            }
+        }
+        pthread_rwlock_unlock(&shard->lock);
+    }
+}
@@ -0,0 +1,35 @@
+#ifndef REGISTRY_H
+#define REGISTRY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Sharded hash index of online users keyed by username. Nodes are embedded in
+// the caller's session object; each shard has its own rwlock so lookups for
+// message delivery only contend with logins/logouts that hash to the same
+// shard. Lifetime is the caller's business: registry_acquire() invokes the
+// hold callback while the shard lock still pins the node, so the caller can
+// take a reference before the owner has a chance to unregister and free it.
+typedef struct registry_node {
+    struct registry_node *next;
+    uint32_t hash;
+    const char *key;
+} registry_node_t;
+
+typedef void (*registry_hold_fn)(registry_node_t *node);
+typedef void (*registry_visit_fn)(registry_node_t *node, void *ctx);
+
+int registry_init(registry_hold_fn hold);
+void registry_shutdown(void);
+// Returns 0 on success or -1 if the key is already registered.
+int registry_insert(registry_node_t *node, const char *key);
+void registry_remove(registry_node_t *node);
+registry_node_t *registry_acquire(const char *key);
+// Lookup without the hold callback, for callers that only need to know.
+bool registry_contains(const char *key);
+size_t registry_count(void);
+// Visits every node while holding the owning shard's read lock.
+void registry_for_each(registry_visit_fn visit, void *ctx);
+
+#endif /* REGISTRY_H */
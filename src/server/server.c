@@ -1,47 +1,490 @@
 #include <errno.h>
+#include <limits.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
+#include <time.h>
 
+#include "admission.h"
+#include "binary_protocol.h"
+#include "cluster.h"
+#include "crypto.h"
+#include "deflate_codec.h"
+#include "line_buffer.h"
+#include "listener.h"
+#include "metrics.h"
 #include "net_compat.h"
+#include "outbound.h"
+#include "poller.h"
+#include "pool.h"
+#include "presence.h"
+#include "profile.h"
+#include "registry.h"
+#include "session_tokens.h"
+#include "snapshot.h"
 #include "storage.h"
+#include "timer_wheel.h"
 
 #define MAX_USERNAME 32
 #define MAX_MESSAGE 1024
-#define LISTEN_BACKLOG 16
+#define MAX_LINE 2048
+#define DEFAULT_LISTEN_BACKLOG 1024
+#define METRICS_BACKLOG 16
 #define DEFAULT_DB_PATH "chat.db"
+#define DEFAULT_IO_THREADS 4
+#define MAX_IO_THREADS 64
+#define EVENT_BATCH 64
+#define ACCEPT_BATCH 64
+#define LOOP_TICK_MS 200
+#define DEFAULT_SEND_QUEUE_LIMIT (4u * 1024u * 1024u)
+#define OUTBOUND_FLUSH_THRESHOLD (64u * 1024u)
+#define MAX_HISTORY_PAGE 1000
+#define INBOX_PAGE 1000
+#define SYNC_PAGE 1000
+#define HISTORY_CHUNK (16u * 1024u)
+#define DEFLATE_MIN_CHUNK 1024 /* smaller history chunks go out plain */
+#define READ_ROUNDS 16
+#define MAX_TAG_PREFIX 24 /* "#" + 20 digits + " " */
+#define MAX_GROUP_RECEIVERS 1024
+#define METRICS_REQUEST_TIMEOUT_MS 1000
+#define IDLE_TICK_MS 250
+#define IDLE_TICKS_PER_SECOND (1000 / IDLE_TICK_MS)
+#define DEFAULT_PING_INTERVAL 30 /* seconds */
+#define DEFAULT_PING_TIMEOUT 30  /* seconds */
+#define DEFAULT_SEND_RATE 200    /* per second and session */
+#define DEFAULT_GET_RATE 50
+#define DEFAULT_USERS_RATE 20
+#define RATE_BURST_SECONDS 2
+#define DEFAULT_SHED_STORAGE_QUEUE 100000
+#define DEFAULT_SHED_OUTBOUND_BYTES (512ull * 1024u * 1024u)
+#define DEFAULT_SNAPSHOT_INTERVAL 60 /* seconds */
+#define DEFAULT_SESSION_TTL 3600     /* seconds */
+#define DEFAULT_RECONNECT_WINDOW 5000 /* ms */
+#define RECONNECT_BUCKETS 16
+
+typedef enum {
+    IO_MODE_THREADS,
+    IO_MODE_EVENTS,
+} io_mode_t;
+
+typedef enum {
+    ACCEPT_SINGLE,    // one listener served by the main thread
+    ACCEPT_REUSEPORT, // one SO_REUSEPORT listener per event loop
+} accept_mode_t;
+
+typedef enum {
+    SLOW_CONSUMER_DISCONNECT,
+    SLOW_CONSUMER_DROP,
+} slow_consumer_policy_t;
+
+typedef enum {
+    ACK_ON_COMMIT,
+    ACK_ON_ENQUEUE,
+} ack_mode_t;
+
+typedef struct {
+    uint16_t port;
+    const char *db_path;
+    io_mode_t io_mode;
+    int io_threads;
+    accept_mode_t accept_mode;
+    int backlog;
+    bool pin_threads;
+    size_t send_queue_limit;
+    slow_consumer_policy_t slow_consumer;
+    ack_mode_t ack;
+    storage_options_t storage;
+    size_t storage_shards; // > 1: db_path is a directory of that many shards
+    uint16_t metrics_port; // 0 = no Prometheus listener
+    int ping_interval;     // seconds of silence before a PING; 0 = no heartbeat
+    int ping_timeout;      // seconds to answer it before the session is closed
+    admission_options_t admission;
+    cluster_options_t cluster; // count 0 = standalone
+    int snapshot_interval;     // seconds between checkpoints; 0 = no snapshot
+    uint64_t session_ttl;      // seconds a resumable token outlives its session; 0 = no tokens
+    int reconnect_window_ms;   // spread of the reconnect hints in SHUTDOWN; 0 = no hint
+} server_config_t;
+
+typedef struct io_loop {
+    pthread_t thread;
+    poller_t *poller;
+    int index;
+    // ACCEPT_REUSEPORT: this loop's own listener, registered in its poller
+    // with the loop itself as event data. Connections accepted here stay on
+    // this loop (and, with --pin-threads, this CPU) for their lifetime.
+    socket_handle_t listener;
+} io_loop_t;
 
 typedef struct client_session {
     socket_handle_t socket_fd;
-    pthread_t thread;
     char username[MAX_USERNAME];
     bool authenticated;
+    registry_node_t registry_node;
+    presence_subscriber_t presence_node; // set by PRESENCE ON
+    // One reference belongs to the worker/loop that owns the socket; message
+    // delivery takes a temporary one through registry_acquire().
+    atomic_int refs;
+    bool closed;
     pthread_mutex_t send_lock;
+    line_buffer_t input;
+    // Set once, by the owner and under send_lock, when the client sends
+    // BINARY; from then on input is read through `frames` and every reply is
+    // encoded as a frame.
+    bool binary;
+    frame_reader_t frames;
+    // Owner only, a bit per cluster node (bit 0 standalone): the last inbox
+    // page from its store was full or failed, so the delivery cursor there
+    // must not be moved past what the client has not seen yet at logout.
+    uint32_t inbox_more;
+    bool deflate_history;  // owner only: BINARY_COMPRESS 1 was received
+    rate_limiter_t limits; // owner only
+    outbound_queue_t outbound;
+    bool corked;
+    bool overflowed;
+    // Under send_lock: a presence push queued bytes here and will write them
+    // once the presence lock is released (release_presence_push()).
+    bool flush_deferred;
+    // Under send_lock: where storage stood when the queue last drained, and
+    // whether a push was lost since, which keeps the cursor where it is.
+    storage_mark_t delivered;
+    bool delivery_lost;
+    // Cluster mode, per node: the last push it sent that was queued here and
+    // the last one written when the queue drained (under send_lock), and
+    // cluster_push_losses() at login (owner only).
+    uint64_t pushed_seq[CLUSTER_MAX_NODES];
+    uint64_t written_seq[CLUSTER_MAX_NODES];
+    uint64_t push_losses[CLUSTER_MAX_NODES];
+    // Event mode only: owning loop and current poller registration.
+    io_loop_t *loop;
+    bool registered;
+    unsigned interest;
+    // Heartbeat: the owner stamps last_active (an idle-clock tick) on every
+    // read; the timer and ping_sent belong to the reaper, under idle_lock.
+    atomic_uint_fast64_t last_active;
+    timer_node_t idle_timer;
+    uint64_t ping_sent; // tick of the unanswered PING, 0 = none
     struct client_session *next;
 } client_session_t;
 
+// Every send_lock is taken through here, so the profiling build can count
+// its contention.
+static void lock_send(client_session_t *session) {
+    profile_mutex_lock(&session->send_lock, PROFILE_SEND_LOCK);
+}
+
 static client_session_t *clients_head = NULL;
 static pthread_mutex_t clients_lock = PTHREAD_MUTEX_INITIALIZER;
+// Thread mode: detached workers still running, counted from before
+// pthread_create() until after their release_session().
+static pthread_mutex_t workers_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t workers_done = PTHREAD_COND_INITIALIZER;
+static int live_workers = 0; // guarded by workers_lock
 static volatile sig_atomic_t server_running = 1;
+static volatile sig_atomic_t io_running = 1;
 static socket_handle_t listener_fd = NET_INVALID_SOCKET;
+// ACCEPT_REUSEPORT: cleared by the main thread ahead of the SHUTDOWN
+// broadcast, after which the loops close their listeners.
+static atomic_bool loops_accepting = true;
+static server_config_t config = {
+    .db_path = DEFAULT_DB_PATH,
+    .storage_shards = 1,
+    .io_mode = IO_MODE_THREADS,
+    .io_threads = DEFAULT_IO_THREADS,
+    .accept_mode = ACCEPT_SINGLE,
+    .backlog = DEFAULT_LISTEN_BACKLOG,
+    .send_queue_limit = DEFAULT_SEND_QUEUE_LIMIT,
+    .slow_consumer = SLOW_CONSUMER_DISCONNECT,
+    .ack = ACK_ON_COMMIT,
+    .ping_interval = DEFAULT_PING_INTERVAL,
+    .ping_timeout = DEFAULT_PING_TIMEOUT,
+    .admission =
+        {
+            .rate = {DEFAULT_SEND_RATE, DEFAULT_GET_RATE, DEFAULT_USERS_RATE},
+            .burst_seconds = RATE_BURST_SECONDS,
+            .storage_queue_limit = DEFAULT_SHED_STORAGE_QUEUE,
+            .outbound_limit = DEFAULT_SHED_OUTBOUND_BYTES,
+        },
+    .cluster = {.count = 0, .self = -1},
+    .snapshot_interval = DEFAULT_SNAPSHOT_INTERVAL,
+    .session_ttl = DEFAULT_SESSION_TTL,
+    .reconnect_window_ms = DEFAULT_RECONNECT_WINDOW,
+};
+// Sessions are recycled through a pool once the last reference is dropped.
+static pool_t session_pool;
+static io_loop_t io_loops[MAX_IO_THREADS];
+static int io_loop_count = 0;
+// Every session with a heartbeat sits in one timer wheel, ticked every
+// IDLE_TICK_MS by the housekeeping thread. A session's timer fires when it may have
+// been silent for --ping-interval; since reads only stamp last_active,
+// activity costs one relaxed store and the timer is re-armed lazily.
+static pthread_mutex_t idle_lock = PTHREAD_MUTEX_INITIALIZER;
+static timer_wheel_t idle_wheel;
+static atomic_uint_fast64_t idle_clock;
+static uint64_t idle_epoch;
+static atomic_bool housekeeping_running;
+static atomic_bool checkpoint_running;
+static char *snapshot_file = NULL; // <db_path>.snapshot
+
+// A command may carry a client-chosen request id: a "#<id> " prefix on a text
+// line, or BINARY_TAGGED on the opcode followed by the id. Every reply to that
+// command repeats the id, so a client pipelining many commands can match
+// answers even when a commit-acknowledged OK overtakes or trails other replies.
+typedef struct {
+    bool tagged;
+    uint64_t id;
+} request_tag_t;
+
+static const request_tag_t untagged = {false, 0};
+
+// A session plus the tag its replies carry, for callbacks that answer later.
+typedef struct {
+    client_session_t *session;
+    request_tag_t tag;
+} reply_target_t;
 
 static void send_formatted(client_session_t *session, const char *fmt, ...);
+static void send_reply(client_session_t *session, request_tag_t tag, const char *fmt, ...);
+
+// Writes the text prefix for `tag` ("" when untagged) and returns its length.
+static size_t format_tag(char *out, request_tag_t tag) {
+    if (!tag.tagged) {
+        return 0;
+    }
+    return (size_t)snprintf(out, MAX_TAG_PREFIX, "#%llu ", (unsigned long long)tag.id);
+}
+
+// Fills `fields` with the tag's id field, if any; returns the count used.
+static size_t tag_fields(binary_field_t *fields, request_tag_t tag) {
+    if (!tag.tagged) {
+        return 0;
+    }
+    fields[0] = BINARY_INT(tag.id);
+    return 1;
+}
+
+static binary_opcode_t tagged_opcode(binary_opcode_t opcode, request_tag_t tag) {
+    return tag.tagged ? (binary_opcode_t)(opcode | BINARY_TAGGED) : opcode;
+}
 
+// History rows are encoded straight into a chunk that is queued whole, so a
+// big GET costs one send_lock round trip and queue entry per chunk rather than
+// per row. Storage has already released its locks when the rows arrive.
+// GET, SYNC and INBOX rows differ only in keyword and opcode, and text SYNC
+// rows also carry the id. A binary session that sent BINARY_COMPRESS gets
+// each chunk packed into one BINARY_DEFLATE frame instead, when that comes
+// out smaller.
 typedef struct {
     client_session_t *session;
-    bool any;
+    request_tag_t tag;
+    const char *keyword;
+    binary_opcode_t opcode;
+    bool with_id;
+    int count;
+    int64_t oldest_id;
+    int64_t newest_id;
+    size_t used;
+    char chunk[HISTORY_CHUNK];
+    char packed[HISTORY_CHUNK];
 } history_context_t;
 
-static void history_emit(const char *timestamp, const char *sender, const char *body, void *ctx) {
+static void queue_output(client_session_t *session, const char *data, size_t len);
+
+// Compressors shared by every owner thread: a deflate stream holds a few
+// hundred KiB, far too much to keep per session.
+static pthread_mutex_t deflater_lock = PTHREAD_MUTEX_INITIALIZER;
+static deflate_codec_t *idle_deflaters[MAX_IO_THREADS];
+static size_t idle_deflater_count = 0;
+
+static deflate_codec_t *acquire_deflater(void) {
+    pthread_mutex_lock(&deflater_lock);
+    deflate_codec_t *codec = idle_deflater_count ? idle_deflaters[--idle_deflater_count] : NULL;
+    pthread_mutex_unlock(&deflater_lock);
+    if (!codec && (codec = malloc(sizeof(*codec))) && deflate_codec_init(codec, false) != 0) {
+        free(codec);
+        codec = NULL;
+    }
+    return codec;
+}
+
+// Keeps up to MAX_IO_THREADS spare; thread mode may briefly use more.
+static void release_deflater(deflate_codec_t *codec) {
+    pthread_mutex_lock(&deflater_lock);
+    if (idle_deflater_count < MAX_IO_THREADS) {
+        idle_deflaters[idle_deflater_count++] = codec;
+        codec = NULL;
+    }
+    pthread_mutex_unlock(&deflater_lock);
+    if (codec) {
+        deflate_codec_end(codec);
+        free(codec);
+    }
+}
+
+static void free_deflaters(void) {
+    pthread_mutex_lock(&deflater_lock);
+    while (idle_deflater_count > 0) {
+        deflate_codec_t *codec = idle_deflaters[--idle_deflater_count];
+        deflate_codec_end(codec);
+        free(codec);
+    }
+    pthread_mutex_unlock(&deflater_lock);
+}
+
+// Builds the BINARY_DEFLATE frame for the chunk in `packed` and points *out
+// at it. Returns its size, or 0 if the chunk should go out as it is.
+static size_t deflate_chunk(history_context_t *hist, const char **out) {
+    const size_t reserved = 1 + 2 * BINARY_MAX_VARINT; // opcode, body length, plain length
+    deflate_codec_t *codec = acquire_deflater();
+    size_t packed_len;
+    int rc = codec ? deflate_codec_compress(codec, NULL, 0, hist->chunk, hist->used, hist->packed + reserved,
+                                            hist->used - reserved - 1, &packed_len)
+                   : -1;
+    if (codec) {
+        release_deflater(codec);
+    }
+    if (rc != 0) {
+        return 0;
+    }
+    size_t body_len = binary_varint_size(hist->used) + packed_len;
+    size_t header_len = 1 + binary_varint_size(body_len) + binary_varint_size(hist->used);
+    unsigned char *frame = (unsigned char *)hist->packed + reserved - header_len;
+    unsigned char *cursor = frame;
+    *cursor++ = BINARY_DEFLATE;
+    cursor = binary_put_varint(cursor, body_len);
+    binary_put_varint(cursor, hist->used);
+    *out = (const char *)frame;
+    return header_len + packed_len;
+}
+
+static void history_begin(history_context_t *hist, client_session_t *session, request_tag_t tag,
+                          const char *keyword, binary_opcode_t opcode) {
+    hist->session = session;
+    hist->tag = tag;
+    hist->keyword = keyword;
+    hist->opcode = opcode;
+    hist->with_id = false;
+    hist->count = 0;
+    hist->oldest_id = 0;
+    hist->newest_id = 0;
+    hist->used = 0;
+}
+
+static void history_flush(history_context_t *hist) {
+    if (hist->used == 0) {
+        return;
+    }
+    const char *data = hist->chunk;
+    size_t len = hist->used;
+    if (hist->session->deflate_history && hist->used >= DEFLATE_MIN_CHUNK) {
+        size_t packed = deflate_chunk(hist, &data);
+        len = packed ? packed : hist->used;
+        data = packed ? data : hist->chunk;
+    }
+    lock_send(hist->session);
+    queue_output(hist->session, data, len);
+    pthread_mutex_unlock(&hist->session->send_lock);
+    hist->used = 0;
+}
+
+// Text lines cannot carry line breaks; bodies stored by binary clients may.
+static void flatten_line(char *text, size_t len) {
+    for (size_t i = 0; i < len; ++i) {
+        if (text[i] == '\n' || text[i] == '\r') {
+            text[i] = ' ';
+        }
+    }
+}
+
+// Runs on the session's owner thread, the only writer of `binary`.
+static void history_emit(int64_t id, const char *timestamp, const char *sender, const char *body, void *ctx) {
     history_context_t *hist = (history_context_t *)ctx;
-    send_formatted(hist->session, "HISTORY %s %s %s", timestamp, sender, body);
-    hist->any = true;
+    // Never let one chunk exceed what the send queue would accept.
+    size_t room = config.send_queue_limit < sizeof(hist->chunk) ? config.send_queue_limit : sizeof(hist->chunk);
+    if (hist->count++ == 0) {
+        hist->oldest_id = id;
+    }
+    hist->newest_id = id;
+    if (hist->session->binary) {
+        binary_field_t fields[5];
+        size_t count = tag_fields(fields, hist->tag);
+        fields[count++] = BINARY_INT(id);
+        fields[count++] = BINARY_TEXT(timestamp, strlen(timestamp));
+        fields[count++] = BINARY_TEXT(sender, strlen(sender));
+        fields[count++] = BINARY_TEXT(body, strlen(body));
+        binary_opcode_t opcode = tagged_opcode(hist->opcode, hist->tag);
+        size_t size = binary_frame_size(fields, count);
+        if (hist->used + size > room) {
+            history_flush(hist);
+        }
+        if (size <= room) {
+            hist->used += binary_encode((unsigned char *)hist->chunk + hist->used, opcode, fields, count);
+            return;
+        }
+        unsigned char *frame = malloc(size); // a message bigger than a chunk goes on its own
+        if (frame) {
+            binary_encode(frame, opcode, fields, count);
+            lock_send(hist->session);
+            queue_output(hist->session, (const char *)frame, size);
+            pthread_mutex_unlock(&hist->session->send_lock);
+            free(frame);
+        }
+        return;
+    }
+    if (hist->used + MAX_LINE > room) {
+        history_flush(hist);
+    }
+    char *line = hist->chunk + hist->used;
+    size_t prefix = format_tag(line, hist->tag);
+    int written = hist->with_id ? snprintf(line + prefix, MAX_LINE - prefix, "%s %lld %s %s %s", hist->keyword,
+                                           (long long)id, timestamp, sender, body)
+                                : snprintf(line + prefix, MAX_LINE - prefix, "%s %s %s %s", hist->keyword, timestamp,
+                                           sender, body);
+    size_t len = written > 0 ? (size_t)written : 0;
+    if (len > MAX_LINE - prefix - 2) {
+        len = MAX_LINE - prefix - 2;
+    }
+    flatten_line(line + prefix, len);
+    len += prefix;
+    line[len++] = '\n';
+    hist->used += len;
+}
+
+// Parses "<user> [limit] [before_id]" in place. Without a limit the whole
+// conversation is returned, as before paging existed.
+static bool parse_history_request(char *args, const char **other, int *limit, int64_t *before_id) {
+    *limit = 0;
+    *before_id = 0;
+    char *space = strchr(args, ' ');
+    if (space) {
+        *space = '\0';
+        char *end;
+        long value = strtol(space + 1, &end, 10);
+        if (end == space + 1 || value < 1 || value > MAX_HISTORY_PAGE) {
+            return false;
+        }
+        *limit = (int)value;
+        if (*end == ' ') {
+            char *cursor = end + 1;
+            long long before = strtoll(cursor, &end, 10);
+            if (end == cursor || before < 1) {
+                return false;
+            }
+            *before_id = (int64_t)before;
+        }
+        if (*end != '\0') {
+            return false;
+        }
+    }
+    *other = args;
+    return strlen(args) > 0;
 }
 
 static void fatal(const char *msg) {
@@ -49,34 +492,325 @@ static void fatal(const char *msg) {
     exit(EXIT_FAILURE);
 }
 
+// Caller holds send_lock. Keeps the poller's write interest in step with the
+// outbound queue so the loop only wakes for sockets that have data pending.
+static void update_interest(client_session_t *session) {
+    if (!session->registered) {
+        return;
+    }
+    unsigned interest = POLLER_READ | (outbound_empty(&session->outbound) ? 0 : POLLER_WRITE);
+    if (interest != session->interest) {
+        poller_modify(session->loop->poller, session->socket_fd, interest, session);
+        session->interest = interest;
+    }
+}
+
+// Caller holds send_lock, with the queue found empty: every message pushed
+// so far has been written, so the delivery marks move up.
+static void mark_drained(client_session_t *session) {
+    storage_delivery_mark(&session->delivered);
+    memcpy(session->written_seq, session->pushed_seq, sizeof(session->written_seq));
+}
+
+// Caller holds send_lock.
+static void flush_locked(client_session_t *session) {
+    long sent = outbound_flush(&session->outbound, session->socket_fd);
+    if (sent < 0) {
+        session->delivery_lost = true;
+        outbound_clear(&session->outbound); // peer is gone; the read side will close
+    } else if (sent > 0) {
+        metrics_count(METRIC_BYTES_OUT, (uint64_t)sent);
+        if (outbound_empty(&session->outbound)) {
+            mark_drained(session);
+        }
+    }
+    update_interest(session);
+}
+
+static void flush_output(client_session_t *session) {
+    lock_send(session);
+    flush_locked(session);
+    pthread_mutex_unlock(&session->send_lock);
+}
+
+// Caller holds send_lock. Appends without writing and returns whether the
+// socket is due a write now: the queue was idle, a corked batch has grown
+// past the flush threshold, or there is no loop to write it once writable.
+// With `shared` set its bytes are referenced rather than copied.
+static bool append_bytes(client_session_t *session, const char *data, size_t len, outbound_shared_t *shared) {
+    if (session->closed || session->overflowed) {
+        return false;
+    }
+    if (session->outbound.bytes + len > config.send_queue_limit) {
+        session->delivery_lost = true;
+        if (config.slow_consumer == SLOW_CONSUMER_DROP) {
+            return false;
+        }
+        session->overflowed = true;
+        metrics_count(METRIC_SLOW_CONSUMERS, 1);
+        outbound_clear(&session->outbound);
+        fprintf(stderr, "Disconnecting slow consumer %s\n",
+                session->authenticated ? session->username : "(unauthenticated)");
+        shutdown(session->socket_fd, SHUT_RDWR); // owner notices EOF and releases
+        return false;
+    }
+    bool was_empty = outbound_empty(&session->outbound);
+    int rc = shared ? outbound_push_shared(&session->outbound, shared) : outbound_push(&session->outbound, data, len);
+    if (rc != 0) {
+        session->delivery_lost = true;
+        return false;
+    }
+    if (session->corked) {
+        return session->outbound.bytes >= OUTBOUND_FLUSH_THRESHOLD;
+    }
+    return was_empty || !session->loop;
+}
+
+// Caller holds send_lock. Lines are only queued here; the socket is written
+// when append_bytes() says so or, for backed-up event-mode sockets, by the
+// owning loop once writable.
+static void queue_bytes(client_session_t *session, const char *data, size_t len, outbound_shared_t *shared) {
+    if (append_bytes(session, data, len, shared)) {
+        flush_locked(session);
+    }
+}
+
+static void queue_output(client_session_t *session, const char *data, size_t len) {
+    queue_bytes(session, data, len, NULL);
+}
+
+static void queue_shared(client_session_t *session, outbound_shared_t *shared) {
+    queue_bytes(session, shared->data, shared->len, shared);
+}
+
+// The owner thread corks a session while it dispatches a batch of commands so
+// all replies leave in as few writev() calls as possible.
+static void session_cork(client_session_t *session) {
+    lock_send(session);
+    session->corked = true;
+    pthread_mutex_unlock(&session->send_lock);
+}
+
+static void session_uncork(client_session_t *session) {
+    lock_send(session);
+    session->corked = false;
+    flush_locked(session);
+    pthread_mutex_unlock(&session->send_lock);
+}
+
+// Encodes a reply line as the status frame named by its first word into
+// `frame`, STATUS_FRAME_MAX bytes. Returns 0 if the word has no opcode.
+#define STATUS_FRAME_MAX (MAX_LINE + BINARY_MAX_HEADER + 2 * BINARY_MAX_VARINT)
+static size_t encode_status_frame(unsigned char *frame, request_tag_t tag, const char *text, size_t len) {
+    const char *space = memchr(text, ' ', len);
+    size_t keyword_len = space ? (size_t)(space - text) : len;
+    int opcode = binary_status_opcode(text, keyword_len);
+    if (opcode < 0) {
+        return 0;
+    }
+    const char *rest = space ? space + 1 : text + len;
+    binary_field_t fields[2];
+    size_t count = tag_fields(fields, tag);
+    fields[count++] = BINARY_TEXT(rest, (size_t)(text + len - rest));
+    return binary_encode(frame, tagged_opcode((binary_opcode_t)opcode, tag), fields, count);
+}
+
+// Caller holds send_lock. `text` is a reply line without its terminator and
+// `text` has room for one more byte; a binary session gets it as the status
+// frame named by the line's first word.
+static void queue_line_locked(client_session_t *session, request_tag_t tag, char *text, size_t len) {
+    if (!session->binary) {
+        if (!tag.tagged) {
+            text[len++] = '\n';
+            queue_output(session, text, len);
+            return;
+        }
+        char line[MAX_TAG_PREFIX + MAX_LINE];
+        size_t prefix = format_tag(line, tag);
+        memcpy(line + prefix, text, len);
+        line[prefix + len] = '\n';
+        queue_output(session, line, prefix + len + 1);
+        return;
+    }
+    unsigned char frame[STATUS_FRAME_MAX];
+    size_t size = encode_status_frame(frame, tag, text, len);
+    if (size > 0) { // every line the server sends after WELCOME has a status opcode
+        queue_output(session, (const char *)frame, size);
+    }
+}
+
+static void send_vreply(client_session_t *session, request_tag_t tag, const char *fmt, va_list args) {
+    char buffer[MAX_LINE];
+    vsnprintf(buffer, sizeof(buffer), fmt, args);
+    size_t len = strlen(buffer);
+    if (len > sizeof(buffer) - 2) {
+        len = sizeof(buffer) - 2;
+    }
+    flatten_line(buffer, len);
+
+    lock_send(session);
+    queue_line_locked(session, tag, buffer, len);
+    pthread_mutex_unlock(&session->send_lock);
+}
+
+// Sends an unsolicited line (WELCOME, SHUTDOWN, framing errors).
 static void send_formatted(client_session_t *session, const char *fmt, ...) {
-    char buffer[2048];
     va_list args;
     va_start(args, fmt);
-    vsnprintf(buffer, sizeof(buffer), fmt, args);
+    send_vreply(session, untagged, fmt, args);
     va_end(args);
-    size_t len = strlen(buffer);
-    if (len < sizeof(buffer) - 1) {
-        buffer[len++] = '\n';
+}
+
+// Sends one reply line to the command identified by `tag`.
+static void send_reply(client_session_t *session, request_tag_t tag, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    send_vreply(session, tag, fmt, args);
+    va_end(args);
+}
+
+// Formats the text MESSAGE line, newline included, into `line` (MAX_LINE).
+static size_t format_chat_line(char *line, const char *sender, const char *body) {
+    int written = snprintf(line, MAX_LINE, "MESSAGE %s %s", sender, body);
+    size_t len = written > 0 ? (size_t)written : 0;
+    if (len > MAX_LINE - 2) {
+        len = MAX_LINE - 2;
+    }
+    flatten_line(line, len);
+    line[len++] = '\n';
+    return len;
+}
+
+// Copies `len` encoded bytes into a new shared buffer.
+static outbound_shared_t *share_bytes(const void *data, size_t len) {
+    outbound_shared_t *shared = outbound_shared_alloc(len);
+    if (shared) {
+        memcpy(shared->data, data, len);
+    }
+    return shared;
+}
+
+// An untagged line (no terminator, shorter than MAX_LINE) encoded for a text
+// or binary recipient, as queue_line_locked() would send it.
+static outbound_shared_t *encode_line(bool binary, const char *text, size_t len) {
+    if (binary) {
+        unsigned char frame[STATUS_FRAME_MAX];
+        size_t size = encode_status_frame(frame, untagged, text, len);
+        return size > 0 ? share_bytes(frame, size) : NULL;
+    }
+    char line[MAX_LINE];
+    memcpy(line, text, len);
+    line[len] = '\n';
+    return share_bytes(line, len + 1);
+}
+
+// Binary recipients get the whole body, encoded straight into the shared
+// buffer; text recipients the usual line, cut at MAX_LINE.
+static outbound_shared_t *encode_chat_message(bool binary, const char *sender, const char *body) {
+    if (binary) {
+        binary_field_t fields[] = {BINARY_TEXT(sender, strlen(sender)), BINARY_TEXT(body, strlen(body))};
+        outbound_shared_t *shared = outbound_shared_alloc(binary_frame_size(fields, 2));
+        if (shared) {
+            binary_encode((unsigned char *)shared->data, BINARY_MESSAGE, fields, 2);
+        }
+        return shared;
+    }
+    char line[MAX_LINE];
+    return share_bytes(line, format_chat_line(line, sender, body));
+}
+
+// A push encoded at most once per wire format and queued by reference on
+// every recipient, however many there are (GROUP, presence, SHUTDOWN).
+typedef struct {
+    outbound_shared_t *encoded[2]; // text, binary
+} fanout_t;
+
+// Caller holds the target's send_lock, so the encoding picked cannot straddle
+// a mode switch. The slot is NULL until the caller encodes into it.
+static outbound_shared_t **fanout_slot(fanout_t *fanout, const client_session_t *target) {
+    return &fanout->encoded[target->binary ? 1 : 0];
+}
+
+static void fanout_release(fanout_t *fanout) {
+    for (size_t i = 0; i < 2; ++i) {
+        outbound_shared_release(fanout->encoded[i]);
+        fanout->encoded[i] = NULL;
+    }
+}
+
+// Encoded under send_lock so it cannot straddle a mode switch.
+static void send_chat_message(client_session_t *target, const char *sender, const char *body) {
+    lock_send(target);
+    outbound_shared_t *encoded = encode_chat_message(target->binary, sender, body);
+    if (encoded) {
+        queue_shared(target, encoded);
+        outbound_shared_release(encoded);
+    }
+    pthread_mutex_unlock(&target->send_lock);
+}
+
+static client_session_t *session_from_node(registry_node_t *node) {
+    return (client_session_t *)((char *)node - offsetof(client_session_t, registry_node));
+}
+
+static void session_hold(registry_node_t *node) {
+    atomic_fetch_add(&session_from_node(node)->refs, 1);
+}
+
+static void session_put(client_session_t *session) {
+    if (atomic_fetch_sub(&session->refs, 1) != 1) {
+        return;
     }
-    buffer[len] = '\0';
+    pthread_mutex_destroy(&session->send_lock);
+    outbound_clear(&session->outbound);
+    frame_reader_free(&session->frames);
+    pool_free(&session_pool, session);
+}
 
-    pthread_mutex_lock(&session->send_lock);
-    ssize_t written = send(session->socket_fd, buffer, strlen(buffer), 0);
-    (void)written; // best-effort send; errors handled by read loop
+// Clients told to come back all at once would hit the restarted server in one
+// wave, so the reconnect hint is spread over --reconnect-window: sessions are
+// dealt round-robin into buckets, each with its own delay and its own shared
+// encoding of the notice.
+typedef struct {
+    fanout_t buckets[RECONNECT_BUCKETS];
+    int delay_ms[RECONNECT_BUCKETS];
+    size_t next;
+} shutdown_notice_t;
+
+static void send_shutdown_notice(registry_node_t *node, void *ctx) {
+    shutdown_notice_t *notice = (shutdown_notice_t *)ctx;
+    size_t bucket = config.reconnect_window_ms > 0 ? notice->next++ % RECONNECT_BUCKETS : 0;
+    client_session_t *session = session_from_node(node);
+    lock_send(session);
+    outbound_shared_t **slot = fanout_slot(&notice->buckets[bucket], session);
+    if (!*slot) {
+        char line[64];
+        int len = config.reconnect_window_ms > 0
+                      ? snprintf(line, sizeof(line), "SHUTDOWN Server shutting down... reconnect in %d ms",
+                                 notice->delay_ms[bucket])
+                      : snprintf(line, sizeof(line), "SHUTDOWN Server shutting down...");
+        *slot = encode_line(session->binary, line, (size_t)len);
+    }
+    if (*slot) {
+        queue_shared(session, *slot);
+    }
     pthread_mutex_unlock(&session->send_lock);
 }
 
 static void broadcast_shutdown_message(void) {
-    pthread_mutex_lock(&clients_lock);
-    client_session_t *cur = clients_head;
-    while (cur) {
-        if (cur->authenticated) {
-            send_formatted(cur, "SHUTDOWN Server shutting down...");
-        }
-        cur = cur->next;
+    shutdown_notice_t notice;
+    memset(&notice, 0, sizeof(notice));
+    // Bucket i covers [i, i + 1) / RECONNECT_BUCKETS of the window, at a
+    // random point of it.
+    srand((unsigned)time(NULL));
+    for (int i = 0; i < RECONNECT_BUCKETS; ++i) {
+        int width = config.reconnect_window_ms / RECONNECT_BUCKETS;
+        notice.delay_ms[i] = i * width + (width > 0 ? rand() % width : 0);
+    }
+    registry_for_each(send_shutdown_notice, &notice);
+    for (int i = 0; i < RECONNECT_BUCKETS; ++i) {
+        fanout_release(&notice.buckets[i]);
     }
-    pthread_mutex_unlock(&clients_lock);
 }
 
 static void handle_signal(int signum) {
@@ -99,33 +833,21 @@ static void install_signal_handlers(void) {
     sigemptyset(&sa.sa_mask);
     sigaction(SIGINT, &sa, NULL);
     sigaction(SIGTERM, &sa, NULL);
+    // Writes to a reset peer must fail with EPIPE, not kill the process.
+    sa.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &sa, NULL);
 #endif
 }
 
-static client_session_t *find_client_by_name(const char *username) {
-    client_session_t *cur = clients_head;
-    while (cur) {
-        if (cur->authenticated && strncmp(cur->username, username, MAX_USERNAME) == 0) {
-            return cur;
-        }
-        cur = cur->next;
-    }
-    return NULL;
-}
-
-static bool username_available(const char *username) {
-    return find_client_by_name(username) == NULL;
-}
-
 static void add_client(client_session_t *session) {
-    pthread_mutex_lock(&clients_lock);
+    metrics_lock(&clients_lock, METRIC_CLIENTS_LOCK_WAIT);
     session->next = clients_head;
     clients_head = session;
     pthread_mutex_unlock(&clients_lock);
 }
 
 static void remove_client(client_session_t *session) {
-    pthread_mutex_lock(&clients_lock);
+    metrics_lock(&clients_lock, METRIC_CLIENTS_LOCK_WAIT);
     client_session_t **cur = &clients_head;
     while (*cur) {
         if (*cur == session) {
@@ -137,234 +859,2251 @@ static void remove_client(client_session_t *session) {
     pthread_mutex_unlock(&clients_lock);
 }
 
-static void notify_user_list(client_session_t *session) {
-    pthread_mutex_lock(&clients_lock);
-    client_session_t *cur = clients_head;
-    send_formatted(session, "USERS_BEGIN");
-    while (cur) {
-        if (cur->authenticated) {
-            send_formatted(session, "USER %s", cur->username);
+// Presence pushes reuse one encoded line per wire format, as GROUP does. One
+// call may report several events (a relocated or dropped user); each new
+// version starts over. Sockets are not written under the presence lock: the
+// subscribers due a write are held in `flush` until release_presence_push().
+typedef struct {
+    fanout_t frames;
+    uint64_t version; // of the event in `frames`, 0 for none
+    client_session_t **flush; // each with a reference
+    size_t flush_count;
+    size_t flush_capacity;
+} presence_push_t;
+
+#define PRESENCE_PUSH_INIT {{{NULL, NULL}}, 0, NULL, 0, 0}
+
+static size_t format_presence_line(char *line, const presence_event_t *event) {
+    int written = snprintf(line, MAX_LINE, "%s %s %llu", event->joined ? "JOIN" : "LEAVE", event->name,
+                           (unsigned long long)event->version);
+    return written > 0 ? (size_t)written : 0;
+}
+
+// Caller holds the target's send_lock. Returns false if the target could not
+// be listed, in which case the caller writes to it at once.
+static bool defer_flush(presence_push_t *push, client_session_t *target) {
+    if (target->flush_deferred) {
+        return true; // already listed; that flush writes these bytes too
+    }
+    if (push->flush_count == push->flush_capacity) {
+        size_t capacity = push->flush_capacity ? push->flush_capacity * 2 : 16;
+        client_session_t **flush = realloc(push->flush, capacity * sizeof(*flush));
+        if (!flush) {
+            return false;
         }
-        cur = cur->next;
+        push->flush = flush;
+        push->flush_capacity = capacity;
     }
-    pthread_mutex_unlock(&clients_lock);
-    send_formatted(session, "USERS_END");
+    atomic_fetch_add(&target->refs, 1);
+    target->flush_deferred = true;
+    push->flush[push->flush_count++] = target;
+    return true;
 }
 
-static void deliver_message(const char *sender, const char *receiver, const char *body) {
-    if (storage_store_message(sender, receiver, body) != 0) {
-        fprintf(stderr, "Failed to persist message from %s to %s: %s\n", sender, receiver, storage_last_error());
+// Runs under the presence lock for each subscriber. Only appends to the
+// queue, so logins and logouts do not wait behind socket writes.
+static void push_presence(presence_subscriber_t *subscriber, const presence_event_t *event, void *ctx) {
+    presence_push_t *push = (presence_push_t *)ctx;
+    client_session_t *target =
+        (client_session_t *)((char *)subscriber - offsetof(client_session_t, presence_node));
+    if (push->version != event->version) {
+        fanout_release(&push->frames);
+        push->version = event->version;
     }
-    pthread_mutex_lock(&clients_lock);
-    client_session_t *target = find_client_by_name(receiver);
-    if (target) {
-        send_formatted(target, "MESSAGE %s %s", sender, body);
+    lock_send(target);
+    outbound_shared_t **slot = fanout_slot(&push->frames, target);
+    if (!*slot) {
+        char line[MAX_LINE];
+        *slot = encode_line(target->binary, line, format_presence_line(line, event));
     }
-    pthread_mutex_unlock(&clients_lock);
+    if (*slot && append_bytes(target, (*slot)->data, (*slot)->len, *slot) && !defer_flush(push, target)) {
+        flush_locked(target);
+    }
+    pthread_mutex_unlock(&target->send_lock);
 }
 
-static ssize_t read_line(socket_handle_t fd, char *buffer, size_t max_len) {
-    size_t offset = 0;
-    while (offset < max_len - 1) {
-        char c;
-        ssize_t n = recv(fd, &c, 1, 0);
-        if (n <= 0) {
-            return n;
-        }
-        if (c == '\r') {
-            continue;
-        }
-        if (c == '\n') {
-            break;
+// After the presence call has returned, with its lock released.
+static void release_presence_push(presence_push_t *push) {
+    fanout_release(&push->frames);
+    for (size_t i = 0; i < push->flush_count; ++i) {
+        client_session_t *target = push->flush[i];
+        lock_send(target);
+        target->flush_deferred = false;
+        if (!target->closed) {
+            flush_locked(target);
         }
-        buffer[offset++] = c;
+        pthread_mutex_unlock(&target->send_lock);
+        session_put(target);
     }
-    buffer[offset] = '\0';
-    return (ssize_t)offset;
+    free(push->flush);
 }
 
-static void trim_newline(char *str) {
-    size_t len = strlen(str);
-    if (len == 0) {
+// Plain USERS and USERS <since> with a stale version get the list; a recent
+// enough version gets just the JOIN/LEAVE events after it. The lines are
+// written from a copy, with neither the registry nor the presence lock held.
+static void notify_user_list(client_session_t *session, request_tag_t tag, bool versioned, uint64_t since) {
+    presence_event_t *events = NULL;
+    size_t count = 0;
+    uint64_t version = 0;
+    int rc = versioned ? presence_changes(since, &events, &count, &version) : 0;
+    if (rc == 1) {
+        send_reply(session, tag, "USERS_BEGIN %llu delta", (unsigned long long)version);
+        for (size_t i = 0; i < count; ++i) {
+            char line[MAX_LINE];
+            format_presence_line(line, &events[i]);
+            send_reply(session, tag, "%s", line);
+        }
+        send_reply(session, tag, "USERS_END");
+        free(events);
         return;
     }
-    char *end = str + len - 1;
-    while (end >= str && (*end == '\n' || *end == '\r' || *end == ' ')) {
-        *end = '\0';
-        --end;
+    presence_snapshot_t *snapshot = rc == 0 ? presence_snapshot() : NULL;
+    if (!snapshot) {
+        send_reply(session, tag, "ERROR Failed to list users: out of memory");
+        return;
     }
+    if (versioned) {
+        send_reply(session, tag, "USERS_BEGIN %llu full", (unsigned long long)snapshot->version);
+    } else {
+        send_reply(session, tag, "USERS_BEGIN");
+    }
+    for (size_t i = 0; i < snapshot->count; ++i) {
+        send_reply(session, tag, "USER %s", snapshot->names[i]);
+    }
+    send_reply(session, tag, "USERS_END");
+    presence_snapshot_release(snapshot);
 }
 
-static void *client_worker(void *arg) {
-    client_session_t *session = (client_session_t *)arg;
-    send_formatted(session, "WELCOME Provide AUTH <username>");
-    char line[2048];
-    while (server_running) {
-        ssize_t len = read_line(session->socket_fd, line, sizeof(line));
-        if (len <= 0) {
-            break;
-        }
-        if (!session->authenticated) {
-            if (strncmp(line, "AUTH ", 5) == 0) {
-                char *username = line + 5;
-                trim_newline(username);
-                if (strlen(username) == 0 || strlen(username) >= MAX_USERNAME) {
-                    send_formatted(session, "ERROR Invalid username length");
-                    continue;
-                }
-                pthread_mutex_lock(&clients_lock);
-                bool available = username_available(username);
-                if (available) {
-                    strncpy(session->username, username, sizeof(session->username));
-                    session->authenticated = true;
-                    pthread_mutex_unlock(&clients_lock);
-                    send_formatted(session, "OK Authenticated as %s", session->username);
-                } else {
-                    pthread_mutex_unlock(&clients_lock);
-                    send_formatted(session, "ERROR Username taken");
-                }
-            } else {
-                send_formatted(session, "ERROR Authenticate first using AUTH <username>");
-            }
-            continue;
-        }
-
-        if (strncmp(line, "SEND ", 5) == 0) {
-            char *rest = line + 5;
-            char *space = strchr(rest, ' ');
-            if (!space) {
-                send_formatted(session, "ERROR Usage: SEND <user> <message>");
-                continue;
-            }
-            *space = '\0';
-            const char *target = rest;
-            const char *message = space + 1;
-            if (strlen(message) == 0) {
-                send_formatted(session, "ERROR Message cannot be empty");
-                continue;
-            }
-            deliver_message(session->username, target, message);
-            send_formatted(session, "OK Message queued");
-            continue;
-        }
+static void handle_presence(client_session_t *session, request_tag_t tag, bool on) {
+    if (on) {
+        presence_subscribe(&session->presence_node);
+        send_reply(session, tag, "OK Presence on");
+    } else {
+        presence_unsubscribe(&session->presence_node);
+        send_reply(session, tag, "OK Presence off");
+    }
+}
 
-        if (strncmp(line, "GET ", 4) == 0) {
-            const char *other = line + 4;
-            if (strlen(other) == 0) {
-                send_formatted(session, "ERROR Usage: GET <user>");
-                continue;
-            }
-            history_context_t ctx = {session, false};
-            if (storage_fetch_conversation(session->username, other, history_emit, &ctx) != 0) {
-                send_formatted(session, "ERROR Failed to query history: %s", storage_last_error());
-            } else if (!ctx.any) {
-                send_formatted(session, "INFO No messages with %s", other);
-            } else {
-                send_formatted(session, "OK History end");
-            }
-            continue;
+// STATS: one STAT line per metric, in the text form STATS_BEGIN/STATS_END
+// brackets like the user list.
+static void handle_stats(client_session_t *session, request_tag_t tag) {
+    size_t len;
+    char *text = metrics_render_text(&len);
+    if (!text) {
+        send_reply(session, tag, "ERROR Failed to collect statistics: out of memory");
+        return;
+    }
+    send_reply(session, tag, "STATS_BEGIN");
+    char *line = text;
+    char *end = text + len;
+    while (line < end) {
+        char *newline = memchr(line, '\n', (size_t)(end - line));
+        if (!newline) {
+            newline = end;
         }
+        send_reply(session, tag, "STAT %.*s", (int)(newline - line), line);
+        line = newline + 1;
+    }
+    send_reply(session, tag, "STATS_END");
+    free(text);
+}
 
-        if (strncmp(line, "DELETE ", 7) == 0) {
-            const char *other = line + 7;
-            if (strlen(other) == 0) {
-                send_formatted(session, "ERROR Usage: DELETE <user>");
-                continue;
-            }
-            if (storage_delete_conversation(session->username, other) != 0) {
-                send_formatted(session, "ERROR Failed to delete history: %s", storage_last_error());
-            } else {
-                send_formatted(session, "OK Deleted history with %s", other);
-            }
-            continue;
-        }
+// `error` is the failure's text; the caller's own storage_last_error() when
+// the failure happened on its thread.
+static void send_store_result(client_session_t *session, request_tag_t tag, int status, const char *error) {
+    if (status == 0) {
+        send_reply(session, tag, "OK Message queued");
+    } else {
+        send_reply(session, tag, "ERROR Failed to store message: %s", error);
+    }
+}
 
-        if (strcmp(line, "USERS") == 0) {
-            notify_user_list(session);
-            continue;
-        }
+// Run on the storage writer thread once the sender's message has committed;
+// both hold the reference taken in deliver_message(). Untagged sends, the
+// common case, pass the session itself and allocate nothing.
+static void ack_after_commit(int status, const char *error, void *ctx) {
+    client_session_t *session = (client_session_t *)ctx;
+    send_store_result(session, untagged, status, error);
+    session_put(session);
+}
 
-        if (strcmp(line, "QUIT") == 0) {
-            send_formatted(session, "BYE");
-            break;
-        }
+static void ack_tagged_after_commit(int status, const char *error, void *ctx) {
+    reply_target_t *target = (reply_target_t *)ctx;
+    send_store_result(target->session, target->tag, status, error);
+    session_put(target->session);
+    free(target);
+}
 
-        send_formatted(session, "ERROR Unknown command");
+static void log_store_failure(int status, const char *error, void *ctx) {
+    (void)ctx;
+    if (status != 0) {
+        fprintf(stderr, "Failed to persist message: %s\n", error);
     }
+}
 
-    net_close(session->socket_fd);
-    pthread_mutex_destroy(&session->send_lock);
-    if (session->authenticated) {
-        printf("User %s disconnected\n", session->username);
+// Hands the insert to the storage writer, which group-commits it with other
+// senders' messages. The sender's OK follows the commit or, with
+// --ack=enqueue, is sent as soon as the message is queued.
+static void store_and_ack(client_session_t *sender, request_tag_t tag, const char *const *receivers, size_t count,
+                          const char *body) {
+    if (config.ack == ACK_ON_ENQUEUE) {
+        if (storage_submit_group(sender->username, receivers, count, body, log_store_failure, NULL) != 0) {
+            send_store_result(sender, tag, -1, storage_last_error());
+        } else {
+            send_reply(sender, tag, "OK Message queued");
+        }
+        return;
+    }
+    store_callback ack = ack_after_commit;
+    void *ctx = sender;
+    if (tag.tagged) {
+        reply_target_t *target = malloc(sizeof(*target));
+        if (!target) {
+            send_reply(sender, tag, "ERROR Failed to store message: out of memory");
+            return;
+        }
+        target->session = sender;
+        target->tag = tag;
+        ack = ack_tagged_after_commit;
+        ctx = target;
+    }
+    atomic_fetch_add(&sender->refs, 1);
+    if (storage_submit_group(sender->username, receivers, count, body, ack, ctx) != 0) {
+        send_store_result(sender, tag, -1, storage_last_error());
+        session_put(sender);
+        if (ctx != sender) {
+            free(ctx);
+        }
+    }
+}
+
+// A recipient who is not connected here may be on another cluster node. The
+// push carries the delivery mark taken now, which that node's logout hands
+// back. Returns false when the push could not be queued: that link is down
+// or has been reset, so the other node counts it as lost rather than covered
+// by later pushes, and the message waits in the recipient's inbox.
+static bool forward_message(const char *sender, const char *receiver, const char *body) {
+    int node = cluster_enabled() ? presence_locate(receiver) : -1;
+    if (node < 0) {
+        return false;
+    }
+    storage_mark_t stamp;
+    storage_delivery_mark(&stamp);
+    if (cluster_push(node, sender, receiver, body, stamp.queued) != 0) {
+        metrics_count(METRIC_FORWARD_FAILED, 1);
+        return false;
+    }
+    metrics_count(METRIC_FORWARDED, 1);
+    return true;
+}
+
+// Fan-out for GROUP, and for every message in a cluster: the push is encoded
+// at most twice (text and binary) and every online recipient's queue
+// references that one buffer. Runs before the message is submitted, except in
+// a cluster, where it runs after so that the stamps forwarded pushes carry
+// cover the message itself.
+static void push_message(const char *sender, const char *const *receivers, size_t count, const char *body) {
+    fanout_t push = {{NULL, NULL}};
+    for (size_t i = 0; i < count; ++i) {
+        registry_node_t *node = registry_acquire(receivers[i]);
+        if (!node) {
+            forward_message(sender, receivers[i], body);
+            continue;
+        }
+        client_session_t *target = session_from_node(node);
+        lock_send(target);
+        outbound_shared_t **slot = fanout_slot(&push, target);
+        if (!*slot) {
+            *slot = encode_chat_message(target->binary, sender, body);
+        }
+        if (*slot) {
+            queue_shared(target, *slot);
+        }
+        pthread_mutex_unlock(&target->send_lock);
+        session_put(target);
+    }
+    fanout_release(&push);
+}
+
+// The sender's reply to a message split across the nodes that store its
+// conversations: sent once every part has committed, with the first error.
+typedef struct {
+    client_session_t *session;
+    request_tag_t tag;
+    atomic_int parts;
+    atomic_bool failed;
+    char error[MAX_LINE];
+} store_ticket_t;
+
+static void store_part_done(int status, const char *error, void *ctx) {
+    store_ticket_t *ticket = (store_ticket_t *)ctx;
+    if (status != 0 && !atomic_exchange(&ticket->failed, true)) {
+        snprintf(ticket->error, sizeof(ticket->error), "%s", error);
+    }
+    if (atomic_fetch_sub(&ticket->parts, 1) == 1) {
+        send_store_result(ticket->session, ticket->tag, atomic_load(&ticket->failed) ? -1 : 0, ticket->error);
+        session_put(ticket->session);
+        free(ticket);
+    }
+}
+
+// Cluster mode: each receiver's conversation with the sender lives on its
+// owner node, which pushes and stores it. The local part goes straight to
+// storage, the others to their owners; the sender hears back once.
+static void deliver_clustered(client_session_t *sender, request_tag_t tag, const char *const *receivers, size_t count,
+                              const char *body) {
+    const char **part = malloc(count * (sizeof(*part) + sizeof(int)));
+    store_ticket_t *ticket = config.ack == ACK_ON_ENQUEUE ? NULL : calloc(1, sizeof(*ticket));
+    if (!part || (config.ack != ACK_ON_ENQUEUE && !ticket)) {
+        free(part);
+        free(ticket);
+        send_reply(sender, tag, "ERROR Failed to store message: out of memory");
+        return;
+    }
+    int *owner = (int *)(part + count);
+    for (size_t i = 0; i < count; ++i) {
+        owner[i] = cluster_owner(sender->username, receivers[i]);
+    }
+    if (ticket) {
+        ticket->session = sender;
+        ticket->tag = tag;
+        atomic_init(&ticket->parts, 1); // ours, until every part is handed off
+        atomic_fetch_add(&sender->refs, 1);
+    }
+    char error[MAX_LINE] = "";
+    for (int node = 0; node < config.cluster.count; ++node) {
+        size_t n = 0;
+        for (size_t i = 0; i < count; ++i) {
+            if (owner[i] == node) {
+                part[n++] = receivers[i];
+            }
+        }
+        if (n == 0) {
+            continue;
+        }
+        if (ticket) {
+            atomic_fetch_add(&ticket->parts, 1);
+        }
+        int rc;
+        if (node == config.cluster.self) {
+            rc = storage_submit_group(sender->username, part, n, body, ticket ? store_part_done : log_store_failure,
+                                      ticket);
+            if (rc != 0) {
+                snprintf(error, sizeof(error), "%s", storage_last_error());
+            }
+            push_message(sender->username, part, n, body);
+        } else {
+            rc = cluster_store(node, sender->username, part, n, body, ticket ? store_part_done : NULL, ticket);
+            if (rc != 0) {
+                snprintf(error, sizeof(error), "cluster node %d is unavailable", node);
+            }
+        }
+        if (rc != 0 && ticket) {
+            store_part_done(-1, error, ticket);
+        }
+    }
+    free(part);
+    if (ticket) {
+        store_part_done(0, NULL, ticket);
+    } else if (error[0]) {
+        send_store_result(sender, tag, -1, error);
+    } else {
+        send_reply(sender, tag, "OK Message queued");
+    }
+}
+
+// Pushes the message to an online recipient straight away, then stores it.
+static void deliver_message(client_session_t *sender, request_tag_t tag, const char *receiver, const char *body) {
+    uint64_t start = metrics_now();
+    metrics_count(METRIC_MESSAGES, 1);
+    if (cluster_enabled()) {
+        deliver_clustered(sender, tag, &receiver, 1, body);
+        metrics_record_since(METRIC_DELIVER_TIME, start);
+        return;
+    }
+    registry_node_t *node = registry_acquire(receiver);
+    if (node) {
+        client_session_t *target = session_from_node(node);
+        send_chat_message(target, sender->username, body);
+        session_put(target);
+    }
+    store_and_ack(sender, tag, &receiver, 1, body);
+    metrics_record_since(METRIC_DELIVER_TIME, start);
+}
+
+// Storage keeps a single row for a GROUP body.
+static void deliver_group(client_session_t *sender, request_tag_t tag, const char *const *receivers, size_t count,
+                          const char *body) {
+    uint64_t start = metrics_now();
+    metrics_count(METRIC_MESSAGES, 1);
+    if (cluster_enabled()) {
+        deliver_clustered(sender, tag, receivers, count, body);
+    } else {
+        push_message(sender->username, receivers, count, body);
+        store_and_ack(sender, tag, receivers, count, body);
+    }
+    metrics_record_since(METRIC_DELIVER_TIME, start);
+}
+
+// Cluster hooks, run on the reader thread of the peer's link. The push's
+// seq is noted before it is queued, so a write that empties the queue at
+// once already counts it.
+static bool deliver_pushed(int node, uint64_t seq, const char *sender, const char *receiver, const char *body) {
+    registry_node_t *entry = registry_acquire(receiver);
+    if (!entry) {
+        return false;
+    }
+    client_session_t *target = session_from_node(entry);
+    lock_send(target);
+    target->pushed_seq[node] = seq;
+    outbound_shared_t *encoded = encode_chat_message(target->binary, sender, body);
+    if (encoded) {
+        queue_shared(target, encoded);
+        outbound_shared_release(encoded);
+    } else {
+        target->delivery_lost = true;
+    }
+    pthread_mutex_unlock(&target->send_lock);
+    session_put(target);
+    return true;
+}
+
+typedef struct {
+    int node;
+    uint64_t seq;
+} relay_t;
+
+static void relay_stored(int status, const char *error, void *ctx) {
+    relay_t *relay = (relay_t *)ctx;
+    cluster_stored(relay->node, relay->seq, status, error);
+    free(relay);
+}
+
+// A message relayed by the sender's node, for conversations stored here.
+static void store_relayed(int node, uint64_t seq, const char *sender, const char *const *receivers, size_t count,
+                          const char *body) {
+    relay_t *relay = seq ? malloc(sizeof(*relay)) : NULL;
+    if (relay) {
+        *relay = (relay_t){node, seq};
+    }
+    if (seq && !relay) {
+        cluster_stored(node, seq, -1, "out of memory");
+    } else if (storage_submit_group(sender, receivers, count, body, relay ? relay_stored : log_store_failure,
+                                    relay) != 0) {
+        if (relay) {
+            cluster_stored(node, seq, -1, storage_last_error());
+            free(relay);
+        } else {
+            fprintf(stderr, "Failed to persist message from %s to %s: %s\n", sender, receivers[0],
+                    storage_last_error());
+        }
+    }
+    push_message(sender, receivers, count, body);
+}
+
+// Serves a read from this node's store: for a local user, or as the read
+// hook for a user of another node. An inbox is only peeked at; the reader
+// advances it once the rows are delivered.
+static int read_local(const cluster_read_t *request, cluster_row_callback emit, void *ctx, char *error,
+                      size_t error_len) {
+    int rc;
+    switch (request->kind) {
+    case CLUSTER_READ_HISTORY:
+        rc = storage_fetch_conversation(request->user, request->other, request->id, request->limit, emit, ctx);
+        break;
+    case CLUSTER_READ_SINCE:
+        rc = storage_fetch_since(request->user, request->other, request->id, request->limit, emit, ctx);
+        break;
+    case CLUSTER_READ_INBOX:
+        rc = storage_peek_inbox(request->user, request->limit, emit, ctx);
+        break;
+    default:
+        rc = storage_delete_conversation(request->user, request->other);
+        break;
+    }
+    if (rc != 0) {
+        snprintf(error, error_len, "%s", storage_last_error());
+    }
+    return rc;
+}
+
+// GET, SYNC and DELETE go to the node that stores the conversation.
+static int read_conversation(const cluster_read_t *request, cluster_row_callback emit, void *ctx, char *error,
+                             size_t error_len) {
+    int node = cluster_enabled() ? cluster_owner(request->user, request->other) : -1;
+    if (node < 0 || node == config.cluster.self) {
+        return read_local(request, emit, ctx, error, error_len);
+    }
+    bool partial;
+    return cluster_read(node, request, emit, ctx, &partial, error, error_len);
+}
+
+static void advance_inbox(const char *name, const int64_t *ids, size_t count) {
+    if (storage_advance_inbox(name, ids, count) != 0) {
+        fprintf(stderr, "Failed to record delivery for %s: %s\n", name, storage_last_error());
+    }
+}
+
+static void mark_pushes_delivered(const char *name, const uint64_t *stamp) {
+    storage_mark_t mark;
+    memset(&mark, 0, sizeof(mark));
+    memcpy(mark.queued, stamp, storage_shard_count() * sizeof(mark.queued[0]));
+    if (storage_mark_delivered(name, &mark) != 0) {
+        fprintf(stderr, "Failed to record delivery for %s: %s\n", name, storage_last_error());
+    }
+}
+
+static int remote_join(const char *name, int node, bool exclusive) {
+    presence_push_t push = PRESENCE_PUSH_INIT;
+    int rc = presence_join_remote(name, node, exclusive, push_presence, &push);
+    release_presence_push(&push);
+    return rc;
+}
+
+static void remote_leave(const char *name, int node) {
+    presence_push_t push = PRESENCE_PUSH_INIT;
+    presence_leave_remote(name, node, push_presence, &push);
+    release_presence_push(&push);
+}
+
+static void remote_drop(int node) {
+    presence_push_t push = PRESENCE_PUSH_INIT;
+    presence_drop_node(node, push_presence, &push);
+    release_presence_push(&push);
+}
+
+static int compare_names(const void *a, const void *b) {
+    return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+// Sorts the receiver list and drops repeats; each receiver gets one copy.
+static size_t unique_receivers(const char **receivers, size_t count) {
+    qsort(receivers, count, sizeof(receivers[0]), compare_names);
+    size_t out = 0;
+    for (size_t i = 0; i < count; ++i) {
+        if (out == 0 || strcmp(receivers[out - 1], receivers[i]) != 0) {
+            receivers[out++] = receivers[i];
+        }
+    }
+    return out;
+}
+
+// Splits "<user>,<user>,..." in place. Returns the number of distinct names,
+// or 0 if a name is empty or there are more than MAX_GROUP_RECEIVERS.
+static size_t split_receivers(char *list, const char **receivers) {
+    size_t count = 0;
+    for (char *name = list; name; ) {
+        char *comma = strchr(name, ',');
+        if (comma) {
+            *comma = '\0';
+        }
+        if (*name == '\0' || count == MAX_GROUP_RECEIVERS) {
+            return 0;
+        }
+        receivers[count++] = name;
+        name = comma ? comma + 1 : NULL;
+    }
+    return unique_receivers(receivers, count);
+}
+
+static void trim_newline(char *str) {
+    size_t len = strlen(str);
+    if (len == 0) {
+        return;
+    }
+    char *end = str + len - 1;
+    while (end >= str && (*end == '\n' || *end == '\r' || *end == ' ')) {
+        *end = '\0';
+        --end;
+    }
+}
+
+static uint32_t node_bit(int node) {
+    return 1u << node;
+}
+
+// An inbox row held until every node's page is in, for the merge.
+typedef struct {
+    int node;
+    int64_t id;
+    const char *timestamp;
+    const char *sender;
+    const char *body;
+} inbox_row_t;
+
+typedef struct {
+    inbox_row_t *rows;
+    size_t count;
+    size_t capacity;
+    int node; // whose page is being read
+    bool failed;
+} inbox_rows_t;
+
+static void collect_inbox_row(int64_t id, const char *timestamp, const char *sender, const char *body, void *ctx) {
+    inbox_rows_t *collected = (inbox_rows_t *)ctx;
+    if (collected->failed) {
+        return;
+    }
+    if (collected->count == collected->capacity) {
+        size_t capacity = collected->capacity ? collected->capacity * 2 : 64;
+        inbox_row_t *rows = realloc(collected->rows, capacity * sizeof(*rows));
+        if (!rows) {
+            collected->failed = true;
+            return;
+        }
+        collected->rows = rows;
+        collected->capacity = capacity;
+    }
+    size_t ts_len = strlen(timestamp) + 1;
+    size_t sender_len = strlen(sender) + 1;
+    size_t body_len = strlen(body) + 1;
+    char *text = malloc(ts_len + sender_len + body_len);
+    if (!text) {
+        collected->failed = true;
+        return;
+    }
+    inbox_row_t *row = &collected->rows[collected->count++];
+    row->node = collected->node;
+    row->id = id;
+    row->timestamp = memcpy(text, timestamp, ts_len);
+    row->sender = memcpy(text + ts_len, sender, sender_len);
+    row->body = memcpy(text + ts_len + sender_len, body, body_len);
+}
+
+// Rows of one node's page keep their order (id order per shard); pages are
+// merged by timestamp, as storage merges its shards.
+static int compare_inbox_rows(const void *a, const void *b) {
+    const inbox_row_t *x = (const inbox_row_t *)a;
+    const inbox_row_t *y = (const inbox_row_t *)b;
+    int order = strcmp(x->timestamp, y->timestamp);
+    if (order == 0) {
+        order = x->node != y->node ? (x->node < y->node ? -1 : 1) : (x->id < y->id ? -1 : x->id > y->id);
+    }
+    return order;
+}
+
+static void drop_inbox_rows(inbox_rows_t *collected, size_t from) {
+    for (size_t i = from; i < collected->count; ++i) {
+        free((char *)collected->rows[i].timestamp);
+    }
+    collected->count = from;
+}
+
+// Cluster mode: each node's store holds part of the inbox. Every node's page
+// is read, the rows merged and cut to one page, and each store's cursors then
+// advanced past the rows it gave; a node that failed keeps its cursors.
+static int fetch_cluster_inbox(client_session_t *session, history_context_t *hist, char *error, size_t error_len) {
+    inbox_rows_t collected = {NULL, 0, 0, 0, false};
+    int rc = 0;
+    session->inbox_more = 0;
+    for (int node = 0; node < config.cluster.count; ++node) {
+        cluster_read_t request = {CLUSTER_READ_INBOX, session->username, "", 0, INBOX_PAGE};
+        char problem[MAX_LINE];
+        size_t before = collected.count;
+        bool partial = false;
+        collected.node = node;
+        int read = node == config.cluster.self
+                       ? read_local(&request, collect_inbox_row, &collected, problem, sizeof(problem))
+                       : cluster_read(node, &request, collect_inbox_row, &collected, &partial, problem,
+                                      sizeof(problem));
+        if (read == 0 && collected.failed) {
+            snprintf(problem, sizeof(problem), "out of memory reading inbox");
+            read = -1;
+        }
+        if (read != 0) {
+            drop_inbox_rows(&collected, before);
+            collected.failed = false;
+            session->inbox_more |= node_bit(node);
+            if (rc == 0) {
+                snprintf(error, error_len, "%s", problem);
+            }
+            rc = -1;
+        } else if (partial || collected.count - before == INBOX_PAGE) {
+            session->inbox_more |= node_bit(node);
+        }
+    }
+    if (collected.count > 0) {
+        qsort(collected.rows, collected.count, sizeof(collected.rows[0]), compare_inbox_rows);
+    }
+    // One page as in standalone mode: the rows past it stay unread on their
+    // node, whose cursors move only over what is sent.
+    for (size_t i = INBOX_PAGE; i < collected.count; ++i) {
+        session->inbox_more |= node_bit(collected.rows[i].node);
+    }
+    if (collected.count > INBOX_PAGE) {
+        drop_inbox_rows(&collected, INBOX_PAGE);
+    }
+    int64_t *ids = collected.count > 0 ? malloc(collected.count * sizeof(*ids)) : NULL;
+    for (size_t i = 0; i < collected.count; ++i) {
+        const inbox_row_t *row = &collected.rows[i];
+        history_emit(row->id, row->timestamp, row->sender, row->body, hist);
+    }
+    for (int node = 0; ids && node < config.cluster.count; ++node) {
+        size_t n = 0;
+        for (size_t i = 0; i < collected.count; ++i) {
+            if (collected.rows[i].node == node) {
+                ids[n++] = collected.rows[i].id;
+            }
+        }
+        if (n > 0 && node == config.cluster.self) {
+            advance_inbox(session->username, ids, n);
+        } else if (n > 0) {
+            cluster_advance(node, session->username, ids, n);
+        }
+    }
+    free(ids); // without it the cursors stay, and the rows come again
+    drop_inbox_rows(&collected, 0);
+    free(collected.rows);
+    return rc;
+}
+
+// Pushes messages that arrived while the user was away, oldest first, a page
+// at a time. On AUTH nothing is sent for an empty inbox; the INBOX command
+// always gets its trailer. Delivery is at least once: a message pushed live
+// just as its receiver leaves or arrives may be repeated here.
+static void handle_inbox(client_session_t *session, request_tag_t tag, bool requested) {
+    history_context_t hist;
+    history_begin(&hist, session, tag, "INBOX", BINARY_MISSED);
+    char error[MAX_LINE];
+    int rc;
+    if (cluster_enabled()) {
+        rc = fetch_cluster_inbox(session, &hist, error, sizeof(error));
+    } else {
+        rc = storage_fetch_inbox(session->username, INBOX_PAGE, history_emit, &hist);
+        // A failure keeps the cursor where it is, too.
+        session->inbox_more = rc != 0 || hist.count == INBOX_PAGE ? node_bit(0) : 0;
+        if (rc != 0) {
+            snprintf(error, sizeof(error), "%s", storage_last_error());
+        }
+    }
+    history_flush(&hist);
+    if (rc != 0) {
+        send_reply(session, tag, "ERROR Failed to query inbox: %s", error);
+    } else if (session->inbox_more) {
+        send_reply(session, tag, "OK Inbox more");
+    } else if (requested || hist.count > 0) {
+        send_reply(session, tag, "OK Inbox end");
+    }
+}
+
+// Reapplies what session_tokens_logout() recorded for the previous session.
+static void resume_session(client_session_t *session, const session_state_t *state) {
+    if (state->presence) {
+        presence_subscribe(&session->presence_node);
+    }
+}
+
+// `token` (NULL if absent) asks to resume the session it was issued for; a
+// stale one is no error, the login just starts afresh with a new token.
+static void handle_auth(client_session_t *session, request_tag_t tag, const char *username, const char *token) {
+    if (strlen(username) == 0 || strlen(username) >= MAX_USERNAME) {
+        send_reply(session, tag, "ERROR Invalid username length");
+        return;
+    }
+    // Before the claim, after which pushes for the name may be on their way.
+    for (int node = 0; cluster_enabled() && node < config.cluster.count; ++node) {
+        session->push_losses[node] = cluster_push_losses(node, username);
+    }
+    // In a cluster the name's home node decides first, cluster-wide.
+    cluster_claim_t claim = cluster_enabled() ? cluster_claim(username) : CLUSTER_HOME;
+    if (claim == CLUSTER_UNAVAILABLE) {
+        send_reply(session, tag, "ERROR Cluster unavailable, try again");
+        return;
+    }
+    if (claim == CLUSTER_TAKEN) {
+        send_reply(session, tag, "ERROR Username taken");
+        return;
+    }
+    memcpy(session->username, username, strlen(username) + 1); // length checked above
+    presence_push_t push = PRESENCE_PUSH_INIT;
+    int rc = presence_join(&session->registry_node, session->username, claim == CLUSTER_GRANTED, push_presence,
+                           &push);
+    release_presence_push(&push);
+    if (rc == 0) {
+        cluster_announce(session->username, true);
+        session->authenticated = true;
+        session_state_t state;
+        char issued[SESSION_TOKEN_LEN + 1];
+        if (token && session_tokens_resume(session->username, token, &state)) {
+            resume_session(session, &state);
+            send_reply(session, tag, "OK Resumed as %s %s", session->username, token);
+        } else if (session_tokens_issue(session->username, issued) == 0) {
+            send_reply(session, tag, "OK Authenticated as %s %s", session->username, issued);
+        } else {
+            send_reply(session, tag, "OK Authenticated as %s", session->username);
+        }
+        handle_inbox(session, tag, false);
+    } else {
+        session->username[0] = '\0';
+        send_reply(session, tag, "ERROR Username taken");
+    }
+}
+
+static void handle_get(client_session_t *session, request_tag_t tag, const char *other, int limit, int64_t before_id) {
+    history_context_t hist;
+    history_begin(&hist, session, tag, "HISTORY", BINARY_HISTORY);
+    cluster_read_t request = {CLUSTER_READ_HISTORY, session->username, other, before_id, limit};
+    char error[MAX_LINE];
+    int rc = read_conversation(&request, history_emit, &hist, error, sizeof(error));
+    history_flush(&hist);
+    if (rc != 0) {
+        send_reply(session, tag, "ERROR Failed to query history: %s", error);
+    } else if (hist.count == 0) {
+        send_reply(session, tag, "INFO No messages with %s", other);
+    } else if (limit > 0 && hist.count == limit) {
+        // A full page: older messages may remain, fetch them with this cursor.
+        send_reply(session, tag, "OK History more %lld", (long long)hist.oldest_id);
+    } else {
+        send_reply(session, tag, "OK History end");
+    }
+}
+
+// The oldest page of messages above `after_id`. The trailer carries the
+// newest id sent (after_id if none), which is where the next SYNC starts;
+// "more" says a full page went out and newer messages may remain.
+static void handle_sync(client_session_t *session, request_tag_t tag, const char *other, int64_t after_id) {
+    history_context_t hist;
+    history_begin(&hist, session, tag, "SYNC", BINARY_HISTORY);
+    hist.with_id = true;
+    cluster_read_t request = {CLUSTER_READ_SINCE, session->username, other, after_id, SYNC_PAGE};
+    char error[MAX_LINE];
+    int rc = read_conversation(&request, history_emit, &hist, error, sizeof(error));
+    history_flush(&hist);
+    if (rc != 0) {
+        send_reply(session, tag, "ERROR Failed to query history: %s", error);
+    } else {
+        send_reply(session, tag, "OK Sync %s %lld", hist.count == SYNC_PAGE ? "more" : "end",
+                   (long long)(hist.count > 0 ? hist.newest_id : after_id));
+    }
+}
+
+static void handle_delete(client_session_t *session, request_tag_t tag, const char *other) {
+    cluster_read_t request = {CLUSTER_READ_DELETE, session->username, other, 0, 0};
+    char error[MAX_LINE];
+    if (read_conversation(&request, NULL, NULL, error, sizeof(error)) != 0) {
+        send_reply(session, tag, "ERROR Failed to delete history: %s", error);
+    } else {
+        send_reply(session, tag, "OK Deleted history with %s", other);
+    }
+}
+
+// The reply is the last text line; whatever the client sends after BINARY
+// is framed.
+static void switch_to_binary(client_session_t *session, request_tag_t tag) {
+    char reply[] = "OK Binary protocol\n";
+    lock_send(session);
+    queue_line_locked(session, tag, reply, sizeof(reply) - 2);
+    session->binary = true;
+    pthread_mutex_unlock(&session->send_lock);
+}
+
+// Splits an optional "#<id> " prefix off `*line`. Returns false if the line
+// starts like a tag but does not hold a valid one.
+static bool parse_request_tag(char **line, request_tag_t *tag) {
+    *tag = untagged;
+    if ((*line)[0] != '#') {
+        return true;
+    }
+    char *digits = *line + 1;
+    if (*digits < '0' || *digits > '9') {
+        return false;
+    }
+    char *end;
+    errno = 0;
+    unsigned long long id = strtoull(digits, &end, 10);
+    if (errno == ERANGE || *end != ' ') {
+        return false;
+    }
+    tag->tagged = true;
+    tag->id = (uint64_t)id;
+    *line = end + 1;
+    return true;
+}
+
+// Gate for commands that create work. Replies and returns false when the
+// command must be refused: "ERROR Busy" while the server sheds load, or
+// "ERROR Rate limited" once this session has used its share.
+static bool admit(client_session_t *session, request_tag_t tag, admit_class_t kind) {
+    uint64_t retry_ms = 0;
+    switch (admission_check(&session->limits, kind, metrics_now(), &retry_ms)) {
+    case ADMIT_OK:
+        return true;
+    case ADMIT_BUSY:
+        metrics_count(METRIC_SHED, 1);
+        send_reply(session, tag, "ERROR Busy");
+        return false;
+    case ADMIT_RATE_LIMITED:
+        metrics_count(METRIC_RATE_LIMITED, 1);
+        send_reply(session, tag, "ERROR Rate limited, retry in %llu ms", (unsigned long long)retry_ms);
+        return false;
+    }
+    return true;
+}
+
+// Executes one protocol line. Returns false once the connection should close.
+static bool process_command(client_session_t *session, char *line) {
+    request_tag_t tag;
+    if (!parse_request_tag(&line, &tag)) {
+        send_formatted(session, "ERROR Invalid request id");
+        return true;
+    }
+    if (strcmp(line, "BINARY") == 0) {
+        switch_to_binary(session, tag);
+        return true;
+    }
+    // Any input counts as activity, so a PONG needs no further handling.
+    if (strcmp(line, "PING") == 0) {
+        send_reply(session, tag, "PONG");
+        return true;
+    }
+    if (strcmp(line, "PONG") == 0) {
+        return true;
+    }
+    if (!session->authenticated) {
+        if (strncmp(line, "AUTH ", 5) == 0) {
+            char *username = line + 5;
+            trim_newline(username);
+            char *token = strchr(username, ' ');
+            if (token) {
+                *token++ = '\0';
+            }
+            handle_auth(session, tag, username, token);
+        } else {
+            send_reply(session, tag, "ERROR Authenticate first using AUTH <username>");
+        }
+        return true;
+    }
+
+    if (strncmp(line, "SEND ", 5) == 0) {
+        char *rest = line + 5;
+        char *space = strchr(rest, ' ');
+        if (!space) {
+            send_reply(session, tag, "ERROR Usage: SEND <user> <message>");
+            return true;
+        }
+        *space = '\0';
+        const char *target = rest;
+        const char *message = space + 1;
+        if (strlen(message) == 0) {
+            send_reply(session, tag, "ERROR Message cannot be empty");
+            return true;
+        }
+        if (!admit(session, tag, ADMIT_SEND)) {
+            return true;
+        }
+        deliver_message(session, tag, target, message);
+        return true;
+    }
+
+    if (strncmp(line, "GROUP ", 6) == 0) {
+        char *rest = line + 6;
+        char *space = strchr(rest, ' ');
+        const char *receivers[MAX_GROUP_RECEIVERS];
+        size_t count = 0;
+        if (space) {
+            *space = '\0';
+            count = split_receivers(rest, receivers);
+        }
+        if (count == 0) {
+            send_reply(session, tag, "ERROR Usage: GROUP <user>[,<user>...] <message> (up to %d users)",
+                       MAX_GROUP_RECEIVERS);
+            return true;
+        }
+        if (space[1] == '\0') {
+            send_reply(session, tag, "ERROR Message cannot be empty");
+            return true;
+        }
+        if (!admit(session, tag, ADMIT_SEND)) {
+            return true;
+        }
+        deliver_group(session, tag, receivers, count, space + 1);
+        return true;
+    }
+
+    if (strncmp(line, "GET ", 4) == 0) {
+        const char *other;
+        int limit;
+        int64_t before_id;
+        if (!parse_history_request(line + 4, &other, &limit, &before_id)) {
+            send_reply(session, tag, "ERROR Usage: GET <user> [limit 1-%d] [before_id]", MAX_HISTORY_PAGE);
+            return true;
+        }
+        if (!admit(session, tag, ADMIT_GET)) {
+            return true;
+        }
+        handle_get(session, tag, other, limit, before_id);
+        return true;
+    }
+
+    if (strncmp(line, "SYNC ", 5) == 0) {
+        char *space = strchr(line + 5, ' ');
+        char *end = NULL;
+        long long after_id = -1;
+        if (space) {
+            *space = '\0';
+            errno = 0;
+            after_id = strtoll(space + 1, &end, 10);
+        }
+        if (!space || line[5] == '\0' || end == space + 1 || *end != '\0' || after_id < 0 || errno == ERANGE) {
+            send_reply(session, tag, "ERROR Usage: SYNC <user> <after_id>");
+            return true;
+        }
+        if (!admit(session, tag, ADMIT_GET)) {
+            return true;
+        }
+        handle_sync(session, tag, line + 5, (int64_t)after_id);
+        return true;
+    }
+
+    if (strncmp(line, "DELETE ", 7) == 0) {
+        const char *other = line + 7;
+        if (strlen(other) == 0) {
+            send_reply(session, tag, "ERROR Usage: DELETE <user>");
+            return true;
+        }
+        handle_delete(session, tag, other);
+        return true;
+    }
+
+    if (strcmp(line, "USERS") == 0) {
+        if (!admit(session, tag, ADMIT_USERS)) {
+            return true;
+        }
+        notify_user_list(session, tag, false, 0);
+        return true;
+    }
+
+    if (strncmp(line, "USERS ", 6) == 0) {
+        char *end;
+        errno = 0;
+        unsigned long long since = strtoull(line + 6, &end, 10);
+        if (line[6] < '0' || line[6] > '9' || *end != '\0' || errno == ERANGE) {
+            send_reply(session, tag, "ERROR Usage: USERS [since_version]");
+            return true;
+        }
+        if (!admit(session, tag, ADMIT_USERS)) {
+            return true;
+        }
+        notify_user_list(session, tag, true, (uint64_t)since);
+        return true;
+    }
+
+    if (strcmp(line, "PRESENCE ON") == 0 || strcmp(line, "PRESENCE OFF") == 0) {
+        handle_presence(session, tag, line[10] == 'N');
+        return true;
+    }
+
+    if (strcmp(line, "INBOX") == 0) {
+        if (!admit(session, tag, ADMIT_GET)) {
+            return true;
+        }
+        handle_inbox(session, tag, true);
+        return true;
+    }
+
+    if (strcmp(line, "STATS") == 0) {
+        handle_stats(session, tag);
+        return true;
+    }
+
+    if (strcmp(line, "QUIT") == 0) {
+        send_reply(session, tag, "BYE");
+        return false;
+    }
+
+    send_reply(session, tag, "ERROR Unknown command");
+    return true;
+}
+
+// Copies a text field into `out` as a C string. Names are held to what a
+// text line could carry, which keeps storage's conversation keys bounded.
+static bool next_name(binary_cursor_t *cur, char *out) {
+    const char *text;
+    size_t len;
+    if (!binary_next_text(cur, &text, &len) || len >= MAX_LINE) {
+        return false;
+    }
+    memcpy(out, text, len);
+    out[len] = '\0';
+    return true;
+}
+
+// GROUP frame: count, names, body. Returns false if the fields are malformed.
+static bool process_group_frame(client_session_t *session, request_tag_t tag, binary_cursor_t *cur, size_t len) {
+    uint64_t count;
+    if (!binary_next_int(cur, &count)) {
+        return false;
+    }
+    if (count == 0 || count > MAX_GROUP_RECEIVERS) {
+        send_reply(session, tag, "ERROR Usage: GROUP <user>[,<user>...] <message> (up to %d users)",
+                   MAX_GROUP_RECEIVERS);
+        return true;
+    }
+    // One block for the pointers and the NUL-terminated copies of the names
+    // and body, which together take at most the frame plus a byte each.
+    size_t n = (size_t)count;
+    const char **receivers = malloc(n * sizeof(*receivers) + len + n + 1);
+    if (!receivers) {
+        send_reply(session, tag, "ERROR Failed to store message: out of memory");
+        return true;
+    }
+    char *out = (char *)(receivers + n);
+    const char *text;
+    size_t text_len;
+    bool ok = true;
+    for (size_t i = 0; ok && i <= n; ++i) {
+        ok = binary_next_text(cur, &text, &text_len) && (i == n || (text_len > 0 && text_len < MAX_LINE));
+        if (ok) {
+            memcpy(out, text, text_len);
+            out[text_len] = '\0';
+            if (i < n) {
+                receivers[i] = out;
+            }
+            out += text_len + 1;
+        }
+    }
+    ok = ok && cur->p == cur->end;
+    if (ok) {
+        if (text_len == 0) {
+            send_reply(session, tag, "ERROR Message cannot be empty");
+        } else if (admit(session, tag, ADMIT_SEND)) {
+            deliver_group(session, tag, receivers, unique_receivers(receivers, n), out - text_len - 1);
+        }
+    }
+    free(receivers);
+    return ok;
+}
+
+// Binary counterpart of process_command(); same replies, same handlers.
+static bool process_frame(client_session_t *session, int opcode, const unsigned char *body, size_t len) {
+    binary_cursor_t cur = {body, body + len};
+    char user[MAX_LINE];
+    request_tag_t tag = untagged;
+    if (opcode & BINARY_TAGGED) {
+        if (!binary_next_int(&cur, &tag.id)) {
+            send_formatted(session, "ERROR Malformed frame");
+            return true;
+        }
+        tag.tagged = true;
+        opcode &= ~BINARY_TAGGED;
+    }
+    if ((opcode == BINARY_PING || opcode == BINARY_PONG) && cur.p == cur.end) {
+        if (opcode == BINARY_PING) {
+            send_reply(session, tag, "PONG");
+        }
+        return true;
+    }
+    // Like PING, a property of the connection, so allowed before AUTH.
+    if (opcode == BINARY_COMPRESS) {
+        uint64_t on;
+        if (!binary_next_int(&cur, &on) || cur.p != cur.end || on > 1) {
+            send_reply(session, tag, "ERROR Malformed frame");
+        } else if (on == 1 && !CHAT_USE_ZLIB) {
+            send_reply(session, tag, "ERROR Compression unavailable");
+        } else {
+            session->deflate_history = on == 1;
+            send_reply(session, tag, "OK Compression %s", on == 1 ? "on" : "off");
+        }
+        return true;
+    }
+    if (!session->authenticated) {
+        char token[MAX_LINE];
+        if (opcode != BINARY_AUTH) {
+            send_reply(session, tag, "ERROR Authenticate first using AUTH <username>");
+        } else if (!next_name(&cur, user)) {
+            send_reply(session, tag, "ERROR Malformed frame");
+        } else if (cur.p == cur.end) {
+            handle_auth(session, tag, user, NULL);
+        } else if (next_name(&cur, token) && cur.p == cur.end) {
+            handle_auth(session, tag, user, token);
+        } else {
+            send_reply(session, tag, "ERROR Malformed frame");
+        }
+        return true;
+    }
+    switch (opcode) {
+    case BINARY_SEND: {
+        const char *text;
+        size_t text_len;
+        if (!next_name(&cur, user) || !binary_next_text(&cur, &text, &text_len) || cur.p != cur.end) {
+            break;
+        }
+        if (text_len == 0) {
+            send_reply(session, tag, "ERROR Message cannot be empty");
+            return true;
+        }
+        if (!admit(session, tag, ADMIT_SEND)) {
+            return true;
+        }
+        char *message = malloc(text_len + 1);
+        if (!message) {
+            send_reply(session, tag, "ERROR Failed to store message: out of memory");
+            return true;
+        }
+        memcpy(message, text, text_len);
+        message[text_len] = '\0';
+        deliver_message(session, tag, user, message);
+        free(message);
+        return true;
+    }
+    case BINARY_GROUP:
+        if (!process_group_frame(session, tag, &cur, len)) {
+            break;
+        }
+        return true;
+    case BINARY_GET: {
+        uint64_t limit;
+        uint64_t before_id;
+        if (!next_name(&cur, user) || !binary_next_int(&cur, &limit) || !binary_next_int(&cur, &before_id) ||
+            cur.p != cur.end) {
+            break;
+        }
+        if (user[0] == '\0' || limit > MAX_HISTORY_PAGE || before_id > INT64_MAX) {
+            send_reply(session, tag, "ERROR Usage: GET <user> [limit 1-%d] [before_id]", MAX_HISTORY_PAGE);
+            return true;
+        }
+        if (!admit(session, tag, ADMIT_GET)) {
+            return true;
+        }
+        handle_get(session, tag, user, (int)limit, (int64_t)before_id);
+        return true;
+    }
+    case BINARY_SYNC: {
+        uint64_t after_id;
+        if (!next_name(&cur, user) || !binary_next_int(&cur, &after_id) || cur.p != cur.end) {
+            break;
+        }
+        if (user[0] == '\0' || after_id > INT64_MAX) {
+            send_reply(session, tag, "ERROR Usage: SYNC <user> <after_id>");
+            return true;
+        }
+        if (!admit(session, tag, ADMIT_GET)) {
+            return true;
+        }
+        handle_sync(session, tag, user, (int64_t)after_id);
+        return true;
+    }
+    case BINARY_DELETE:
+        if (!next_name(&cur, user) || cur.p != cur.end) {
+            break;
+        }
+        if (user[0] == '\0') {
+            send_reply(session, tag, "ERROR Usage: DELETE <user>");
+            return true;
+        }
+        handle_delete(session, tag, user);
+        return true;
+    case BINARY_USERS: {
+        uint64_t since = 0;
+        bool versioned = cur.p != cur.end;
+        if (versioned && (!binary_next_int(&cur, &since) || cur.p != cur.end)) {
+            break;
+        }
+        if (!admit(session, tag, ADMIT_USERS)) {
+            return true;
+        }
+        notify_user_list(session, tag, versioned, since);
+        return true;
+    }
+    case BINARY_PRESENCE: {
+        uint64_t on;
+        if (!binary_next_int(&cur, &on) || cur.p != cur.end || on > 1) {
+            break;
+        }
+        handle_presence(session, tag, on == 1);
+        return true;
+    }
+    case BINARY_INBOX:
+        if (cur.p != cur.end) {
+            break;
+        }
+        if (!admit(session, tag, ADMIT_GET)) {
+            return true;
+        }
+        handle_inbox(session, tag, true);
+        return true;
+    case BINARY_STATS:
+        if (cur.p != cur.end) {
+            break;
+        }
+        handle_stats(session, tag);
+        return true;
+    case BINARY_QUIT:
+        send_reply(session, tag, "BYE");
+        return false;
+    default:
+        send_reply(session, tag, "ERROR Unknown command");
+        return true;
+    }
+    send_reply(session, tag, "ERROR Malformed frame");
+    return true;
+}
+
+// What was written to the socket live counts as delivered, unless a push was
+// lost or an inbox page was left unread. This node's store moves the cursor
+// to its own mark; every other node that pushed here is told the last push
+// written, unless one of its pushes for the user may have gone missing since
+// login, and moves the cursor to the mark it sent that push under.
+static void record_delivery(client_session_t *session) {
+    int self = cluster_enabled() ? config.cluster.self : 0;
+    if (!(session->inbox_more & node_bit(self)) &&
+        storage_mark_delivered(session->username, &session->delivered) != 0) {
+        fprintf(stderr, "Failed to record delivery for %s: %s\n", session->username, storage_last_error());
+    }
+    uint64_t written[CLUSTER_MAX_NODES];
+    lock_send(session);
+    memcpy(written, session->written_seq, sizeof(written));
+    pthread_mutex_unlock(&session->send_lock);
+    for (int node = 0; cluster_enabled() && node < config.cluster.count; ++node) {
+        if (node != self && written[node] > 0 && !(session->inbox_more & node_bit(node)) &&
+            cluster_push_losses(node, session->username) == session->push_losses[node]) {
+            cluster_delivered(node, session->username, written[node]);
+        }
+    }
+}
+
+// Called by the owner once the connection is finished. Deliveries that
+// already hold a reference see `closed` and skip the socket, so the fd can be
+// closed now even though the memory lives until the last session_put().
+static void release_session(client_session_t *session) {
+    if (config.ping_interval > 0) {
+        pthread_mutex_lock(&idle_lock);
+        timer_wheel_cancel(&session->idle_timer);
+        pthread_mutex_unlock(&idle_lock);
+    }
+    if (session->authenticated) {
+        // The marks are taken while the name is still registered: a message
+        // queued after presence_leave() is never pushed here and must stay
+        // above them.
+        lock_send(session);
+        bool delivered = !session->delivery_lost;
+        if (delivered && outbound_empty(&session->outbound)) {
+            mark_drained(session);
+        }
+        pthread_mutex_unlock(&session->send_lock);
+        // Before the name is released, so that a reconnect that wins it
+        // finds the token ready to resume.
+        session_state_t state = {session->presence_node.subscribed};
+        session_tokens_logout(session->username, &state);
+        presence_unsubscribe(&session->presence_node);
+        presence_push_t push = PRESENCE_PUSH_INIT;
+        presence_leave(&session->registry_node, push_presence, &push);
+        release_presence_push(&push);
+        cluster_announce(session->username, false);
+        if (delivered) {
+            record_delivery(session);
+        }
+    }
+    remove_client(session);
+    lock_send(session);
+    session->closed = true;
+    outbound_clear(&session->outbound);
+    pthread_mutex_unlock(&session->send_lock);
+    net_close(session->socket_fd);
+    if (session->authenticated) {
+        printf("User %s disconnected\n", session->username);
+    }
+    session_put(session);
+}
+
+static bool drain_frames(client_session_t *session) {
+    bool keep = true;
+    while (keep) {
+        int opcode;
+        const unsigned char *body;
+        size_t len;
+        int rc = frame_reader_next(&session->frames, &opcode, &body, &len);
+        if (rc == 0) {
+            break;
+        }
+        if (rc < 0) {
+            send_formatted(session, "ERROR Malformed frame");
+            return false; // no way to find the next frame boundary
+        }
+        uint64_t start = metrics_now();
+        profile_span_t span = profile_frame_begin(opcode);
+        keep = process_frame(session, opcode, body, len);
+        profile_command_end(span);
+        metrics_count(METRIC_COMMANDS, 1);
+        metrics_record_since(METRIC_COMMAND_TIME, start);
+    }
+    return keep;
+}
+
+static bool drain_lines(client_session_t *session) {
+    char line[MAX_LINE];
+    bool keep = true;
+    while (keep && !session->binary && line_buffer_next(&session->input, line, sizeof(line)) >= 0) {
+        uint64_t start = metrics_now();
+        profile_span_t span = profile_command_begin(line);
+        keep = process_command(session, line);
+        profile_command_end(span);
+        metrics_count(METRIC_COMMANDS, 1);
+        metrics_record_since(METRIC_COMMAND_TIME, start);
+    }
+    if (keep && session->binary) {
+        // Bytes that arrived behind the BINARY line are already framed.
+        char rest[LINE_BUFFER_CAPACITY];
+        size_t len = line_buffer_drain(&session->input, rest);
+        if (frame_reader_append(&session->frames, rest, len) != 0) {
+            return false;
+        }
+        keep = drain_frames(session);
     }
-    remove_client(session);
-    free(session);
+    return keep;
+}
+
+// Commands the kernel has already buffered are read and dispatched in one
+// corked batch, so a client pipelining requests gets its replies in as few
+// writes as possible. Bounded so one busy client cannot starve a loop.
+static bool handle_readable(client_session_t *session) {
+    bool keep = true;
+    session_cork(session);
+    for (int round = 0; keep && round < READ_ROUNDS; ++round) {
+        ssize_t n = session->binary ? frame_reader_fill(&session->frames, session->socket_fd)
+                                    : line_buffer_fill(&session->input, session->socket_fd);
+        if (n == 0) {
+            keep = false;
+        } else if (n < 0) {
+            keep = net_would_block() || net_was_interrupted();
+            break;
+        } else {
+            atomic_store_explicit(&session->last_active, atomic_load_explicit(&idle_clock, memory_order_relaxed),
+                                  memory_order_relaxed);
+            metrics_count(METRIC_BYTES_IN, (uint64_t)n);
+            keep = session->binary ? drain_frames(session) : drain_lines(session);
+        }
+    }
+    session_uncork(session);
+    return keep;
+}
+
+static void worker_exited(void) {
+    pthread_mutex_lock(&workers_lock);
+    if (--live_workers == 0) {
+        pthread_cond_broadcast(&workers_done);
+    }
+    pthread_mutex_unlock(&workers_lock);
+}
+
+// Thread mode: the worker owns one non-blocking socket and waits on it with
+// poll(), so it can drain its outbound queue as well as read commands.
+static void *client_worker(void *arg) {
+    client_session_t *session = (client_session_t *)arg;
+    send_formatted(session, "WELCOME Provide AUTH <username>");
+    while (io_running) {
+        net_pollfd_t pfd;
+        pfd.fd = session->socket_fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        lock_send(session);
+        if (!outbound_empty(&session->outbound)) {
+            pfd.events |= POLLOUT;
+        }
+        pthread_mutex_unlock(&session->send_lock);
+        int rc = net_poll(&pfd, 1, LOOP_TICK_MS);
+        if (rc < 0) {
+            if (net_was_interrupted()) {
+                continue;
+            }
+            break;
+        }
+        if (rc == 0) {
+            continue;
+        }
+        if (pfd.revents & POLLOUT) {
+            flush_output(session);
+        }
+        if (pfd.revents & POLLIN) {
+            if (!handle_readable(session)) {
+                break;
+            }
+        } else if (pfd.revents & (POLLHUP | POLLERR | POLLNVAL)) {
+            break;
+        }
+    }
+    release_session(session);
+    worker_exited();
     return NULL;
 }
 
-static void accept_loop(uint16_t port) {
-    listener_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (listener_fd == NET_INVALID_SOCKET) {
-        fatal("socket");
+static void accept_connections(io_loop_t *loop);
+
+static void close_loop_listener(io_loop_t *loop) {
+    if (loop->listener != NET_INVALID_SOCKET) {
+        poller_remove(loop->poller, loop->listener);
+        net_close(loop->listener);
+        loop->listener = NET_INVALID_SOCKET;
+    }
+}
+
+static void *io_loop_run(void *arg) {
+    io_loop_t *loop = (io_loop_t *)arg;
+    poller_event_t events[EVENT_BATCH];
+    if (config.pin_threads && listener_pin_thread(loop->index) < 0) {
+        fprintf(stderr, "Failed to pin event loop %d to a CPU\n", loop->index);
+    }
+    while (io_running) {
+        int n = poller_wait(loop->poller, events, EVENT_BATCH, LOOP_TICK_MS);
+        if (!atomic_load(&loops_accepting)) {
+            close_loop_listener(loop);
+        }
+        for (int i = 0; i < n; ++i) {
+            if (events[i].data == loop) {
+                if (loop->listener != NET_INVALID_SOCKET) {
+                    accept_connections(loop);
+                }
+                continue;
+            }
+            client_session_t *session = (client_session_t *)events[i].data;
+            bool keep = true;
+            if (events[i].events & POLLER_WRITE) {
+                flush_output(session);
+            }
+            if (events[i].events & POLLER_READ) {
+                keep = handle_readable(session);
+            } else if (events[i].events & POLLER_HANGUP) {
+                keep = false;
+            }
+            if (!keep) {
+                poller_remove(loop->poller, session->socket_fd);
+                release_session(session);
+            }
+        }
+    }
+    close_loop_listener(loop);
+    return NULL;
+}
+
+static void start_io_loops(void) {
+#ifndef _WIN32
+    // Loop threads inherit a blocked SIGINT/SIGTERM so the signal always lands
+    // on the accept thread and interrupts accept().
+    sigset_t block, previous;
+    sigemptyset(&block);
+    sigaddset(&block, SIGINT);
+    sigaddset(&block, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &block, &previous);
+#endif
+    for (int i = 0; i < config.io_threads; ++i) {
+        io_loops[i].index = i;
+        io_loops[i].listener = NET_INVALID_SOCKET;
+        io_loops[i].poller = poller_create();
+        if (!io_loops[i].poller) {
+            fatal("poller_create");
+        }
+        if (config.accept_mode == ACCEPT_REUSEPORT) {
+            io_loops[i].listener = listener_open(config.port, config.backlog, true, true);
+            if (io_loops[i].listener == NET_INVALID_SOCKET) {
+                fatal("listen (SO_REUSEPORT)");
+            }
+            if (poller_add(io_loops[i].poller, io_loops[i].listener, POLLER_READ, &io_loops[i]) != 0) {
+                fatal("poller_add");
+            }
+        }
+        if (pthread_create(&io_loops[i].thread, NULL, io_loop_run, &io_loops[i]) != 0) {
+            fatal("pthread_create");
+        }
+        io_loop_count++;
+    }
+#ifndef _WIN32
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+#endif
+    printf("Event I/O mode with %d loop threads%s\n", io_loop_count,
+           config.accept_mode == ACCEPT_REUSEPORT ? ", one SO_REUSEPORT listener each" : "");
+}
+
+static void stop_io_loops(void) {
+    for (int i = 0; i < io_loop_count; ++i) {
+        pthread_join(io_loops[i].thread, NULL);
+    }
+    // Loop threads are gone, so every remaining event-mode session is ours.
+    pthread_mutex_lock(&clients_lock);
+    client_session_t *cur = clients_head;
+    clients_head = NULL;
+    pthread_mutex_unlock(&clients_lock);
+    while (cur) {
+        client_session_t *next = cur->next;
+        cur->next = NULL;
+        release_session(cur);
+        cur = next;
+    }
+    for (int i = 0; i < io_loop_count; ++i) {
+        poller_destroy(io_loops[i].poller);
+    }
+    io_loop_count = 0;
+}
+
+// Thread mode: workers notice io_running == 0 within one poll tick and
+// release their own sessions. Waits up to `timeout_ms` for the last one to
+// exit, or for as long as it takes when negative; returns whether all did.
+static bool wait_for_workers(int timeout_ms) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    if (timeout_ms > 0) {
+        deadline.tv_sec += timeout_ms / 1000;
+        deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec += 1;
+            deadline.tv_nsec -= 1000000000L;
+        }
+    }
+    pthread_mutex_lock(&workers_lock);
+    while (live_workers > 0) {
+        if (timeout_ms < 0) {
+            pthread_cond_wait(&workers_done, &workers_lock);
+        } else if (pthread_cond_timedwait(&workers_done, &workers_lock, &deadline) != 0) {
+            break;
+        }
+    }
+    bool done = live_workers == 0;
+    pthread_mutex_unlock(&workers_lock);
+    return done;
+}
+
+static int attach_to_loop(client_session_t *session, io_loop_t *loop) {
+    session->loop = loop;
+    send_formatted(session, "WELCOME Provide AUTH <username>");
+    lock_send(session);
+    session->interest = POLLER_READ | (outbound_empty(&session->outbound) ? 0 : POLLER_WRITE);
+    int rc = poller_add(session->loop->poller, session->socket_fd, session->interest, session);
+    session->registered = (rc == 0);
+    pthread_mutex_unlock(&session->send_lock);
+    return rc;
+}
+
+static client_session_t *open_session(socket_handle_t client_fd) {
+    client_session_t *session = pool_alloc(&session_pool);
+    if (!session) {
+        fprintf(stderr, "Out of memory\n");
+        net_close(client_fd);
+        return NULL;
+    }
+    memset(session, 0, sizeof(*session));
+    session->socket_fd = client_fd;
+    atomic_init(&session->refs, 1);
+    line_buffer_init(&session->input);
+    frame_reader_init(&session->frames);
+    outbound_init(&session->outbound);
+    pthread_mutex_init(&session->send_lock, NULL);
+    add_client(session);
+    metrics_count(METRIC_CONNECTIONS, 1);
+    if (config.ping_interval > 0) {
+        pthread_mutex_lock(&idle_lock);
+        uint64_t now = atomic_load(&idle_clock);
+        atomic_init(&session->last_active, now);
+        timer_wheel_schedule(&idle_wheel, &session->idle_timer,
+                             now + (uint64_t)config.ping_interval * IDLE_TICKS_PER_SECOND);
+        pthread_mutex_unlock(&idle_lock);
+    }
+    return session;
+}
+
+static void report_accept_error(void) {
+#ifdef _WIN32
+    fprintf(stderr, "accept failed: %d\n", WSAGetLastError());
+#else
+    perror("accept");
+#endif
+}
+
+// ACCEPT_REUSEPORT: drains this loop's listener, bounded so a connection
+// storm cannot starve the sessions the loop already serves; the listener
+// stays readable and the rest are taken on the next wakeup.
+static void accept_connections(io_loop_t *loop) {
+    for (int i = 0; i < ACCEPT_BATCH && atomic_load(&loops_accepting); ++i) {
+        socket_handle_t client_fd = listener_accept(loop->listener);
+        if (client_fd == NET_INVALID_SOCKET) {
+            if (net_was_interrupted()) {
+                continue;
+            }
+            if (!net_would_block()) {
+                report_accept_error();
+            }
+            return;
+        }
+        client_session_t *session = open_session(client_fd);
+        if (session && attach_to_loop(session, loop) != 0) {
+            fprintf(stderr, "Failed to register connection with event loop\n");
+            release_session(session);
+        }
     }
-    int opt = 1;
-    setsockopt(listener_fd, SOL_SOCKET, SO_REUSEADDR, (const char *)&opt, sizeof(opt));
+}
 
-    struct sockaddr_in addr = {0};
-    addr.sin_family = AF_INET;
-    addr.sin_addr.s_addr = INADDR_ANY;
-    addr.sin_port = htons(port);
-    if (bind(listener_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
-        fatal("bind");
+static void accept_loop(void) {
+    if (config.accept_mode == ACCEPT_REUSEPORT) {
+        // The loops accept for themselves; this thread only waits for the
+        // signal, which interrupts the sleep.
+        printf("Server listening on port %u\n", config.port);
+        while (server_running) {
+            net_sleep_ms(LOOP_TICK_MS);
+        }
+        atomic_store(&loops_accepting, false);
+        return;
     }
-    if (listen(listener_fd, LISTEN_BACKLOG) == -1) {
+    listener_fd = listener_open(config.port, config.backlog, false, false);
+    if (listener_fd == NET_INVALID_SOCKET) {
         fatal("listen");
     }
-    printf("Server listening on port %u\n", port);
+    printf("Server listening on port %u\n", config.port);
+    // Workers start detached: a short-lived one may have released its
+    // session before pthread_create() returns, so nothing may touch the
+    // session after handing it over.
+    pthread_attr_t worker_attr;
+    pthread_attr_init(&worker_attr);
+    pthread_attr_setdetachstate(&worker_attr, PTHREAD_CREATE_DETACHED);
+    static unsigned next_loop = 0;
     while (server_running) {
-        struct sockaddr_in client_addr;
-        socklen_t client_len = sizeof(client_addr);
-        socket_handle_t client_fd = accept(listener_fd, (struct sockaddr *)&client_addr, &client_len);
+        socket_handle_t client_fd = listener_accept(listener_fd);
         if (client_fd == NET_INVALID_SOCKET) {
             if (net_was_interrupted()) {
                 continue;
             }
-#ifdef _WIN32
-            fprintf(stderr, "accept failed: %d\n", WSAGetLastError());
-#else
-            perror("accept");
-#endif
+            if (server_running) {
+                report_accept_error();
+            }
             break;
         }
-        client_session_t *session = calloc(1, sizeof(client_session_t));
+        client_session_t *session = open_session(client_fd);
         if (!session) {
-            fprintf(stderr, "Out of memory\n");
-            net_close(client_fd);
             continue;
         }
-        session->socket_fd = client_fd;
-        pthread_mutex_init(&session->send_lock, NULL);
-        add_client(session);
-        if (pthread_create(&session->thread, NULL, client_worker, session) != 0) {
-            fprintf(stderr, "Failed to create worker thread\n");
-            remove_client(session);
-            net_close(client_fd);
-            pthread_mutex_destroy(&session->send_lock);
-            free(session);
-            continue;
+        if (config.io_mode == IO_MODE_EVENTS) {
+            if (attach_to_loop(session, &io_loops[next_loop++ % (unsigned)io_loop_count]) != 0) {
+                fprintf(stderr, "Failed to register connection with event loop\n");
+                release_session(session);
+                continue;
+            }
+        } else {
+            pthread_t thread;
+            pthread_mutex_lock(&workers_lock);
+            live_workers++;
+            pthread_mutex_unlock(&workers_lock);
+            if (pthread_create(&thread, &worker_attr, client_worker, session) != 0) {
+                fprintf(stderr, "Failed to create worker thread\n");
+                release_session(session);
+                worker_exited();
+                continue;
+            }
         }
-        pthread_detach(session->thread);
         printf("Incoming connection accepted\n");
     }
+    pthread_attr_destroy(&worker_attr);
+}
+
+static uint64_t idle_now(void) {
+    return metrics_now() / (IDLE_TICK_MS * 1000000ull) - idle_epoch;
+}
+
+// Runs under idle_lock, which release_session() takes to cancel the timer
+// before closing the socket, so the session and its fd are still live here.
+// Input of any kind answers a PING; a session that stays silent for the whole
+// timeout is shut down, and its owner then releases it like any hangup.
+static void expire_idle(timer_node_t *node, uint64_t now, void *ctx) {
+    (void)ctx;
+    client_session_t *session = (client_session_t *)((char *)node - offsetof(client_session_t, idle_timer));
+    uint64_t last = atomic_load_explicit(&session->last_active, memory_order_relaxed);
+    if (session->ping_sent && last >= session->ping_sent) {
+        session->ping_sent = 0;
+    }
+    if (!session->ping_sent) {
+        uint64_t due = last + (uint64_t)config.ping_interval * IDLE_TICKS_PER_SECOND;
+        if (due > now) {
+            timer_wheel_schedule(&idle_wheel, node, due);
+            return;
+        }
+        send_formatted(session, "PING");
+        metrics_count(METRIC_PINGS, 1);
+        session->ping_sent = now;
+        timer_wheel_schedule(&idle_wheel, node, now + (uint64_t)config.ping_timeout * IDLE_TICKS_PER_SECOND);
+        return;
+    }
+    metrics_count(METRIC_IDLE_TIMEOUTS, 1);
+    lock_send(session);
+    session->delivery_lost = true; // whatever was written may never have been read
+    if (!session->closed) {
+        shutdown(session->socket_fd, SHUT_RDWR);
+    }
+    pthread_mutex_unlock(&session->send_lock);
+}
+
+// Ticks the idle wheel and samples the send queues for load shedding.
+static void *housekeeping_main(void *arg) {
+    (void)arg;
+    while (atomic_load(&housekeeping_running)) {
+        net_sleep_ms(IDLE_TICK_MS);
+        uint64_t now = idle_now();
+        atomic_store(&idle_clock, now);
+        if (config.ping_interval > 0) {
+            pthread_mutex_lock(&idle_lock);
+            timer_wheel_advance(&idle_wheel, now, expire_idle, NULL);
+            pthread_mutex_unlock(&idle_lock);
+        }
+        if (config.admission.outbound_limit > 0) {
+            admission_sample_outbound(outbound_queued_bytes());
+        }
+    }
+    return NULL;
+}
+
+// Helper threads leave SIGINT/SIGTERM to the main thread, which the signal
+// has to interrupt.
+static int start_service_thread(pthread_t *thread, void *(*run)(void *)) {
+#ifndef _WIN32
+    sigset_t block, previous;
+    sigemptyset(&block);
+    sigaddset(&block, SIGINT);
+    sigaddset(&block, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &block, &previous);
+#endif
+    int rc = pthread_create(thread, NULL, run, NULL);
+#ifndef _WIN32
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+#endif
+    return rc;
+}
+
+// A snapshot every --snapshot-interval, so that a crash too restarts with
+// recent session tokens and delivery state; a clean shutdown writes the last.
+static void *checkpoint_main(void *arg) {
+    (void)arg;
+    uint64_t waited_ms = 0;
+    while (atomic_load(&checkpoint_running)) {
+        net_sleep_ms(LOOP_TICK_MS);
+        waited_ms += LOOP_TICK_MS;
+        if (waited_ms >= (uint64_t)config.snapshot_interval * 1000u) {
+            waited_ms = 0;
+            snapshot_write(false);
+        }
+    }
+    return NULL;
+}
+
+static int start_housekeeping(pthread_t *thread) {
+    // Tick 1 is "now", so a ping_sent of 0 can mean none.
+    idle_epoch = metrics_now() / (IDLE_TICK_MS * 1000000ull) - 1;
+    atomic_init(&idle_clock, idle_now());
+    timer_wheel_init(&idle_wheel, atomic_load(&idle_clock));
+    atomic_store(&housekeeping_running, true);
+    return start_service_thread(thread, housekeeping_main);
+}
+
+static uint64_t sessions_gauge(void) {
+    uint64_t count = 0;
+    pthread_mutex_lock(&clients_lock);
+    for (client_session_t *cur = clients_head; cur; cur = cur->next) {
+        ++count;
+    }
+    pthread_mutex_unlock(&clients_lock);
+    return count;
+}
+
+static uint64_t users_online_gauge(void) {
+    return registry_count();
+}
+
+static uint64_t storage_queue_gauge(void) {
+    return storage_queue_depth();
+}
+
+static uint64_t cache_hits_counter(void) {
+    storage_cache_stats_t stats;
+    storage_cache_stats(&stats);
+    return stats.hits;
+}
+
+static uint64_t cache_misses_counter(void) {
+    storage_cache_stats_t stats;
+    storage_cache_stats(&stats);
+    return stats.misses;
+}
+
+static uint64_t cache_bytes_gauge(void) {
+    storage_cache_stats_t stats;
+    storage_cache_stats(&stats);
+    return stats.bytes;
+}
+
+static uint64_t cluster_peers_gauge(void) {
+    return cluster_connected_peers();
+}
+
+static void register_metrics(void) {
+    metrics_register("sessions", "Open client connections.", METRIC_GAUGE, sessions_gauge);
+    metrics_register("users_online", "Authenticated users.", METRIC_GAUGE, users_online_gauge);
+    metrics_register("outbound_queued_bytes", "Bytes waiting in client send queues.", METRIC_GAUGE,
+                     outbound_queued_bytes);
+    metrics_register("storage_queue_depth", "Messages and cursor updates waiting for the storage writer.",
+                     METRIC_GAUGE, storage_queue_gauge);
+    metrics_register("history_cache_hits", "GETs answered from the recent-history cache.", METRIC_COUNTER,
+                     cache_hits_counter);
+    metrics_register("history_cache_misses", "GETs that read the storage backend.", METRIC_COUNTER,
+                     cache_misses_counter);
+    metrics_register("history_cache_bytes", "Memory held by the recent-history cache.", METRIC_GAUGE,
+                     cache_bytes_gauge);
+    if (cluster_enabled()) {
+        metrics_register("cluster_peers", "Cluster peers this node has a link to.", METRIC_GAUGE,
+                         cluster_peers_gauge);
+    }
+}
+
+// Blocking socket; fails once a scraper that went away resets it.
+static int send_all(socket_handle_t fd, const char *data, size_t len) {
+    while (len > 0) {
+        int chunk = len > INT_MAX ? INT_MAX : (int)len;
+        long n = (long)send(fd, data, chunk, 0);
+        if (n <= 0) {
+            if (n < 0 && net_was_interrupted()) {
+                continue;
+            }
+            return -1;
+        }
+        data += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+// Answers one scrape: whatever the request says, the reply is the metrics in
+// the Prometheus text format, and the connection closes after it.
+static void serve_metrics(socket_handle_t fd) {
+    net_pollfd_t pfd = {0};
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    char request[4096];
+    if (net_poll(&pfd, 1, METRICS_REQUEST_TIMEOUT_MS) <= 0 || recv(fd, request, sizeof(request), 0) <= 0) {
+        return;
+    }
+    size_t len;
+    char *body = metrics_render_prometheus(&len);
+    if (!body) {
+        return;
+    }
+    char header[128];
+    int header_len = snprintf(header, sizeof(header),
+                              "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                              "Content-Length: %zu\r\nConnection: close\r\n\r\n",
+                              len);
+    if (send_all(fd, header, (size_t)header_len) == 0) {
+        send_all(fd, body, len);
+    }
+    free(body);
+}
+
+static socket_handle_t metrics_fd = NET_INVALID_SOCKET;
+static atomic_bool metrics_running;
+
+// Prometheus listener, on its own thread so scrapes never wait behind client
+// traffic. Scrapes are served one at a time.
+static void *metrics_main(void *arg) {
+    (void)arg;
+    while (atomic_load(&metrics_running)) {
+        net_pollfd_t pfd = {0};
+        pfd.fd = metrics_fd;
+        pfd.events = POLLIN;
+        if (net_poll(&pfd, 1, LOOP_TICK_MS) <= 0) {
+            continue;
+        }
+        socket_handle_t client = accept(metrics_fd, NULL, NULL);
+        if (client == NET_INVALID_SOCKET) {
+            continue;
+        }
+        serve_metrics(client);
+        net_close(client);
+    }
+    net_close(metrics_fd);
+    return NULL;
+}
+
+static int start_metrics_listener(pthread_t *thread) {
+    metrics_fd = listener_open(config.metrics_port, METRICS_BACKLOG, false, false);
+    if (metrics_fd == NET_INVALID_SOCKET) {
+        return -1;
+    }
+    atomic_store(&metrics_running, true);
+    if (start_service_thread(thread, metrics_main) != 0) {
+        net_close(metrics_fd);
+        return -1;
+    }
+    printf("Metrics listening on port %u\n", config.metrics_port);
+    return 0;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s <port> [db_path] [--io=threads|events] [--io-threads=N]\n"
+            "          [--accept=single|reuseport] [--backlog=N] [--pin-threads]\n"
+            "          [--send-queue-limit=BYTES] [--slow-consumer=disconnect|drop]\n"
+            "          [--journal=wal|rollback] [--synchronous=off|normal|full]\n"
+            "          [--ack=commit|enqueue] [--write-batch=N] [--write-delay-ms=MS]\n"
+            "          [--history-cache=MESSAGES] [--history-cache-bytes=BYTES]\n"
+            "          [--read-connections=N] [--storage-shards=N] [--metrics-port=PORT]\n"
+            "          [--compress=off|deflate|dictionary] [--compress-min=BYTES]\n"
+            "          [--retain-seconds=N] [--retain-messages=N] [--purge-batch=N]\n"
+            "          [--ping-interval=SECONDS] [--ping-timeout=SECONDS]\n"
+            "          [--send-rate=N] [--get-rate=N] [--users-rate=N]\n"
+            "          [--shed-storage-queue=N] [--shed-outbound-bytes=BYTES]\n"
+            "          [--snapshot-interval=SECONDS] [--session-ttl=SECONDS]\n"
+            "          [--reconnect-window=MS]\n"
+            "          [--cluster=IP:PORT,IP:PORT,... --cluster-node=INDEX --cluster-secret=TEXT]\n"
+            "       Each cluster node keeps its own db_path and stores the conversations it owns.\n",
+            prog);
+}
+
+static int parse_options(int argc, char **argv) {
+    int positional = 0;
+    for (int i = 1; i < argc; ++i) {
+        const char *arg = argv[i];
+        if (strncmp(arg, "--io=", 5) == 0) {
+            if (strcmp(arg + 5, "threads") == 0) {
+                config.io_mode = IO_MODE_THREADS;
+            } else if (strcmp(arg + 5, "events") == 0) {
+                config.io_mode = IO_MODE_EVENTS;
+            } else {
+                return -1;
+            }
+        } else if (strncmp(arg, "--io-threads=", 13) == 0) {
+            config.io_threads = atoi(arg + 13);
+            if (config.io_threads < 1 || config.io_threads > MAX_IO_THREADS) {
+                return -1;
+            }
+        } else if (strncmp(arg, "--accept=", 9) == 0) {
+            if (strcmp(arg + 9, "single") == 0) {
+                config.accept_mode = ACCEPT_SINGLE;
+            } else if (strcmp(arg + 9, "reuseport") == 0) {
+                config.accept_mode = ACCEPT_REUSEPORT;
+            } else {
+                return -1;
+            }
+        } else if (strncmp(arg, "--backlog=", 10) == 0) {
+            config.backlog = atoi(arg + 10);
+            if (config.backlog < 1) {
+                return -1;
+            }
+        } else if (strncmp(arg, "--ping-interval=", 16) == 0) {
+            config.ping_interval = atoi(arg + 16);
+            if (config.ping_interval < 0) {
+                return -1;
+            }
+        } else if (strncmp(arg, "--ping-timeout=", 15) == 0) {
+            config.ping_timeout = atoi(arg + 15);
+            if (config.ping_timeout < 1) {
+                return -1;
+            }
+        } else if (strncmp(arg, "--send-rate=", 12) == 0) {
+            config.admission.rate[ADMIT_SEND] = atof(arg + 12);
+        } else if (strncmp(arg, "--get-rate=", 11) == 0) {
+            config.admission.rate[ADMIT_GET] = atof(arg + 11);
+        } else if (strncmp(arg, "--users-rate=", 13) == 0) {
+            config.admission.rate[ADMIT_USERS] = atof(arg + 13);
+        } else if (strncmp(arg, "--shed-storage-queue=", 21) == 0) {
+            long limit = atol(arg + 21);
+            if (limit < 0) {
+                return -1;
+            }
+            config.admission.storage_queue_limit = (size_t)limit;
+        } else if (strncmp(arg, "--shed-outbound-bytes=", 22) == 0) {
+            long long limit = atoll(arg + 22);
+            if (limit < 0) {
+                return -1;
+            }
+            config.admission.outbound_limit = (uint64_t)limit;
+        } else if (strcmp(arg, "--pin-threads") == 0) {
+            config.pin_threads = true;
+        } else if (strncmp(arg, "--send-queue-limit=", 19) == 0) {
+            long limit = atol(arg + 19);
+            if (limit < MAX_LINE) {
+                return -1;
+            }
+            config.send_queue_limit = (size_t)limit;
+        } else if (strncmp(arg, "--slow-consumer=", 16) == 0) {
+            if (strcmp(arg + 16, "disconnect") == 0) {
+                config.slow_consumer = SLOW_CONSUMER_DISCONNECT;
+            } else if (strcmp(arg + 16, "drop") == 0) {
+                config.slow_consumer = SLOW_CONSUMER_DROP;
+            } else {
+                return -1;
+            }
+        } else if (strncmp(arg, "--journal=", 10) == 0) {
+            if (strcmp(arg + 10, "wal") == 0) {
+                config.storage.wal = true;
+            } else if (strcmp(arg + 10, "rollback") == 0) {
+                config.storage.wal = false;
+            } else {
+                return -1;
+            }
+        } else if (strncmp(arg, "--synchronous=", 14) == 0) {
+            if (strcmp(arg + 14, "off") == 0) {
+                config.storage.synchronous = STORAGE_SYNC_OFF;
+            } else if (strcmp(arg + 14, "normal") == 0) {
+                config.storage.synchronous = STORAGE_SYNC_NORMAL;
+            } else if (strcmp(arg + 14, "full") == 0) {
+                config.storage.synchronous = STORAGE_SYNC_FULL;
+            } else {
+                return -1;
+            }
+        } else if (strncmp(arg, "--ack=", 6) == 0) {
+            if (strcmp(arg + 6, "commit") == 0) {
+                config.ack = ACK_ON_COMMIT;
+            } else if (strcmp(arg + 6, "enqueue") == 0) {
+                config.ack = ACK_ON_ENQUEUE;
+            } else {
+                return -1;
+            }
+        } else if (strncmp(arg, "--write-batch=", 14) == 0) {
+            int batch = atoi(arg + 14);
+            if (batch < 1) {
+                return -1;
+            }
+            config.storage.write_batch = (size_t)batch;
+        } else if (strncmp(arg, "--write-delay-ms=", 17) == 0) {
+            config.storage.write_delay_ms = atoi(arg + 17);
+            if (config.storage.write_delay_ms < 0) {
+                return -1;
+            }
+        } else if (strncmp(arg, "--history-cache=", 16) == 0) {
+            long messages = atol(arg + 16);
+            if (messages < 0) {
+                return -1;
+            }
+            config.storage.cache_messages = (size_t)messages;
+        } else if (strncmp(arg, "--history-cache-bytes=", 22) == 0) {
+            long bytes = atol(arg + 22);
+            if (bytes < 0) {
+                return -1;
+            }
+            config.storage.cache_bytes = (size_t)bytes;
+        } else if (strncmp(arg, "--read-connections=", 19) == 0) {
+            int readers = atoi(arg + 19);
+            if (readers < 1 || readers > 64) {
+                return -1;
+            }
+            config.storage.read_connections = (size_t)readers;
+        } else if (strncmp(arg, "--storage-shards=", 17) == 0) {
+            int count = atoi(arg + 17);
+            if (count < 1 || count > STORAGE_MAX_SHARDS) {
+                return -1;
+            }
+            config.storage_shards = (size_t)count;
+        } else if (strncmp(arg, "--compress=", 11) == 0) {
+            if (strcmp(arg + 11, "off") == 0) {
+                config.storage.compression = STORAGE_COMPRESS_OFF;
+            } else if (strcmp(arg + 11, "deflate") == 0) {
+                config.storage.compression = STORAGE_COMPRESS_DEFLATE;
+            } else if (strcmp(arg + 11, "dictionary") == 0) {
+                config.storage.compression = STORAGE_COMPRESS_DICTIONARY;
+            } else {
+                return -1;
+            }
+        } else if (strncmp(arg, "--compress-min=", 15) == 0) {
+            long bytes = atol(arg + 15);
+            if (bytes < 0) {
+                return -1;
+            }
+            config.storage.compress_min_bytes = (size_t)bytes;
+        } else if (strncmp(arg, "--retain-seconds=", 17) == 0) {
+            long long seconds = atoll(arg + 17);
+            if (seconds < 0) {
+                return -1;
+            }
+            config.storage.retain_seconds = (uint64_t)seconds;
+        } else if (strncmp(arg, "--retain-messages=", 18) == 0) {
+            long long messages = atoll(arg + 18);
+            if (messages < 0) {
+                return -1;
+            }
+            config.storage.retain_messages = (uint64_t)messages;
+        } else if (strncmp(arg, "--purge-batch=", 14) == 0) {
+            long batch = atol(arg + 14);
+            if (batch < 1) {
+                return -1;
+            }
+            config.storage.purge_batch = (size_t)batch;
+        } else if (strncmp(arg, "--snapshot-interval=", 20) == 0) {
+            config.snapshot_interval = atoi(arg + 20);
+            if (config.snapshot_interval < 0) {
+                return -1;
+            }
+        } else if (strncmp(arg, "--session-ttl=", 14) == 0) {
+            long long seconds = atoll(arg + 14);
+            if (seconds < 0) {
+                return -1;
+            }
+            config.session_ttl = (uint64_t)seconds;
+        } else if (strncmp(arg, "--reconnect-window=", 19) == 0) {
+            config.reconnect_window_ms = atoi(arg + 19);
+            if (config.reconnect_window_ms < 0) {
+                return -1;
+            }
+        } else if (strncmp(arg, "--cluster=", 10) == 0) {
+            if (cluster_parse_members(arg + 10, &config.cluster) != 0) {
+                return -1;
+            }
+        } else if (strncmp(arg, "--cluster-node=", 15) == 0) {
+            char *end;
+            long node = strtol(arg + 15, &end, 10);
+            if (*end != '\0' || node < 0 || node >= CLUSTER_MAX_NODES) {
+                return -1;
+            }
+            config.cluster.self = (int)node;
+        } else if (strncmp(arg, "--cluster-secret=", 17) == 0) {
+            size_t len = strlen(arg + 17);
+            if (len == 0 || len > CLUSTER_SECRET_MAX) {
+                return -1;
+            }
+            memcpy(config.cluster.secret, arg + 17, len + 1);
+        } else if (strncmp(arg, "--metrics-port=", 15) == 0) {
+            int port = atoi(arg + 15);
+            if (port < 0 || port > 65535) {
+                return -1;
+            }
+            config.metrics_port = (uint16_t)port;
+        } else if (strncmp(arg, "--", 2) == 0) {
+            return -1;
+        } else if (positional == 0) {
+            config.port = (uint16_t)atoi(arg);
+            positional++;
+        } else if (positional == 1) {
+            config.db_path = arg;
+            positional++;
+        } else {
+            return -1;
+        }
+    }
+    for (int kind = 0; kind < ADMIT_CLASS_COUNT; ++kind) {
+        if (config.admission.rate[kind] < 0) {
+            return -1;
+        }
+    }
+    // Every node needs the member list, its own place in it and the secret.
+    if ((config.cluster.count > 0 || config.cluster.self >= 0 || config.cluster.secret[0]) &&
+        (config.cluster.self < 0 || config.cluster.self >= config.cluster.count || !config.cluster.secret[0])) {
+        return -1;
+    }
+#if defined(STORAGE_USE_SQLITE) && !STORAGE_USE_SQLITE
+    // The flat-file backend has no retention sweep; refuse rather than keep
+    // everything while the operator expects it to expire.
+    if (config.storage.retain_seconds > 0 || config.storage.retain_messages > 0) {
+        fprintf(stderr, "--retain-seconds and --retain-messages need the SQLite backend\n");
+        return -1;
+    }
+#endif
+    // Per-loop listeners and pinning only exist in event mode.
+    if (config.io_mode != IO_MODE_EVENTS && (config.accept_mode == ACCEPT_REUSEPORT || config.pin_threads)) {
+        return -1;
+    }
+    return positional >= 1 ? 0 : -1;
 }
 
 int main(int argc, char **argv) {
-    if (argc < 2 || argc > 3) {
-        fprintf(stderr, "Usage: %s <port> [db_path]\n", argv[0]);
+    storage_default_options(&config.storage);
+    if (parse_options(argc, argv) != 0) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (profile_start() != 0) {
         return EXIT_FAILURE;
     }
-    uint16_t port = (uint16_t)atoi(argv[1]);
-    const char *db_path = (argc == 3) ? argv[2] : DEFAULT_DB_PATH;
 
     if (net_init() != 0) {
         fprintf(stderr, "Failed to initialize networking\n");
@@ -372,26 +3111,130 @@ int main(int argc, char **argv) {
     }
 
     install_signal_handlers();
-    if (storage_init(db_path) != 0) {
+    pool_init(&session_pool, sizeof(client_session_t));
+    if (registry_init(session_hold) != 0) {
+        fprintf(stderr, "Failed to initialize user registry\n");
+        net_cleanup();
+        return EXIT_FAILURE;
+    }
+    if (config.cluster.count > 0) {
+        config.storage.node_index = (size_t)config.cluster.self;
+        config.storage.node_count = (size_t)config.cluster.count;
+    }
+    if (storage_init(config.db_path, config.storage_shards, &config.storage) != 0) {
         fprintf(stderr, "Storage init failed: %s\n", storage_last_error());
         net_cleanup();
         return EXIT_FAILURE;
     }
+    session_tokens_configure(config.session_ttl);
+    if (config.snapshot_interval > 0 && (snapshot_file = malloc(strlen(config.db_path) + 10))) {
+        sprintf(snapshot_file, "%s.snapshot", config.db_path);
+        snapshot_configure(snapshot_file);
+        if (snapshot_load() == 1) {
+            printf("Restored state from %s\n", snapshot_file);
+        }
+    }
+    const cluster_hooks_t cluster_hooks = {deliver_pushed,        store_relayed, read_local,   advance_inbox,
+                                           mark_pushes_delivered, remote_join,   remote_leave, remote_drop};
+    config.cluster.stamp_len = storage_shard_count();
+    if (cluster_init(&config.cluster, &cluster_hooks) != 0) {
+        fprintf(stderr, "Failed to start cluster node %d on port %u: %s\n", config.cluster.self,
+                config.cluster.members[config.cluster.self].port, strerror(errno));
+        storage_shutdown();
+        net_cleanup();
+        return EXIT_FAILURE;
+    }
+
+    register_metrics();
+    pthread_t metrics_thread;
+    bool metrics_started = false;
+    if (config.metrics_port != 0) {
+        if (start_metrics_listener(&metrics_thread) != 0) {
+            fprintf(stderr, "Failed to start metrics listener on port %u\n", config.metrics_port);
+            cluster_shutdown();
+            storage_shutdown();
+            net_cleanup();
+            return EXIT_FAILURE;
+        }
+        metrics_started = true;
+    }
+    admission_configure(&config.admission);
+    pthread_t housekeeping_thread;
+    bool housekeeping_started = false;
+    if (config.ping_interval > 0 || config.admission.outbound_limit > 0) {
+        if (start_housekeeping(&housekeeping_thread) != 0) {
+            fprintf(stderr, "Failed to start the housekeeping thread\n");
+            cluster_shutdown();
+            storage_shutdown();
+            net_cleanup();
+            return EXIT_FAILURE;
+        }
+        housekeeping_started = true;
+    }
+    pthread_t checkpoint_thread;
+    bool checkpoint_started = false;
+    if (snapshot_file) {
+        atomic_store(&checkpoint_running, true);
+        if (start_service_thread(&checkpoint_thread, checkpoint_main) != 0) {
+            fprintf(stderr, "Failed to start the checkpoint thread\n");
+            cluster_shutdown();
+            storage_shutdown();
+            net_cleanup();
+            return EXIT_FAILURE;
+        }
+        checkpoint_started = true;
+    }
 
-    accept_loop(port);
+    if (config.io_mode == IO_MODE_EVENTS) {
+        start_io_loops();
+    }
+    accept_loop();
     broadcast_shutdown_message();
+    io_running = 0;
+    if (config.io_mode == IO_MODE_EVENTS) {
+        stop_io_loops();
+    }
 
     if (listener_fd != NET_INVALID_SOCKET) {
         net_close(listener_fd);
     }
-    pthread_mutex_lock(&clients_lock);
-    client_session_t *cur = clients_head;
-    while (cur) {
-        net_close(cur->socket_fd);
-        cur = cur->next;
+    // Give workers a few ticks to finish on their own. The ones that outlive
+    // that still own their sockets; waking them with a shutdown rather than
+    // closing the fd under them avoids a double close racing with their own
+    // release_session(). Storage and the cache below must outlive them all.
+    if (config.io_mode != IO_MODE_EVENTS && !wait_for_workers(5 * LOOP_TICK_MS)) {
+        pthread_mutex_lock(&clients_lock);
+        client_session_t *cur = clients_head;
+        while (cur) {
+            shutdown(cur->socket_fd, SHUT_RDWR);
+            cur = cur->next;
+        }
+        pthread_mutex_unlock(&clients_lock);
+        wait_for_workers(-1);
     }
-    pthread_mutex_unlock(&clients_lock);
+    if (housekeeping_started) {
+        atomic_store(&housekeeping_running, false);
+        pthread_join(housekeeping_thread, NULL);
+    }
+    if (metrics_started) {
+        atomic_store(&metrics_running, false);
+        pthread_join(metrics_thread, NULL); // gauges read storage and the registry
+    }
+    if (checkpoint_started) {
+        atomic_store(&checkpoint_running, false);
+        pthread_join(checkpoint_thread, NULL);
+    }
+    cluster_shutdown();
+    storage_stop_purge();
+    snapshot_write(true);
     storage_shutdown();
+    session_tokens_shutdown();
+    crypto_shutdown();
+    free(snapshot_file);
+    presence_shutdown();
+    free_deflaters();
+    registry_shutdown();
+    profile_stop();
     printf("Server shutdown complete\n");
     net_cleanup();
     return EXIT_SUCCESS;
@@ -0,0 +1,218 @@
+#define _POSIX_C_SOURCE 200809L
+#include "session_tokens.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "crypto.h"
+
+#define INITIAL_BUCKETS 64u /* power of two */
+
+typedef struct session_entry {
+    struct session_entry *next;
+    uint32_t hash;
+    session_record_t record;
+} session_entry_t;
+
+static pthread_mutex_t tokens_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t ttl = 0;
+static session_entry_t **buckets = NULL;
+static size_t bucket_count = 0;
+static size_t entry_count = 0;
+
+static uint32_t hash_name(const char *name) {
+    uint32_t hash = 2166136261u; // FNV-1a
+    for (const unsigned char *p = (const unsigned char *)name; *p; ++p) {
+        hash ^= *p;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static bool expired(const session_record_t *record, int64_t now) {
+    return !record->online && now - record->ended >= (int64_t)ttl;
+}
+
+// Caller holds tokens_lock.
+static session_entry_t **find_slot(const char *name, uint32_t hash) {
+    session_entry_t **slot = &buckets[hash & (bucket_count - 1)];
+    while (*slot && ((*slot)->hash != hash || strcmp((*slot)->record.name, name) != 0)) {
+        slot = &(*slot)->next;
+    }
+    return slot;
+}
+
+// Caller holds tokens_lock. Drops expired entries on the way, which bounds the
+// table by the users seen within one ttl.
+static int grow_buckets(int64_t now) {
+    size_t new_count = bucket_count ? bucket_count * 2 : INITIAL_BUCKETS;
+    session_entry_t **grown = calloc(new_count, sizeof(session_entry_t *));
+    if (!grown) {
+        return -1;
+    }
+    for (size_t b = 0; b < bucket_count; ++b) {
+        while (buckets[b]) {
+            session_entry_t *entry = buckets[b];
+            buckets[b] = entry->next;
+            if (expired(&entry->record, now)) {
+                free(entry);
+                --entry_count;
+                continue;
+            }
+            entry->next = grown[entry->hash & (new_count - 1)];
+            grown[entry->hash & (new_count - 1)] = entry;
+        }
+    }
+    free(buckets);
+    buckets = grown;
+    bucket_count = new_count;
+    return 0;
+}
+
+// Caller holds tokens_lock. Returns the entry for `name`, created blank if
+// missing, or NULL when out of memory.
+static session_entry_t *intern_entry(const char *name, int64_t now) {
+    uint32_t hash = hash_name(name);
+    if (bucket_count > 0) {
+        session_entry_t *found = *find_slot(name, hash);
+        if (found) {
+            return found;
+        }
+    }
+    if (entry_count >= bucket_count && grow_buckets(now) != 0 && bucket_count == 0) {
+        return NULL;
+    }
+    session_entry_t *entry = calloc(1, sizeof(session_entry_t));
+    if (!entry) {
+        return NULL;
+    }
+    entry->hash = hash;
+    snprintf(entry->record.name, sizeof(entry->record.name), "%s", name);
+    entry->next = buckets[hash & (bucket_count - 1)];
+    buckets[hash & (bucket_count - 1)] = entry;
+    ++entry_count;
+    return entry;
+}
+
+void session_tokens_configure(uint64_t ttl_seconds) {
+    pthread_mutex_lock(&tokens_lock);
+    ttl = ttl_seconds;
+    pthread_mutex_unlock(&tokens_lock);
+}
+
+bool session_tokens_enabled(void) {
+    pthread_mutex_lock(&tokens_lock);
+    bool enabled = ttl > 0;
+    pthread_mutex_unlock(&tokens_lock);
+    return enabled;
+}
+
+int session_tokens_issue(const char *name, char token[SESSION_TOKEN_LEN + 1]) {
+    static const char hex[] = "0123456789abcdef";
+    unsigned char raw[SESSION_TOKEN_LEN / 2];
+    if (crypto_random(raw, sizeof(raw)) != 0) {
+        return -1;
+    }
+    int64_t now = (int64_t)time(NULL);
+    pthread_mutex_lock(&tokens_lock);
+    session_entry_t *entry = ttl > 0 ? intern_entry(name, now) : NULL;
+    if (!entry) {
+        pthread_mutex_unlock(&tokens_lock);
+        return -1;
+    }
+    for (size_t i = 0; i < sizeof(raw); ++i) {
+        entry->record.token[2 * i] = hex[raw[i] >> 4];
+        entry->record.token[2 * i + 1] = hex[raw[i] & 0x0F];
+    }
+    entry->record.token[SESSION_TOKEN_LEN] = '\0';
+    entry->record.online = true;
+    entry->record.ended = 0;
+    memset(&entry->record.state, 0, sizeof(entry->record.state));
+    memcpy(token, entry->record.token, SESSION_TOKEN_LEN + 1);
+    pthread_mutex_unlock(&tokens_lock);
+    return 0;
+}
+
+bool session_tokens_resume(const char *name, const char *token, session_state_t *state) {
+    int64_t now = (int64_t)time(NULL);
+    bool resumed = false;
+    pthread_mutex_lock(&tokens_lock);
+    session_entry_t *entry = (ttl > 0 && bucket_count > 0) ? *find_slot(name, hash_name(name)) : NULL;
+    // A resume while the token's session is still online would mean two
+    // clients holding it; the name is taken then anyway. The token is
+    // compared in constant time, so a guess learns nothing from the timing.
+    if (entry && !entry->record.online && !expired(&entry->record, now) && strlen(token) == SESSION_TOKEN_LEN &&
+        crypto_equal((const unsigned char *)entry->record.token, (const unsigned char *)token, SESSION_TOKEN_LEN)) {
+        entry->record.online = true;
+        *state = entry->record.state;
+        resumed = true;
+    }
+    pthread_mutex_unlock(&tokens_lock);
+    return resumed;
+}
+
+void session_tokens_logout(const char *name, const session_state_t *state) {
+    pthread_mutex_lock(&tokens_lock);
+    session_entry_t *entry = (ttl > 0 && bucket_count > 0) ? *find_slot(name, hash_name(name)) : NULL;
+    if (entry) {
+        entry->record.online = false;
+        entry->record.ended = (int64_t)time(NULL);
+        entry->record.state = *state;
+    }
+    pthread_mutex_unlock(&tokens_lock);
+}
+
+void session_tokens_export(void (*visit)(const session_record_t *record, void *ctx), void *ctx) {
+    int64_t now = (int64_t)time(NULL);
+    pthread_mutex_lock(&tokens_lock);
+    for (size_t b = 0; b < bucket_count; ++b) {
+        for (session_entry_t *entry = buckets[b]; entry; entry = entry->next) {
+            if (!expired(&entry->record, now)) {
+                visit(&entry->record, ctx);
+            }
+        }
+    }
+    pthread_mutex_unlock(&tokens_lock);
+}
+
+int session_tokens_import(const session_record_t *record) {
+    int64_t now = (int64_t)time(NULL);
+    session_record_t copy = *record;
+    copy.name[SESSION_NAME_MAX - 1] = '\0';
+    copy.token[SESSION_TOKEN_LEN] = '\0';
+    if (copy.online) {
+        copy.online = false;
+        copy.ended = now;
+    }
+    pthread_mutex_lock(&tokens_lock);
+    int rc = 0;
+    if (ttl > 0 && copy.name[0] && !expired(&copy, now)) {
+        session_entry_t *entry = intern_entry(copy.name, now);
+        if (entry) {
+            entry->record = copy;
+        } else {
+            rc = -1;
+        }
+    }
+    pthread_mutex_unlock(&tokens_lock);
+    return rc;
+}
+
+void session_tokens_shutdown(void) {
+    pthread_mutex_lock(&tokens_lock);
+    for (size_t b = 0; b < bucket_count; ++b) {
+        while (buckets[b]) {
+            session_entry_t *next = buckets[b]->next;
+            free(buckets[b]);
+            buckets[b] = next;
+        }
+    }
+    free(buckets);
+    buckets = NULL;
+    bucket_count = 0;
+    entry_count = 0;
+    pthread_mutex_unlock(&tokens_lock);
+}
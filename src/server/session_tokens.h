@@ -0,0 +1,54 @@
+#ifndef SESSION_TOKENS_H
+#define SESSION_TOKENS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Resumable sessions. Every AUTH is answered with a token for that name; a
+// client that reconnects with `AUTH <name> <token>` while the token is still
+// known gets its session back ("OK Resumed as"), with the per-session state
+// recorded here at its last logout reapplied. Since AUTH has no password the
+// token is not a credential, only proof that the client is the same one that
+// left, so its view of presence and of its local history is still current.
+// A token expires a configurable time after its session ended; the table is
+// kept across restarts by the snapshot (snapshot.c). All functions are
+// thread-safe.
+#define SESSION_NAME_MAX 32
+#define SESSION_TOKEN_LEN 32 /* hex digits */
+
+typedef struct {
+    bool presence; // PRESENCE ON
+} session_state_t;
+
+typedef struct {
+    char name[SESSION_NAME_MAX];
+    char token[SESSION_TOKEN_LEN + 1];
+    bool online;        // no logout recorded since the token was issued or resumed
+    int64_t ended;      // unix time of the logout, for an offline session
+    session_state_t state;
+} session_record_t;
+
+// 0 disables tokens: AUTH replies carry none and every resume fails.
+void session_tokens_configure(uint64_t ttl_seconds);
+bool session_tokens_enabled(void);
+// A fresh token for `name`, replacing any earlier one. Returns 0, or -1 when
+// out of memory or out of system randomness (the login then simply carries no
+// token, and any earlier one stays as it was).
+int session_tokens_issue(const char *name, char token[SESSION_TOKEN_LEN + 1]);
+// Returns true and the saved state if `token` is the live token for `name`;
+// the session counts as online again.
+bool session_tokens_resume(const char *name, const char *token, session_state_t *state);
+// The session behind `name`'s token ended with this state; the token stays
+// resumable for the configured time.
+void session_tokens_logout(const char *name, const session_state_t *state);
+
+// Visits every unexpired record, for a checkpoint.
+void session_tokens_export(void (*visit)(const session_record_t *record, void *ctx), void *ctx);
+// Adds a checkpointed record, unless it expired meanwhile. A record that was
+// online when checkpointed belonged to a session the restart cut off, so its
+// expiry starts now. Returns 0 or -1.
+int session_tokens_import(const session_record_t *record);
+void session_tokens_shutdown(void);
+
+#endif /* SESSION_TOKENS_H */
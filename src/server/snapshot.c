@@ -0,0 +1,526 @@
+#define _POSIX_C_SOURCE 200809L
+#include "snapshot.h"
+
+#include "history_cache.h"
+#include "session_tokens.h"
+#include "storage.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <io.h>
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Header: magic, u32 version, u32 flags, u64 body length, u64 FNV-1a of the
+// body. The flags sit outside the checksum so loading can clear CLEAN in
+// place. The body is a run of sections, each a u32 type, u32 entry count and
+// u64 byte length, then the entries; a string is a u32 length, the bytes, a
+// NUL, and padding to the next multiple of 8.
+#define SNAPSHOT_MAGIC "CHATSNAP"
+#define SNAPSHOT_VERSION 1u
+#define SNAPSHOT_HEADER_BYTES 32u
+#define SNAPSHOT_FLAGS_OFFSET 12u
+#define SNAPSHOT_CLEAN 1u
+#define SECTION_HEADER_BYTES 16u
+#define TOKEN_ONLINE 1u
+#define TOKEN_PRESENCE 2u
+
+typedef enum {
+    SECTION_TOKENS = 1,    // u64 ended, u32 flags, name, token
+    SECTION_CAUGHT_UP = 2, // u32 shard, user
+    SECTION_SHARDS = 3,    // u64 newest id per shard
+    SECTION_CACHE = 4,     // user_a, user_b, u32 rows, u32 complete, then per row u64 id, timestamp, sender, body
+    SECTION_TYPES
+} section_type_t;
+
+static const char *snapshot_path = NULL;
+
+void snapshot_configure(const char *path) {
+    snapshot_path = path;
+}
+
+static uint64_t fnv1a64(const unsigned char *data, size_t len) {
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < len; ++i) {
+        hash ^= data[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+static void put_le(unsigned char *p, uint64_t v, size_t bytes) {
+    for (size_t i = 0; i < bytes; ++i) {
+        p[i] = (unsigned char)(v >> (8 * i));
+    }
+}
+
+static uint64_t get_le(const unsigned char *p, size_t bytes) {
+    uint64_t v = 0;
+    for (size_t i = 0; i < bytes; ++i) {
+        v |= (uint64_t)p[i] << (8 * i);
+    }
+    return v;
+}
+
+// ---------------------------------------------------------------------------
+// Writing: the whole file is built in memory, then written out at once.
+
+typedef struct {
+    unsigned char *data;
+    size_t len;
+    size_t capacity;
+    bool failed;
+} snapshot_buffer_t;
+
+static unsigned char *reserve(snapshot_buffer_t *b, size_t len) {
+    if (b->failed) {
+        return NULL;
+    }
+    if (b->capacity - b->len < len) {
+        size_t new_cap = b->capacity ? b->capacity : 4096;
+        while (new_cap - b->len < len) {
+            new_cap *= 2;
+        }
+        unsigned char *grown = realloc(b->data, new_cap);
+        if (!grown) {
+            b->failed = true;
+            return NULL;
+        }
+        b->data = grown;
+        b->capacity = new_cap;
+    }
+    unsigned char *p = b->data + b->len;
+    b->len += len;
+    return p;
+}
+
+static void put_int(snapshot_buffer_t *b, uint64_t v, size_t bytes) {
+    unsigned char *p = reserve(b, bytes);
+    if (p) {
+        put_le(p, v, bytes);
+    }
+}
+
+static void put_string(snapshot_buffer_t *b, const char *text) {
+    size_t len = strlen(text);
+    size_t start = b->len;
+    size_t bytes = ((start + 4 + len + 1 + 7) & ~(size_t)7) - start;
+    unsigned char *p = reserve(b, bytes);
+    if (p) {
+        put_le(p, len, 4);
+        memcpy(p + 4, text, len);
+        memset(p + 4 + len, 0, bytes - 4 - len);
+    }
+}
+
+typedef struct {
+    snapshot_buffer_t *buffer;
+    size_t start;
+    uint32_t count;
+} section_writer_t;
+
+static section_writer_t begin_section(snapshot_buffer_t *b, section_type_t type) {
+    section_writer_t section = {b, b->len, 0};
+    put_int(b, (uint64_t)type, 4);
+    put_int(b, 0, 4);
+    put_int(b, 0, 8);
+    return section;
+}
+
+static void end_section(section_writer_t *section) {
+    snapshot_buffer_t *b = section->buffer;
+    if (!b->failed) {
+        put_le(b->data + section->start + 4, section->count, 4);
+        put_le(b->data + section->start + 8, b->len - section->start - SECTION_HEADER_BYTES, 8);
+    }
+}
+
+static void write_token(const session_record_t *record, void *ctx) {
+    section_writer_t *section = (section_writer_t *)ctx;
+    uint32_t flags = (record->online ? TOKEN_ONLINE : 0) | (record->state.presence ? TOKEN_PRESENCE : 0);
+    put_int(section->buffer, (uint64_t)record->ended, 8);
+    put_int(section->buffer, flags, 4);
+    put_string(section->buffer, record->name);
+    put_string(section->buffer, record->token);
+    ++section->count;
+}
+
+static void write_caught_up(size_t shard, const char *user, void *ctx) {
+    section_writer_t *section = (section_writer_t *)ctx;
+    put_int(section->buffer, shard, 4);
+    put_string(section->buffer, user);
+    ++section->count;
+}
+
+static void write_ring(const char *user_a, const char *user_b, const history_row_t *rows, size_t count,
+                       bool complete, void *ctx) {
+    section_writer_t *section = (section_writer_t *)ctx;
+    snapshot_buffer_t *b = section->buffer;
+    put_string(b, user_a);
+    put_string(b, user_b);
+    put_int(b, count, 4);
+    put_int(b, complete ? 1 : 0, 4);
+    for (size_t i = 0; i < count; ++i) {
+        put_int(b, (uint64_t)rows[i].id, 8);
+        put_string(b, rows[i].timestamp);
+        put_string(b, rows[i].sender);
+        put_string(b, rows[i].body);
+    }
+    ++section->count;
+}
+
+static int sync_file(FILE *fp) {
+    if (fflush(fp) != 0) {
+        return -1;
+    }
+#ifdef _WIN32
+    return _commit(_fileno(fp));
+#else
+    return fsync(fileno(fp));
+#endif
+}
+
+static int replace_file(const char *from, const char *to) {
+#ifdef _WIN32
+    return MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING) ? 0 : -1;
+#else
+    return rename(from, to);
+#endif
+}
+
+// The storage checkpoint comes before the cache export: every row committed
+// up to the recorded newest ids is in the cache by then, and a row committed
+// after them leaves its shard newer than recorded, which the loader rejects.
+int snapshot_write(bool clean) {
+    if (!snapshot_path) {
+        return 0;
+    }
+    snapshot_buffer_t b = {NULL, 0, 0, false};
+    reserve(&b, SNAPSHOT_HEADER_BYTES);
+    section_writer_t tokens = begin_section(&b, SECTION_TOKENS);
+    session_tokens_export(write_token, &tokens);
+    end_section(&tokens);
+    size_t shards = storage_shard_count();
+    int64_t *newest = calloc(shards, sizeof(int64_t));
+    section_writer_t caught_up = begin_section(&b, SECTION_CAUGHT_UP);
+    int rc = newest ? storage_checkpoint(newest, write_caught_up, &caught_up) : -1;
+    end_section(&caught_up);
+    section_writer_t shard_ids = begin_section(&b, SECTION_SHARDS);
+    for (size_t i = 0; rc == 0 && i < shards; ++i) {
+        put_int(&b, (uint64_t)newest[i], 8);
+        ++shard_ids.count;
+    }
+    end_section(&shard_ids);
+    free(newest);
+    if (rc != 0) {
+        fprintf(stderr, "Snapshot skipped: %s\n", storage_last_error());
+        free(b.data);
+        return -1;
+    }
+    if (clean) {
+        section_writer_t cache = begin_section(&b, SECTION_CACHE);
+        history_cache_export(write_ring, &cache);
+        end_section(&cache);
+    }
+    if (b.failed) {
+        fprintf(stderr, "Snapshot skipped: out of memory\n");
+        free(b.data);
+        return -1;
+    }
+    memcpy(b.data, SNAPSHOT_MAGIC, 8);
+    put_le(b.data + 8, SNAPSHOT_VERSION, 4);
+    put_le(b.data + SNAPSHOT_FLAGS_OFFSET, clean ? SNAPSHOT_CLEAN : 0, 4);
+    put_le(b.data + 16, b.len - SNAPSHOT_HEADER_BYTES, 8);
+    put_le(b.data + 24, fnv1a64(b.data + SNAPSHOT_HEADER_BYTES, b.len - SNAPSHOT_HEADER_BYTES), 8);
+
+    char tmp_path[PATH_MAX + 16];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", snapshot_path);
+    FILE *fp = fopen(tmp_path, "wb");
+    bool ok = fp && fwrite(b.data, 1, b.len, fp) == b.len;
+    ok = fp && sync_file(fp) == 0 && ok;
+    ok = fp && fclose(fp) == 0 && ok;
+    ok = ok && replace_file(tmp_path, snapshot_path) == 0;
+    if (!ok) {
+        fprintf(stderr, "Failed to write snapshot %s: %s\n", snapshot_path, strerror(errno));
+        remove(tmp_path);
+        rc = -1;
+    }
+    free(b.data);
+    return rc;
+}
+
+// ---------------------------------------------------------------------------
+// Loading, straight from the mapped file: strings are handed on in place.
+
+typedef struct {
+    const unsigned char *base;
+    const unsigned char *p;
+    const unsigned char *end;
+    bool failed;
+} snapshot_cursor_t;
+
+static const unsigned char *take(snapshot_cursor_t *c, size_t len) {
+    if (c->failed || (size_t)(c->end - c->p) < len) {
+        c->failed = true;
+        return NULL;
+    }
+    const unsigned char *p = c->p;
+    c->p += len;
+    return p;
+}
+
+static uint64_t take_int(snapshot_cursor_t *c, size_t bytes) {
+    const unsigned char *p = take(c, bytes);
+    return p ? get_le(p, bytes) : 0;
+}
+
+static const char *take_string(snapshot_cursor_t *c) {
+    size_t len = (size_t)take_int(c, 4);
+    const unsigned char *text = take(c, len + 1);
+    if (!text || text[len] != '\0' || memchr(text, '\0', len)) {
+        c->failed = true;
+        return NULL;
+    }
+    size_t offset = (size_t)(c->p - c->base);
+    take(c, ((offset + 7) & ~(size_t)7) - offset);
+    return (const char *)text;
+}
+
+#ifdef _WIN32
+static unsigned char *map_file(const char *path, size_t *len) {
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        return NULL;
+    }
+    fseek(fp, 0, SEEK_END);
+    long file_len = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    unsigned char *data = file_len > 0 ? malloc((size_t)file_len) : NULL;
+    errno = data ? 0 : EINVAL;
+    if (data && fread(data, 1, (size_t)file_len, fp) != (size_t)file_len) {
+        free(data);
+        data = NULL;
+    }
+    fclose(fp);
+    *len = data ? (size_t)file_len : 0;
+    return data;
+}
+
+static void unmap_file(unsigned char *data, size_t len) {
+    (void)len;
+    free(data);
+}
+#else
+static unsigned char *map_file(const char *path, size_t *len) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    void *data = MAP_FAILED;
+    if (fstat(fd, &st) == 0) {
+        if (st.st_size > 0) {
+            data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        } else {
+            errno = EINVAL;
+        }
+    }
+    close(fd);
+    if (data == MAP_FAILED) {
+        return NULL;
+    }
+    *len = (size_t)st.st_size;
+    return data;
+}
+
+static void unmap_file(unsigned char *data, size_t len) {
+    munmap(data, len);
+}
+#endif
+
+// So that a crash after this start cannot leave the cache looking restorable
+// while the database moves on; the next checkpoint replaces the file anyway.
+static void clear_clean_flag(const unsigned char *header) {
+    FILE *fp = fopen(snapshot_path, "r+b");
+    if (!fp) {
+        return;
+    }
+    unsigned char flags[4];
+    put_le(flags, get_le(header + SNAPSHOT_FLAGS_OFFSET, 4) & ~(uint64_t)SNAPSHOT_CLEAN, 4);
+    if (fseek(fp, SNAPSHOT_FLAGS_OFFSET, SEEK_SET) == 0 && fwrite(flags, 1, sizeof(flags), fp) == sizeof(flags)) {
+        sync_file(fp);
+    }
+    fclose(fp);
+}
+
+static int restore_tokens(snapshot_cursor_t c, uint32_t count) {
+    for (uint32_t i = 0; i < count; ++i) {
+        session_record_t record;
+        memset(&record, 0, sizeof(record));
+        record.ended = (int64_t)take_int(&c, 8);
+        uint32_t flags = (uint32_t)take_int(&c, 4);
+        const char *name = take_string(&c);
+        const char *token = take_string(&c);
+        if (c.failed || strlen(name) >= sizeof(record.name) || strlen(token) != SESSION_TOKEN_LEN) {
+            return -1;
+        }
+        memcpy(record.name, name, strlen(name) + 1);
+        memcpy(record.token, token, SESSION_TOKEN_LEN + 1);
+        record.online = (flags & TOKEN_ONLINE) != 0;
+        record.state.presence = (flags & TOKEN_PRESENCE) != 0;
+        if (session_tokens_import(&record) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// `current[shard]` says whether the shard is still exactly as checkpointed.
+static int restore_caught_up(snapshot_cursor_t c, uint32_t count, const bool *current, size_t shards) {
+    uint32_t *owners = malloc((count ? count : 1) * sizeof(uint32_t));
+    const char **names = malloc((count ? count : 1) * sizeof(const char *));
+    const char **picked = malloc((count ? count : 1) * sizeof(const char *));
+    int rc = owners && names && picked ? 0 : -1;
+    for (uint32_t i = 0; rc == 0 && i < count; ++i) {
+        owners[i] = (uint32_t)take_int(&c, 4);
+        names[i] = take_string(&c);
+        rc = c.failed || owners[i] >= shards ? -1 : 0;
+    }
+    for (size_t shard = 0; rc == 0 && shard < shards; ++shard) {
+        size_t n = 0;
+        for (uint32_t i = 0; current[shard] && i < count; ++i) {
+            if (owners[i] == shard) {
+                picked[n++] = names[i];
+            }
+        }
+        rc = storage_restore_caught_up(shard, picked, n);
+    }
+    free(owners);
+    free(names);
+    free(picked);
+    return rc;
+}
+
+// Rings are stored least recently used first, so filling them in file order
+// rebuilds the eviction order too.
+static int restore_cache(snapshot_cursor_t c, uint32_t count, const bool *current, size_t shards) {
+    history_row_t *rows = NULL;
+    size_t capacity = 0;
+    int rc = 0;
+    for (uint32_t r = 0; rc == 0 && r < count; ++r) {
+        const char *user_a = take_string(&c);
+        const char *user_b = take_string(&c);
+        size_t row_count = (size_t)take_int(&c, 4);
+        bool complete = take_int(&c, 4) != 0;
+        if (c.failed || row_count > (size_t)(c.end - c.p) / 8) {
+            rc = -1;
+            break;
+        }
+        if (row_count > capacity) {
+            history_row_t *grown = realloc(rows, row_count * sizeof(history_row_t));
+            if (!grown) {
+                rc = -1;
+                break;
+            }
+            rows = grown;
+            capacity = row_count;
+        }
+        for (size_t i = 0; i < row_count; ++i) {
+            rows[i].id = (int64_t)take_int(&c, 8);
+            rows[i].timestamp = take_string(&c);
+            rows[i].sender = take_string(&c);
+            rows[i].body = take_string(&c);
+        }
+        if (c.failed) {
+            rc = -1;
+        } else if (row_count > 0 && current[(uint64_t)rows[0].id % shards]) {
+            uint64_t generation = history_cache_generation(user_a, user_b);
+            history_cache_fill(user_a, user_b, rows, row_count, complete, generation);
+        }
+    }
+    free(rows);
+    if (rc != 0) {
+        history_cache_clear(); // do not keep half of a damaged section
+    }
+    return rc;
+}
+
+int snapshot_load(void) {
+    if (!snapshot_path) {
+        return 0;
+    }
+    size_t len = 0;
+    unsigned char *data = map_file(snapshot_path, &len);
+    if (!data) {
+        if (errno != ENOENT) {
+            fprintf(stderr, "Ignoring snapshot %s: %s\n", snapshot_path, strerror(errno));
+        }
+        return 0;
+    }
+    const char *problem = NULL;
+    if (len < SNAPSHOT_HEADER_BYTES || memcmp(data, SNAPSHOT_MAGIC, 8) != 0 ||
+        get_le(data + 8, 4) != SNAPSHOT_VERSION) {
+        problem = "not a snapshot of this version";
+    } else if (get_le(data + 16, 8) != len - SNAPSHOT_HEADER_BYTES ||
+               get_le(data + 24, 8) != fnv1a64(data + SNAPSHOT_HEADER_BYTES, len - SNAPSHOT_HEADER_BYTES)) {
+        problem = "checksum mismatch";
+    }
+    // Index the sections first: their order in the file is not the order
+    // they are applied in.
+    snapshot_cursor_t sections[SECTION_TYPES];
+    uint32_t counts[SECTION_TYPES];
+    memset(sections, 0, sizeof(sections));
+    memset(counts, 0, sizeof(counts));
+    snapshot_cursor_t c = {data, data + SNAPSHOT_HEADER_BYTES, data + len, false};
+    while (!problem && c.p < c.end) {
+        uint32_t type = (uint32_t)take_int(&c, 4);
+        uint32_t count = (uint32_t)take_int(&c, 4);
+        uint64_t bytes = take_int(&c, 8);
+        const unsigned char *start = (c.failed || bytes > (uint64_t)(c.end - c.p)) ? NULL : take(&c, (size_t)bytes);
+        if (!start) {
+            problem = "truncated section";
+        } else if (type > 0 && type < SECTION_TYPES) {
+            sections[type] = (snapshot_cursor_t){data, start, start + bytes, false};
+            counts[type] = count;
+        }
+    }
+    bool clean = (get_le(data + SNAPSHOT_FLAGS_OFFSET, 4) & SNAPSHOT_CLEAN) != 0;
+    if (problem) {
+        fprintf(stderr, "Ignoring snapshot %s: %s\n", snapshot_path, problem);
+        unmap_file(data, len);
+        return 0;
+    }
+    if (clean) {
+        clear_clean_flag(data);
+    }
+
+    int rc = restore_tokens(sections[SECTION_TOKENS], counts[SECTION_TOKENS]);
+    size_t shards = storage_shard_count();
+    bool current[STORAGE_MAX_SHARDS] = {false};
+    if (rc == 0 && counts[SECTION_SHARDS] == shards) {
+        snapshot_cursor_t ids = sections[SECTION_SHARDS];
+        for (size_t i = 0; i < shards; ++i) {
+            current[i] = (int64_t)take_int(&ids, 8) == storage_newest_id(i) && !ids.failed;
+        }
+        rc = restore_caught_up(sections[SECTION_CAUGHT_UP], counts[SECTION_CAUGHT_UP], current, shards);
+        if (rc == 0 && clean) {
+            rc = restore_cache(sections[SECTION_CACHE], counts[SECTION_CACHE], current, shards);
+        }
+    }
+    unmap_file(data, len);
+    if (rc != 0) {
+        fprintf(stderr, "Snapshot %s partly restored: damaged or out of memory\n", snapshot_path);
+    }
+    return 1;
+}
@@ -0,0 +1,33 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdbool.h>
+
+// Restart checkpoint of the in-memory state that is expensive or impossible
+// to rebuild from the database: resumable session tokens, which users are
+// caught up on each storage shard, and (at a clean shutdown) the recent
+// history cache. A restart loads it instead of starting cold. Every shard's
+// newest message id is recorded with it, and storage state is only restored
+// for shards that are exactly as checkpointed; the cache additionally needs
+// a clean snapshot that no run since has started from.
+//
+// The file is a fixed header followed by 8-byte aligned sections of
+// little-endian integers and NUL-terminated strings, so it is checked and
+// read in place from a read-only mapping. It is written to a temporary file
+// and renamed over the old one, and its checksum rejects anything torn.
+
+// `path` is where the snapshot lives, or NULL for none.
+void snapshot_configure(const char *path);
+
+// Writes the snapshot. `clean` is for the final one, taken after every
+// session ended and the storage writers drained; only that one carries the
+// cache. Returns 0 or -1 with a message on stderr.
+int snapshot_write(bool clean);
+
+// Restores whatever in the snapshot still holds, then marks it used. Call
+// after storage_init() and before accepting connections. Returns 1 if a
+// snapshot was loaded, 0 if there was none or it was unusable (the reason
+// goes to stderr).
+int snapshot_load(void);
+
+#endif /* SNAPSHOT_H */
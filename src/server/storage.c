@@ -1,318 +1,1270 @@
-#include "storage.h"
+#define _POSIX_C_SOURCE 200809L
+#include "storage_backend.h"
+#include "history_cache.h"
+#include "metrics.h"
 
+#include <errno.h>
+#include <limits.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
-#ifndef STORAGE_USE_SQLITE
-#define STORAGE_USE_SQLITE 1
+#ifdef _WIN32
+#include <direct.h>
+#define make_directory(path) _mkdir(path)
+#else
+#include <sys/stat.h>
+#define make_directory(path) mkdir(path, 0755)
 #endif
 
 #define MAX_ERROR_LEN 256
+#define DEFAULT_WRITE_BATCH 256
+#define DEFAULT_WRITE_DELAY_MS 2
+#define DEFAULT_CACHE_MESSAGES 64
+#define DEFAULT_CACHE_BYTES (16u * 1024u * 1024u)
+#define DEFAULT_READ_CONNECTIONS 4
+#define DEFAULT_COMPRESS_MIN_BYTES 64
+#define DEFAULT_PURGE_BATCH 500
+#define PURGE_PAUSE_MS 10   /* between slices while there is work */
+#define PURGE_IDLE_MS 1000 /* between checks once there is none */
+#define POSITION_RING 4096  /* queue positions a delivery mark can trail by */
 
-static char last_error[MAX_ERROR_LEN];
-static pthread_mutex_t storage_lock = PTHREAD_MUTEX_INITIALIZER;
-static pthread_mutex_t error_lock = PTHREAD_MUTEX_INITIALIZER;
+// Writers, readers and the purge thread fail independently, so each thread
+// keeps its own text. A failure reported on another thread carries a copy
+// (store_callback's `error`, storage_store_message()).
+static _Thread_local char last_error[MAX_ERROR_LEN];
 
-static void set_error(const char *fmt, const char *detail) {
-    pthread_mutex_lock(&error_lock);
+void storage_set_error(const char *fmt, const char *detail) {
     snprintf(last_error, sizeof(last_error), fmt, detail ? detail : "");
-    pthread_mutex_unlock(&error_lock);
 }
 
 const char *storage_last_error(void) {
-    pthread_mutex_lock(&error_lock);
-    const char *msg = (*last_error) ? last_error : "unknown error";
-    pthread_mutex_unlock(&error_lock);
-    return msg;
+    return (*last_error) ? last_error : "unknown error";
 }
 
-#if STORAGE_USE_SQLITE
-#include <sqlite3.h>
+void storage_default_options(storage_options_t *options) {
+    options->wal = true;
+    options->synchronous = STORAGE_SYNC_NORMAL;
+    options->write_batch = DEFAULT_WRITE_BATCH;
+    options->write_delay_ms = DEFAULT_WRITE_DELAY_MS;
+    options->cache_messages = DEFAULT_CACHE_MESSAGES;
+    options->cache_bytes = DEFAULT_CACHE_BYTES;
+    options->read_connections = DEFAULT_READ_CONNECTIONS;
+    options->compression = STORAGE_COMPRESS_OFF;
+    options->compress_min_bytes = DEFAULT_COMPRESS_MIN_BYTES;
+    options->retain_seconds = 0;
+    options->retain_messages = 0;
+    options->purge_batch = DEFAULT_PURGE_BATCH;
+    options->node_index = 0;
+    options->node_count = 1;
+}
 
-static sqlite3 *db_handle = NULL;
+// Write-behind pipeline. Producers push onto an intrusive MPSC queue (Vyukov
+// style: one atomic exchange per push, no lock) and a single writer thread
+// drains it, committing up to write_batch messages per transaction once the
+// batch is full or write_delay_ms after it started filling. An entry without
+// receivers is a delivery cursor update for `sender` instead of a message:
+// to `id`, or with id 0 to the newest id committed by queue `position`.
+typedef struct pending_message {
+    _Atomic(struct pending_message *) next;
+    store_callback done;
+    void *ctx;
+    int status;
+    uint64_t submitted_at; // metrics_now() at submission
+    int64_t id;
+    uint64_t position;
+    char timestamp[32];
+    const char *sender;
+    const char **receivers;
+    size_t receiver_count;
+    const char *body;
+    char text[];
+} pending_message_t;
 
-int storage_init(const char *path) {
-    if (sqlite3_open(path, &db_handle) != SQLITE_OK) {
-        set_error("Failed to open database: %s", sqlite3_errmsg(db_handle));
-        return -1;
+// Storage is split into shards by conversation. Each shard is one backend (a
+// database file, or a log) with its own write-behind queue, writer thread
+// and storage_lock, so inserts and reads on different shards never meet. A
+// backend hands out its own ids; callers see them interleaved as
+// local * shard_count + shard, which keeps them unique and ascending within a
+// conversation, and leaves a single shard's ids as they are.
+typedef struct {
+    size_t index;
+    storage_backend_t *backend;
+    pthread_mutex_t storage_lock; // every backend call but fetch
+    int64_t newest_id;            // last committed local id, guarded by storage_lock
+
+    pending_message_t *stub;
+    _Atomic(pending_message_t *) queue_head; // producers
+    pending_message_t *queue_tail;           // writer only
+    atomic_size_t pending_count;
+    atomic_ullong submitted_count;
+    // Raised after the push, so every entry in the first queued_count queue
+    // positions had been pushed when the count was read.
+    atomic_ullong queued_count;
+    atomic_bool writer_sleeping;
+
+    pthread_mutex_t writer_lock;
+    pthread_cond_t writer_cond;
+    pthread_cond_t commit_cond;
+    unsigned long long committed_count; // guarded by writer_lock
+    bool writer_kick;                   // guarded by writer_lock
+    bool writer_stopping;               // guarded by writer_lock
+    bool writer_started;
+    pthread_t writer_thread;
+    // Writer only, allocated before the writer starts so it cannot fail
+    // later with submitters waiting on it.
+    pending_message_t **batch;
+    // Writer only: the newest id committed once each of the last
+    // POSITION_RING queue positions had been taken.
+    int64_t position_ids[POSITION_RING];
+
+    // Users with nothing above their cursor here, restored from a checkpoint
+    // (storage_restore_caught_up()); a fixed table that only ever shrinks.
+    pthread_mutex_t caught_up_lock;
+    struct caught_up_user **caught_up;
+    size_t caught_up_buckets;
+    atomic_size_t caught_up_count;
+} shard_t;
+
+static shard_t *shards = NULL;
+static size_t shard_count = 0;
+// Cluster mode: this store's place among the nodes' stores, whose ids
+// interleave (storage_options_t.node_index).
+static size_t node_index = 0;
+static size_t node_count = 1;
+
+static uint32_t fnv1a(uint32_t hash, const char *text) {
+    for (const unsigned char *p = (const unsigned char *)text; *p; ++p) {
+        hash ^= *p;
+        hash *= 16777619u;
     }
-    const char *sql =
-        "CREATE TABLE IF NOT EXISTS messages ("
-        "id INTEGER PRIMARY KEY AUTOINCREMENT,"
-        "sender TEXT NOT NULL,"
-        "receiver TEXT NOT NULL,"
-        "body TEXT NOT NULL,"
-        "created_at DATETIME DEFAULT CURRENT_TIMESTAMP" ");";
-    char *err = NULL;
-    if (sqlite3_exec(db_handle, sql, NULL, NULL, &err) != SQLITE_OK) {
-        set_error("Failed to create schema: %s", err);
-        sqlite3_free(err);
-        return -1;
+    return hash;
+}
+
+// Both directions of a conversation hash the same way: names in byte order.
+static shard_t *conversation_shard(const char *user_a, const char *user_b) {
+    if (shard_count == 1) {
+        return &shards[0];
     }
-    return 0;
+    if (strcmp(user_a, user_b) > 0) {
+        const char *tmp = user_a;
+        user_a = user_b;
+        user_b = tmp;
+    }
+    uint32_t hash = fnv1a(fnv1a(2166136261u, user_a), "\n");
+    return &shards[fnv1a(hash, user_b) % shard_count];
 }
 
-void storage_shutdown(void) {
-    if (db_handle) {
-        sqlite3_close(db_handle);
-        db_handle = NULL;
+// Published ids are local * stride + slot, one slot per shard of every
+// node's store, so they are unique cluster-wide and route back to a shard.
+static int64_t id_stride(void) {
+    return (int64_t)(shard_count * node_count);
+}
+
+static int64_t id_slot(const shard_t *shard) {
+    return (int64_t)(node_index * shard_count + shard->index);
+}
+
+static int64_t global_id(const shard_t *shard, int64_t local) {
+    return local * id_stride() + id_slot(shard);
+}
+
+static int64_t local_id(const shard_t *shard, int64_t global) {
+    return (global - id_slot(shard)) / id_stride();
+}
+
+// The shard a published id belongs to, or NULL for another node's id.
+static shard_t *id_shard(int64_t global) {
+    if (global <= 0) {
+        return NULL;
     }
+    int64_t slot = global % id_stride() - (int64_t)(node_index * shard_count);
+    return slot >= 0 && slot < (int64_t)shard_count ? &shards[slot] : NULL;
 }
 
-int storage_store_message(const char *sender, const char *receiver, const char *body) {
-    pthread_mutex_lock(&storage_lock);
-    const char *sql = "INSERT INTO messages (sender, receiver, body) VALUES (?, ?, ?);";
-    sqlite3_stmt *stmt = NULL;
-    if (sqlite3_prepare_v2(db_handle, sql, -1, &stmt, NULL) != SQLITE_OK) {
-        pthread_mutex_unlock(&storage_lock);
-        set_error("Failed to prepare insert: %s", sqlite3_errmsg(db_handle));
+// The local bound for `before_id`: the shard's local ids below it are exactly
+// its ids below before_id. 0 stays "no bound"; -1 means no id qualifies.
+static int64_t local_before(const shard_t *shard, int64_t before_id) {
+    if (before_id <= 0) {
+        return 0;
+    }
+    int64_t above = before_id - id_slot(shard);
+    return above > 0 ? (above - 1) / id_stride() + 1 : -1;
+}
+
+// The local bound for `after_id`: the shard's local ids above it are exactly
+// its ids above after_id.
+static int64_t local_after(const shard_t *shard, int64_t after_id) {
+    int64_t above = after_id - id_slot(shard);
+    return above > 0 ? above / id_stride() : 0;
+}
+
+// Messages queued but not yet committed, counted per hashed receiver, and
+// cursor updates per hashed user. An inbox read only has to wait for the
+// writer when its user's slot is busy, which keeps a reconnect storm from
+// cutting every batch short, yet still sees the previous page's cursor move.
+#define INBOUND_SLOTS 1024u /* power of two */
+static atomic_uint inbound_pending[INBOUND_SLOTS];
+
+static atomic_uint *inbound_slot(const char *user) {
+    return &inbound_pending[fnv1a(2166136261u, user) & (INBOUND_SLOTS - 1)];
+}
+
+// The same for messages by hashed sender. A history read waits for the
+// writer only while its requester's own messages are queued, the ones they
+// may have been acknowledged for already; otherwise it reads what has
+// committed without cutting the batch short.
+static atomic_uint sent_pending[INBOUND_SLOTS];
+
+static atomic_uint *sent_slot(const char *user) {
+    return &sent_pending[fnv1a(2166136261u, user) & (INBOUND_SLOTS - 1)];
+}
+
+// A caught-up user's inbox read skips the shard until a message to them is
+// queued there, which takes them out again before it can commit.
+typedef struct caught_up_user {
+    struct caught_up_user *next;
+    uint32_t hash;
+    char name[];
+} caught_up_user_t;
+
+// Caller holds caught_up_lock.
+static caught_up_user_t **caught_up_link(shard_t *shard, const char *user, uint32_t hash) {
+    caught_up_user_t **link = &shard->caught_up[hash % shard->caught_up_buckets];
+    while (*link && ((*link)->hash != hash || strcmp((*link)->name, user) != 0)) {
+        link = &(*link)->next;
+    }
+    return link;
+}
+
+static bool is_caught_up(shard_t *shard, const char *user) {
+    if (atomic_load(&shard->caught_up_count) == 0) {
+        return false;
+    }
+    pthread_mutex_lock(&shard->caught_up_lock);
+    bool found = *caught_up_link(shard, user, fnv1a(2166136261u, user)) != NULL;
+    pthread_mutex_unlock(&shard->caught_up_lock);
+    return found;
+}
+
+static void clear_caught_up(shard_t *shard, const char *user) {
+    if (atomic_load(&shard->caught_up_count) == 0) {
+        return;
+    }
+    pthread_mutex_lock(&shard->caught_up_lock);
+    caught_up_user_t **link = caught_up_link(shard, user, fnv1a(2166136261u, user));
+    caught_up_user_t *found = *link;
+    if (found) {
+        *link = found->next;
+        atomic_fetch_sub(&shard->caught_up_count, 1);
+    }
+    pthread_mutex_unlock(&shard->caught_up_lock);
+    free(found);
+}
+
+static void free_caught_up(shard_t *shard) {
+    for (size_t b = 0; b < shard->caught_up_buckets; ++b) {
+        while (shard->caught_up[b]) {
+            caught_up_user_t *next = shard->caught_up[b]->next;
+            free(shard->caught_up[b]);
+            shard->caught_up[b] = next;
+        }
+    }
+    free(shard->caught_up);
+    shard->caught_up = NULL;
+    shard->caught_up_buckets = 0;
+    atomic_store(&shard->caught_up_count, 0);
+}
+
+static void settle_inbound(pending_message_t **batch, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        atomic_fetch_sub(batch[i]->receiver_count == 0 ? inbound_slot(batch[i]->sender) : sent_slot(batch[i]->sender),
+                         1);
+        for (size_t r = 0; r < batch[i]->receiver_count; ++r) {
+            atomic_fetch_sub(inbound_slot(batch[i]->receivers[r]), 1);
+        }
+    }
+}
+static size_t write_batch = DEFAULT_WRITE_BATCH;
+static int write_delay_ms = DEFAULT_WRITE_DELAY_MS;
+
+static void queue_push(shard_t *shard, pending_message_t *msg) {
+    atomic_store_explicit(&msg->next, NULL, memory_order_relaxed);
+    pending_message_t *prev = atomic_exchange_explicit(&shard->queue_head, msg, memory_order_acq_rel);
+    atomic_store_explicit(&prev->next, msg, memory_order_release);
+}
+
+// Returns NULL when the queue is empty or a producer is between its exchange
+// and its link store; the writer simply retries on the next pass.
+static pending_message_t *queue_pop(shard_t *shard) {
+    pending_message_t *tail = shard->queue_tail;
+    pending_message_t *next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (tail == shard->stub) {
+        if (!next) {
+            return NULL;
+        }
+        shard->queue_tail = next;
+        tail = next;
+        next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    }
+    if (next) {
+        shard->queue_tail = next;
+        return tail;
+    }
+    if (tail != atomic_load_explicit(&shard->queue_head, memory_order_acquire)) {
+        return NULL;
+    }
+    queue_push(shard, shard->stub);
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (next) {
+        shard->queue_tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+static void deadline_after_ms(struct timespec *ts, int ms) {
+    clock_gettime(CLOCK_REALTIME, ts);
+    ts->tv_sec += ms / 1000;
+    ts->tv_nsec += (long)(ms % 1000) * 1000000L;
+    if (ts->tv_nsec >= 1000000000L) {
+        ts->tv_sec += 1;
+        ts->tv_nsec -= 1000000000L;
+    }
+}
+
+// Caller holds writer_lock. Sleeps until at least `wake_at` messages are
+// pending. writer_sleeping is raised before the count is re-checked, and
+// producers bump the count before reading the flag, so either the producer
+// signals or the writer sees its message.
+static int writer_wait(shard_t *shard, size_t wake_at, const struct timespec *deadline) {
+    atomic_store(&shard->writer_sleeping, true);
+    int rc = 0;
+    if (atomic_load(&shard->pending_count) < wake_at && !shard->writer_stopping && !shard->writer_kick) {
+        rc = deadline ? pthread_cond_timedwait(&shard->writer_cond, &shard->writer_lock, deadline)
+                      : pthread_cond_wait(&shard->writer_cond, &shard->writer_lock);
+    }
+    atomic_store(&shard->writer_sleeping, false);
+    return rc;
+}
+
+// The newest id committed once queue position `position` was taken, for a
+// cursor update at `current`; 0 if nothing was, or if the ring has moved on.
+static int64_t newest_at(const shard_t *shard, uint64_t position, uint64_t current) {
+    if (position == 0 || current - position >= POSITION_RING) {
+        return 0;
+    }
+    return shard->position_ids[position % POSITION_RING];
+}
+
+// `taken` is the number of queue positions popped before this batch.
+static void write_batch_locked(shard_t *shard, pending_message_t **batch, size_t count, uint64_t taken) {
+    storage_backend_t *backend = shard->backend;
+    int rc = storage_backend_begin(backend);
+    int64_t newest = shard->newest_id;
+    for (size_t i = 0; i < count; ++i) {
+        pending_message_t *msg = batch[i];
+        uint64_t position = taken + i + 1;
+        if (rc != 0) {
+            msg->status = -1;
+        } else if (msg->receiver_count == 0) {
+            // The update commits or rolls back with the batch, so a cursor
+            // never passes ids that a failed batch hands out again.
+            int64_t upto = msg->id ? msg->id : newest_at(shard, msg->position, position);
+            msg->status = upto > 0 ? storage_backend_set_cursor(backend, msg->sender, upto) : 0;
+        } else if (msg->receiver_count == 1) {
+            msg->status = storage_backend_insert(backend, msg->sender, msg->receivers[0], msg->body, &msg->id,
+                                                 msg->timestamp, sizeof(msg->timestamp));
+        } else {
+            msg->status = storage_backend_insert_group(backend, msg->sender, msg->receivers, msg->receiver_count,
+                                                       msg->body, &msg->id, msg->timestamp, sizeof(msg->timestamp));
+        }
+        if (msg->receiver_count > 0 && msg->status == 0 && msg->id > newest) {
+            newest = msg->id;
+        }
+        shard->position_ids[position % POSITION_RING] = newest;
+    }
+    if (rc == 0 && storage_backend_commit(backend) != 0) {
+        storage_backend_rollback(backend);
+        for (size_t i = 0; i < count; ++i) {
+            batch[i]->status = -1;
+            shard->position_ids[(taken + i + 1) % POSITION_RING] = shard->newest_id;
+        }
+        rc = -1;
+    }
+    settle_inbound(batch, count);
+    if (rc != 0) {
+        return;
+    }
+    shard->newest_id = newest;
+    // After the commit, so a read that started earlier sees the generation
+    // move and does not overwrite the ring; the single writer keeps ids in
+    // commit order.
+    for (size_t i = 0; i < count; ++i) {
+        pending_message_t *msg = batch[i];
+        if (msg->receiver_count > 0 && msg->status == 0) {
+            history_row_t row = {global_id(shard, msg->id), msg->timestamp, msg->sender, msg->body};
+            history_cache_append(msg->sender, msg->receivers, msg->receiver_count, &row);
+        }
+    }
+}
+
+static void *writer_main(void *arg) {
+    shard_t *shard = (shard_t *)arg;
+    pending_message_t **batch = shard->batch;
+    for (;;) {
+        pthread_mutex_lock(&shard->writer_lock);
+        while (atomic_load(&shard->pending_count) == 0 && !shard->writer_stopping) {
+            shard->writer_kick = false; // everything submitted so far is committed
+            writer_wait(shard, 1, NULL);
+        }
+        if (write_delay_ms > 0 && !shard->writer_stopping) {
+            struct timespec deadline;
+            deadline_after_ms(&deadline, write_delay_ms);
+            while (atomic_load(&shard->pending_count) < write_batch && !shard->writer_kick &&
+                   !shard->writer_stopping) {
+                if (writer_wait(shard, write_batch, &deadline) == ETIMEDOUT) {
+                    break;
+                }
+            }
+        }
+        bool done = shard->writer_stopping && atomic_load(&shard->pending_count) == 0;
+        shard->writer_kick = false;
+        uint64_t taken = shard->committed_count;
+        pthread_mutex_unlock(&shard->writer_lock);
+        if (done) {
+            break;
+        }
+
+        size_t count = 0;
+        while (count < write_batch) {
+            pending_message_t *msg = queue_pop(shard);
+            if (!msg) {
+                break;
+            }
+            batch[count++] = msg;
+        }
+        if (count == 0) {
+            continue; // a producer is mid-push; its message shows up next pass
+        }
+        atomic_fetch_sub(&shard->pending_count, count);
+
+        metrics_lock(&shard->storage_lock, METRIC_STORAGE_LOCK_WAIT);
+        write_batch_locked(shard, batch, count, taken);
+        pthread_mutex_unlock(&shard->storage_lock);
+
+        uint64_t now = metrics_now();
+        for (size_t i = 0; i < count; ++i) {
+            if (batch[i]->receiver_count > 0 && batch[i]->status == 0) {
+                metrics_record(METRIC_COMMIT_LATENCY, now - batch[i]->submitted_at);
+            }
+            if (batch[i]->done) {
+                // A failure in this batch was the writer's own, so its text
+                // is still this thread's last error.
+                batch[i]->done(batch[i]->status, batch[i]->status == 0 ? NULL : storage_last_error(), batch[i]->ctx);
+            }
+            free(batch[i]);
+        }
+        pthread_mutex_lock(&shard->writer_lock);
+        shard->committed_count += count;
+        pthread_cond_broadcast(&shard->commit_cond);
+        pthread_mutex_unlock(&shard->writer_lock);
+    }
+    return NULL;
+}
+
+// Blocks until everything submitted to the shard before the call has been
+// written, cutting the current batch short. Reads and deletes call this so
+// they observe every message the requester was already acknowledged for.
+static void writer_sync(shard_t *shard) {
+    unsigned long long target = atomic_load(&shard->submitted_count);
+    pthread_mutex_lock(&shard->writer_lock);
+    if (shard->committed_count < target) {
+        shard->writer_kick = true;
+        pthread_cond_signal(&shard->writer_cond);
+        while (shard->committed_count < target) {
+            pthread_cond_wait(&shard->commit_cond, &shard->writer_lock);
+        }
+    }
+    pthread_mutex_unlock(&shard->writer_lock);
+}
+
+// Background purge. A delete only hides rows; this thread removes them, and
+// whatever the retention limits have expired, one slice per storage_lock hold
+// and shard with a pause between rounds, so a sender waits behind at most one
+// small transaction. Deletes wake it early.
+static pthread_mutex_t purge_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t purge_cond = PTHREAD_COND_INITIALIZER;
+static bool purge_kick = false;     // guarded by purge_lock
+static bool purge_stopping = false; // guarded by purge_lock
+static bool purge_started = false;
+static pthread_t purge_thread;
+static uint64_t retain_seconds = 0;
+static uint64_t retain_messages = 0; // per shard: its share of the cap
+static size_t purge_batch = DEFAULT_PURGE_BATCH;
+
+static int purge_shard(shard_t *shard) {
+    metrics_lock(&shard->storage_lock, METRIC_STORAGE_LOCK_WAIT);
+    int64_t newest = shard->newest_id;
+    int64_t upto = retain_messages > 0 && (uint64_t)newest > retain_messages ? newest - (int64_t)retain_messages : 0;
+    int64_t floor = 0;
+    int done = storage_backend_purge(shard->backend, upto, retain_seconds, purge_batch, &floor);
+    if (floor > 0) {
+        // Rows the cache holds may have just been swept; ids above
+        // newest_id have not been handed out yet.
+        history_cache_set_floor(shard->index, global_id(shard, floor < newest ? floor : newest));
+    }
+    pthread_mutex_unlock(&shard->storage_lock);
+    return done;
+}
+
+static void *purge_main(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&purge_lock);
+    while (!purge_stopping) {
+        pthread_mutex_unlock(&purge_lock);
+        int done = 0;
+        for (size_t i = 0; i < shard_count; ++i) {
+            if (purge_shard(&shards[i]) > 0) {
+                done = 1;
+            }
+        }
+
+        pthread_mutex_lock(&purge_lock);
+        struct timespec deadline;
+        deadline_after_ms(&deadline, done > 0 ? PURGE_PAUSE_MS : PURGE_IDLE_MS);
+        while (!purge_stopping && (done > 0 || !purge_kick) &&
+               pthread_cond_timedwait(&purge_cond, &purge_lock, &deadline) != ETIMEDOUT) {
+        }
+        purge_kick = false;
+    }
+    pthread_mutex_unlock(&purge_lock);
+    return NULL;
+}
+
+void storage_stop_purge(void) {
+    if (purge_started) {
+        pthread_mutex_lock(&purge_lock);
+        purge_stopping = true;
+        pthread_cond_signal(&purge_cond);
+        pthread_mutex_unlock(&purge_lock);
+        pthread_join(purge_thread, NULL);
+        purge_started = false;
+    }
+}
+
+// A sharded store is a directory of shard-NN.db files. Conversations are
+// placed by a hash modulo the shard count, so the count is recorded beside
+// them and a later start with another one is refused rather than losing them.
+static int prepare_directory(const char *path, size_t count) {
+    char file[PATH_MAX];
+    if (make_directory(path) != 0 && errno != EEXIST) {
+        storage_set_error("Failed to create storage directory: %s", strerror(errno));
         return -1;
     }
-    sqlite3_bind_text(stmt, 1, sender, -1, SQLITE_TRANSIENT);
-    sqlite3_bind_text(stmt, 2, receiver, -1, SQLITE_TRANSIENT);
-    sqlite3_bind_text(stmt, 3, body, -1, SQLITE_TRANSIENT);
-    int rc = sqlite3_step(stmt);
-    sqlite3_finalize(stmt);
-    pthread_mutex_unlock(&storage_lock);
-    if (rc != SQLITE_DONE) {
-        set_error("Failed to store message: %s", sqlite3_errmsg(db_handle));
+    if (snprintf(file, sizeof(file), "%s/shards", path) >= (int)sizeof(file)) {
+        storage_set_error("Storage path is too long%s", "");
+        return -1;
+    }
+    FILE *fp = fopen(file, "r");
+    if (fp) {
+        unsigned long recorded = 0;
+        int found = fscanf(fp, "%lu", &recorded);
+        fclose(fp);
+        if (found == 1 && recorded == count) {
+            return 0;
+        }
+        char detail[32];
+        snprintf(detail, sizeof(detail), "%lu", found == 1 ? recorded : 0ul);
+        storage_set_error("Storage directory was created with %s shards", detail);
+        return -1;
+    }
+    fp = fopen(file, "w");
+    if (!fp || fprintf(fp, "%lu\n", (unsigned long)count) < 0 || fclose(fp) != 0) {
+        storage_set_error("Failed to record the shard count: %s", strerror(errno));
         return -1;
     }
     return 0;
 }
 
-int storage_fetch_conversation(const char *user_a, const char *user_b, history_callback cb, void *ctx) {
-    pthread_mutex_lock(&storage_lock);
-    const char *sql =
-        "SELECT datetime(created_at), sender, body FROM messages "
-        "WHERE (sender=? AND receiver=?) OR (sender=? AND receiver=?) "
-        "ORDER BY created_at ASC";
-    sqlite3_stmt *stmt = NULL;
-    if (sqlite3_prepare_v2(db_handle, sql, -1, &stmt, NULL) != SQLITE_OK) {
-        pthread_mutex_unlock(&storage_lock);
-        set_error("Failed to query history: %s", sqlite3_errmsg(db_handle));
+static int open_shard(shard_t *shard, const char *path, const storage_options_t *options) {
+    char file[PATH_MAX];
+    if (shard_count > 1) {
+        if (snprintf(file, sizeof(file), "%s/shard-%02lu.db", path, (unsigned long)shard->index) >=
+            (int)sizeof(file)) {
+            storage_set_error("Storage path is too long%s", "");
+            return -1;
+        }
+        path = file;
+    }
+    if (!(shard->backend = storage_backend_open(path, options))) {
         return -1;
     }
-    sqlite3_bind_text(stmt, 1, user_a, -1, SQLITE_TRANSIENT);
-    sqlite3_bind_text(stmt, 2, user_b, -1, SQLITE_TRANSIENT);
-    sqlite3_bind_text(stmt, 3, user_b, -1, SQLITE_TRANSIENT);
-    sqlite3_bind_text(stmt, 4, user_a, -1, SQLITE_TRANSIENT);
-
-    while (sqlite3_step(stmt) == SQLITE_ROW) {
-        const char *timestamp = (const char *)sqlite3_column_text(stmt, 0);
-        const char *sender = (const char *)sqlite3_column_text(stmt, 1);
-        const char *body = (const char *)sqlite3_column_text(stmt, 2);
-        cb(timestamp ? timestamp : "", sender ? sender : "", body ? body : "", ctx);
+    shard->newest_id = storage_backend_last_id(shard->backend);
+    if (pthread_create(&shard->writer_thread, NULL, writer_main, shard) != 0) {
+        storage_set_error("Failed to start storage writer%s", "");
+        return -1;
     }
-    sqlite3_finalize(stmt);
-    pthread_mutex_unlock(&storage_lock);
+    shard->writer_started = true;
     return 0;
 }
 
-int storage_delete_conversation(const char *user_a, const char *user_b) {
-    pthread_mutex_lock(&storage_lock);
-    const char *sql =
-        "DELETE FROM messages WHERE (sender=? AND receiver=?) OR (sender=? AND receiver=?)";
-    sqlite3_stmt *stmt = NULL;
-    if (sqlite3_prepare_v2(db_handle, sql, -1, &stmt, NULL) != SQLITE_OK) {
-        pthread_mutex_unlock(&storage_lock);
-        set_error("Failed to prepare delete: %s", sqlite3_errmsg(db_handle));
+int storage_init(const char *path, size_t count, const storage_options_t *options) {
+    storage_options_t defaults;
+    if (!options) {
+        storage_default_options(&defaults);
+        options = &defaults;
+    }
+    count = count > 0 ? count : 1;
+    if (count > STORAGE_MAX_SHARDS) {
+        storage_set_error("Too many storage shards%s", "");
+        return -1;
+    }
+    if (count > 1 && prepare_directory(path, count) != 0) {
         return -1;
     }
-    sqlite3_bind_text(stmt, 1, user_a, -1, SQLITE_TRANSIENT);
-    sqlite3_bind_text(stmt, 2, user_b, -1, SQLITE_TRANSIENT);
-    sqlite3_bind_text(stmt, 3, user_b, -1, SQLITE_TRANSIENT);
-    sqlite3_bind_text(stmt, 4, user_a, -1, SQLITE_TRANSIENT);
-    int rc = sqlite3_step(stmt);
-    sqlite3_finalize(stmt);
-    pthread_mutex_unlock(&storage_lock);
-    if (rc != SQLITE_DONE) {
-        set_error("Failed to delete history: %s", sqlite3_errmsg(db_handle));
+    write_batch = options->write_batch > 0 ? options->write_batch : 1;
+    write_delay_ms = options->write_delay_ms > 0 ? options->write_delay_ms : 0;
+    node_count = options->node_count > 0 ? options->node_count : 1;
+    node_index = options->node_index < node_count ? options->node_index : 0;
+    history_cache_configure(options->cache_messages, options->cache_bytes, count);
+    if (!(shards = calloc(count, sizeof(shard_t)))) {
+        storage_set_error("Out of memory starting storage%s", "");
         return -1;
     }
+    shard_count = count;
+    for (size_t i = 0; i < count; ++i) {
+        shard_t *shard = &shards[i];
+        shard->index = i;
+        pthread_mutex_init(&shard->storage_lock, NULL);
+        pthread_mutex_init(&shard->caught_up_lock, NULL);
+        pthread_mutex_init(&shard->writer_lock, NULL);
+        pthread_cond_init(&shard->writer_cond, NULL);
+        pthread_cond_init(&shard->commit_cond, NULL);
+        shard->stub = calloc(1, sizeof(pending_message_t));
+        shard->queue_tail = shard->stub;
+        atomic_init(&shard->queue_head, shard->stub);
+        shard->batch = malloc(write_batch * sizeof(pending_message_t *));
+    }
+    for (size_t i = 0; i < count; ++i) {
+        bool allocated = shards[i].stub && shards[i].batch;
+        if (!allocated || open_shard(&shards[i], path, options) != 0) {
+            if (!allocated) {
+                storage_set_error("Out of memory starting storage%s", "");
+            }
+            storage_shutdown();
+            return -1;
+        }
+    }
+    retain_seconds = options->retain_seconds;
+    retain_messages = (options->retain_messages + count - 1) / count;
+    purge_batch = options->purge_batch > 0 ? options->purge_batch : 1;
+    purge_stopping = false;
+    if (pthread_create(&purge_thread, NULL, purge_main, NULL) != 0) {
+        storage_set_error("Failed to start storage purge%s", "");
+        storage_shutdown();
+        return -1;
+    }
+    purge_started = true;
     return 0;
 }
 
-#else
+void storage_shutdown(void) {
+    storage_stop_purge();
+    for (size_t i = 0; i < shard_count; ++i) {
+        shard_t *shard = &shards[i];
+        if (shard->writer_started) {
+            pthread_mutex_lock(&shard->writer_lock);
+            shard->writer_stopping = true;
+            pthread_cond_signal(&shard->writer_cond);
+            pthread_mutex_unlock(&shard->writer_lock);
+            pthread_join(shard->writer_thread, NULL);
+        }
+        if (shard->backend) {
+            storage_backend_close(shard->backend);
+        }
+        free(shard->stub);
+        free(shard->batch);
+        free_caught_up(shard);
+        pthread_mutex_destroy(&shard->caught_up_lock);
+        pthread_mutex_destroy(&shard->storage_lock);
+        pthread_mutex_destroy(&shard->writer_lock);
+        pthread_cond_destroy(&shard->writer_cond);
+        pthread_cond_destroy(&shard->commit_cond);
+    }
+    free(shards);
+    shards = NULL;
+    shard_count = 0;
+    history_cache_clear();
+}
 
-#include <errno.h>
-#include <limits.h>
-#ifdef _WIN32
-#define strdup _strdup
-#endif
+static void submit_pending(shard_t *shard, pending_message_t *msg) {
+    atomic_fetch_add(&shard->submitted_count, 1);
+    size_t pending = atomic_fetch_add(&shard->pending_count, 1) + 1;
+    queue_push(shard, msg);
+    atomic_fetch_add(&shard->queued_count, 1);
+    if (atomic_load(&shard->writer_sleeping) && (pending == 1 || pending >= write_batch)) {
+        pthread_mutex_lock(&shard->writer_lock);
+        pthread_cond_signal(&shard->writer_cond);
+        pthread_mutex_unlock(&shard->writer_lock);
+    }
+}
 
-static char storage_path[PATH_MAX];
+// Everything lives in one block: the header, the receiver pointers, then the
+// strings they point at.
+static pending_message_t *new_message(const char *sender, const char *const *receivers, size_t count,
+                                      const char *body, store_callback done, void *ctx) {
+    size_t sender_len = strlen(sender) + 1;
+    size_t body_len = strlen(body) + 1;
+    size_t size = sizeof(pending_message_t) + count * sizeof(const char *) + sender_len + body_len;
+    for (size_t i = 0; i < count; ++i) {
+        size += strlen(receivers[i]) + 1;
+    }
+    pending_message_t *msg = malloc(size);
+    if (!msg) {
+        return NULL;
+    }
+    msg->receivers = (const char **)(void *)msg->text;
+    msg->receiver_count = count;
+    char *cursor = msg->text + count * sizeof(const char *);
+    for (size_t i = 0; i < count; ++i) {
+        size_t len = strlen(receivers[i]) + 1;
+        msg->receivers[i] = memcpy(cursor, receivers[i], len);
+        cursor += len;
+    }
+    msg->sender = memcpy(cursor, sender, sender_len);
+    cursor += sender_len;
+    msg->body = memcpy(cursor, body, body_len);
+    msg->done = done;
+    msg->ctx = ctx;
+    msg->status = 0;
+    msg->submitted_at = metrics_now();
+    return msg;
+}
+
+int storage_submit_message(const char *sender, const char *receiver, const char *body, store_callback done, void *ctx) {
+    return storage_submit_group(sender, &receiver, 1, body, done, ctx);
+}
+
+// A group spanning several shards is one queue entry per shard; the caller's
+// callback runs once, after the last of them, and fails with the text of the
+// first part that failed.
+typedef struct {
+    atomic_size_t remaining;
+    atomic_int status;
+    store_callback done;
+    void *ctx;
+    char error[MAX_ERROR_LEN]; // written only by the part that set status
+} group_ticket_t;
+
+static void group_part_done(int status, const char *error, void *arg) {
+    group_ticket_t *ticket = (group_ticket_t *)arg;
+    int expected = 0;
+    if (status != 0 && atomic_compare_exchange_strong(&ticket->status, &expected, status)) {
+        snprintf(ticket->error, sizeof(ticket->error), "%s", error ? error : "unknown error");
+    }
+    if (atomic_fetch_sub(&ticket->remaining, 1) == 1) {
+        int result = atomic_load(&ticket->status);
+        ticket->done(result, result == 0 ? NULL : ticket->error, ticket->ctx);
+        free(ticket);
+    }
+}
 
-static void ensure_path_buffer(void) {
-    if (storage_path[0] == '\0') {
-        strncpy(storage_path, "chat.log", sizeof(storage_path) - 1);
+static void queue_message(shard_t *shard, pending_message_t *msg) {
+    atomic_fetch_add(sent_slot(msg->sender), 1);
+    for (size_t i = 0; i < msg->receiver_count; ++i) {
+        atomic_fetch_add(inbound_slot(msg->receivers[i]), 1);
+        clear_caught_up(shard, msg->receivers[i]);
     }
+    submit_pending(shard, msg);
 }
 
-static int portable_getline(char **lineptr, size_t *n, FILE *stream) {
-    if (!lineptr || !n || !stream) {
+int storage_submit_group(const char *sender, const char *const *receivers, size_t count, const char *body,
+                         store_callback done, void *ctx) {
+    if (count == 0) {
+        storage_set_error("Message has no receivers%s", "");
         return -1;
     }
-    if (*lineptr == NULL || *n == 0) {
-        *n = 256;
-        *lineptr = malloc(*n);
-        if (!*lineptr) {
+    if (shard_count == 1 || count == 1) {
+        pending_message_t *msg = new_message(sender, receivers, count, body, done, ctx);
+        if (!msg) {
+            storage_set_error("Out of memory queueing message%s", "");
             return -1;
         }
+        queue_message(count == 1 ? conversation_shard(sender, receivers[0]) : &shards[0], msg);
+        return 0;
+    }
+    size_t *home = malloc(count * sizeof(size_t));
+    const char **subset = malloc(count * sizeof(const char *));
+    group_ticket_t *ticket = done ? malloc(sizeof(group_ticket_t)) : NULL;
+    pending_message_t *parts[STORAGE_MAX_SHARDS];
+    size_t part_shard[STORAGE_MAX_SHARDS];
+    size_t part_count = 0;
+    bool ok = home && subset && (ticket || !done);
+    for (size_t i = 0; ok && i < count; ++i) {
+        home[i] = conversation_shard(sender, receivers[i])->index;
     }
-    size_t total = 0;
-    while (fgets(*lineptr + total, (int)(*n - total), stream)) {
-        size_t chunk = strlen(*lineptr + total);
-        total += chunk;
-        if (total > 0 && (*lineptr)[total - 1] == '\n') {
-            return (int)total;
+    for (size_t s = 0; ok && s < shard_count; ++s) {
+        size_t n = 0;
+        for (size_t i = 0; i < count; ++i) {
+            if (home[i] == s) {
+                subset[n++] = receivers[i];
+            }
         }
-        size_t new_size = (*n) * 2;
-        char *tmp = realloc(*lineptr, new_size);
-        if (!tmp) {
-            return -1;
+        if (n > 0) {
+            parts[part_count] = new_message(sender, subset, n, body, ticket ? group_part_done : NULL, ticket);
+            part_shard[part_count] = s;
+            if ((ok = parts[part_count] != NULL)) {
+                ++part_count;
+            }
+        }
+    }
+    free(home);
+    free(subset);
+    if (!ok) {
+        for (size_t i = 0; i < part_count; ++i) {
+            free(parts[i]);
         }
-        *lineptr = tmp;
-        *n = new_size;
+        free(ticket);
+        storage_set_error("Out of memory queueing message%s", "");
+        return -1;
+    }
+    if (ticket && part_count == 1) {
+        parts[0]->done = done;
+        parts[0]->ctx = ctx;
+        free(ticket);
+    } else if (ticket) {
+        atomic_init(&ticket->remaining, part_count);
+        atomic_init(&ticket->status, 0);
+        ticket->done = done;
+        ticket->ctx = ctx;
+    }
+    for (size_t i = 0; i < part_count; ++i) {
+        queue_message(&shards[part_shard[i]], parts[i]);
     }
-    return (total > 0) ? (int)total : -1;
+    return 0;
 }
 
-static void format_timestamp(char *buffer, size_t len) {
-    time_t now = time(NULL);
-#ifdef _WIN32
-    struct tm tm_now;
-    localtime_s(&tm_now, &now);
-    strftime(buffer, len, "%Y-%m-%d %H:%M:%S", &tm_now);
-#else
-    struct tm tm_now;
-    localtime_r(&now, &tm_now);
-    strftime(buffer, len, "%Y-%m-%d %H:%M:%S", &tm_now);
-#endif
+// Queues a cursor update to `upto`, the shard's own id, or with `upto` 0 to
+// the newest id committed by queue `position`.
+static int submit_cursor(shard_t *shard, const char *user, int64_t upto, uint64_t position) {
+    size_t user_len = strlen(user) + 1;
+    pending_message_t *msg = malloc(sizeof(pending_message_t) + user_len);
+    if (!msg) {
+        storage_set_error("Out of memory queueing cursor%s", "");
+        return -1;
+    }
+    msg->sender = memcpy(msg->text, user, user_len);
+    msg->receivers = NULL;
+    msg->receiver_count = 0;
+    msg->body = NULL;
+    msg->id = upto;
+    msg->position = position;
+    msg->done = NULL;
+    msg->ctx = NULL;
+    msg->status = 0;
+    msg->submitted_at = 0;
+    atomic_fetch_add(inbound_slot(user), 1);
+    submit_pending(shard, msg);
+    return 0;
 }
 
-int storage_init(const char *path) {
-    ensure_path_buffer();
-    if (path) {
-        strncpy(storage_path, path, sizeof(storage_path) - 1);
+void storage_delivery_mark(storage_mark_t *mark) {
+    for (size_t i = 0; i < shard_count; ++i) {
+        mark->queued[i] = atomic_load(&shards[i].queued_count);
     }
-    FILE *file = fopen(storage_path, "a");
-    if (!file) {
-        set_error("Failed to open log file: %s", strerror(errno));
-        return -1;
+}
+
+// Every shard keeps its own cursor for the user.
+int storage_mark_delivered(const char *user, const storage_mark_t *mark) {
+    int rc = 0;
+    for (size_t i = 0; i < shard_count; ++i) {
+        if (mark->queued[i] > 0 && submit_cursor(&shards[i], user, 0, mark->queued[i]) != 0) {
+            rc = -1;
+        }
     }
-    fclose(file);
-    return 0;
+    return rc;
 }
 
-void storage_shutdown(void) {}
+typedef struct {
+    shard_t *shard;
+    bool done;
+    int status;
+    char error[MAX_ERROR_LEN];
+} sync_store_t;
+
+static void sync_store_done(int status, const char *error, void *ctx) {
+    sync_store_t *wait = (sync_store_t *)ctx;
+    pthread_mutex_lock(&wait->shard->writer_lock);
+    wait->status = status;
+    if (status != 0) {
+        snprintf(wait->error, sizeof(wait->error), "%s", error ? error : "unknown error");
+    }
+    wait->done = true;
+    pthread_cond_broadcast(&wait->shard->commit_cond);
+    pthread_mutex_unlock(&wait->shard->writer_lock);
+}
 
 int storage_store_message(const char *sender, const char *receiver, const char *body) {
-    pthread_mutex_lock(&storage_lock);
-    FILE *file = fopen(storage_path, "a");
-    if (!file) {
-        pthread_mutex_unlock(&storage_lock);
-        set_error("Failed to append to log: %s", strerror(errno));
+    shard_t *shard = conversation_shard(sender, receiver);
+    sync_store_t wait = {shard, false, 0, ""};
+    if (storage_submit_message(sender, receiver, body, sync_store_done, &wait) != 0) {
         return -1;
     }
-    char ts[32];
-    format_timestamp(ts, sizeof(ts));
-    fprintf(file, "%s|%s|%s|%s\n", ts, sender, receiver, body);
-    fclose(file);
-    pthread_mutex_unlock(&storage_lock);
-    return 0;
+    pthread_mutex_lock(&shard->writer_lock);
+    shard->writer_kick = true;
+    pthread_cond_signal(&shard->writer_cond);
+    while (!wait.done) {
+        pthread_cond_wait(&shard->commit_cond, &shard->writer_lock);
+    }
+    pthread_mutex_unlock(&shard->writer_lock);
+    if (wait.status != 0) {
+        storage_set_error("%s", wait.error); // the writer's text, now on this thread
+    }
+    return wait.status;
 }
 
-int storage_fetch_conversation(const char *user_a, const char *user_b, history_callback cb, void *ctx) {
-    pthread_mutex_lock(&storage_lock);
-    FILE *file = fopen(storage_path, "r");
-    if (!file) {
-        pthread_mutex_unlock(&storage_lock);
-        set_error("Failed to read log: %s", strerror(errno));
-        return -1;
+// Rows of one backend read, copied out so the caller's callback (which writes
+// to sockets) runs only after the backend has released its connection or lock.
+#define ROW_CHUNK_BYTES (64u * 1024u)
+
+typedef struct row_chunk {
+    struct row_chunk *next;
+    size_t used;
+    size_t size;
+    char data[];
+} row_chunk_t;
+
+typedef struct {
+    const shard_t *shard; // whose local ids the rows arrive with
+    history_row_t *rows;  // with caller-facing ids
+    size_t count;
+    size_t capacity;
+    row_chunk_t *chunks; // newest first; row strings point into these
+    bool failed;
+} row_buffer_t;
+
+static char *row_buffer_alloc(row_buffer_t *buffer, size_t len) {
+    row_chunk_t *chunk = buffer->chunks;
+    if (!chunk || chunk->size - chunk->used < len) {
+        size_t size = len > ROW_CHUNK_BYTES ? len : ROW_CHUNK_BYTES;
+        chunk = malloc(sizeof(row_chunk_t) + size);
+        if (!chunk) {
+            return NULL;
+        }
+        chunk->next = buffer->chunks;
+        chunk->used = 0;
+        chunk->size = size;
+        buffer->chunks = chunk;
+    }
+    char *out = chunk->data + chunk->used;
+    chunk->used += len;
+    return out;
+}
+
+static void collect_row(int64_t id, const char *timestamp, const char *sender, const char *body, void *arg) {
+    row_buffer_t *buffer = (row_buffer_t *)arg;
+    if (buffer->failed) {
+        return;
+    }
+    if (buffer->count == buffer->capacity) {
+        size_t capacity = buffer->capacity ? buffer->capacity * 2 : 64;
+        history_row_t *rows = realloc(buffer->rows, capacity * sizeof(history_row_t));
+        if (!rows) {
+            buffer->failed = true;
+            return;
+        }
+        buffer->rows = rows;
+        buffer->capacity = capacity;
+    }
+    size_t ts_len = strlen(timestamp) + 1;
+    size_t sender_len = strlen(sender) + 1;
+    size_t body_len = strlen(body) + 1;
+    char *block = row_buffer_alloc(buffer, ts_len + sender_len + body_len);
+    if (!block) {
+        buffer->failed = true;
+        return;
     }
-    char *line = NULL;
-    size_t len = 0;
-    while (portable_getline(&line, &len, file) != -1) {
-        char *ts = strtok(line, "|");
-        char *sender = strtok(NULL, "|");
-        char *receiver = strtok(NULL, "|");
-        char *body = strtok(NULL, "\n");
-        if (!ts || !sender || !receiver || !body) {
+    history_row_t *row = &buffer->rows[buffer->count++];
+    row->id = global_id(buffer->shard, id);
+    row->timestamp = memcpy(block, timestamp, ts_len);
+    row->sender = memcpy(block + ts_len, sender, sender_len);
+    row->body = memcpy(block + ts_len + sender_len, body, body_len);
+}
+
+static void row_buffer_free(row_buffer_t *buffer) {
+    while (buffer->chunks) {
+        row_chunk_t *next = buffer->chunks->next;
+        free(buffer->chunks);
+        buffer->chunks = next;
+    }
+    free(buffer->rows);
+}
+
+int storage_fetch_conversation(const char *user_a, const char *user_b, int64_t before_id, int limit,
+                               history_callback cb, void *ctx) {
+    uint64_t start = metrics_now();
+    shard_t *shard = conversation_shard(user_a, user_b);
+    if (atomic_load(sent_slot(user_a)) > 0) {
+        writer_sync(shard);
+    }
+    if (history_cache_fetch(user_a, user_b, before_id, limit, cb, ctx)) {
+        metrics_record_since(METRIC_FETCH_TIME, start);
+        return 0;
+    }
+    int64_t before = local_before(shard, before_id);
+    if (before < 0) {
+        metrics_record_since(METRIC_FETCH_TIME, start);
+        return 0; // below the shard's first id
+    }
+    // Reads do not take storage_lock: the backend runs them alongside the
+    // writer. Only a read of the newest page tells us what the ring should hold.
+    bool fill = before_id <= 0 && history_cache_capacity() > 0;
+    uint64_t generation = fill ? history_cache_generation(user_a, user_b) : 0;
+    row_buffer_t buffer = {.shard = shard};
+    int rc = storage_backend_fetch(shard->backend, user_a, user_b, before, limit, collect_row, &buffer);
+    if (rc == 0 && buffer.failed) {
+        storage_set_error("Out of memory reading history%s", "");
+        rc = -1;
+    }
+    if (rc == 0) {
+        if (fill) {
+            // A short (or unlimited) newest page means nothing older exists.
+            bool complete = limit <= 0 || buffer.count < (size_t)limit;
+            history_cache_fill(user_a, user_b, buffer.rows, buffer.count, complete, generation);
+        }
+        for (size_t i = 0; i < buffer.count; ++i) {
+            const history_row_t *row = &buffer.rows[i];
+            cb(row->id, row->timestamp, row->sender, row->body, ctx);
+        }
+    }
+    row_buffer_free(&buffer);
+    metrics_record_since(METRIC_FETCH_TIME, start);
+    return rc;
+}
+
+int storage_fetch_since(const char *user_a, const char *user_b, int64_t after_id, int limit, history_callback cb,
+                        void *ctx) {
+    uint64_t start = metrics_now();
+    shard_t *shard = conversation_shard(user_a, user_b);
+    if (atomic_load(sent_slot(user_a)) > 0) {
+        writer_sync(shard);
+    }
+    if (history_cache_fetch_since(user_a, user_b, after_id, limit, cb, ctx)) {
+        metrics_record_since(METRIC_FETCH_TIME, start);
+        return 0;
+    }
+    row_buffer_t buffer = {.shard = shard};
+    int rc = storage_backend_fetch_since(shard->backend, user_a, user_b, local_after(shard, after_id), limit,
+                                         collect_row, &buffer);
+    if (rc == 0 && buffer.failed) {
+        storage_set_error("Out of memory reading history%s", "");
+        rc = -1;
+    }
+    for (size_t i = 0; rc == 0 && i < buffer.count; ++i) {
+        const history_row_t *row = &buffer.rows[i];
+        cb(row->id, row->timestamp, row->sender, row->body, ctx);
+    }
+    row_buffer_free(&buffer);
+    metrics_record_since(METRIC_FETCH_TIME, start);
+    return rc;
+}
+
+// Ids only order messages within a shard, so shards are merged by timestamp.
+static bool row_before(const history_row_t *a, const history_row_t *b) {
+    int order = strcmp(a->timestamp, b->timestamp);
+    return order < 0 || (order == 0 && a->id < b->id);
+}
+
+// With `advance` false the rows are only streamed; the caller moves the
+// cursors with storage_advance_inbox() once they are delivered.
+static int read_inbox(const char *user, int limit, bool advance, history_callback cb, void *ctx) {
+    if (atomic_load(inbound_slot(user)) > 0) {
+        for (size_t i = 0; i < shard_count; ++i) {
+            writer_sync(&shards[i]);
+        }
+    }
+    // Each shard answers up to `limit` rows above its own cursor; the oldest
+    // `limit` of all of them are delivered and each cursor moves past the
+    // rows taken from its shard.
+    row_buffer_t buffers[STORAGE_MAX_SHARDS];
+    size_t taken[STORAGE_MAX_SHARDS];
+    int rc = 0;
+    for (size_t i = 0; i < shard_count; ++i) {
+        buffers[i] = (row_buffer_t){.shard = &shards[i]};
+        taken[i] = 0;
+    }
+    for (size_t i = 0; rc == 0 && i < shard_count; ++i) {
+        if (is_caught_up(&shards[i], user)) {
             continue;
         }
-        bool match =
-            (strcmp(sender, user_a) == 0 && strcmp(receiver, user_b) == 0) ||
-            (strcmp(sender, user_b) == 0 && strcmp(receiver, user_a) == 0);
-        if (match) {
-            cb(ts, sender, body, ctx);
+        rc = storage_backend_fetch_inbox(shards[i].backend, user, limit, collect_row, &buffers[i]);
+        if (rc == 0 && buffers[i].failed) {
+            storage_set_error("Out of memory reading inbox%s", "");
+            rc = -1;
         }
     }
-    free(line);
-    fclose(file);
-    pthread_mutex_unlock(&storage_lock);
-    return 0;
+    for (size_t sent = 0; rc == 0 && (limit <= 0 || sent < (size_t)limit); ++sent) {
+        const history_row_t *row = NULL;
+        size_t from = 0;
+        for (size_t i = 0; i < shard_count; ++i) {
+            if (taken[i] < buffers[i].count && (!row || row_before(&buffers[i].rows[taken[i]], row))) {
+                row = &buffers[i].rows[taken[i]];
+                from = i;
+            }
+        }
+        if (!row) {
+            break;
+        }
+        cb(row->id, row->timestamp, row->sender, row->body, ctx);
+        ++taken[from];
+    }
+    for (size_t i = 0; i < shard_count; ++i) {
+        if (rc == 0 && advance && taken[i] > 0) {
+            rc = submit_cursor(&shards[i], user, local_id(&shards[i], buffers[i].rows[taken[i] - 1].id), 0);
+        }
+        row_buffer_free(&buffers[i]);
+    }
+    return rc;
+}
+
+int storage_fetch_inbox(const char *user, int limit, history_callback cb, void *ctx) {
+    return read_inbox(user, limit, true, cb, ctx);
+}
+
+int storage_peek_inbox(const char *user, int limit, history_callback cb, void *ctx) {
+    return read_inbox(user, limit, false, cb, ctx);
+}
+
+// Rows are taken from each shard oldest first, so the newest id per shard
+// is where its cursor goes. Ids of other nodes' stores are skipped.
+int storage_advance_inbox(const char *user, const int64_t *ids, size_t count) {
+    int64_t upto[STORAGE_MAX_SHARDS] = {0};
+    for (size_t i = 0; i < count; ++i) {
+        shard_t *shard = id_shard(ids[i]);
+        if (shard && local_id(shard, ids[i]) > upto[shard->index]) {
+            upto[shard->index] = local_id(shard, ids[i]);
+        }
+    }
+    int rc = 0;
+    for (size_t i = 0; i < shard_count; ++i) {
+        if (upto[i] > 0 && submit_cursor(&shards[i], user, upto[i], 0) != 0) {
+            rc = -1;
+        }
+    }
+    return rc;
 }
 
 int storage_delete_conversation(const char *user_a, const char *user_b) {
-    pthread_mutex_lock(&storage_lock);
-    enum { TMP_EXTRA = 8 };
-    char tmp_path[PATH_MAX + TMP_EXTRA];
-    size_t base_len = strnlen(storage_path, sizeof(storage_path));
-    if (base_len + 4 >= sizeof(tmp_path)) {
-        pthread_mutex_unlock(&storage_lock);
-        set_error("Log path too long for temp file", "");
-        return -1;
+    shard_t *shard = conversation_shard(user_a, user_b);
+    writer_sync(shard);
+    metrics_lock(&shard->storage_lock, METRIC_STORAGE_LOCK_WAIT);
+    int rc = storage_backend_delete(shard->backend, user_a, user_b);
+    history_cache_invalidate(user_a, user_b);
+    pthread_mutex_unlock(&shard->storage_lock);
+    if (rc == 0) {
+        pthread_mutex_lock(&purge_lock);
+        purge_kick = true;
+        pthread_cond_signal(&purge_cond);
+        pthread_mutex_unlock(&purge_lock);
     }
-    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", storage_path);
-    FILE *src = fopen(storage_path, "r");
-    if (!src) {
-        pthread_mutex_unlock(&storage_lock);
-        set_error("Failed to read log: %s", strerror(errno));
-        return -1;
+    return rc;
+}
+
+void storage_cache_stats(storage_cache_stats_t *stats) {
+    history_cache_stats(stats);
+}
+
+size_t storage_queue_depth(void) {
+    size_t depth = 0;
+    for (size_t i = 0; i < shard_count; ++i) {
+        depth += atomic_load(&shards[i].pending_count);
+    }
+    return depth;
+}
+
+size_t storage_shard_count(void) {
+    return shard_count;
+}
+
+typedef struct {
+    size_t shard;
+    storage_user_callback cb;
+    void *ctx;
+} caught_up_visit_t;
+
+static void visit_caught_up(const char *user, void *arg) {
+    caught_up_visit_t *visit = (caught_up_visit_t *)arg;
+    visit->cb(visit->shard, user, visit->ctx);
+}
+
+// The newest id is read first: a message committed while the cursors are
+// listed makes the checkpoint's newest id stale, which its reader detects.
+int storage_checkpoint(int64_t *newest, storage_user_callback cb, void *ctx) {
+    for (size_t i = 0; i < shard_count; ++i) {
+        shard_t *shard = &shards[i];
+        writer_sync(shard);
+        metrics_lock(&shard->storage_lock, METRIC_STORAGE_LOCK_WAIT);
+        newest[i] = shard->newest_id;
+        caught_up_visit_t visit = {i, cb, ctx};
+        int rc = storage_backend_caught_up(shard->backend, newest[i], visit_caught_up, &visit);
+        pthread_mutex_unlock(&shard->storage_lock);
+        if (rc != 0) {
+            return -1;
+        }
     }
-    FILE *dst = fopen(tmp_path, "w");
-    if (!dst) {
-        fclose(src);
-        pthread_mutex_unlock(&storage_lock);
-        set_error("Failed to open temp log: %s", strerror(errno));
+    return 0;
+}
+
+int64_t storage_newest_id(size_t shard) {
+    if (shard >= shard_count) {
         return -1;
     }
-    char *line = NULL;
-    size_t len = 0;
-    while (portable_getline(&line, &len, src) != -1) {
-        char *copy = strdup(line);
-        if (!copy) {
+    metrics_lock(&shards[shard].storage_lock, METRIC_STORAGE_LOCK_WAIT);
+    int64_t id = shards[shard].newest_id;
+    pthread_mutex_unlock(&shards[shard].storage_lock);
+    return id;
+}
+
+int storage_restore_caught_up(size_t shard_index, const char *const *users, size_t count) {
+    if (shard_index >= shard_count || count == 0) {
+        return 0;
+    }
+    shard_t *shard = &shards[shard_index];
+    pthread_mutex_lock(&shard->caught_up_lock);
+    free_caught_up(shard);
+    shard->caught_up_buckets = count;
+    shard->caught_up = calloc(count, sizeof(caught_up_user_t *));
+    int rc = shard->caught_up ? 0 : -1;
+    size_t restored = 0;
+    for (size_t i = 0; rc == 0 && i < count; ++i) {
+        uint32_t hash = fnv1a(2166136261u, users[i]);
+        caught_up_user_t **link = caught_up_link(shard, users[i], hash);
+        if (*link) {
             continue;
         }
-        char *sender = strtok(copy, "|"); // timestamp
-        sender = strtok(NULL, "|");
-        char *receiver = strtok(NULL, "|");
-        bool match = sender && receiver &&
-            ((strcmp(sender, user_a) == 0 && strcmp(receiver, user_b) == 0) ||
-             (strcmp(sender, user_b) == 0 && strcmp(receiver, user_a) == 0));
-        free(copy);
-        if (!match) {
-            fputs(line, dst);
+        size_t len = strlen(users[i]) + 1;
+        caught_up_user_t *user = malloc(sizeof(caught_up_user_t) + len);
+        if (!user) {
+            rc = -1;
+            break;
         }
+        user->next = NULL;
+        user->hash = hash;
+        memcpy(user->name, users[i], len);
+        *link = user;
+        ++restored;
     }
-    free(line);
-    fclose(src);
-    fclose(dst);
-#ifdef _WIN32
-    remove(storage_path);
-#endif
-    if (rename(tmp_path, storage_path) != 0) {
-        pthread_mutex_unlock(&storage_lock);
-        set_error("Failed to replace log file: %s", strerror(errno));
-        return -1;
+    if (rc != 0) {
+        free_caught_up(shard);
+        storage_set_error("Out of memory restoring delivery state%s", "");
+    } else {
+        atomic_store(&shard->caught_up_count, restored);
     }
-    pthread_mutex_unlock(&storage_lock);
-    return 0;
+    pthread_mutex_unlock(&shard->caught_up_lock);
+    return rc;
 }
-
-#endif
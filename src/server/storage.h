@@ -2,14 +2,133 @@
 #define STORAGE_H
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
-typedef void (*history_callback)(const char *timestamp, const char *sender, const char *body, void *ctx);
+// Storage can be split into shards by conversation, each with its own
+// database (or log), writer thread and read connections.
+#define STORAGE_MAX_SHARDS 64
 
-int storage_init(const char *path);
+typedef void (*history_callback)(int64_t id, const char *timestamp, const char *sender, const char *body, void *ctx);
+
+typedef enum {
+    STORAGE_SYNC_OFF,
+    STORAGE_SYNC_NORMAL,
+    STORAGE_SYNC_FULL,
+} storage_sync_t;
+
+// How the SQLite backend stores new message bodies. Compressed bodies are
+// written as BLOBs beside plain TEXT rows and every read takes either, so the
+// setting can change between runs.
+typedef enum {
+    STORAGE_COMPRESS_OFF,
+    STORAGE_COMPRESS_DEFLATE,    // each body deflated on its own
+    STORAGE_COMPRESS_DICTIONARY, // deflated against a dictionary trained from recent bodies
+} storage_compression_t;
+
+typedef struct {
+    bool wal;                   // SQLite write-ahead log instead of rollback journal
+    storage_sync_t synchronous; // PRAGMA synchronous level
+    size_t write_batch;         // max messages per write-behind transaction
+    int write_delay_ms;         // how long a partial batch may wait for company
+    size_t cache_messages;      // newest messages kept in memory per conversation
+    size_t cache_bytes;         // memory budget across all cached conversations
+    size_t read_connections;    // SQLite read-only connections serving history
+    storage_compression_t compression;
+    size_t compress_min_bytes; // shorter bodies are always stored as plain text
+    uint64_t retain_seconds;   // purge messages older than this; 0 = keep forever
+    uint64_t retain_messages;  // purge all but the newest this many message ids; 0 = no cap
+    size_t purge_batch;        // rows per background purge transaction
+    // Cluster mode: this node's index among node_count stores (1 when
+    // standalone). Ids are interleaved so that no two stores hand out the same.
+    size_t node_index;
+    size_t node_count;
+} storage_options_t;
+
+typedef struct {
+    uint64_t hits;   // GETs answered from the recent-history cache
+    uint64_t misses; // GETs that had to read the backend
+    size_t conversations;
+    size_t bytes;
+} storage_cache_stats_t;
+
+// Completion for storage_submit_message(); runs on the storage writer thread
+// once the message's batch has committed (status 0) or failed (-1, with the
+// failure's text in `error`, valid for the call; NULL on success).
+typedef void (*store_callback)(int status, const char *error, void *ctx);
+
+void storage_default_options(storage_options_t *options);
+// `options` may be NULL to use storage_default_options(). With `shards` > 1
+// `path` is a directory (created if missing) holding one store per shard;
+// 0 or 1 keeps a single store at `path`. A directory must always be opened
+// with the shard count it was created with.
+int storage_init(const char *path, size_t shards, const storage_options_t *options);
 void storage_shutdown(void);
+// Queues the message for the write-behind writer and returns immediately.
+int storage_submit_message(const char *sender, const char *receiver, const char *body, store_callback done, void *ctx);
+// One message to several distinct receivers: the body is stored once per
+// shard involved, under a single id that appears in each of that shard's
+// sender/receiver conversations. `done` runs once, after every shard.
+int storage_submit_group(const char *sender, const char *const *receivers, size_t count, const char *body,
+                         store_callback done, void *ctx);
+// Synchronous variant: returns once the message is committed.
 int storage_store_message(const char *sender, const char *receiver, const char *body);
-int storage_fetch_conversation(const char *user_a, const char *user_b, history_callback cb, void *ctx);
+// Streams the conversation oldest-first. With `limit` > 0 only the newest
+// `limit` messages whose id is below `before_id` (0 = no bound) are returned,
+// so callers page backwards by passing the smallest id they have seen.
+// `user_a` is the requester: the read includes their own queued messages,
+// and otherwise only what has committed.
+int storage_fetch_conversation(const char *user_a, const char *user_b, int64_t before_id, int limit,
+                               history_callback cb, void *ctx);
+// Streams, oldest first, up to `limit` (0 = no bound) of the conversation's
+// messages with ids above `after_id`, so a client holding a copy of the
+// conversation fetches only what it has not seen.
+int storage_fetch_since(const char *user_a, const char *user_b, int64_t after_id, int limit, history_callback cb,
+                        void *ctx);
 int storage_delete_conversation(const char *user_a, const char *user_b);
+// Streams, oldest first and across all conversations, up to `limit` (0 = no
+// bound) messages addressed to `user` above its delivery cursor, then moves
+// the cursor past them.
+int storage_fetch_inbox(const char *user, int limit, history_callback cb, void *ctx);
+// The same page, leaving the cursors where they are: for a reader on another
+// cluster node, which hands back the ids it delivered to
+// storage_advance_inbox() (cursors only move forward).
+int storage_peek_inbox(const char *user, int limit, history_callback cb, void *ctx);
+int storage_advance_inbox(const char *user, const int64_t *ids, size_t count);
+// How far each shard's write-behind queue had been filled. Taken while a
+// session's output is empty, it covers only messages whose live push, which
+// precedes their submission, has already been written to the socket.
+typedef struct {
+    uint64_t queued[STORAGE_MAX_SHARDS]; // 0 = no mark, the cursor stays
+} storage_mark_t;
+
+void storage_delivery_mark(storage_mark_t *mark);
+// Moves `user`'s cursor on each shard to the newest message committed ahead of
+// the mark, e.g. because they were pushed live while the user was online.
+int storage_mark_delivered(const char *user, const storage_mark_t *mark);
+// The last failure on the calling thread.
 const char *storage_last_error(void);
+void storage_cache_stats(storage_cache_stats_t *stats);
+// Messages and cursor updates waiting for the writer.
+size_t storage_queue_depth(void);
+
+// Checkpoints (snapshot.c). A user is caught up on a shard when their cursor
+// there is at or past the shard's newest message, so an inbox read would find
+// nothing on it; ids here are the shard's own.
+typedef void (*storage_user_callback)(size_t shard, const char *user, void *ctx);
+size_t storage_shard_count(void);
+// Waits for queued writes, then stores each shard's newest id in `newest`
+// (storage_shard_count() entries) and reports that shard's caught-up users.
+// Returns 0 or -1 with the error set.
+int storage_checkpoint(int64_t *newest, storage_user_callback cb, void *ctx);
+int64_t storage_newest_id(size_t shard);
+// Before any message is submitted, and only from a checkpoint whose newest id
+// for `shard` is still storage_newest_id(): inbox reads for these users skip
+// the shard until a message to them is queued there. Returns 0 or -1 when
+// out of memory.
+int storage_restore_caught_up(size_t shard, const char *const *users, size_t count);
+// Stops background purging ahead of storage_shutdown(), so that a final
+// checkpoint describes the database as it is left.
+void storage_stop_purge(void);
 
 #endif /* STORAGE_H */
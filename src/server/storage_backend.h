@@ -0,0 +1,63 @@
+#ifndef STORAGE_BACKEND_H
+#define STORAGE_BACKEND_H
+
+#include "storage.h"
+
+#ifndef STORAGE_USE_SQLITE
+#define STORAGE_USE_SQLITE 1
+#endif
+
+// Internal contract between storage.c (write-behind pipeline, locking) and the
+// persistence backend selected by STORAGE_USE_SQLITE: storage_sqlite.c or
+// storage_flatfile.c. Each open backend is one store on disk (a shard, when
+// storage is sharded) with its own state, so several can be used at once.
+// storage.c serializes every call on one backend except fetch under that
+// shard's lock; fetch may run concurrently with those and with other fetches,
+// so each backend synchronizes its reads itself.
+typedef struct storage_backend storage_backend_t;
+
+// Returns NULL with the error set.
+storage_backend_t *storage_backend_open(const char *path, const storage_options_t *options);
+void storage_backend_close(storage_backend_t *backend);
+int storage_backend_begin(storage_backend_t *backend);
+// Reports the id and display timestamp (as a later fetch would show it) of
+// the new message.
+int storage_backend_insert(storage_backend_t *backend, const char *sender, const char *receiver, const char *body,
+                           int64_t *id, char *timestamp, size_t timestamp_len);
+// `count` >= 2 distinct receivers sharing one message id.
+int storage_backend_insert_group(storage_backend_t *backend, const char *sender, const char *const *receivers,
+                                 size_t count, const char *body, int64_t *id, char *timestamp, size_t timestamp_len);
+int storage_backend_commit(storage_backend_t *backend);
+void storage_backend_rollback(storage_backend_t *backend);
+int storage_backend_fetch(storage_backend_t *backend, const char *user_a, const char *user_b, int64_t before_id,
+                          int limit, history_callback cb, void *ctx);
+// The oldest `limit` (0 = no bound) messages with ids above `after_id`, oldest first.
+int storage_backend_fetch_since(storage_backend_t *backend, const char *user_a, const char *user_b, int64_t after_id,
+                                int limit, history_callback cb, void *ctx);
+// Hides the conversation's current messages from every read; the rows may
+// be removed later by storage_backend_purge().
+int storage_backend_delete(storage_backend_t *backend, const char *user_a, const char *user_b);
+// Messages to `user` with ids above its delivery cursor (or, for a user the
+// backend has no cursor for, above the floor recorded when cursors were
+// introduced), oldest first.
+int storage_backend_fetch_inbox(storage_backend_t *backend, const char *user, int limit, history_callback cb,
+                                void *ctx);
+// Raises the cursor to `id`; a lower id leaves it unchanged. Called between
+// begin and commit, and undone by a rollback.
+int storage_backend_set_cursor(storage_backend_t *backend, const char *user, int64_t id);
+int64_t storage_backend_last_id(storage_backend_t *backend);
+// Reports every user with a delivery cursor of its own at or past `id`.
+int storage_backend_caught_up(storage_backend_t *backend, int64_t id, void (*cb)(const char *user, void *ctx),
+                              void *ctx);
+// One bounded slice of background cleanup, under the shard's lock: physically
+// removes up to `batch` rows hidden by deletes, or up to `batch` messages
+// with ids up to `upto_id` (0 = none) or older than `max_age_seconds`
+// (0 = any age), or reclaims free space. Returns a positive amount when it
+// did work and may have more, 0 when idle, -1 on error. After a retention
+// sweep *floor is raised to an id at or below which no message remains.
+int storage_backend_purge(storage_backend_t *backend, int64_t upto_id, uint64_t max_age_seconds, size_t batch,
+                          int64_t *floor);
+
+void storage_set_error(const char *fmt, const char *detail);
+
+#endif /* STORAGE_BACKEND_H */
@@ -0,0 +1,2060 @@
+#define _POSIX_C_SOURCE 200809L
+#include "storage_backend.h"
+
+#if !STORAGE_USE_SQLITE
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef _WIN32
+#include <io.h>
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+// Segmented append log. Messages and delete tombstones are length-prefixed,
+// checksummed binary records appended to numbered segment files
+// (<path>.000001, ...). A manifest lists the live segments, and an in-memory
+// index maps each conversation to the (segment, offset) of its records, so a
+// fetch only reads that conversation and a delete is one tombstone append.
+// Sealed segments whose live share drops below half are rewritten by a
+// background compaction thread. The index is snapshotted to <path>.index on
+// shutdown and after compaction; on startup only bytes appended after the
+// snapshot are replayed, otherwise the index is rebuilt from the segments.
+// Each user also has a list of their conversations, and every entry records
+// which of the two names received it, so an inbox read touches only the
+// user's own conversations and never reads a record it does not deliver.
+#define SEGMENT_MAX_BYTES (4u * 1024u * 1024u)
+#define MAX_RECORD_PAYLOAD (2u * 1024u * 1024u) /* above the 1 MiB binary protocol frame */
+#define RECORD_HEADER_BYTES 9u /* u32 payload length, u32 checksum, u8 type */
+#define RECORD_MESSAGE 1u
+#define RECORD_TOMBSTONE 2u
+#define INDEX_MAGIC 0x58494843u /* "CHIX" */
+#define INDEX_VERSION 2u
+#define COMPACT_INTERVAL_MS 1000
+#define INITIAL_BUCKETS 64u
+#define CURSOR_BUCKETS 1024u
+#define INBOX_LOCK_BATCH 64u /* records an inbox read takes per hold of log_lock */
+
+typedef struct {
+    int64_t id;
+    uint32_t segment;
+    uint32_t size; // whole record, header included
+    uint64_t offset;
+    bool to_first; // the receiver is the first name of the conversation key
+} log_entry_t;
+
+typedef struct conversation {
+    struct conversation *next;
+    uint32_t hash;
+    char *key;
+    log_entry_t *entries; // sorted by id
+    size_t count;
+    size_t capacity;
+    int64_t deleted_upto; // messages with id <= this were deleted
+    uint32_t tomb_segment; // where the tombstone for deleted_upto lives
+    uint32_t tomb_size;
+} conversation_t;
+
+// The conversations a user is part of, for inbox reads. Conversations live
+// until the index is freed, so the pointers stay valid.
+typedef struct member {
+    struct member *next;
+    uint32_t hash;
+    conversation_t **convs;
+    size_t count;
+    size_t capacity;
+    char name[];
+} member_t;
+
+typedef struct {
+    uint32_t number;
+    FILE *fp;
+    uint64_t size;
+    uint64_t live; // bytes of records still referenced
+} segment_t;
+
+typedef struct {
+    conversation_t *conv;
+    log_entry_t entry;
+} pending_entry_t;
+
+typedef struct cursor {
+    struct cursor *next;
+    int64_t id;
+    char user[];
+} cursor_t;
+
+typedef struct {
+    int64_t id;
+    char *user;
+} cursor_update_t;
+
+// One log: a storage shard, or the whole store.
+struct storage_backend {
+    char base_path[PATH_MAX];
+    pthread_mutex_t log_lock; // vs. the compaction thread
+
+    segment_t *segments; // sorted by number
+    size_t segment_count;
+    size_t segment_capacity;
+    uint32_t active_segment;
+    uint32_t next_segment;
+    int64_t next_id;
+
+    conversation_t **buckets;
+    size_t bucket_count;
+    size_t conversation_count;
+
+    member_t **member_buckets;
+    size_t member_bucket_count;
+    size_t member_count;
+
+    // Records of the open batch; indexed only once the batch commits.
+    pending_entry_t *pending;
+    size_t pending_count;
+    size_t pending_capacity;
+    uint64_t batch_start;
+    int64_t batch_first_id;
+
+    unsigned char *scratch;
+    size_t scratch_capacity;
+
+    pthread_t compactor_thread;
+    pthread_cond_t compactor_cond;
+    bool compactor_running;
+    bool compactor_stopping;
+
+    // Delivery cursors (see open_cursors()).
+    cursor_t *cursor_buckets[CURSOR_BUCKETS];
+    FILE *cursor_fp;
+    // Cursor moves made inside a write batch: applied by commit_locked() once
+    // the batch's records are flushed, dropped by a rollback, since the ids of
+    // a failed batch are handed out again.
+    cursor_update_t *cursor_updates;
+    size_t cursor_update_count;
+    size_t cursor_update_capacity;
+};
+
+// ---------------------------------------------------------------------------
+// Encoding helpers
+
+static void put_u16(unsigned char *p, uint16_t v) {
+    p[0] = (unsigned char)v;
+    p[1] = (unsigned char)(v >> 8);
+}
+
+static void put_u32(unsigned char *p, uint32_t v) {
+    for (int i = 0; i < 4; ++i) {
+        p[i] = (unsigned char)(v >> (8 * i));
+    }
+}
+
+static void put_u64(unsigned char *p, uint64_t v) {
+    for (int i = 0; i < 8; ++i) {
+        p[i] = (unsigned char)(v >> (8 * i));
+    }
+}
+
+static uint16_t get_u16(const unsigned char *p) {
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static uint32_t get_u32(const unsigned char *p) {
+    uint32_t v = 0;
+    for (int i = 3; i >= 0; --i) {
+        v = (v << 8) | p[i];
+    }
+    return v;
+}
+
+static uint64_t get_u64(const unsigned char *p) {
+    uint64_t v = 0;
+    for (int i = 7; i >= 0; --i) {
+        v = (v << 8) | p[i];
+    }
+    return v;
+}
+
+static uint32_t fnv1a(uint32_t hash, const unsigned char *data, size_t len) {
+    for (size_t i = 0; i < len; ++i) {
+        hash ^= data[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static unsigned char *ensure_scratch(storage_backend_t *backend, size_t len) {
+    if (len > backend->scratch_capacity) {
+        unsigned char *tmp = realloc(backend->scratch, len);
+        if (!tmp) {
+            storage_set_error("Out of memory in log buffer%s", "");
+            return NULL;
+        }
+        backend->scratch = tmp;
+        backend->scratch_capacity = len;
+    }
+    return backend->scratch;
+}
+
+static void format_timestamp(time_t when, char *buffer, size_t len) {
+    struct tm tm_when;
+#ifdef _WIN32
+    localtime_s(&tm_when, &when);
+#else
+    localtime_r(&when, &tm_when);
+#endif
+    strftime(buffer, len, "%Y-%m-%d %H:%M:%S", &tm_when);
+}
+
+// Both directions of a conversation share one key: the two names in byte
+// order joined by a newline, matching the SQLite backend. Names come from
+// records unterminated, hence the explicit lengths.
+static bool name_after(const char *user_a, size_t a_len, const char *user_b, size_t b_len) {
+    size_t common = a_len < b_len ? a_len : b_len;
+    int order = memcmp(user_a, user_b, common);
+    return order > 0 || (order == 0 && a_len > b_len);
+}
+
+static char *conversation_key_n(const char *user_a, size_t a_len, const char *user_b, size_t b_len) {
+    if (name_after(user_a, a_len, user_b, b_len)) {
+        const char *tmp = user_a;
+        user_a = user_b;
+        user_b = tmp;
+        size_t tmp_len = a_len;
+        a_len = b_len;
+        b_len = tmp_len;
+    }
+    char *key = malloc(a_len + b_len + 2);
+    if (key) {
+        memcpy(key, user_a, a_len);
+        key[a_len] = '\n';
+        memcpy(key + a_len + 1, user_b, b_len);
+        key[a_len + b_len + 1] = '\0';
+    }
+    return key;
+}
+
+static char *conversation_key(const char *user_a, const char *user_b) {
+    return conversation_key_n(user_a, strlen(user_a), user_b, strlen(user_b));
+}
+
+// ---------------------------------------------------------------------------
+// Files
+
+static void segment_path(storage_backend_t *backend, uint32_t number, char *buffer, size_t len) {
+    snprintf(buffer, len, "%s.%06u", backend->base_path, (unsigned)number);
+}
+
+static void sibling_path(storage_backend_t *backend, const char *suffix, char *buffer, size_t len) {
+    snprintf(buffer, len, "%s%s", backend->base_path, suffix);
+}
+
+static int replace_file(const char *from, const char *to) {
+#ifdef _WIN32
+    return MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING) ? 0 : -1;
+#else
+    return rename(from, to);
+#endif
+}
+
+static int truncate_file(FILE *fp, uint64_t size) {
+    fflush(fp);
+#ifdef _WIN32
+    return _chsize_s(_fileno(fp), (long long)size) == 0 ? 0 : -1;
+#else
+    return ftruncate(fileno(fp), (off_t)size);
+#endif
+}
+
+// ---------------------------------------------------------------------------
+// Segments
+
+static segment_t *find_segment(storage_backend_t *backend, uint32_t number) {
+    size_t lo = 0;
+    size_t hi = backend->segment_count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (backend->segments[mid].number == number) {
+            return &backend->segments[mid];
+        }
+        if (backend->segments[mid].number < number) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return NULL;
+}
+
+// Opens (or with `create`, truncates) a segment file and adds it to the set.
+static segment_t *add_segment(storage_backend_t *backend, uint32_t number, bool create) {
+    char path[PATH_MAX + 16];
+    segment_path(backend, number, path, sizeof(path));
+    FILE *fp = fopen(path, create ? "w+b" : "r+b");
+    if (!fp) {
+        storage_set_error("Failed to open log segment: %s", strerror(errno));
+        return NULL;
+    }
+    if (backend->segment_count == backend->segment_capacity) {
+        size_t new_cap = backend->segment_capacity ? backend->segment_capacity * 2 : 16;
+        segment_t *tmp = realloc(backend->segments, new_cap * sizeof(segment_t));
+        if (!tmp) {
+            fclose(fp);
+            storage_set_error("Out of memory tracking segments%s", "");
+            return NULL;
+        }
+        backend->segments = tmp;
+        backend->segment_capacity = new_cap;
+    }
+    size_t pos = backend->segment_count;
+    while (pos > 0 && backend->segments[pos - 1].number > number) {
+        --pos;
+    }
+    memmove(&backend->segments[pos + 1], &backend->segments[pos], (backend->segment_count - pos) * sizeof(segment_t));
+    ++backend->segment_count;
+    segment_t *seg = &backend->segments[pos];
+    seg->number = number;
+    seg->fp = fp;
+    fseek(fp, 0, SEEK_END);
+    seg->size = (uint64_t)ftell(fp);
+    seg->live = 0;
+    if (number >= backend->next_segment) {
+        backend->next_segment = number + 1;
+    }
+    return seg;
+}
+
+static void drop_segment(storage_backend_t *backend, uint32_t number, bool unlink_file) {
+    segment_t *seg = find_segment(backend, number);
+    if (!seg) {
+        return;
+    }
+    fclose(seg->fp);
+    if (unlink_file) {
+        char path[PATH_MAX + 16];
+        segment_path(backend, number, path, sizeof(path));
+        remove(path);
+    }
+    size_t pos = (size_t)(seg - backend->segments);
+    memmove(&backend->segments[pos], &backend->segments[pos + 1],
+            (backend->segment_count - pos - 1) * sizeof(segment_t));
+    --backend->segment_count;
+}
+
+static void close_segments(storage_backend_t *backend) {
+    for (size_t i = 0; i < backend->segment_count; ++i) {
+        fclose(backend->segments[i].fp);
+    }
+    free(backend->segments);
+    backend->segments = NULL;
+    backend->segment_count = backend->segment_capacity = 0;
+}
+
+// The manifest is tiny and rewritten (write + atomic rename) whenever the set
+// of segments changes.
+static int save_manifest(storage_backend_t *backend) {
+    char path[PATH_MAX + 16];
+    char tmp_path[PATH_MAX + 16];
+    sibling_path(backend, ".manifest", path, sizeof(path));
+    sibling_path(backend, ".manifest.tmp", tmp_path, sizeof(tmp_path));
+    FILE *fp = fopen(tmp_path, "w");
+    if (!fp) {
+        storage_set_error("Failed to write log manifest: %s", strerror(errno));
+        return -1;
+    }
+    fprintf(fp, "chatlog 1\nnext %u\nactive %u\n", (unsigned)backend->next_segment, (unsigned)backend->active_segment);
+    for (size_t i = 0; i < backend->segment_count; ++i) {
+        fprintf(fp, "segment %u\n", (unsigned)backend->segments[i].number);
+    }
+    if (fclose(fp) != 0 || replace_file(tmp_path, path) != 0) {
+        storage_set_error("Failed to write log manifest: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// Returns 1 if a manifest was loaded, 0 if none exists, -1 on error.
+static int load_manifest(storage_backend_t *backend) {
+    char path[PATH_MAX + 16];
+    sibling_path(backend, ".manifest", path, sizeof(path));
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        return 0;
+    }
+    char line[64];
+    unsigned value;
+    int rc = 1;
+    if (!fgets(line, sizeof(line), fp) || strcmp(line, "chatlog 1\n") != 0) {
+        storage_set_error("Unrecognised log manifest%s", "");
+        rc = -1;
+    }
+    while (rc == 1 && fgets(line, sizeof(line), fp)) {
+        if (sscanf(line, "next %u", &value) == 1) {
+            if (value > backend->next_segment) {
+                backend->next_segment = value;
+            }
+        } else if (sscanf(line, "active %u", &value) == 1) {
+            backend->active_segment = value;
+        } else if (sscanf(line, "segment %u", &value) == 1) {
+            if (!add_segment(backend, value, false)) {
+                rc = -1;
+            }
+        }
+    }
+    fclose(fp);
+    if (rc == 1 && !find_segment(backend, backend->active_segment)) {
+        storage_set_error("Log manifest names no active segment%s", "");
+        rc = -1;
+    }
+    return rc;
+}
+
+// ---------------------------------------------------------------------------
+// Conversation index
+
+static uint32_t hash_key(const char *key) {
+    return fnv1a(2166136261u, (const unsigned char *)key, strlen(key));
+}
+
+static conversation_t *find_conversation(storage_backend_t *backend, const char *key) {
+    if (backend->bucket_count == 0) {
+        return NULL;
+    }
+    uint32_t hash = hash_key(key);
+    for (conversation_t *conv = backend->buckets[hash & (backend->bucket_count - 1)]; conv; conv = conv->next) {
+        if (conv->hash == hash && strcmp(conv->key, key) == 0) {
+            return conv;
+        }
+    }
+    return NULL;
+}
+
+static int grow_buckets(storage_backend_t *backend) {
+    size_t new_count = backend->bucket_count ? backend->bucket_count * 2 : INITIAL_BUCKETS;
+    conversation_t **fresh = calloc(new_count, sizeof(conversation_t *));
+    if (!fresh) {
+        return -1;
+    }
+    for (size_t i = 0; i < backend->bucket_count; ++i) {
+        conversation_t *conv = backend->buckets[i];
+        while (conv) {
+            conversation_t *next = conv->next;
+            size_t b = conv->hash & (new_count - 1);
+            conv->next = fresh[b];
+            fresh[b] = conv;
+            conv = next;
+        }
+    }
+    free(backend->buckets);
+    backend->buckets = fresh;
+    backend->bucket_count = new_count;
+    return 0;
+}
+
+static uint32_t hash_name(const char *name, size_t len) {
+    return fnv1a(2166136261u, (const unsigned char *)name, len);
+}
+
+static member_t *find_member(storage_backend_t *backend, const char *name, size_t len) {
+    if (backend->member_bucket_count == 0) {
+        return NULL;
+    }
+    uint32_t hash = hash_name(name, len);
+    for (member_t *member = backend->member_buckets[hash & (backend->member_bucket_count - 1)]; member;
+         member = member->next) {
+        if (member->hash == hash && strncmp(member->name, name, len) == 0 && member->name[len] == '\0') {
+            return member;
+        }
+    }
+    return NULL;
+}
+
+static int grow_member_buckets(storage_backend_t *backend) {
+    size_t new_count = backend->member_bucket_count ? backend->member_bucket_count * 2 : INITIAL_BUCKETS;
+    member_t **fresh = calloc(new_count, sizeof(member_t *));
+    if (!fresh) {
+        return -1;
+    }
+    for (size_t i = 0; i < backend->member_bucket_count; ++i) {
+        member_t *member = backend->member_buckets[i];
+        while (member) {
+            member_t *next = member->next;
+            size_t b = member->hash & (new_count - 1);
+            member->next = fresh[b];
+            fresh[b] = member;
+            member = next;
+        }
+    }
+    free(backend->member_buckets);
+    backend->member_buckets = fresh;
+    backend->member_bucket_count = new_count;
+    return 0;
+}
+
+// Finds or adds the user `name` (not terminated; it comes from a key) with
+// room for one more conversation.
+static member_t *reserve_member(storage_backend_t *backend, const char *name, size_t len) {
+    member_t *member = find_member(backend, name, len);
+    if (!member) {
+        if (backend->member_count >= backend->member_bucket_count && grow_member_buckets(backend) != 0) {
+            return NULL;
+        }
+        member = calloc(1, sizeof(member_t) + len + 1);
+        if (!member) {
+            return NULL;
+        }
+        memcpy(member->name, name, len);
+        member->hash = hash_name(name, len);
+        size_t b = member->hash & (backend->member_bucket_count - 1);
+        member->next = backend->member_buckets[b];
+        backend->member_buckets[b] = member;
+        ++backend->member_count;
+    }
+    if (member->count == member->capacity) {
+        size_t new_cap = member->capacity ? member->capacity * 2 : 4;
+        conversation_t **tmp = realloc(member->convs, new_cap * sizeof(conversation_t *));
+        if (!tmp) {
+            return NULL;
+        }
+        member->convs = tmp;
+        member->capacity = new_cap;
+    }
+    return member;
+}
+
+static void free_members(storage_backend_t *backend) {
+    for (size_t i = 0; i < backend->member_bucket_count; ++i) {
+        member_t *member = backend->member_buckets[i];
+        while (member) {
+            member_t *next = member->next;
+            free(member->convs);
+            free(member);
+            member = next;
+        }
+    }
+    free(backend->member_buckets);
+    backend->member_buckets = NULL;
+    backend->member_bucket_count = backend->member_count = 0;
+}
+
+// Takes ownership of `key`. A new conversation is added to both users' lists.
+static conversation_t *intern_conversation(storage_backend_t *backend, char *key) {
+    conversation_t *conv = find_conversation(backend, key);
+    if (conv) {
+        free(key);
+        return conv;
+    }
+    if (backend->conversation_count >= backend->bucket_count && grow_buckets(backend) != 0) {
+        free(key);
+        return NULL;
+    }
+    size_t first_len = strcspn(key, "\n");
+    const char *second = key + first_len + 1;
+    member_t *first = reserve_member(backend, key, first_len);
+    member_t *other = first ? reserve_member(backend, second, strlen(second)) : NULL;
+    conv = other ? calloc(1, sizeof(conversation_t)) : NULL;
+    if (!conv) {
+        free(key);
+        return NULL;
+    }
+    first->convs[first->count++] = conv;
+    if (other != first) {
+        other->convs[other->count++] = conv;
+    }
+    conv->key = key;
+    conv->hash = hash_key(key);
+    size_t b = conv->hash & (backend->bucket_count - 1);
+    conv->next = backend->buckets[b];
+    backend->buckets[b] = conv;
+    ++backend->conversation_count;
+    return conv;
+}
+
+static void free_conversations(storage_backend_t *backend) {
+    for (size_t i = 0; i < backend->bucket_count; ++i) {
+        conversation_t *conv = backend->buckets[i];
+        while (conv) {
+            conversation_t *next = conv->next;
+            free(conv->entries);
+            free(conv->key);
+            free(conv);
+            conv = next;
+        }
+    }
+    free(backend->buckets);
+    backend->buckets = NULL;
+    backend->bucket_count = backend->conversation_count = 0;
+    free_members(backend);
+}
+
+static int push_entry(conversation_t *conv, const log_entry_t *entry) {
+    if (conv->count == conv->capacity) {
+        size_t new_cap = conv->capacity ? conv->capacity * 2 : 8;
+        log_entry_t *tmp = realloc(conv->entries, new_cap * sizeof(log_entry_t));
+        if (!tmp) {
+            storage_set_error("Out of memory indexing log%s", "");
+            return -1;
+        }
+        conv->entries = tmp;
+        conv->capacity = new_cap;
+    }
+    conv->entries[conv->count++] = *entry;
+    return 0;
+}
+
+// First entry with id >= `id`.
+static size_t lower_bound(const conversation_t *conv, int64_t id) {
+    size_t lo = 0;
+    size_t hi = conv->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (conv->entries[mid].id < id) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static int compare_entries(const void *a, const void *b) {
+    int64_t x = ((const log_entry_t *)a)->id;
+    int64_t y = ((const log_entry_t *)b)->id;
+    return (x > y) - (x < y);
+}
+
+// After loading a snapshot and/or scanning segments (in segment order, which
+// is not id order once compaction has run): sort, drop deleted entries and
+// recompute the per-segment live byte counts from scratch.
+static void finalize_index(storage_backend_t *backend) {
+    for (size_t i = 0; i < backend->segment_count; ++i) {
+        backend->segments[i].live = 0;
+    }
+    for (size_t b = 0; b < backend->bucket_count; ++b) {
+        for (conversation_t *conv = backend->buckets[b]; conv; conv = conv->next) {
+            bool sorted = true;
+            for (size_t i = 1; i < conv->count && sorted; ++i) {
+                sorted = conv->entries[i - 1].id < conv->entries[i].id;
+            }
+            if (!sorted) {
+                qsort(conv->entries, conv->count, sizeof(log_entry_t), compare_entries);
+            }
+            size_t first = lower_bound(conv, conv->deleted_upto + 1);
+            if (first > 0) {
+                memmove(conv->entries, conv->entries + first, (conv->count - first) * sizeof(log_entry_t));
+                conv->count -= first;
+            }
+            for (size_t i = 0; i < conv->count; ++i) {
+                segment_t *seg = find_segment(backend, conv->entries[i].segment);
+                if (seg) {
+                    seg->live += conv->entries[i].size;
+                }
+            }
+            if (conv->deleted_upto > 0) {
+                segment_t *seg = find_segment(backend, conv->tomb_segment);
+                if (seg) {
+                    seg->live += conv->tomb_size;
+                }
+            }
+            if (conv->count > 0 && conv->entries[conv->count - 1].id >= backend->next_id) {
+                backend->next_id = conv->entries[conv->count - 1].id + 1;
+            }
+            if (conv->deleted_upto >= backend->next_id) {
+                backend->next_id = conv->deleted_upto + 1;
+            }
+        }
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Records
+
+typedef struct {
+    unsigned type;
+    uint32_t size; // header + payload
+    int64_t id;    // message id, or the tombstone's delete-up-to id
+    int64_t when;
+    const char *sender;
+    uint16_t sender_len;
+    const char *receiver;
+    uint16_t receiver_len;
+    const char *body;
+    uint32_t body_len;
+} record_t;
+
+// Reads the record at `offset` into the scratch buffer. Returns 0 on success,
+// 1 if the bytes there are not a complete, intact record (torn tail), -1 on
+// I/O error.
+static int read_record(storage_backend_t *backend, segment_t *seg, uint64_t offset, record_t *rec) {
+    unsigned char header[RECORD_HEADER_BYTES];
+    if (offset + RECORD_HEADER_BYTES > seg->size) {
+        return 1;
+    }
+    if (fseek(seg->fp, (long)offset, SEEK_SET) != 0 || fread(header, 1, sizeof(header), seg->fp) != sizeof(header)) {
+        storage_set_error("Failed to read log: %s", strerror(errno));
+        return -1;
+    }
+    uint32_t len = get_u32(header);
+    if (len > MAX_RECORD_PAYLOAD || offset + RECORD_HEADER_BYTES + len > seg->size) {
+        return 1;
+    }
+    unsigned char *payload = ensure_scratch(backend, len + 1);
+    if (!payload) {
+        return -1;
+    }
+    if (fread(payload, 1, len, seg->fp) != len) {
+        storage_set_error("Failed to read log: %s", strerror(errno));
+        return -1;
+    }
+    if (fnv1a(fnv1a(2166136261u, header + 8, 1), payload, len) != get_u32(header + 4)) {
+        return 1;
+    }
+    memset(rec, 0, sizeof(*rec));
+    rec->type = header[8];
+    rec->size = RECORD_HEADER_BYTES + len;
+    if (rec->type == RECORD_MESSAGE && len >= 24) {
+        rec->id = (int64_t)get_u64(payload);
+        rec->when = (int64_t)get_u64(payload + 8);
+        rec->sender_len = get_u16(payload + 16);
+        rec->receiver_len = get_u16(payload + 18);
+        rec->body_len = get_u32(payload + 20);
+        if (24u + rec->sender_len + rec->receiver_len + rec->body_len != len || rec->sender_len == 0 ||
+            rec->receiver_len == 0) {
+            return 1;
+        }
+        rec->sender = (const char *)payload + 24;
+        rec->receiver = rec->sender + rec->sender_len;
+        rec->body = rec->receiver + rec->receiver_len;
+        return 0;
+    }
+    if (rec->type == RECORD_TOMBSTONE && len >= 12) {
+        rec->id = (int64_t)get_u64(payload);
+        rec->sender_len = get_u16(payload + 8);
+        rec->receiver_len = get_u16(payload + 10);
+        if (12u + rec->sender_len + rec->receiver_len != len) {
+            return 1;
+        }
+        rec->sender = (const char *)payload + 12;
+        rec->receiver = rec->sender + rec->sender_len;
+        return 0;
+    }
+    return 1;
+}
+
+// Looks up (or with `create`, interns) the conversation a record belongs to.
+static conversation_t *record_conversation(storage_backend_t *backend, const record_t *rec, bool create) {
+    char *key = conversation_key_n(rec->sender, rec->sender_len, rec->receiver, rec->receiver_len);
+    if (!key) {
+        return NULL;
+    }
+    if (create) {
+        return intern_conversation(backend, key);
+    }
+    conversation_t *conv = find_conversation(backend, key);
+    free(key);
+    return conv;
+}
+
+// Writes a record at the end of `seg`. The caller flushes.
+static int append_record(segment_t *seg, unsigned type, const unsigned char *payload, uint32_t len,
+                         uint64_t *offset) {
+    unsigned char header[RECORD_HEADER_BYTES];
+    header[8] = (unsigned char)type;
+    put_u32(header, len);
+    put_u32(header + 4, fnv1a(fnv1a(2166136261u, header + 8, 1), payload, len));
+    if (fseek(seg->fp, (long)seg->size, SEEK_SET) != 0 || fwrite(header, 1, sizeof(header), seg->fp) != sizeof(header) ||
+        fwrite(payload, 1, len, seg->fp) != len) {
+        storage_set_error("Failed to append to log: %s", strerror(errno));
+        return -1;
+    }
+    *offset = seg->size;
+    seg->size += RECORD_HEADER_BYTES + len;
+    return 0;
+}
+
+static uint32_t encode_message(storage_backend_t *backend, unsigned char **out, int64_t id, int64_t when,
+                               const char *sender, const char *receiver, const char *body) {
+    size_t sender_len = strlen(sender);
+    size_t receiver_len = strlen(receiver);
+    size_t body_len = strlen(body);
+    size_t len = 24 + sender_len + receiver_len + body_len;
+    if (sender_len > UINT16_MAX || receiver_len > UINT16_MAX || len > MAX_RECORD_PAYLOAD) {
+        storage_set_error("Message too large for log%s", "");
+        return 0;
+    }
+    unsigned char *payload = ensure_scratch(backend, len);
+    if (!payload) {
+        return 0;
+    }
+    put_u64(payload, (uint64_t)id);
+    put_u64(payload + 8, (uint64_t)when);
+    put_u16(payload + 16, (uint16_t)sender_len);
+    put_u16(payload + 18, (uint16_t)receiver_len);
+    put_u32(payload + 20, (uint32_t)body_len);
+    memcpy(payload + 24, sender, sender_len);
+    memcpy(payload + 24 + sender_len, receiver, receiver_len);
+    memcpy(payload + 24 + sender_len + receiver_len, body, body_len);
+    *out = payload;
+    return (uint32_t)len;
+}
+
+// Indexes every intact record in `seg` from `offset` on. A torn tail on the
+// active segment (crash mid-append) is cut off so new appends start clean.
+static int scan_segment(storage_backend_t *backend, segment_t *seg, uint64_t offset) {
+    uint32_t number = seg->number;
+    while (offset < seg->size) {
+        record_t rec;
+        int rc = read_record(backend, seg, offset, &rec);
+        if (rc < 0) {
+            return -1;
+        }
+        if (rc > 0) {
+            if (number == backend->active_segment) {
+                truncate_file(seg->fp, offset);
+            }
+            seg->size = offset;
+            break;
+        }
+        uint64_t at = offset;
+        offset += rec.size;
+        conversation_t *conv = record_conversation(backend, &rec, true);
+        if (!conv) {
+            continue;
+        }
+        if (rec.type == RECORD_MESSAGE) {
+            log_entry_t entry = {rec.id, number, rec.size, at,
+                                 !name_after(rec.receiver, rec.receiver_len, rec.sender, rec.sender_len)};
+            if (push_entry(conv, &entry) != 0) {
+                return -1;
+            }
+            if (rec.id >= backend->next_id) {
+                backend->next_id = rec.id + 1;
+            }
+        } else if (rec.id > conv->deleted_upto) {
+            conv->deleted_upto = rec.id;
+            conv->tomb_segment = number;
+            conv->tomb_size = rec.size;
+        }
+    }
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// Index snapshot: header, segment table, then every conversation with its
+// entries, followed by a checksum of everything before it.
+
+typedef struct {
+    FILE *fp;
+    uint32_t checksum;
+    bool failed;
+} snapshot_writer_t;
+
+static void snapshot_put(snapshot_writer_t *w, const void *data, size_t len) {
+    w->checksum = fnv1a(w->checksum, data, len);
+    if (fwrite(data, 1, len, w->fp) != len) {
+        w->failed = true;
+    }
+}
+
+static void snapshot_u32(snapshot_writer_t *w, uint32_t v) {
+    unsigned char buf[4];
+    put_u32(buf, v);
+    snapshot_put(w, buf, sizeof(buf));
+}
+
+static void snapshot_u64(snapshot_writer_t *w, uint64_t v) {
+    unsigned char buf[8];
+    put_u64(buf, v);
+    snapshot_put(w, buf, sizeof(buf));
+}
+
+static int save_index(storage_backend_t *backend) {
+    char path[PATH_MAX + 16];
+    char tmp_path[PATH_MAX + 16];
+    sibling_path(backend, ".index", path, sizeof(path));
+    sibling_path(backend, ".index.tmp", tmp_path, sizeof(tmp_path));
+    snapshot_writer_t w = {fopen(tmp_path, "wb"), 2166136261u, false};
+    if (!w.fp) {
+        storage_set_error("Failed to write log index: %s", strerror(errno));
+        return -1;
+    }
+    snapshot_u32(&w, INDEX_MAGIC);
+    snapshot_u32(&w, INDEX_VERSION);
+    snapshot_u64(&w, (uint64_t)backend->next_id);
+    snapshot_u32(&w, (uint32_t)backend->segment_count);
+    for (size_t i = 0; i < backend->segment_count; ++i) {
+        snapshot_u32(&w, backend->segments[i].number);
+        snapshot_u64(&w, backend->segments[i].size);
+    }
+    snapshot_u32(&w, (uint32_t)backend->conversation_count);
+    for (size_t b = 0; b < backend->bucket_count; ++b) {
+        for (conversation_t *conv = backend->buckets[b]; conv; conv = conv->next) {
+            uint32_t key_len = (uint32_t)strlen(conv->key);
+            snapshot_u32(&w, key_len);
+            snapshot_put(&w, conv->key, key_len);
+            snapshot_u64(&w, (uint64_t)conv->deleted_upto);
+            snapshot_u32(&w, conv->tomb_segment);
+            snapshot_u32(&w, conv->tomb_size);
+            snapshot_u64(&w, conv->count);
+            for (size_t i = 0; i < conv->count; ++i) {
+                snapshot_u64(&w, (uint64_t)conv->entries[i].id);
+                snapshot_u32(&w, conv->entries[i].segment);
+                snapshot_u32(&w, conv->entries[i].size);
+                snapshot_u64(&w, conv->entries[i].offset);
+                unsigned char flag = conv->entries[i].to_first;
+                snapshot_put(&w, &flag, 1);
+            }
+        }
+    }
+    unsigned char sum[4];
+    put_u32(sum, w.checksum);
+    if (fwrite(sum, 1, sizeof(sum), w.fp) != sizeof(sum)) {
+        w.failed = true;
+    }
+    if (fclose(w.fp) != 0 || w.failed || replace_file(tmp_path, path) != 0) {
+        storage_set_error("Failed to write log index: %s", strerror(errno));
+        remove(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+typedef struct {
+    const unsigned char *data;
+    size_t len;
+    size_t pos;
+    bool failed;
+} snapshot_reader_t;
+
+static const unsigned char *snapshot_take(snapshot_reader_t *r, size_t len) {
+    if (r->failed || r->len - r->pos < len) {
+        r->failed = true;
+        return NULL;
+    }
+    const unsigned char *p = r->data + r->pos;
+    r->pos += len;
+    return p;
+}
+
+static uint32_t snapshot_read_u32(snapshot_reader_t *r) {
+    const unsigned char *p = snapshot_take(r, 4);
+    return p ? get_u32(p) : 0;
+}
+
+static uint64_t snapshot_read_u64(snapshot_reader_t *r) {
+    const unsigned char *p = snapshot_take(r, 8);
+    return p ? get_u64(p) : 0;
+}
+
+// Loads the snapshot if every segment it names is still listed and at least
+// as long as when the snapshot was taken; then replays whatever was appended
+// since. Returns false (leaving the index empty) when the snapshot is
+// missing or stale, in which case the caller rebuilds from the segments.
+static bool load_index(storage_backend_t *backend) {
+    char path[PATH_MAX + 16];
+    sibling_path(backend, ".index", path, sizeof(path));
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        return false;
+    }
+    fseek(fp, 0, SEEK_END);
+    long file_len = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    unsigned char *data = (file_len > 4) ? malloc((size_t)file_len) : NULL;
+    bool ok = data && fread(data, 1, (size_t)file_len, fp) == (size_t)file_len;
+    fclose(fp);
+    if (!ok) {
+        free(data);
+        return false;
+    }
+    snapshot_reader_t r = {data, (size_t)file_len - 4, 0, false};
+    ok = fnv1a(2166136261u, data, r.len) == get_u32(data + r.len) && snapshot_read_u32(&r) == INDEX_MAGIC &&
+         snapshot_read_u32(&r) == INDEX_VERSION;
+    int64_t snapshot_next_id = (int64_t)snapshot_read_u64(&r);
+    uint32_t segs = snapshot_read_u32(&r);
+    // Segments added after the snapshot (rollover, compaction output whose
+    // snapshot never got written) are replayed from the start; a snapshot
+    // segment that is gone or shorter means the snapshot is stale.
+    uint64_t *recorded = ok ? calloc(backend->segment_count ? backend->segment_count : 1, sizeof(uint64_t)) : NULL;
+    ok = ok && recorded && segs <= backend->segment_count;
+    for (uint32_t i = 0; ok && i < segs; ++i) {
+        uint32_t number = snapshot_read_u32(&r);
+        uint64_t size = snapshot_read_u64(&r);
+        segment_t *seg = find_segment(backend, number);
+        ok = !r.failed && seg && seg->size >= size;
+        if (ok) {
+            recorded[seg - backend->segments] = size;
+        }
+    }
+    uint32_t convs = ok ? snapshot_read_u32(&r) : 0;
+    for (uint32_t c = 0; ok && c < convs; ++c) {
+        uint32_t key_len = snapshot_read_u32(&r);
+        const unsigned char *key_bytes = snapshot_take(&r, key_len);
+        char *key = key_bytes ? malloc(key_len + 1) : NULL;
+        if (!key) {
+            ok = false;
+            break;
+        }
+        memcpy(key, key_bytes, key_len);
+        key[key_len] = '\0';
+        conversation_t *conv = intern_conversation(backend, key);
+        if (!conv) {
+            ok = false;
+            break;
+        }
+        conv->deleted_upto = (int64_t)snapshot_read_u64(&r);
+        conv->tomb_segment = snapshot_read_u32(&r);
+        conv->tomb_size = snapshot_read_u32(&r);
+        uint64_t count = snapshot_read_u64(&r);
+        for (uint64_t i = 0; ok && i < count; ++i) {
+            log_entry_t entry;
+            entry.id = (int64_t)snapshot_read_u64(&r);
+            entry.segment = snapshot_read_u32(&r);
+            entry.size = snapshot_read_u32(&r);
+            entry.offset = snapshot_read_u64(&r);
+            const unsigned char *flag = snapshot_take(&r, 1);
+            entry.to_first = flag && *flag;
+            ok = !r.failed && push_entry(conv, &entry) == 0;
+        }
+    }
+    ok = ok && !r.failed && r.pos == r.len;
+    free(data);
+    if (ok) {
+        backend->next_id = snapshot_next_id;
+        for (size_t i = 0; ok && i < backend->segment_count; ++i) {
+            if (backend->segments[i].size > recorded[i]) {
+                ok = scan_segment(backend, &backend->segments[i], recorded[i]) == 0;
+            }
+        }
+    }
+    free(recorded);
+    if (!ok) {
+        free_conversations(backend);
+        backend->next_id = 1;
+    }
+    return ok;
+}
+
+static int rebuild_index(storage_backend_t *backend) {
+    for (size_t i = 0; i < backend->segment_count; ++i) {
+        if (scan_segment(backend, &backend->segments[i], 0) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// Compaction
+
+static bool record_is_live(storage_backend_t *backend, const record_t *rec, uint32_t number,
+                           conversation_t **conv_out) {
+    conversation_t *conv = record_conversation(backend, rec, false);
+    *conv_out = conv;
+    if (!conv) {
+        return false;
+    }
+    if (rec->type == RECORD_MESSAGE) {
+        return rec->id > conv->deleted_upto;
+    }
+    return rec->id == conv->deleted_upto && conv->tomb_segment == number;
+}
+
+typedef struct {
+    conversation_t *conv;
+    size_t index; // entry index, or SIZE_MAX for the conversation's tombstone
+    uint64_t offset;
+} relocation_t;
+
+// Caller holds log_lock. Copies the live records of one sealed segment into a
+// fresh segment; only once that is flushed are the index entries repointed,
+// the manifest switched over and the old file deleted, so a failure or crash
+// at any point leaves a readable set.
+static int compact_segment(storage_backend_t *backend, uint32_t victim) {
+    if (find_segment(backend, victim)->live == 0) {
+        drop_segment(backend, victim, true);
+        return save_manifest(backend);
+    }
+    uint32_t number = backend->next_segment;
+    if (!add_segment(backend, number, true)) {
+        return -1;
+    }
+    relocation_t *moves = NULL;
+    size_t move_count = 0;
+    size_t move_capacity = 0;
+    uint64_t offset = 0;
+    int rc = 0;
+    for (;;) {
+        segment_t *seg = find_segment(backend, victim);
+        record_t rec;
+        int status = (offset < seg->size) ? read_record(backend, seg, offset, &rec) : 1;
+        if (status != 0) {
+            rc = (status < 0) ? -1 : 0;
+            break;
+        }
+        offset += rec.size;
+        conversation_t *conv;
+        if (!record_is_live(backend, &rec, victim, &conv)) {
+            continue;
+        }
+        size_t index = SIZE_MAX;
+        if (rec.type == RECORD_MESSAGE) {
+            index = lower_bound(conv, rec.id);
+            if (index == conv->count || conv->entries[index].id != rec.id || conv->entries[index].segment != victim) {
+                continue;
+            }
+        }
+        if (move_count == move_capacity) {
+            size_t new_cap = move_capacity ? move_capacity * 2 : 256;
+            relocation_t *tmp = realloc(moves, new_cap * sizeof(relocation_t));
+            if (!tmp) {
+                rc = -1;
+                break;
+            }
+            moves = tmp;
+            move_capacity = new_cap;
+        }
+        // The payload is still in the scratch buffer filled by read_record().
+        segment_t *out = find_segment(backend, number);
+        uint64_t at;
+        if (append_record(out, rec.type, backend->scratch, rec.size - RECORD_HEADER_BYTES, &at) != 0) {
+            rc = -1;
+            break;
+        }
+        out->live += rec.size;
+        moves[move_count++] = (relocation_t){conv, index, at};
+    }
+    if (rc != 0 || fflush(find_segment(backend, number)->fp) != 0) {
+        free(moves);
+        drop_segment(backend, number, true);
+        storage_set_error("Log compaction failed: %s", strerror(errno));
+        return -1;
+    }
+    for (size_t i = 0; i < move_count; ++i) {
+        relocation_t *move = &moves[i];
+        if (move->index == SIZE_MAX) {
+            move->conv->tomb_segment = number;
+        } else {
+            move->conv->entries[move->index].segment = number;
+            move->conv->entries[move->index].offset = move->offset;
+        }
+    }
+    free(moves);
+    drop_segment(backend, victim, false);
+    if (save_manifest(backend) != 0) {
+        return -1;
+    }
+    char path[PATH_MAX + 16];
+    segment_path(backend, victim, path, sizeof(path));
+    remove(path);
+    return save_index(backend);
+}
+
+static bool pick_victim(storage_backend_t *backend, uint32_t *victim) {
+    for (size_t i = 0; i < backend->segment_count; ++i) {
+        if (backend->segments[i].number != backend->active_segment &&
+            (backend->segments[i].live == 0 || backend->segments[i].live * 2 < backend->segments[i].size)) {
+            *victim = backend->segments[i].number;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void *compactor_main(void *arg) {
+    storage_backend_t *backend = arg;
+    pthread_mutex_lock(&backend->log_lock);
+    while (!backend->compactor_stopping) {
+        uint32_t victim;
+        if (pick_victim(backend, &victim)) {
+            if (compact_segment(backend, victim) != 0) {
+                fprintf(stderr, "Log compaction: %s\n", storage_last_error());
+            } else {
+                continue; // look for more work straight away
+            }
+        }
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += COMPACT_INTERVAL_MS / 1000;
+        pthread_cond_timedwait(&backend->compactor_cond, &backend->log_lock, &deadline);
+    }
+    pthread_mutex_unlock(&backend->log_lock);
+    return NULL;
+}
+
+// ---------------------------------------------------------------------------
+// Legacy text log ("ts|sender|receiver|body" lines) import
+
+static int portable_getline(char **lineptr, size_t *n, FILE *stream) {
+    if (!lineptr || !n || !stream) {
+        return -1;
+    }
+    if (*lineptr == NULL || *n == 0) {
+        *n = 256;
+        *lineptr = malloc(*n);
+        if (!*lineptr) {
+            return -1;
+        }
+    }
+    size_t total = 0;
+    while (fgets(*lineptr + total, (int)(*n - total), stream)) {
+        size_t chunk = strlen(*lineptr + total);
+        total += chunk;
+        if (total > 0 && (*lineptr)[total - 1] == '\n') {
+            return (int)total;
+        }
+        size_t new_size = (*n) * 2;
+        char *tmp = realloc(*lineptr, new_size);
+        if (!tmp) {
+            return -1;
+        }
+        *lineptr = tmp;
+        *n = new_size;
+    }
+    return (total > 0) ? (int)total : -1;
+}
+
+static time_t parse_timestamp(const char *text) {
+    struct tm tm_when;
+    memset(&tm_when, 0, sizeof(tm_when));
+    if (sscanf(text, "%d-%d-%d %d:%d:%d", &tm_when.tm_year, &tm_when.tm_mon, &tm_when.tm_mday, &tm_when.tm_hour,
+               &tm_when.tm_min, &tm_when.tm_sec) != 6) {
+        return time(NULL);
+    }
+    tm_when.tm_year -= 1900;
+    tm_when.tm_mon -= 1;
+    tm_when.tm_isdst = -1;
+    return mktime(&tm_when);
+}
+
+static int begin_locked(storage_backend_t *backend);
+static int commit_locked(storage_backend_t *backend);
+static void rollback_locked(storage_backend_t *backend);
+static int insert_at(storage_backend_t *backend, const char *sender, const char *receiver, const char *body,
+                     time_t when);
+
+// Called with log_lock held on a fresh log. Imported in batches so the
+// segments roll over as they fill.
+static int import_legacy_log(storage_backend_t *backend) {
+    FILE *src = fopen(backend->base_path, "r");
+    if (!src) {
+        return 0;
+    }
+    char *line = NULL;
+    size_t len = 0;
+    int rc = begin_locked(backend);
+    while (rc == 0 && portable_getline(&line, &len, src) != -1) {
+        char *ts = strtok(line, "|");
+        char *sender = strtok(NULL, "|");
+        char *receiver = strtok(NULL, "|");
+        char *body = strtok(NULL, "\n");
+        if (ts && sender && receiver && body) {
+            rc = insert_at(backend, sender, receiver, body, parse_timestamp(ts));
+        }
+        if (rc == 0 && find_segment(backend, backend->active_segment)->size >= SEGMENT_MAX_BYTES) {
+            rc = (commit_locked(backend) == 0) ? begin_locked(backend) : -1;
+        }
+    }
+    free(line);
+    fclose(src);
+    if (rc != 0 || commit_locked(backend) != 0) {
+        rollback_locked(backend);
+        return -1;
+    }
+    char done_path[PATH_MAX + 16];
+    sibling_path(backend, ".legacy", done_path, sizeof(done_path));
+    if (replace_file(backend->base_path, done_path) != 0) {
+        storage_set_error("Failed to retire legacy log: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// Delivery cursors: the highest message id each user has been handed, kept in
+// <path>.cursors as an append-only list of checksummed (name, id) records
+// that is rewritten compacted on every open. The entry for the empty name is
+// the floor for users without one of their own: the last id when the file
+// was created, so history logged before cursors existed is not redelivered.
+
+static cursor_t **cursor_slot(storage_backend_t *backend, const char *user) {
+    cursor_t **slot = &backend->cursor_buckets[hash_key(user) & (CURSOR_BUCKETS - 1)];
+    while (*slot && strcmp((*slot)->user, user) != 0) {
+        slot = &(*slot)->next;
+    }
+    return slot;
+}
+
+// Returns 1 if the cursor moved, 0 if it already was at or past `id`.
+static int raise_cursor(storage_backend_t *backend, const char *user, int64_t id) {
+    cursor_t **slot = cursor_slot(backend, user);
+    if (*slot) {
+        if ((*slot)->id >= id) {
+            return 0;
+        }
+        (*slot)->id = id;
+        return 1;
+    }
+    size_t len = strlen(user) + 1;
+    cursor_t *cursor = malloc(sizeof(cursor_t) + len);
+    if (!cursor) {
+        storage_set_error("Out of memory tracking delivery%s", "");
+        return -1;
+    }
+    cursor->next = NULL;
+    cursor->id = id;
+    memcpy(cursor->user, user, len);
+    *slot = cursor;
+    return 1;
+}
+
+static int64_t cursor_of(storage_backend_t *backend, const char *user) {
+    cursor_t *cursor = *cursor_slot(backend, user);
+    if (!cursor) {
+        cursor = *cursor_slot(backend, "");
+    }
+    return cursor ? cursor->id : 0;
+}
+
+// u16 name length, name, u64 id, u32 checksum of the preceding bytes.
+static int write_cursor(FILE *fp, const char *user, int64_t id) {
+    size_t len = strlen(user);
+    unsigned char head[2];
+    unsigned char tail[12];
+    put_u16(head, (uint16_t)len);
+    put_u64(tail, (uint64_t)id);
+    put_u32(tail + 8, fnv1a(fnv1a(fnv1a(2166136261u, head, 2), (const unsigned char *)user, len), tail, 8));
+    return (fwrite(head, 1, 2, fp) == 2 && fwrite(user, 1, len, fp) == len && fwrite(tail, 1, 12, fp) == 12) ? 0
+                                                                                                              : -1;
+}
+
+static void drop_cursor_updates(storage_backend_t *backend) {
+    for (size_t i = 0; i < backend->cursor_update_count; ++i) {
+        free(backend->cursor_updates[i].user);
+    }
+    backend->cursor_update_count = 0;
+}
+
+static int apply_cursor_updates(storage_backend_t *backend) {
+    int rc = 0;
+    for (size_t i = 0; rc == 0 && i < backend->cursor_update_count; ++i) {
+        rc = raise_cursor(backend, backend->cursor_updates[i].user, backend->cursor_updates[i].id);
+        if (rc > 0) {
+            rc = write_cursor(backend->cursor_fp, backend->cursor_updates[i].user, backend->cursor_updates[i].id);
+        }
+    }
+    if (rc == 0 && backend->cursor_update_count > 0 && fflush(backend->cursor_fp) != 0) {
+        rc = -1;
+    }
+    if (rc != 0) {
+        storage_set_error("Failed to write delivery cursors: %s", strerror(errno));
+    }
+    drop_cursor_updates(backend);
+    return rc;
+}
+
+static void free_cursors(storage_backend_t *backend) {
+    drop_cursor_updates(backend);
+    free(backend->cursor_updates);
+    backend->cursor_updates = NULL;
+    backend->cursor_update_capacity = 0;
+    for (size_t b = 0; b < CURSOR_BUCKETS; ++b) {
+        while (backend->cursor_buckets[b]) {
+            cursor_t *next = backend->cursor_buckets[b]->next;
+            free(backend->cursor_buckets[b]);
+            backend->cursor_buckets[b] = next;
+        }
+    }
+    if (backend->cursor_fp) {
+        fclose(backend->cursor_fp);
+        backend->cursor_fp = NULL;
+    }
+}
+
+// Caller holds log_lock, after the index is loaded so next_id is final.
+static int open_cursors(storage_backend_t *backend) {
+    char path[PATH_MAX + 16];
+    char tmp_path[PATH_MAX + 16];
+    sibling_path(backend, ".cursors", path, sizeof(path));
+    sibling_path(backend, ".cursors.tmp", tmp_path, sizeof(tmp_path));
+    FILE *fp = fopen(path, "rb");
+    if (fp) {
+        unsigned char head[2];
+        unsigned char tail[12];
+        while (fread(head, 1, 2, fp) == 2) {
+            size_t len = get_u16(head);
+            char *name = (char *)ensure_scratch(backend, len + 1);
+            if (!name) {
+                fclose(fp);
+                return -1;
+            }
+            if (fread(name, 1, len, fp) != len || fread(tail, 1, 12, fp) != 12 ||
+                fnv1a(fnv1a(fnv1a(2166136261u, head, 2), (unsigned char *)name, len), tail, 8) != get_u32(tail + 8)) {
+                break; // torn tail
+            }
+            name[len] = '\0';
+            if (raise_cursor(backend, name, (int64_t)get_u64(tail)) < 0) {
+                fclose(fp);
+                return -1;
+            }
+        }
+        fclose(fp);
+    } else if (raise_cursor(backend, "", backend->next_id - 1) < 0) {
+        return -1;
+    }
+    FILE *out = fopen(tmp_path, "wb");
+    int rc = out ? 0 : -1;
+    for (size_t b = 0; rc == 0 && b < CURSOR_BUCKETS; ++b) {
+        for (cursor_t *cursor = backend->cursor_buckets[b]; rc == 0 && cursor; cursor = cursor->next) {
+            rc = write_cursor(out, cursor->user, cursor->id);
+        }
+    }
+    if (out && fclose(out) != 0) {
+        rc = -1;
+    }
+    if (rc != 0 || replace_file(tmp_path, path) != 0 || !(backend->cursor_fp = fopen(path, "ab"))) {
+        storage_set_error("Failed to write delivery cursors: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// Backend interface
+
+static void reset_state(storage_backend_t *backend) {
+    free_cursors(backend);
+    free_conversations(backend);
+    close_segments(backend);
+    free(backend->pending);
+    backend->pending = NULL;
+    backend->pending_count = backend->pending_capacity = 0;
+    backend->active_segment = 0;
+    backend->next_segment = 1;
+    backend->next_id = 1;
+}
+
+static void free_backend(storage_backend_t *backend) {
+    free(backend->scratch);
+    pthread_mutex_destroy(&backend->log_lock);
+    pthread_cond_destroy(&backend->compactor_cond);
+    free(backend);
+}
+
+storage_backend_t *storage_backend_open(const char *path, const storage_options_t *options) {
+    (void)options; // journaling, sync levels and body compression only apply to the SQLite backend
+    storage_backend_t *backend = calloc(1, sizeof(*backend));
+    if (!backend) {
+        storage_set_error("Failed to open log: %s", "out of memory");
+        return NULL;
+    }
+    strncpy(backend->base_path, path ? path : "chat.log", sizeof(backend->base_path) - 1);
+    pthread_mutex_init(&backend->log_lock, NULL);
+    pthread_cond_init(&backend->compactor_cond, NULL);
+    backend->next_segment = 1;
+    backend->next_id = 1;
+    pthread_mutex_lock(&backend->log_lock);
+    int rc = load_manifest(backend);
+    if (rc == 0) {
+        // Fresh log: start the first segment, then pull in an old text log.
+        backend->active_segment = backend->next_segment;
+        rc = (add_segment(backend, backend->active_segment, true) && save_manifest(backend) == 0) ? 0 : -1;
+        if (rc == 0) {
+            rc = import_legacy_log(backend);
+        }
+    } else if (rc == 1) {
+        rc = (load_index(backend) || rebuild_index(backend) == 0) ? 0 : -1;
+        if (rc == 0) {
+            finalize_index(backend);
+        }
+    }
+    if (rc == 0) {
+        rc = open_cursors(backend);
+    }
+    pthread_mutex_unlock(&backend->log_lock);
+    if (rc != 0) {
+        reset_state(backend);
+        free_backend(backend);
+        return NULL;
+    }
+    backend->compactor_running = pthread_create(&backend->compactor_thread, NULL, compactor_main, backend) == 0;
+    return backend;
+}
+
+void storage_backend_close(storage_backend_t *backend) {
+    if (backend->compactor_running) {
+        pthread_mutex_lock(&backend->log_lock);
+        backend->compactor_stopping = true;
+        pthread_cond_signal(&backend->compactor_cond);
+        pthread_mutex_unlock(&backend->log_lock);
+        pthread_join(backend->compactor_thread, NULL);
+    }
+    pthread_mutex_lock(&backend->log_lock);
+    if (backend->segment_count > 0 && save_index(backend) != 0) {
+        fprintf(stderr, "%s\n", storage_last_error());
+    }
+    reset_state(backend);
+    pthread_mutex_unlock(&backend->log_lock);
+    free_backend(backend);
+}
+
+// Seals a full active segment before a batch starts, so every record of the
+// batch lands in one file and a rollback is a single truncate.
+static int roll_segment_locked(storage_backend_t *backend) {
+    segment_t *seg = find_segment(backend, backend->active_segment);
+    if (seg->size < SEGMENT_MAX_BYTES) {
+        return 0;
+    }
+    uint32_t number = backend->next_segment;
+    if (!add_segment(backend, number, true)) {
+        return -1;
+    }
+    backend->active_segment = number;
+    return save_manifest(backend);
+}
+
+static int begin_locked(storage_backend_t *backend) {
+    int rc = roll_segment_locked(backend);
+    if (rc == 0) {
+        backend->batch_start = find_segment(backend, backend->active_segment)->size;
+        backend->batch_first_id = backend->next_id;
+        backend->pending_count = 0;
+        drop_cursor_updates(backend);
+    }
+    return rc;
+}
+
+int storage_backend_begin(storage_backend_t *backend) {
+    pthread_mutex_lock(&backend->log_lock);
+    int rc = begin_locked(backend);
+    pthread_mutex_unlock(&backend->log_lock);
+    return rc;
+}
+
+// Appends one message record under `id` without advancing next_id.
+static int insert_record(storage_backend_t *backend, const char *sender, const char *receiver, const char *body,
+                         time_t when, int64_t id) {
+    if (backend->pending_count == backend->pending_capacity) {
+        size_t new_cap = backend->pending_capacity ? backend->pending_capacity * 2 : 64;
+        pending_entry_t *tmp = realloc(backend->pending, new_cap * sizeof(pending_entry_t));
+        if (!tmp) {
+            storage_set_error("Out of memory appending to log%s", "");
+            return -1;
+        }
+        backend->pending = tmp;
+        backend->pending_capacity = new_cap;
+    }
+    char *key = conversation_key(sender, receiver);
+    conversation_t *conv = key ? intern_conversation(backend, key) : NULL;
+    if (!conv) {
+        storage_set_error("Out of memory indexing log%s", "");
+        return -1;
+    }
+    unsigned char *payload;
+    uint32_t len = encode_message(backend, &payload, id, (int64_t)when, sender, receiver, body);
+    uint64_t offset;
+    segment_t *seg = find_segment(backend, backend->active_segment);
+    if (len == 0 || append_record(seg, RECORD_MESSAGE, payload, len, &offset) != 0) {
+        return -1;
+    }
+    pending_entry_t *p = &backend->pending[backend->pending_count++];
+    p->conv = conv;
+    p->entry.id = id;
+    p->entry.segment = backend->active_segment;
+    p->entry.size = RECORD_HEADER_BYTES + len;
+    p->entry.offset = offset;
+    p->entry.to_first = !name_after(receiver, strlen(receiver), sender, strlen(sender));
+    return 0;
+}
+
+static int insert_at(storage_backend_t *backend, const char *sender, const char *receiver, const char *body,
+                     time_t when) {
+    if (insert_record(backend, sender, receiver, body, when, backend->next_id) != 0) {
+        return -1;
+    }
+    ++backend->next_id;
+    return 0;
+}
+
+int storage_backend_insert(storage_backend_t *backend, const char *sender, const char *receiver, const char *body,
+                           int64_t *id, char *timestamp, size_t timestamp_len) {
+    time_t now = time(NULL);
+    pthread_mutex_lock(&backend->log_lock);
+    int rc = insert_at(backend, sender, receiver, body, now);
+    *id = backend->next_id - 1;
+    pthread_mutex_unlock(&backend->log_lock);
+    format_timestamp(now, timestamp, timestamp_len);
+    return rc;
+}
+
+// The index is per conversation, so a group message is one record per
+// receiver, all carrying the same id; each copy lives and dies with its own
+// conversation exactly like a direct message.
+int storage_backend_insert_group(storage_backend_t *backend, const char *sender, const char *const *receivers,
+                                 size_t count, const char *body, int64_t *id, char *timestamp, size_t timestamp_len) {
+    time_t now = time(NULL);
+    int rc = 0;
+    pthread_mutex_lock(&backend->log_lock);
+    segment_t *seg = find_segment(backend, backend->active_segment);
+    uint64_t start = seg->size;
+    size_t first_entry = backend->pending_count;
+    for (size_t i = 0; rc == 0 && i < count; ++i) {
+        rc = insert_record(backend, sender, receivers[i], body, now, backend->next_id);
+    }
+    if (rc == 0) {
+        *id = backend->next_id++;
+    } else {
+        // All or nothing: cut the copies already appended so neither this
+        // batch's commit nor a later index rebuild can pick them up.
+        truncate_file(seg->fp, start);
+        seg->size = start;
+        backend->pending_count = first_entry;
+    }
+    pthread_mutex_unlock(&backend->log_lock);
+    format_timestamp(now, timestamp, timestamp_len);
+    return rc;
+}
+
+static int commit_locked(storage_backend_t *backend) {
+    segment_t *seg = find_segment(backend, backend->active_segment);
+    int rc = 0;
+    if (fflush(seg->fp) != 0) {
+        storage_set_error("Failed to flush log: %s", strerror(errno));
+        rc = -1;
+    }
+    for (size_t i = 0; rc == 0 && i < backend->pending_count; ++i) {
+        rc = push_entry(backend->pending[i].conv, &backend->pending[i].entry);
+        seg->live += backend->pending[i].entry.size;
+    }
+    backend->pending_count = 0;
+    if (rc == 0) {
+        rc = apply_cursor_updates(backend);
+    }
+    return rc;
+}
+
+int storage_backend_commit(storage_backend_t *backend) {
+    pthread_mutex_lock(&backend->log_lock);
+    int rc = commit_locked(backend);
+    pthread_mutex_unlock(&backend->log_lock);
+    return rc;
+}
+
+static void rollback_locked(storage_backend_t *backend) {
+    segment_t *seg = find_segment(backend, backend->active_segment);
+    // Entries already pushed by a partially failed commit are cut off along
+    // with the bytes.
+    for (size_t b = 0; b < backend->bucket_count; ++b) {
+        for (conversation_t *conv = backend->buckets[b]; conv; conv = conv->next) {
+            conv->count = lower_bound(conv, backend->batch_first_id);
+        }
+    }
+    truncate_file(seg->fp, backend->batch_start);
+    seg->size = backend->batch_start;
+    seg->live = 0;
+    backend->pending_count = 0;
+    drop_cursor_updates(backend);
+    backend->next_id = backend->batch_first_id;
+    finalize_index(backend);
+}
+
+void storage_backend_rollback(storage_backend_t *backend) {
+    pthread_mutex_lock(&backend->log_lock);
+    rollback_locked(backend);
+    pthread_mutex_unlock(&backend->log_lock);
+}
+
+// Streams entries [start, end) of `conv`. Caller holds log_lock.
+static int emit_entries(storage_backend_t *backend, const conversation_t *conv, size_t start, size_t end,
+                        history_callback cb, void *ctx) {
+    for (size_t i = start; i < end; ++i) {
+        log_entry_t entry = conv->entries[i];
+        record_t rec;
+        if (read_record(backend, find_segment(backend, entry.segment), entry.offset,
+                        &rec) != 0 || rec.type != RECORD_MESSAGE) {
+            storage_set_error("Corrupt log record%s", "");
+            return -1;
+        }
+        char ts[32];
+        format_timestamp((time_t)rec.when, ts, sizeof(ts));
+        // Terminate the fields in place: the scratch buffer has a spare
+        // byte after the body, and the receiver (non-empty, not needed
+        // here) follows the sender.
+        char *sender = (char *)rec.sender;
+        char *body = (char *)rec.body;
+        body[rec.body_len] = '\0';
+        sender[rec.sender_len] = '\0';
+        cb(entry.id, ts, sender, body, ctx);
+    }
+    return 0;
+}
+
+int storage_backend_fetch(storage_backend_t *backend, const char *user_a, const char *user_b, int64_t before_id,
+                          int limit, history_callback cb, void *ctx) {
+    char *key = conversation_key(user_a, user_b);
+    if (!key) {
+        storage_set_error("Out of memory reading log%s", "");
+        return -1;
+    }
+    pthread_mutex_lock(&backend->log_lock);
+    conversation_t *conv = find_conversation(backend, key);
+    free(key);
+    int rc = 0;
+    if (conv) {
+        size_t end = (before_id > 0) ? lower_bound(conv, before_id) : conv->count;
+        size_t start = (limit > 0 && end > (size_t)limit) ? end - (size_t)limit : 0;
+        rc = emit_entries(backend, conv, start, end, cb, ctx);
+    }
+    pthread_mutex_unlock(&backend->log_lock);
+    return rc;
+}
+
+int storage_backend_fetch_since(storage_backend_t *backend, const char *user_a, const char *user_b, int64_t after_id,
+                                int limit, history_callback cb, void *ctx) {
+    char *key = conversation_key(user_a, user_b);
+    if (!key) {
+        storage_set_error("Out of memory reading log%s", "");
+        return -1;
+    }
+    pthread_mutex_lock(&backend->log_lock);
+    conversation_t *conv = find_conversation(backend, key);
+    free(key);
+    int rc = 0;
+    if (conv) {
+        size_t start = lower_bound(conv, after_id + 1);
+        size_t end = (limit > 0 && conv->count - start > (size_t)limit) ? start + (size_t)limit : conv->count;
+        rc = emit_entries(backend, conv, start, end, cb, ctx);
+    }
+    pthread_mutex_unlock(&backend->log_lock);
+    return rc;
+}
+
+int storage_backend_delete(storage_backend_t *backend, const char *user_a, const char *user_b) {
+    char *key = conversation_key(user_a, user_b);
+    if (!key) {
+        storage_set_error("Out of memory deleting history%s", "");
+        return -1;
+    }
+    pthread_mutex_lock(&backend->log_lock);
+    conversation_t *conv = find_conversation(backend, key);
+    int rc = 0;
+    if (conv && conv->count > 0) {
+        int64_t upto = conv->entries[conv->count - 1].id;
+        size_t a_len = strcspn(key, "\n");
+        size_t b_len = strlen(key) - a_len - 1;
+        uint32_t len = (uint32_t)(12 + a_len + b_len);
+        unsigned char *payload = ensure_scratch(backend, len);
+        segment_t *seg = find_segment(backend, backend->active_segment);
+        uint64_t offset;
+        rc = -1;
+        if (payload) {
+            put_u64(payload, (uint64_t)upto);
+            put_u16(payload + 8, (uint16_t)a_len);
+            put_u16(payload + 10, (uint16_t)b_len);
+            memcpy(payload + 12, key, a_len);
+            memcpy(payload + 12 + a_len, key + a_len + 1, b_len);
+            if (append_record(seg, RECORD_TOMBSTONE, payload, len, &offset) == 0 && fflush(seg->fp) == 0) {
+                rc = 0;
+            } else {
+                storage_set_error("Failed to append to log: %s", strerror(errno));
+            }
+        }
+        if (rc == 0) {
+            for (size_t i = 0; i < conv->count; ++i) {
+                segment_t *owner = find_segment(backend, conv->entries[i].segment);
+                if (owner) {
+                    owner->live -= conv->entries[i].size;
+                }
+            }
+            if (conv->deleted_upto > 0) {
+                segment_t *owner = find_segment(backend, conv->tomb_segment);
+                if (owner) {
+                    owner->live -= conv->tomb_size;
+                }
+            }
+            conv->count = 0;
+            conv->deleted_upto = upto;
+            conv->tomb_segment = backend->active_segment;
+            conv->tomb_size = RECORD_HEADER_BYTES + len;
+            seg->live += conv->tomb_size;
+            pthread_cond_signal(&backend->compactor_cond);
+        }
+    }
+    pthread_mutex_unlock(&backend->log_lock);
+    free(key);
+    return rc;
+}
+
+int storage_backend_set_cursor(storage_backend_t *backend, const char *user, int64_t id) {
+    pthread_mutex_lock(&backend->log_lock);
+    int rc = 0;
+    if (backend->cursor_update_count == backend->cursor_update_capacity) {
+        size_t new_cap = backend->cursor_update_capacity ? backend->cursor_update_capacity * 2 : 16;
+        cursor_update_t *tmp = realloc(backend->cursor_updates, new_cap * sizeof(cursor_update_t));
+        if (tmp) {
+            backend->cursor_updates = tmp;
+            backend->cursor_update_capacity = new_cap;
+        } else {
+            rc = -1;
+        }
+    }
+    char *copy = rc == 0 ? malloc(strlen(user) + 1) : NULL;
+    if (copy) {
+        strcpy(copy, user);
+        backend->cursor_updates[backend->cursor_update_count].id = id;
+        backend->cursor_updates[backend->cursor_update_count++].user = copy;
+    } else {
+        storage_set_error("Out of memory tracking delivery%s", "");
+        rc = -1;
+    }
+    pthread_mutex_unlock(&backend->log_lock);
+    return rc;
+}
+
+int64_t storage_backend_last_id(storage_backend_t *backend) {
+    pthread_mutex_lock(&backend->log_lock);
+    int64_t id = backend->next_id - 1;
+    pthread_mutex_unlock(&backend->log_lock);
+    return id;
+}
+
+int storage_backend_caught_up(storage_backend_t *backend, int64_t id, void (*cb)(const char *user, void *ctx),
+                              void *ctx) {
+    pthread_mutex_lock(&backend->log_lock);
+    for (size_t b = 0; b < CURSOR_BUCKETS; ++b) {
+        for (cursor_t *cursor = backend->cursor_buckets[b]; cursor; cursor = cursor->next) {
+            if (cursor->user[0] && cursor->id >= id) {
+                cb(cursor->user, ctx);
+            }
+        }
+    }
+    pthread_mutex_unlock(&backend->log_lock);
+    return 0;
+}
+
+// Deletes are tombstones already and the compaction thread reclaims their
+// space a segment at a time. Retention is not supported by this backend, and
+// the server refuses --retain-seconds/--retain-messages when built with it.
+int storage_backend_purge(storage_backend_t *backend, int64_t upto_id, uint64_t max_age_seconds, size_t batch,
+                          int64_t *floor) {
+    (void)backend;
+    (void)upto_id;
+    (void)max_age_seconds;
+    (void)batch;
+    (void)floor;
+    return 0;
+}
+
+// An inbox read's place in one of the user's conversations.
+typedef struct {
+    conversation_t *conv;
+    size_t next;   // next entry to look at
+    bool to_first; // which entries the user received
+    bool both;     // notes to self: all of them
+} inbox_source_t;
+
+// A message picked for the page, read once log_lock has been let go.
+typedef struct {
+    conversation_t *conv;
+    int64_t id;
+} inbox_pick_t;
+
+// A picked record copied out of the scratch buffer, for the callback: its
+// sender and body sit at `text` in the batch's shared buffer.
+typedef struct {
+    int64_t id;
+    char timestamp[32];
+    size_t text;
+    size_t sender_len;
+} inbox_row_t;
+
+typedef struct {
+    inbox_row_t rows[INBOX_LOCK_BATCH];
+    size_t count;
+    char *text;
+    size_t text_len;
+    size_t text_capacity;
+} inbox_batch_t;
+
+// Moves `source` to its next entry for the user; false when there is none.
+// The user's own sends are skipped here, from the index alone.
+static bool inbox_source_ready(inbox_source_t *source) {
+    const conversation_t *conv = source->conv;
+    while (source->next < conv->count && !source->both && conv->entries[source->next].to_first != source->to_first) {
+        ++source->next;
+    }
+    return source->next < conv->count;
+}
+
+static int64_t inbox_source_id(const inbox_source_t *source) {
+    return source->conv->entries[source->next].id;
+}
+
+// Min-heap on the id of each source's next entry.
+static void inbox_sift_down(inbox_source_t *heap, size_t count, size_t i) {
+    for (;;) {
+        size_t least = i;
+        for (size_t child = 2 * i + 1; child <= 2 * i + 2 && child < count; ++child) {
+            if (inbox_source_id(&heap[child]) < inbox_source_id(&heap[least])) {
+                least = child;
+            }
+        }
+        if (least == i) {
+            return;
+        }
+        inbox_source_t tmp = heap[i];
+        heap[i] = heap[least];
+        heap[least] = tmp;
+        i = least;
+    }
+}
+
+// Caller holds log_lock. Picks the user's oldest `limit` messages above the
+// cursor by merging their conversations through a heap, so the work is one
+// binary search per conversation plus a heap step per row; no record is read.
+static int pick_inbox(storage_backend_t *backend, const char *user, int limit, inbox_pick_t **picks_out,
+                      size_t *count_out) {
+    size_t user_len = strlen(user);
+    member_t *member = find_member(backend, user, user_len);
+    *picks_out = NULL;
+    *count_out = 0;
+    if (!member || member->count == 0) {
+        return 0;
+    }
+    inbox_source_t *heap = malloc(member->count * sizeof(inbox_source_t));
+    if (!heap) {
+        storage_set_error("Out of memory reading log%s", "");
+        return -1;
+    }
+    int64_t after = cursor_of(backend, user);
+    size_t sources = 0;
+    for (size_t i = 0; i < member->count; ++i) {
+        conversation_t *conv = member->convs[i];
+        const char *second = conv->key + strcspn(conv->key, "\n") + 1;
+        bool is_first = strncmp(conv->key, user, user_len) == 0 && conv->key[user_len] == '\n';
+        inbox_source_t source = {conv, lower_bound(conv, after + 1), is_first, is_first && strcmp(second, user) == 0};
+        if (inbox_source_ready(&source)) {
+            heap[sources++] = source;
+        }
+    }
+    for (size_t i = sources / 2; i-- > 0;) {
+        inbox_sift_down(heap, sources, i);
+    }
+    inbox_pick_t *picks = NULL;
+    size_t count = 0;
+    size_t capacity = 0;
+    int rc = 0;
+    while (sources > 0 && (limit <= 0 || count < (size_t)limit)) {
+        if (count == capacity) {
+            size_t new_cap = capacity ? capacity * 2 : (limit > 0 && limit < 256 ? (size_t)limit : 256);
+            inbox_pick_t *tmp = realloc(picks, new_cap * sizeof(inbox_pick_t));
+            if (!tmp) {
+                storage_set_error("Out of memory reading log%s", "");
+                rc = -1;
+                break;
+            }
+            picks = tmp;
+            capacity = new_cap;
+        }
+        picks[count++] = (inbox_pick_t){heap[0].conv, inbox_source_id(&heap[0])};
+        ++heap[0].next;
+        if (!inbox_source_ready(&heap[0])) {
+            heap[0] = heap[--sources];
+        }
+        inbox_sift_down(heap, sources, 0);
+    }
+    free(heap);
+    if (rc != 0) {
+        free(picks);
+        return -1;
+    }
+    *picks_out = picks;
+    *count_out = count;
+    return 0;
+}
+
+// Caller holds log_lock. Copies a picked message into `batch`, unless it was
+// deleted since it was picked. Compaction may have moved it, so it is looked
+// up again by id.
+static int copy_inbox_row(storage_backend_t *backend, const inbox_pick_t *pick, inbox_batch_t *batch) {
+    const conversation_t *conv = pick->conv;
+    size_t index = lower_bound(conv, pick->id);
+    if (index == conv->count || conv->entries[index].id != pick->id) {
+        return 0;
+    }
+    const log_entry_t *entry = &conv->entries[index];
+    record_t rec;
+    if (read_record(backend, find_segment(backend, entry->segment), entry->offset, &rec) != 0 ||
+        rec.type != RECORD_MESSAGE) {
+        storage_set_error("Corrupt log record%s", "");
+        return -1;
+    }
+    size_t need = batch->text_len + rec.sender_len + rec.body_len + 2;
+    if (need > batch->text_capacity) {
+        size_t new_cap = batch->text_capacity ? batch->text_capacity : 4096;
+        while (new_cap < need) {
+            new_cap *= 2;
+        }
+        char *tmp = realloc(batch->text, new_cap);
+        if (!tmp) {
+            storage_set_error("Out of memory reading log%s", "");
+            return -1;
+        }
+        batch->text = tmp;
+        batch->text_capacity = new_cap;
+    }
+    inbox_row_t *row = &batch->rows[batch->count++];
+    row->id = pick->id;
+    format_timestamp((time_t)rec.when, row->timestamp, sizeof(row->timestamp));
+    row->text = batch->text_len;
+    row->sender_len = rec.sender_len;
+    char *text = batch->text + batch->text_len;
+    memcpy(text, rec.sender, rec.sender_len);
+    text[rec.sender_len] = '\0';
+    memcpy(text + rec.sender_len + 1, rec.body, rec.body_len);
+    text[rec.sender_len + 1 + rec.body_len] = '\0';
+    batch->text_len = need;
+    return 0;
+}
+
+// The page is picked from the index under log_lock, then its records are
+// read a few dozen at a time, each batch under one short hold of the lock,
+// and handed to the callback with the lock released, so writers are never
+// held up for a whole page.
+int storage_backend_fetch_inbox(storage_backend_t *backend, const char *user, int limit, history_callback cb,
+                                void *ctx) {
+    inbox_pick_t *picks;
+    size_t count;
+    pthread_mutex_lock(&backend->log_lock);
+    int rc = pick_inbox(backend, user, limit, &picks, &count);
+    pthread_mutex_unlock(&backend->log_lock);
+    inbox_batch_t batch = {.count = 0};
+    for (size_t start = 0; rc == 0 && start < count; start += INBOX_LOCK_BATCH) {
+        size_t end = count - start > INBOX_LOCK_BATCH ? start + INBOX_LOCK_BATCH : count;
+        batch.count = 0;
+        batch.text_len = 0;
+        pthread_mutex_lock(&backend->log_lock);
+        for (size_t i = start; rc == 0 && i < end; ++i) {
+            rc = copy_inbox_row(backend, &picks[i], &batch);
+        }
+        pthread_mutex_unlock(&backend->log_lock);
+        for (size_t i = 0; rc == 0 && i < batch.count; ++i) {
+            const inbox_row_t *row = &batch.rows[i];
+            char *sender = batch.text + row->text;
+            cb(row->id, row->timestamp, sender, sender + row->sender_len + 1, ctx);
+        }
+    }
+    free(batch.text);
+    free(picks);
+    return rc;
+}
+
+#endif
@@ -0,0 +1,1037 @@
+#define _POSIX_C_SOURCE 200809L
+#include "storage_backend.h"
+
+#if STORAGE_USE_SQLITE
+
+#include <pthread.h>
+#include <sqlite3.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "binary_protocol.h"
+#include "deflate_codec.h"
+
+// Protocol lines are capped well below this, so two names always fit.
+#define MAX_CONVERSATION_KEY 4096
+#define MAX_READERS 64
+#define BUSY_TIMEOUT_MS 5000
+
+// A compressed body is a BLOB in the body column:
+//   codec (1 byte) | varint dictionary id (0 = none) | varint plain length | raw deflate
+// using the wire protocol's varints. Plain bodies stay TEXT, so databases
+// written before compression existed, or with it off, read unchanged.
+#define BODY_CODEC_DEFLATE 1
+#define MAX_BODY_BYTES BINARY_MAX_FRAME
+// Dictionaries are trained from the newest bodies once there are enough of
+// them and again after every DICTIONARY_RETRAIN_ROWS messages, at open or by
+// the writer after a commit, and kept forever: old rows name the one they
+// were compressed with.
+#define DICTIONARY_BYTES (32u * 1024u)
+#define DICTIONARY_MIN_ROWS 1000
+#define DICTIONARY_RETRAIN_ROWS 100000
+#define DICTIONARY_SAMPLE_ROWS 5000
+
+// Both directions of a conversation share one key: the two user names in
+// byte order joined by a newline (which a name can never contain). The SQL
+// in migrate_schema() builds the same key for rows written before the column
+// existed, relying on BINARY collation matching strcmp().
+#define CONVERSATION_KEY_SQL \
+    "CASE WHEN sender < receiver THEN sender || char(10) || receiver " \
+    "ELSE receiver || char(10) || sender END"
+
+// Deleting a conversation only records a tombstone: every row of it up to
+// deleted_upto is hidden from reads at once, and the purge removes them later
+// in small transactions (see storage_backend_purge()).
+#define TOMBSTONE_SQL(conversation) \
+    "IFNULL((SELECT deleted_upto FROM conversation_tombstones t WHERE t.conversation=" conversation "), 0)"
+
+// A group message is one messages row (receiver '', conversation NULL) plus
+// a message_recipients row per receiver carrying that pair's conversation
+// key, so a conversation is its direct rows merged with its group rows. Both
+// halves come out of their (conversation, id) indexes already in id order and
+// SQLite merges them without a sort.
+// `cmp` bounds the ids by ?2 from below (">") or above ("<").
+#define CONVERSATION_ROWS_SQL(cmp) \
+    "SELECT id, created_at, sender, body FROM messages WHERE conversation=?1 AND id" cmp "?2 " \
+    "AND id>" TOMBSTONE_SQL("?1") \
+    " UNION ALL SELECT r.message_id, m.created_at, m.sender, m.body FROM message_recipients r " \
+    "JOIN messages m ON m.id=r.message_id WHERE r.conversation=?1 AND r.message_id" cmp "?2 " \
+    "AND r.message_id>" TOMBSTONE_SQL("?1")
+
+#define FETCH_SQL \
+    "SELECT id, datetime(created_at), sender, body FROM (" CONVERSATION_ROWS_SQL("<") ") ORDER BY id ASC"
+// Newest page first, then flipped back to chronological order.
+#define PAGE_SQL \
+    "SELECT id, datetime(created_at), sender, body FROM (" CONVERSATION_ROWS_SQL("<") \
+    " ORDER BY 1 DESC LIMIT ?3) ORDER BY id ASC"
+// The oldest page above an id, for clients catching up a local copy.
+#define SINCE_SQL \
+    "SELECT id, datetime(created_at), sender, body FROM (" CONVERSATION_ROWS_SQL(">") ") ORDER BY id ASC LIMIT ?3"
+
+// A user's inbox is every message addressed to them above their delivery
+// cursor, or above the '' floor row for users without one; the floor is the
+// last id when the table was created, so older history is not redelivered.
+// Both halves walk a (receiver, id) index from the cursor upwards, checking
+// each row's conversation for a tombstone by primary key.
+#define INBOX_CURSOR_SQL \
+    "IFNULL((SELECT delivered_upto FROM delivery_cursors WHERE user IN (?1, '') ORDER BY user DESC LIMIT 1), 0)"
+#define INBOX_SQL \
+    "SELECT id, datetime(created_at), sender, body FROM (" \
+    "SELECT id, created_at, sender, body FROM messages WHERE receiver=?1 AND id>" INBOX_CURSOR_SQL \
+    " AND id>" TOMBSTONE_SQL("messages.conversation") \
+    " UNION ALL SELECT r.message_id, m.created_at, m.sender, m.body FROM message_recipients r " \
+    "JOIN messages m ON m.id=r.message_id WHERE r.recipient=?1 AND r.message_id>" INBOX_CURSOR_SQL \
+    " AND r.message_id>" TOMBSTONE_SQL("r.conversation") \
+    " ORDER BY 1 LIMIT ?2) ORDER BY id ASC"
+
+// The newest id at the time of the delete: later messages stay visible.
+#define TOMBSTONE_UPSERT_SQL \
+    "INSERT INTO conversation_tombstones (conversation, deleted_upto) " \
+    "VALUES (?1, (SELECT IFNULL(MAX(id), 0) FROM messages)) ON CONFLICT(conversation) " \
+    "DO UPDATE SET deleted_upto=max(deleted_upto, excluded.deleted_upto)"
+
+// Purging a tombstone takes up to ?3 of its direct rows, then up to ?3 of its
+// recipient rows together with each group row whose only remaining receiver
+// was this conversation. Each step names the oldest rows first, so repeated
+// calls walk the conversation forwards.
+#define PURGE_DIRECT_SQL \
+    "DELETE FROM messages WHERE id IN " \
+    "(SELECT id FROM messages WHERE conversation=?1 AND id<=?2 ORDER BY id LIMIT ?3)"
+#define PURGE_RECIPIENT_IDS_SQL \
+    "SELECT message_id FROM message_recipients WHERE conversation=?1 AND message_id<=?2 ORDER BY message_id LIMIT ?3"
+#define PURGE_GROUP_SQL \
+    "DELETE FROM messages WHERE id IN (" PURGE_RECIPIENT_IDS_SQL ") " \
+    "AND NOT EXISTS (SELECT 1 FROM message_recipients o WHERE o.message_id=messages.id AND o.conversation<>?1)"
+#define PURGE_RECIPIENTS_SQL \
+    "DELETE FROM message_recipients WHERE conversation=?1 AND message_id IN (" PURGE_RECIPIENT_IDS_SQL ")"
+
+// Retention removes a prefix of the table: ids are handed out in time order,
+// so the rows past either limit are always the oldest ones, and each sweep
+// looks only at the first ?1 of them.
+#define RETENTION_WINDOW_SQL \
+    "SELECT id FROM (SELECT id, created_at FROM messages ORDER BY id LIMIT ?1) WHERE id<=?2 OR created_at<?3"
+
+typedef struct body_dictionary {
+    struct body_dictionary *older;
+    int64_t id;
+    int64_t trained_upto; // newest message id in the sample
+    size_t len;
+    unsigned char data[];
+} body_dictionary_t;
+
+// Inflates compressed bodies into a buffer reused row after row.
+typedef struct {
+    deflate_codec_t inflater;
+    char *text;
+    size_t capacity;
+} body_decoder_t;
+
+// History reads go through a pool of read-only connections so they run
+// beside the writer (WAL gives each one a snapshot) and beside each other.
+typedef struct {
+    sqlite3 *db;
+    sqlite3_stmt *fetch_stmt;
+    sqlite3_stmt *page_stmt;
+    sqlite3_stmt *since_stmt;
+    sqlite3_stmt *inbox_stmt;
+    body_decoder_t decoder;
+} reader_t;
+
+// One database file: a storage shard, or the whole store.
+struct storage_backend {
+    // The writer connection is used only under storage.c's lock for the shard.
+    sqlite3 *db;
+    // Compiled once in storage_backend_open() and reused (reset + rebound) for every call.
+    sqlite3_stmt *insert_stmt;
+    sqlite3_stmt *recipient_stmt;
+    sqlite3_stmt *delete_stmt;
+    sqlite3_stmt *cursor_stmt;
+    // Background purge, also on the writer connection under that lock.
+    sqlite3_stmt *tombstone_stmt;
+    sqlite3_stmt *purge_direct_stmt;
+    sqlite3_stmt *purge_group_stmt;
+    sqlite3_stmt *purge_recipients_stmt;
+    sqlite3_stmt *tombstone_done_stmt;
+    sqlite3_stmt *retention_probe_stmt;
+    sqlite3_stmt *retention_recipients_stmt;
+    sqlite3_stmt *retention_messages_stmt;
+    bool incremental_vacuum;
+
+    // Newest first; the newest one compresses. Entries are published
+    // complete at the head under dictionary_lock and live until close, so
+    // readers walk the list without a lock. The writer adds the ones it
+    // trains, and any connection adds one another server sharing the file
+    // trained, when a row names it (find_dictionary()).
+    _Atomic(body_dictionary_t *) dictionaries;
+    pthread_mutex_t dictionary_lock;
+
+    // Writer-only: how new bodies are stored, and their compression state.
+    storage_compression_t compression;
+    size_t compress_min_bytes;
+    deflate_codec_t body_deflater;
+    int64_t newest_inserted;
+    int64_t next_training; // newest id at which the writer trains again
+    unsigned char *encoded_body;
+    size_t encoded_capacity;
+
+    reader_t readers[MAX_READERS];
+    reader_t *idle_readers[MAX_READERS];
+    size_t reader_count;
+    size_t idle_count;
+    pthread_mutex_t reader_lock;
+    pthread_cond_t reader_cond;
+};
+
+static void conversation_key(const char *user_a, const char *user_b, char *key, size_t len) {
+    if (strcmp(user_a, user_b) > 0) {
+        const char *tmp = user_a;
+        user_a = user_b;
+        user_b = tmp;
+    }
+    snprintf(key, len, "%s\n%s", user_a, user_b);
+}
+
+static int prepare_statement(sqlite3 *db, const char *sql, sqlite3_stmt **stmt, const char *what) {
+    if (sqlite3_prepare_v3(db, sql, -1, SQLITE_PREPARE_PERSISTENT, stmt, NULL) != SQLITE_OK) {
+        storage_set_error(what, sqlite3_errmsg(db));
+        return -1;
+    }
+    return 0;
+}
+
+static void finish_statement(sqlite3_stmt *stmt) {
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+}
+
+static int exec_simple(storage_backend_t *backend, const char *sql, const char *what) {
+    char *err = NULL;
+    if (sqlite3_exec(backend->db, sql, NULL, NULL, &err) != SQLITE_OK) {
+        storage_set_error(what, err);
+        sqlite3_free(err);
+        return -1;
+    }
+    return 0;
+}
+
+static const body_dictionary_t *listed_dictionary(storage_backend_t *backend, uint64_t id) {
+    for (const body_dictionary_t *dict = atomic_load_explicit(&backend->dictionaries, memory_order_acquire); dict;
+         dict = dict->older) {
+        if ((uint64_t)dict->id == id) {
+            return dict;
+        }
+    }
+    return NULL;
+}
+
+// Caller holds dictionary_lock.
+static int add_dictionary_locked(storage_backend_t *backend, int64_t id, int64_t trained_upto, const void *data,
+                                 size_t len) {
+    body_dictionary_t *dict = malloc(sizeof(body_dictionary_t) + len);
+    if (!dict) {
+        storage_set_error("Failed to load dictionaries: %s", "out of memory");
+        return -1;
+    }
+    dict->older = atomic_load_explicit(&backend->dictionaries, memory_order_relaxed);
+    dict->id = id;
+    dict->trained_upto = trained_upto;
+    dict->len = len;
+    memcpy(dict->data, data, len);
+    atomic_store_explicit(&backend->dictionaries, dict, memory_order_release);
+    return 0;
+}
+
+static int add_dictionary(storage_backend_t *backend, int64_t id, int64_t trained_upto, const void *data, size_t len) {
+    pthread_mutex_lock(&backend->dictionary_lock);
+    int rc = add_dictionary_locked(backend, id, trained_upto, data, len);
+    pthread_mutex_unlock(&backend->dictionary_lock);
+    return rc;
+}
+
+// The dictionary a compressed row names. One this process has not seen was
+// trained by another server writing to the same file after this one opened
+// it; it committed before any row using it, so `db`, the connection the row
+// was read on, finds it too.
+static const body_dictionary_t *find_dictionary(storage_backend_t *backend, sqlite3 *db, uint64_t id) {
+    const body_dictionary_t *dict = listed_dictionary(backend, id);
+    if (dict || id > INT64_MAX) {
+        return dict;
+    }
+    pthread_mutex_lock(&backend->dictionary_lock);
+    sqlite3_stmt *stmt = NULL;
+    if (!(dict = listed_dictionary(backend, id)) && // another reader may have just loaded it
+        sqlite3_prepare_v2(db, "SELECT trained_upto, dict FROM body_dictionaries WHERE id=?", -1, &stmt, NULL) ==
+            SQLITE_OK) {
+        sqlite3_bind_int64(stmt, 1, (int64_t)id);
+        if (sqlite3_step(stmt) == SQLITE_ROW &&
+            add_dictionary_locked(backend, (int64_t)id, sqlite3_column_int64(stmt, 0), sqlite3_column_blob(stmt, 1),
+                                  (size_t)sqlite3_column_bytes(stmt, 1)) == 0) {
+            dict = atomic_load_explicit(&backend->dictionaries, memory_order_relaxed);
+        }
+    }
+    sqlite3_finalize(stmt);
+    pthread_mutex_unlock(&backend->dictionary_lock);
+    return dict;
+}
+
+static int reserve(void **buffer, size_t *capacity, size_t need) {
+    if (*capacity >= need) {
+        return 0;
+    }
+    size_t grown = *capacity ? *capacity : 256;
+    while (grown < need) {
+        grown *= 2;
+    }
+    void *data = realloc(*buffer, grown);
+    if (!data) {
+        return -1;
+    }
+    *buffer = data;
+    *capacity = grown;
+    return 0;
+}
+
+static void decoder_free(body_decoder_t *decoder) {
+    deflate_codec_end(&decoder->inflater);
+    free(decoder->text);
+    decoder->text = NULL;
+    decoder->capacity = 0;
+}
+
+// Returns the plain text of a BLOB body, valid until the next call, or NULL
+// if it cannot be decoded (corrupt, unknown dictionary, or no zlib).
+static const char *decode_body(storage_backend_t *backend, sqlite3 *db, body_decoder_t *decoder,
+                               const unsigned char *blob, size_t len) {
+    const unsigned char *p = blob;
+    const unsigned char *end = blob + len;
+    uint64_t dict_id;
+    uint64_t plain_len;
+    if (len == 0 || *p++ != BODY_CODEC_DEFLATE || binary_get_varint(&p, end, &dict_id) != 1 ||
+        binary_get_varint(&p, end, &plain_len) != 1 || plain_len == 0 || plain_len > MAX_BODY_BYTES) {
+        return NULL;
+    }
+    const body_dictionary_t *dict = NULL;
+    if (dict_id != 0 && !(dict = find_dictionary(backend, db, dict_id))) {
+        return NULL;
+    }
+    if ((!decoder->inflater.ready && deflate_codec_init(&decoder->inflater, true) != 0) ||
+        reserve((void **)&decoder->text, &decoder->capacity, (size_t)plain_len + 1) != 0 ||
+        deflate_codec_inflate(&decoder->inflater, dict ? dict->data : NULL, dict ? dict->len : 0, p,
+                              (size_t)(end - p), decoder->text, (size_t)plain_len) != 0 ||
+        memchr(decoder->text, '\0', (size_t)plain_len)) {
+        return NULL;
+    }
+    decoder->text[plain_len] = '\0';
+    return decoder->text;
+}
+
+// A body column, whichever way it was stored; NULL if undecodable.
+static const char *row_body(storage_backend_t *backend, body_decoder_t *decoder, sqlite3_stmt *stmt, int column) {
+    if (sqlite3_column_type(stmt, column) == SQLITE_BLOB) {
+        const unsigned char *blob = sqlite3_column_blob(stmt, column);
+        return decode_body(backend, sqlite3_db_handle(stmt), decoder, blob, (size_t)sqlite3_column_bytes(stmt, column));
+    }
+    const char *text = (const char *)sqlite3_column_text(stmt, column);
+    return text ? text : "";
+}
+
+// Compresses `body` into encoded_body. Returns the encoded length, or 0 when
+// the body should be stored as plain text: compression is off, the body is
+// short, or deflate would not make it smaller.
+static size_t encode_body(storage_backend_t *backend, const char *body) {
+    size_t len = strlen(body);
+    if (backend->compression == STORAGE_COMPRESS_OFF || len < backend->compress_min_bytes ||
+        reserve((void **)&backend->encoded_body, &backend->encoded_capacity, len) != 0) {
+        return 0;
+    }
+    const body_dictionary_t *dict = NULL;
+    if (backend->compression == STORAGE_COMPRESS_DICTIONARY) {
+        dict = atomic_load_explicit(&backend->dictionaries, memory_order_acquire);
+    }
+    unsigned char header[1 + 2 * BINARY_MAX_VARINT];
+    unsigned char *p = header;
+    *p++ = BODY_CODEC_DEFLATE;
+    p = binary_put_varint(p, dict ? (uint64_t)dict->id : 0);
+    p = binary_put_varint(p, len);
+    size_t header_len = (size_t)(p - header);
+    size_t packed;
+    if (header_len + 1 >= len ||
+        deflate_codec_compress(&backend->body_deflater, dict ? dict->data : NULL, dict ? dict->len : 0, body, len,
+                               backend->encoded_body + header_len, len - header_len - 1, &packed) != 0) {
+        return 0;
+    }
+    memcpy(backend->encoded_body, header, header_len);
+    return header_len + packed;
+}
+
+static int load_dictionaries(storage_backend_t *backend) {
+    sqlite3_stmt *stmt = NULL;
+    if (prepare_statement(backend->db, "SELECT id, trained_upto, dict FROM body_dictionaries ORDER BY id", &stmt,
+                          "Failed to load dictionaries: %s") != 0) {
+        return -1;
+    }
+    int rc;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        const void *data = sqlite3_column_blob(stmt, 2);
+        if (add_dictionary(backend, sqlite3_column_int64(stmt, 0), sqlite3_column_int64(stmt, 1), data,
+                           (size_t)sqlite3_column_bytes(stmt, 2)) != 0) {
+            break;
+        }
+    }
+    sqlite3_finalize(stmt);
+    return (rc == SQLITE_DONE) ? 0 : -1;
+}
+
+// deflate finds matches anywhere in the dictionary, but nearer the end they
+// cost fewer bits, so the newest bodies are packed last. Recent chat repeats
+// itself (greetings, bot output, pasted templates), which a plain sample
+// captures without any frequency analysis.
+static int train_dictionary(storage_backend_t *backend) {
+    int64_t newest = storage_backend_last_id(backend);
+    const body_dictionary_t *current = atomic_load_explicit(&backend->dictionaries, memory_order_acquire);
+    backend->next_training = current ? current->trained_upto + DICTIONARY_RETRAIN_ROWS : DICTIONARY_MIN_ROWS;
+    if (newest < backend->next_training) {
+        return 0;
+    }
+    backend->next_training = newest + DICTIONARY_RETRAIN_ROWS; // also after a failure
+    unsigned char *sample = malloc(DICTIONARY_BYTES);
+    sqlite3_stmt *stmt = NULL;
+    body_decoder_t decoder;
+    memset(&decoder, 0, sizeof(decoder));
+    if (!sample) {
+        storage_set_error("Failed to train dictionary: %s", "out of memory");
+        return -1;
+    }
+    if (prepare_statement(backend->db, "SELECT body FROM messages ORDER BY id DESC LIMIT ?", &stmt,
+                          "Failed to train dictionary: %s") != 0) {
+        free(sample);
+        return -1;
+    }
+    sqlite3_bind_int(stmt, 1, DICTIONARY_SAMPLE_ROWS);
+    size_t start = DICTIONARY_BYTES;
+    while (start > 0 && sqlite3_step(stmt) == SQLITE_ROW) {
+        const char *body = row_body(backend, &decoder, stmt, 0);
+        size_t len = body ? strlen(body) : 0;
+        if (len > 0 && len <= start) {
+            start -= len;
+            memcpy(sample + start, body, len);
+        }
+    }
+    sqlite3_finalize(stmt);
+    decoder_free(&decoder);
+    int rc = 0;
+    if (start < DICTIONARY_BYTES) {
+        rc = prepare_statement(backend->db, "INSERT INTO body_dictionaries (trained_upto, dict) VALUES (?, ?)", &stmt,
+                               "Failed to train dictionary: %s");
+        if (rc == 0) {
+            sqlite3_bind_int64(stmt, 1, newest);
+            sqlite3_bind_blob(stmt, 2, sample + start, (int)(DICTIONARY_BYTES - start), SQLITE_STATIC);
+            if (sqlite3_step(stmt) != SQLITE_DONE) {
+                storage_set_error("Failed to train dictionary: %s", sqlite3_errmsg(backend->db));
+                rc = -1;
+            }
+            sqlite3_finalize(stmt);
+        }
+        if (rc == 0) {
+            rc = add_dictionary(backend, sqlite3_last_insert_rowid(backend->db), newest, sample + start,
+                                DICTIONARY_BYTES - start);
+        }
+    }
+    free(sample);
+    return rc;
+}
+
+// Dictionaries are loaded whatever the setting, since any of them may be
+// needed to read old rows.
+static int setup_compression(storage_backend_t *backend, const storage_options_t *options) {
+    backend->compression = options->compression;
+    backend->compress_min_bytes = options->compress_min_bytes;
+    if (load_dictionaries(backend) != 0) {
+        return -1;
+    }
+    if (backend->compression == STORAGE_COMPRESS_OFF) {
+        return 0;
+    }
+    if (deflate_codec_init(&backend->body_deflater, false) != 0) {
+        storage_set_error("Body compression is unavailable%s", CHAT_USE_ZLIB ? "" : ": built without zlib");
+        return -1;
+    }
+    return backend->compression == STORAGE_COMPRESS_DICTIONARY ? train_dictionary(backend) : 0;
+}
+
+static int64_t query_int(storage_backend_t *backend, const char *sql) {
+    sqlite3_stmt *stmt = NULL;
+    int64_t value = 0;
+    if (sqlite3_prepare_v2(backend->db, sql, -1, &stmt, NULL) == SQLITE_OK && sqlite3_step(stmt) == SQLITE_ROW) {
+        value = sqlite3_column_int64(stmt, 0);
+    }
+    sqlite3_finalize(stmt);
+    return value;
+}
+
+// auto_vacuum only takes effect on a database without tables yet; older
+// files keep their mode and simply never get incremental vacuum slices.
+static int apply_pragmas(storage_backend_t *backend, const storage_options_t *options) {
+    static const char *sync_levels[] = {"OFF", "NORMAL", "FULL"};
+    char sql[160];
+    snprintf(sql, sizeof(sql), "PRAGMA auto_vacuum=INCREMENTAL; PRAGMA journal_mode=%s; PRAGMA synchronous=%s;",
+             options->wal ? "WAL" : "DELETE", sync_levels[options->synchronous]);
+    if (exec_simple(backend, sql, "Failed to configure database: %s") != 0) {
+        return -1;
+    }
+    backend->incremental_vacuum = query_int(backend, "PRAGMA auto_vacuum") == 2;
+    return 0;
+}
+
+static bool has_conversation_column(storage_backend_t *backend) {
+    sqlite3_stmt *stmt = NULL;
+    bool found = false;
+    if (sqlite3_prepare_v2(backend->db, "PRAGMA table_info(messages)", -1, &stmt, NULL) != SQLITE_OK) {
+        return false;
+    }
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        const char *name = (const char *)sqlite3_column_text(stmt, 1);
+        if (name && strcmp(name, "conversation") == 0) {
+            found = true;
+        }
+    }
+    sqlite3_finalize(stmt);
+    return found;
+}
+
+// Databases created before the conversation column get it added and
+// backfilled once, in a single transaction.
+static int migrate_schema(storage_backend_t *backend) {
+    if (has_conversation_column(backend)) {
+        return 0;
+    }
+    return exec_simple(backend, "BEGIN IMMEDIATE;"
+                       "ALTER TABLE messages ADD COLUMN conversation TEXT;"
+                       "UPDATE messages SET conversation = " CONVERSATION_KEY_SQL ";"
+                       "COMMIT;",
+                       "Failed to migrate schema: %s");
+}
+
+// Opened after the writer has created and migrated the schema. Without WAL a
+// reader holds a shared lock that the writer's commit waits out, which the
+// busy timeouts on both sides absorb.
+static int open_readers(storage_backend_t *backend, size_t count) {
+    const char *file = sqlite3_db_filename(backend->db, "main");
+    if (!file || !*file) {
+        storage_set_error("History readers need an on-disk database%s", "");
+        return -1;
+    }
+    if (count < 1) {
+        count = 1;
+    } else if (count > MAX_READERS) {
+        count = MAX_READERS;
+    }
+    for (backend->reader_count = 0; backend->reader_count < count; ++backend->reader_count) {
+        reader_t *reader = &backend->readers[backend->reader_count];
+        int rc = sqlite3_open_v2(file, &reader->db, SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, NULL);
+        if (rc != SQLITE_OK) {
+            storage_set_error("Failed to open history reader: %s", sqlite3_errmsg(reader->db));
+            sqlite3_close(reader->db);
+            reader->db = NULL;
+            return -1;
+        }
+        sqlite3_busy_timeout(reader->db, BUSY_TIMEOUT_MS);
+        if (prepare_statement(reader->db, FETCH_SQL, &reader->fetch_stmt, "Failed to query history: %s") != 0 ||
+            prepare_statement(reader->db, PAGE_SQL, &reader->page_stmt, "Failed to query history: %s") != 0 ||
+            prepare_statement(reader->db, SINCE_SQL, &reader->since_stmt, "Failed to query history: %s") != 0 ||
+            prepare_statement(reader->db, INBOX_SQL, &reader->inbox_stmt, "Failed to query inbox: %s") != 0) {
+            backend->idle_readers[backend->idle_count++] = reader; // so close releases it
+            ++backend->reader_count;
+            return -1;
+        }
+        backend->idle_readers[backend->idle_count++] = reader;
+    }
+    return 0;
+}
+
+static reader_t *acquire_reader(storage_backend_t *backend) {
+    pthread_mutex_lock(&backend->reader_lock);
+    while (backend->idle_count == 0) {
+        pthread_cond_wait(&backend->reader_cond, &backend->reader_lock);
+    }
+    reader_t *reader = backend->idle_readers[--backend->idle_count];
+    pthread_mutex_unlock(&backend->reader_lock);
+    return reader;
+}
+
+static void release_reader(storage_backend_t *backend, reader_t *reader) {
+    pthread_mutex_lock(&backend->reader_lock);
+    backend->idle_readers[backend->idle_count++] = reader;
+    pthread_cond_broadcast(&backend->reader_cond);
+    pthread_mutex_unlock(&backend->reader_lock);
+}
+
+static void close_readers(storage_backend_t *backend) {
+    pthread_mutex_lock(&backend->reader_lock);
+    while (backend->idle_count < backend->reader_count) {
+        pthread_cond_wait(&backend->reader_cond, &backend->reader_lock); // a fetch is still running
+    }
+    for (size_t i = 0; i < backend->reader_count; ++i) {
+        sqlite3_finalize(backend->readers[i].fetch_stmt);
+        sqlite3_finalize(backend->readers[i].page_stmt);
+        sqlite3_finalize(backend->readers[i].since_stmt);
+        sqlite3_finalize(backend->readers[i].inbox_stmt);
+        sqlite3_close(backend->readers[i].db);
+        decoder_free(&backend->readers[i].decoder);
+        memset(&backend->readers[i], 0, sizeof(backend->readers[i]));
+    }
+    backend->reader_count = backend->idle_count = 0;
+    pthread_mutex_unlock(&backend->reader_lock);
+}
+
+static int open_database(storage_backend_t *backend, const char *path, const storage_options_t *options) {
+    if (sqlite3_open(path, &backend->db) != SQLITE_OK) {
+        storage_set_error("Failed to open database: %s", sqlite3_errmsg(backend->db));
+        return -1;
+    }
+    sqlite3_busy_timeout(backend->db, BUSY_TIMEOUT_MS);
+    if (apply_pragmas(backend, options) != 0) {
+        return -1;
+    }
+    const char *sql =
+        "CREATE TABLE IF NOT EXISTS messages ("
+        "id INTEGER PRIMARY KEY AUTOINCREMENT,"
+        "sender TEXT NOT NULL,"
+        "receiver TEXT NOT NULL,"
+        "body TEXT NOT NULL,"
+        "created_at DATETIME DEFAULT CURRENT_TIMESTAMP,"
+        "conversation TEXT" ");";
+    if (exec_simple(backend, sql, "Failed to create schema: %s") != 0 || migrate_schema(backend) != 0 ||
+        exec_simple(backend, "CREATE TABLE IF NOT EXISTS message_recipients ("
+                    "message_id INTEGER NOT NULL,"
+                    "recipient TEXT NOT NULL,"
+                    "conversation TEXT NOT NULL,"
+                    "PRIMARY KEY (message_id, recipient)) WITHOUT ROWID;"
+                    "CREATE TABLE IF NOT EXISTS delivery_cursors ("
+                    "user TEXT PRIMARY KEY,"
+                    "delivered_upto INTEGER NOT NULL) WITHOUT ROWID;"
+                    "INSERT OR IGNORE INTO delivery_cursors VALUES ('', (SELECT IFNULL(MAX(id), 0) FROM messages));"
+                    "CREATE TABLE IF NOT EXISTS conversation_tombstones ("
+                    "conversation TEXT PRIMARY KEY,"
+                    "deleted_upto INTEGER NOT NULL) WITHOUT ROWID;"
+                    "CREATE TABLE IF NOT EXISTS body_dictionaries ("
+                    "id INTEGER PRIMARY KEY,"
+                    "trained_upto INTEGER NOT NULL,"
+                    "dict BLOB NOT NULL);",
+                    "Failed to create schema: %s") != 0 ||
+        exec_simple(backend, "CREATE INDEX IF NOT EXISTS messages_by_conversation ON messages (conversation, id);"
+                    "CREATE INDEX IF NOT EXISTS recipients_by_conversation "
+                    "ON message_recipients (conversation, message_id);"
+                    "CREATE INDEX IF NOT EXISTS messages_by_receiver ON messages (receiver, id);"
+                    "CREATE INDEX IF NOT EXISTS recipients_by_recipient ON message_recipients (recipient, message_id);",
+                    "Failed to create index: %s") != 0 ||
+        setup_compression(backend, options) != 0) {
+        return -1;
+    }
+    if (prepare_statement(backend->db,
+                          "INSERT INTO messages (sender, receiver, body, conversation, created_at) "
+                          "VALUES (?, ?, ?, ?, ?);",
+                          &backend->insert_stmt, "Failed to prepare insert: %s") != 0 ||
+        prepare_statement(backend->db,
+                          "INSERT INTO message_recipients (message_id, recipient, conversation) VALUES (?, ?, ?);",
+                          &backend->recipient_stmt, "Failed to prepare insert: %s") != 0 ||
+        prepare_statement(backend->db, TOMBSTONE_UPSERT_SQL, &backend->delete_stmt,
+                          "Failed to prepare delete: %s") != 0 ||
+        prepare_statement(backend->db, "SELECT conversation, deleted_upto FROM conversation_tombstones LIMIT 1",
+                          &backend->tombstone_stmt, "Failed to prepare purge: %s") != 0 ||
+        prepare_statement(backend->db, PURGE_DIRECT_SQL, &backend->purge_direct_stmt,
+                          "Failed to prepare purge: %s") != 0 ||
+        prepare_statement(backend->db, PURGE_GROUP_SQL, &backend->purge_group_stmt,
+                          "Failed to prepare purge: %s") != 0 ||
+        prepare_statement(backend->db, PURGE_RECIPIENTS_SQL, &backend->purge_recipients_stmt,
+                          "Failed to prepare purge: %s") != 0 ||
+        prepare_statement(backend->db, "DELETE FROM conversation_tombstones WHERE conversation=?1 AND deleted_upto=?2",
+                          &backend->tombstone_done_stmt, "Failed to prepare purge: %s") != 0 ||
+        prepare_statement(backend->db, RETENTION_WINDOW_SQL " LIMIT 1", &backend->retention_probe_stmt,
+                          "Failed to prepare retention: %s") != 0 ||
+        prepare_statement(backend->db, "DELETE FROM message_recipients WHERE message_id IN (" RETENTION_WINDOW_SQL ")",
+                          &backend->retention_recipients_stmt, "Failed to prepare retention: %s") != 0 ||
+        prepare_statement(backend->db, "DELETE FROM messages WHERE id IN (" RETENTION_WINDOW_SQL ")",
+                          &backend->retention_messages_stmt, "Failed to prepare retention: %s") != 0 ||
+        prepare_statement(backend->db,
+                          "INSERT INTO delivery_cursors (user, delivered_upto) VALUES (?, ?) ON CONFLICT(user) "
+                          "DO UPDATE SET delivered_upto=max(delivered_upto, excluded.delivered_upto);",
+                          &backend->cursor_stmt, "Failed to prepare cursor update: %s") != 0) {
+        return -1;
+    }
+    return open_readers(backend, options->read_connections);
+}
+
+storage_backend_t *storage_backend_open(const char *path, const storage_options_t *options) {
+    storage_backend_t *backend = calloc(1, sizeof(*backend));
+    if (!backend) {
+        storage_set_error("Failed to open database: %s", "out of memory");
+        return NULL;
+    }
+    pthread_mutex_init(&backend->reader_lock, NULL);
+    pthread_cond_init(&backend->reader_cond, NULL);
+    pthread_mutex_init(&backend->dictionary_lock, NULL);
+    if (open_database(backend, path, options) != 0) {
+        storage_backend_close(backend);
+        return NULL;
+    }
+    return backend;
+}
+
+void storage_backend_close(storage_backend_t *backend) {
+    close_readers(backend);
+    sqlite3_finalize(backend->insert_stmt);
+    sqlite3_finalize(backend->recipient_stmt);
+    sqlite3_finalize(backend->delete_stmt);
+    sqlite3_finalize(backend->cursor_stmt);
+    sqlite3_stmt *purge_steps[] = {backend->tombstone_stmt,        backend->purge_direct_stmt,
+                                   backend->purge_group_stmt,      backend->purge_recipients_stmt,
+                                   backend->tombstone_done_stmt,   backend->retention_probe_stmt,
+                                   backend->retention_recipients_stmt, backend->retention_messages_stmt};
+    for (size_t i = 0; i < sizeof(purge_steps) / sizeof(purge_steps[0]); ++i) {
+        sqlite3_finalize(purge_steps[i]);
+    }
+    deflate_codec_end(&backend->body_deflater);
+    free(backend->encoded_body);
+    body_dictionary_t *dict = atomic_load(&backend->dictionaries);
+    while (dict) {
+        body_dictionary_t *older = dict->older;
+        free(dict);
+        dict = older;
+    }
+    sqlite3_close(backend->db);
+    pthread_mutex_destroy(&backend->reader_lock);
+    pthread_cond_destroy(&backend->reader_cond);
+    pthread_mutex_destroy(&backend->dictionary_lock);
+    free(backend);
+}
+
+int storage_backend_begin(storage_backend_t *backend) {
+    return exec_simple(backend, "BEGIN IMMEDIATE", "Failed to begin transaction: %s");
+}
+
+// A dictionary that has fallen due is trained after the commit, outside the
+// transaction, so a failure costs only compression ratio until the next try.
+int storage_backend_commit(storage_backend_t *backend) {
+    if (exec_simple(backend, "COMMIT", "Failed to commit messages: %s") != 0) {
+        return -1;
+    }
+    if (backend->compression == STORAGE_COMPRESS_DICTIONARY && backend->newest_inserted >= backend->next_training &&
+        train_dictionary(backend) != 0) {
+        fprintf(stderr, "%s\n", storage_last_error());
+    }
+    return 0;
+}
+
+void storage_backend_rollback(storage_backend_t *backend) {
+    sqlite3_exec(backend->db, "ROLLBACK", NULL, NULL, NULL);
+}
+
+// Stamped here rather than by CURRENT_TIMESTAMP so the caller learns the
+// exact value datetime(created_at) will return (UTC).
+static void stamp_now(char *timestamp, size_t timestamp_len) {
+    time_t now = time(NULL);
+    struct tm tm_now;
+#ifdef _WIN32
+    gmtime_s(&tm_now, &now);
+#else
+    gmtime_r(&now, &tm_now);
+#endif
+    strftime(timestamp, timestamp_len, "%Y-%m-%d %H:%M:%S", &tm_now);
+}
+
+// `key` NULL stores a group message row, found only through its recipients.
+static int insert_row(storage_backend_t *backend, const char *sender, const char *receiver, const char *body,
+                      const char *key, const char *timestamp, int64_t *id) {
+    sqlite3_stmt *stmt = backend->insert_stmt;
+    sqlite3_bind_text(stmt, 1, sender, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 2, receiver, -1, SQLITE_STATIC);
+    size_t encoded = encode_body(backend, body);
+    if (encoded > 0) {
+        sqlite3_bind_blob(stmt, 3, backend->encoded_body, (int)encoded, SQLITE_STATIC);
+    } else {
+        sqlite3_bind_text(stmt, 3, body, -1, SQLITE_STATIC);
+    }
+    if (key) {
+        sqlite3_bind_text(stmt, 4, key, -1, SQLITE_STATIC);
+    } else {
+        sqlite3_bind_null(stmt, 4);
+    }
+    sqlite3_bind_text(stmt, 5, timestamp, -1, SQLITE_STATIC);
+    int rc = sqlite3_step(stmt);
+    finish_statement(stmt);
+    if (rc != SQLITE_DONE) {
+        storage_set_error("Failed to store message: %s", sqlite3_errmsg(backend->db));
+        return -1;
+    }
+    *id = sqlite3_last_insert_rowid(backend->db);
+    backend->newest_inserted = *id;
+    return 0;
+}
+
+int storage_backend_insert(storage_backend_t *backend, const char *sender, const char *receiver, const char *body,
+                           int64_t *id, char *timestamp, size_t timestamp_len) {
+    char key[MAX_CONVERSATION_KEY];
+    conversation_key(sender, receiver, key, sizeof(key));
+    stamp_now(timestamp, timestamp_len);
+    return insert_row(backend, sender, receiver, body, key, timestamp, id);
+}
+
+int storage_backend_insert_group(storage_backend_t *backend, const char *sender, const char *const *receivers,
+                                 size_t count, const char *body, int64_t *id, char *timestamp, size_t timestamp_len) {
+    stamp_now(timestamp, timestamp_len);
+    if (insert_row(backend, sender, "", body, NULL, timestamp, id) != 0) {
+        return -1;
+    }
+    sqlite3_stmt *stmt = backend->recipient_stmt;
+    for (size_t i = 0; i < count; ++i) {
+        char key[MAX_CONVERSATION_KEY];
+        conversation_key(sender, receivers[i], key, sizeof(key));
+        sqlite3_bind_int64(stmt, 1, *id);
+        sqlite3_bind_text(stmt, 2, receivers[i], -1, SQLITE_STATIC);
+        sqlite3_bind_text(stmt, 3, key, -1, SQLITE_STATIC);
+        int rc = sqlite3_step(stmt);
+        finish_statement(stmt);
+        if (rc != SQLITE_DONE) {
+            storage_set_error("Failed to store message: %s", sqlite3_errmsg(backend->db));
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Steps a bound reader statement, handing each row to `cb`, and returns the
+// reader to the pool.
+static int stream_rows(storage_backend_t *backend, reader_t *reader, sqlite3_stmt *stmt, history_callback cb,
+                       void *ctx) {
+    int rc;
+    const char *body = "";
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        int64_t id = sqlite3_column_int64(stmt, 0);
+        const char *timestamp = (const char *)sqlite3_column_text(stmt, 1);
+        const char *sender = (const char *)sqlite3_column_text(stmt, 2);
+        if (!(body = row_body(backend, &reader->decoder, stmt, 3))) {
+            break;
+        }
+        cb(id, timestamp ? timestamp : "", sender ? sender : "", body, ctx);
+    }
+    finish_statement(stmt);
+    if (!body) {
+        storage_set_error("Failed to query history: %s", "cannot decode a compressed message body");
+    } else if (rc != SQLITE_DONE) {
+        storage_set_error("Failed to query history: %s", sqlite3_errmsg(reader->db));
+    }
+    release_reader(backend, reader);
+    return (body && rc == SQLITE_DONE) ? 0 : -1;
+}
+
+int storage_backend_fetch(storage_backend_t *backend, const char *user_a, const char *user_b, int64_t before_id,
+                          int limit, history_callback cb, void *ctx) {
+    char key[MAX_CONVERSATION_KEY];
+    conversation_key(user_a, user_b, key, sizeof(key));
+    reader_t *reader = acquire_reader(backend);
+    sqlite3_stmt *stmt = (limit > 0) ? reader->page_stmt : reader->fetch_stmt;
+    sqlite3_bind_text(stmt, 1, key, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 2, before_id > 0 ? before_id : INT64_MAX);
+    if (limit > 0) {
+        sqlite3_bind_int(stmt, 3, limit);
+    }
+    return stream_rows(backend, reader, stmt, cb, ctx);
+}
+
+int storage_backend_fetch_since(storage_backend_t *backend, const char *user_a, const char *user_b, int64_t after_id,
+                                int limit, history_callback cb, void *ctx) {
+    char key[MAX_CONVERSATION_KEY];
+    conversation_key(user_a, user_b, key, sizeof(key));
+    reader_t *reader = acquire_reader(backend);
+    sqlite3_stmt *stmt = reader->since_stmt;
+    sqlite3_bind_text(stmt, 1, key, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 2, after_id);
+    sqlite3_bind_int(stmt, 3, limit > 0 ? limit : -1);
+    return stream_rows(backend, reader, stmt, cb, ctx);
+}
+
+int storage_backend_fetch_inbox(storage_backend_t *backend, const char *user, int limit, history_callback cb,
+                                void *ctx) {
+    reader_t *reader = acquire_reader(backend);
+    sqlite3_stmt *stmt = reader->inbox_stmt;
+    sqlite3_bind_text(stmt, 1, user, -1, SQLITE_STATIC);
+    sqlite3_bind_int(stmt, 2, limit > 0 ? limit : -1);
+    return stream_rows(backend, reader, stmt, cb, ctx);
+}
+
+int storage_backend_set_cursor(storage_backend_t *backend, const char *user, int64_t id) {
+    sqlite3_stmt *stmt = backend->cursor_stmt;
+    sqlite3_bind_text(stmt, 1, user, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 2, id);
+    int rc = sqlite3_step(stmt);
+    finish_statement(stmt);
+    if (rc != SQLITE_DONE) {
+        storage_set_error("Failed to update delivery cursor: %s", sqlite3_errmsg(backend->db));
+        return -1;
+    }
+    return 0;
+}
+
+int64_t storage_backend_last_id(storage_backend_t *backend) {
+    return query_int(backend, "SELECT IFNULL(MAX(id), 0) FROM messages");
+}
+
+int storage_backend_caught_up(storage_backend_t *backend, int64_t id, void (*cb)(const char *user, void *ctx),
+                              void *ctx) {
+    sqlite3_stmt *stmt = NULL;
+    if (sqlite3_prepare_v2(backend->db, "SELECT user FROM delivery_cursors WHERE delivered_upto >= ?1 AND user <> ''",
+                           -1, &stmt, NULL) != SQLITE_OK) {
+        storage_set_error("Failed to read delivery cursors: %s", sqlite3_errmsg(backend->db));
+        return -1;
+    }
+    sqlite3_bind_int64(stmt, 1, id);
+    int rc;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        cb((const char *)sqlite3_column_text(stmt, 0), ctx);
+    }
+    sqlite3_finalize(stmt);
+    if (rc != SQLITE_DONE) {
+        storage_set_error("Failed to read delivery cursors: %s", sqlite3_errmsg(backend->db));
+        return -1;
+    }
+    return 0;
+}
+
+// One row, however long the conversation: the rows themselves go later.
+int storage_backend_delete(storage_backend_t *backend, const char *user_a, const char *user_b) {
+    char key[MAX_CONVERSATION_KEY];
+    conversation_key(user_a, user_b, key, sizeof(key));
+    sqlite3_bind_text(backend->delete_stmt, 1, key, -1, SQLITE_STATIC);
+    int rc = sqlite3_step(backend->delete_stmt);
+    finish_statement(backend->delete_stmt);
+    if (rc != SQLITE_DONE) {
+        storage_set_error("Failed to delete history: %s", sqlite3_errmsg(backend->db));
+        return -1;
+    }
+    return 0;
+}
+
+// Runs a bound DELETE and returns the rows it removed, or -1.
+static int run_delete(storage_backend_t *backend, sqlite3_stmt *stmt) {
+    int rc = sqlite3_step(stmt);
+    finish_statement(stmt);
+    return rc == SQLITE_DONE ? sqlite3_changes(backend->db) : -1;
+}
+
+static int purge_tombstone(storage_backend_t *backend, int batch) {
+    sqlite3_stmt *stmt = backend->tombstone_stmt;
+    if (sqlite3_step(stmt) != SQLITE_ROW) {
+        finish_statement(stmt);
+        return 0;
+    }
+    char key[MAX_CONVERSATION_KEY];
+    snprintf(key, sizeof(key), "%s", (const char *)sqlite3_column_text(stmt, 0));
+    int64_t upto = sqlite3_column_int64(stmt, 1);
+    finish_statement(stmt);
+    if (storage_backend_begin(backend) != 0) {
+        return -1;
+    }
+    int removed[3];
+    sqlite3_stmt *steps[] = {backend->purge_direct_stmt, backend->purge_group_stmt, backend->purge_recipients_stmt};
+    for (size_t i = 0; i < 3; ++i) {
+        sqlite3_bind_text(steps[i], 1, key, -1, SQLITE_STATIC);
+        sqlite3_bind_int64(steps[i], 2, upto);
+        sqlite3_bind_int(steps[i], 3, batch);
+        if ((removed[i] = run_delete(backend, steps[i])) < 0) {
+            storage_backend_rollback(backend);
+            return -1;
+        }
+    }
+    // Short on both sides: nothing at or below `upto` is left. A newer delete
+    // raised `upto`, and keeps the tombstone, if the row no longer matches.
+    if (removed[0] < batch && removed[2] < batch) {
+        sqlite3_bind_text(backend->tombstone_done_stmt, 1, key, -1, SQLITE_STATIC);
+        sqlite3_bind_int64(backend->tombstone_done_stmt, 2, upto);
+        if (run_delete(backend, backend->tombstone_done_stmt) < 0) {
+            storage_backend_rollback(backend);
+            return -1;
+        }
+    }
+    if (storage_backend_commit(backend) != 0) {
+        storage_backend_rollback(backend);
+        return -1;
+    }
+    return removed[0] + removed[1] + removed[2] + 1;
+}
+
+static void bind_retention(sqlite3_stmt *stmt, int batch, int64_t upto_id, const char *cutoff) {
+    sqlite3_bind_int(stmt, 1, batch);
+    sqlite3_bind_int64(stmt, 2, upto_id);
+    sqlite3_bind_text(stmt, 3, cutoff, -1, SQLITE_STATIC);
+}
+
+static int sweep_retention(storage_backend_t *backend, int batch, int64_t upto_id, uint64_t max_age_seconds,
+                           int64_t *floor) {
+    char cutoff[32] = ""; // no created_at sorts below ""
+    if (max_age_seconds > 0) {
+        time_t then = time(NULL) - (time_t)max_age_seconds;
+        struct tm tm_then;
+#ifdef _WIN32
+        gmtime_s(&tm_then, &then);
+#else
+        gmtime_r(&then, &tm_then);
+#endif
+        strftime(cutoff, sizeof(cutoff), "%Y-%m-%d %H:%M:%S", &tm_then);
+    } else if (upto_id <= 0) {
+        return 0;
+    }
+    // Probe first, so an idle sweep costs a short read and no write lock.
+    bind_retention(backend->retention_probe_stmt, batch, upto_id, cutoff);
+    int rc = sqlite3_step(backend->retention_probe_stmt);
+    finish_statement(backend->retention_probe_stmt);
+    if (rc != SQLITE_ROW) {
+        return rc == SQLITE_DONE ? 0 : -1;
+    }
+    if (storage_backend_begin(backend) != 0) {
+        return -1;
+    }
+    bind_retention(backend->retention_recipients_stmt, batch, upto_id, cutoff);
+    int recipients = run_delete(backend, backend->retention_recipients_stmt);
+    bind_retention(backend->retention_messages_stmt, batch, upto_id, cutoff);
+    int messages = recipients < 0 ? -1 : run_delete(backend, backend->retention_messages_stmt);
+    if (messages < 0 || storage_backend_commit(backend) != 0) {
+        storage_backend_rollback(backend);
+        return -1;
+    }
+    // Everything below the oldest surviving id is gone, by whatever means.
+    *floor = query_int(backend, "SELECT IFNULL(MIN(id) - 1, 9223372036854775807) FROM messages");
+    return messages + 1;
+}
+
+// Frees at most a slice of pages per call, and only once a good number have
+// piled up, so inserts can reuse the rest without growing the file again.
+#define VACUUM_SLICE_PAGES 256
+#define VACUUM_FREE_PAGES 1024
+
+static int vacuum_slice(storage_backend_t *backend) {
+    if (!backend->incremental_vacuum || query_int(backend, "PRAGMA freelist_count") < VACUUM_FREE_PAGES) {
+        return 0;
+    }
+    char sql[64];
+    snprintf(sql, sizeof(sql), "PRAGMA incremental_vacuum(%d)", VACUUM_SLICE_PAGES);
+    return exec_simple(backend, sql, "Failed to vacuum: %s") == 0 ? VACUUM_SLICE_PAGES : -1;
+}
+
+int storage_backend_purge(storage_backend_t *backend, int64_t upto_id, uint64_t max_age_seconds, size_t batch,
+                          int64_t *floor) {
+    int limit = batch > 0 && batch < INT32_MAX ? (int)batch : 1;
+    int done = purge_tombstone(backend, limit);
+    if (done == 0) {
+        done = sweep_retention(backend, limit, upto_id, max_age_seconds, floor);
+    }
+    if (done == 0) {
+        done = vacuum_slice(backend);
+    }
+    return done;
+}
+
+#endif
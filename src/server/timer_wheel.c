@@ -0,0 +1,103 @@
+#include "timer_wheel.h"
+
+#include <stddef.h>
+
+#define SLOT_MASK ((uint64_t)TIMER_WHEEL_SLOTS - 1u)
+
+static void list_init(timer_node_t *head) {
+    head->prev = head;
+    head->next = head;
+}
+
+static void list_append(timer_node_t *head, timer_node_t *node) {
+    node->prev = head->prev;
+    node->next = head;
+    head->prev->next = node;
+    head->prev = node;
+}
+
+void timer_wheel_init(timer_wheel_t *wheel, uint64_t now) {
+    for (unsigned level = 0; level < TIMER_WHEEL_LEVELS; ++level) {
+        for (unsigned slot = 0; slot < TIMER_WHEEL_SLOTS; ++slot) {
+            list_init(&wheel->slots[level][slot]);
+        }
+    }
+    wheel->now = now;
+}
+
+// A node goes to the finest level whose slot for `expires` lies less than a
+// full turn ahead of the current one: comparing slot numbers rather than the
+// raw distance keeps it out of the slot that level is currently passing.
+static void file_node(timer_wheel_t *wheel, timer_node_t *node) {
+    for (unsigned level = 0; level < TIMER_WHEEL_LEVELS; ++level) {
+        unsigned shift = level * TIMER_WHEEL_BITS;
+        if ((node->expires >> shift) - (wheel->now >> shift) < TIMER_WHEEL_SLOTS) {
+            list_append(&wheel->slots[level][(node->expires >> shift) & SLOT_MASK], node);
+            return;
+        }
+    }
+    unsigned shift = (TIMER_WHEEL_LEVELS - 1) * TIMER_WHEEL_BITS;
+    list_append(&wheel->slots[TIMER_WHEEL_LEVELS - 1][((wheel->now >> shift) - 1) & SLOT_MASK], node);
+}
+
+void timer_wheel_schedule(timer_wheel_t *wheel, timer_node_t *node, uint64_t expires) {
+    timer_wheel_cancel(node);
+    node->expires = expires > wheel->now ? expires : wheel->now + 1;
+    file_node(wheel, node);
+}
+
+void timer_wheel_cancel(timer_node_t *node) {
+    if (!timer_wheel_pending(node)) {
+        return;
+    }
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    node->prev = NULL;
+    node->next = NULL;
+}
+
+bool timer_wheel_pending(const timer_node_t *node) {
+    return node->next != NULL;
+}
+
+// Moves a slot's nodes out onto `into`, leaving the slot empty.
+static void take_slot(timer_node_t *slot, timer_node_t *into) {
+    list_init(into);
+    if (slot->next != slot) {
+        into->next = slot->next;
+        into->prev = slot->prev;
+        into->next->prev = into;
+        into->prev->next = into;
+        list_init(slot);
+    }
+}
+
+static void cascade(timer_wheel_t *wheel, unsigned level) {
+    timer_node_t pending;
+    unsigned shift = level * TIMER_WHEEL_BITS;
+    take_slot(&wheel->slots[level][(wheel->now >> shift) & SLOT_MASK], &pending);
+    while (pending.next != &pending) {
+        timer_node_t *node = pending.next;
+        timer_wheel_cancel(node);
+        file_node(wheel, node);
+    }
+}
+
+void timer_wheel_advance(timer_wheel_t *wheel, uint64_t now, timer_expire_fn expire, void *ctx) {
+    while (wheel->now < now) {
+        uint64_t tick = ++wheel->now;
+        // Coarsest first, so nodes moving down two levels land in time.
+        for (unsigned level = TIMER_WHEEL_LEVELS - 1; level > 0; --level) {
+            if ((tick & ((1ull << (level * TIMER_WHEEL_BITS)) - 1u)) == 0) {
+                cascade(wheel, level);
+            }
+        }
+        timer_node_t due;
+        take_slot(&wheel->slots[0][tick & SLOT_MASK], &due);
+        while (due.next != &due) {
+            timer_node_t *node = due.next;
+            timer_wheel_cancel(node);
+            expire(node, tick, ctx);
+        }
+    }
+}
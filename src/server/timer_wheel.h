@@ -0,0 +1,41 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Hierarchical timing wheel over an abstract tick counter: three levels of 64
+// slots, so scheduling and cancelling are O(1) and each tick touches one slot
+// (plus, every 64 ticks, one slot of a coarser level moved down). Deadlines
+// more than 64^3 ticks out are parked in the farthest slot and re-filed as
+// they come closer. Not thread-safe; the owner serializes every call.
+#define TIMER_WHEEL_BITS 6u
+#define TIMER_WHEEL_SLOTS (1u << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 3u
+
+// Embedded in the object being timed. Zero-initialized means not scheduled.
+typedef struct timer_node {
+    struct timer_node *prev;
+    struct timer_node *next;
+    uint64_t expires;
+} timer_node_t;
+
+typedef struct {
+    timer_node_t slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS]; // list heads
+    uint64_t now;
+} timer_wheel_t;
+
+// Called for each node whose deadline has passed, after it was unlinked; it
+// may schedule the node again.
+typedef void (*timer_expire_fn)(timer_node_t *node, uint64_t now, void *ctx);
+
+void timer_wheel_init(timer_wheel_t *wheel, uint64_t now);
+// A deadline at or before the current tick fires on the next advance.
+void timer_wheel_schedule(timer_wheel_t *wheel, timer_node_t *node, uint64_t expires);
+// No-op for a node that is not scheduled.
+void timer_wheel_cancel(timer_node_t *node);
+bool timer_wheel_pending(const timer_node_t *node);
+// Runs every tick up to and including `now`.
+void timer_wheel_advance(timer_wheel_t *wheel, uint64_t now, timer_expire_fn expire, void *ctx);
+
+#endif /* TIMER_WHEEL_H */
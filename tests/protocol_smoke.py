@@ -8,17 +8,29 @@ The script expects compiled binaries in ./bin via `make` and will:
 1. Launch the server on an ephemeral port.
 2. Connect two simulated clients (alice, bob).
 3. Exchange a message and validate delivery + history + deletion + user list.
+   Resume a session with the token handed out at AUTH.
+4. Repeat a send and history fetch over the binary framing.
+
+The scenario runs once per server I/O mode (thread-per-connection and event loop),
+and once more on node 0 of a two-node cluster, with cross-node checks.
+Rate limits and load shedding are then checked against servers started with low
+limits.
 """
 from __future__ import annotations
 
 import contextlib
+import hashlib
+import hmac
 import os
+import shutil
 import signal
 import socket
+import sqlite3
 import subprocess
 import sys
 import tempfile
 import time
+import zlib
 from pathlib import Path
 
 PORT = 6200
@@ -26,6 +38,14 @@ TIMEOUT = 3
 ROOT = Path(__file__).resolve().parents[1]
 BIN = ROOT / "bin"
 SERVER_BIN = BIN / "server"
+IO_MODES = (
+    ["--io=threads"],
+    ["--io=events", "--io-threads=2", "--compress=dictionary"],
+    ["--io=events", "--io-threads=2", "--accept=reuseport"],
+    ["--io=events", "--io-threads=2", "--storage-shards=4"],
+    ["--io=events", "--io-threads=2", "--cluster=127.0.0.1:7300,127.0.0.1:7301", "--cluster-node=0",
+     "--cluster-secret=smoke-secret"],
+)
 
 
 def recv_line(sock: socket.socket) -> str:
@@ -50,26 +70,102 @@ def send_line(sock: socket.socket, text: str) -> None:
     sock.sendall((text + "\n").encode())
 
 
-def connect_user(username: str) -> socket.socket:
-    sock = socket.create_connection(("127.0.0.1", PORT), timeout=TIMEOUT)
+def login(username: str, token: str = "", port: int = PORT) -> tuple[socket.socket, str]:
+    sock = socket.create_connection(("127.0.0.1", port), timeout=TIMEOUT)
     recv_line(sock)  # welcome banner
-    send_line(sock, f"AUTH {username}")
+    send_line(sock, f"AUTH {username} {token}".rstrip())
     response = recv_line(sock)
     if not response.startswith("OK"):
         raise RuntimeError(f"Auth failed for {username}: {response}")
     sock.settimeout(TIMEOUT)
+    return sock, response
+
+
+def connect_user(username: str, port: int = PORT) -> socket.socket:
+    return login(username, port=port)[0]
+
+
+def varint(value: int) -> bytes:
+    out = bytearray()
+    while value >= 0x80:
+        out.append((value & 0x7F) | 0x80)
+        value >>= 7
+    out.append(value)
+    return bytes(out)
+
+
+def text_field(value: str) -> bytes:
+    data = value.encode()
+    return varint(len(data)) + data
+
+
+def recv_exact(sock: socket.socket, count: int) -> bytes:
+    data = bytearray()
+    while len(data) < count:
+        chunk = sock.recv(count - len(data))
+        if not chunk:
+            raise RuntimeError("Connection closed unexpectedly")
+        data.extend(chunk)
+    return bytes(data)
+
+
+def read_varint(data: bytes, pos: int) -> tuple[int, int]:
+    value = shift = 0
+    while True:
+        byte = data[pos]
+        pos += 1
+        value |= (byte & 0x7F) << shift
+        shift += 7
+        if not byte & 0x80:
+            return value, pos
+
+
+def recv_frame(sock: socket.socket) -> tuple[int, bytes]:
+    opcode = recv_exact(sock, 1)[0]
+    header = bytearray()
+    while not header or header[-1] & 0x80:
+        header.extend(recv_exact(sock, 1))
+    length, _ = read_varint(bytes(header), 0)
+    return opcode, recv_exact(sock, length)
+
+
+def connect_binary(username: str) -> socket.socket:
+    sock = socket.create_connection(("127.0.0.1", PORT), timeout=TIMEOUT)
+    recv_line(sock)  # welcome banner
+    send_line(sock, "BINARY")
+    assert recv_line(sock) == "OK Binary protocol"
+    sock.sendall(bytes([0x01]) + varint(len(text_field(username))) + text_field(username))
+    opcode, _ = recv_frame(sock)
+    if opcode != 0x41:
+        raise RuntimeError(f"Binary auth failed for {username}")
     return sock
 
 
-def main() -> int:
-    if not SERVER_BIN.exists():
-        print("Build the project first: make", file=sys.stderr)
-        return 1
+def send_frame(sock: socket.socket, opcode: int, body: bytes) -> None:
+    sock.sendall(bytes([opcode]) + varint(len(body)) + body)
+
 
+def temp_db(server_args: list[str]) -> str:
+    if any(arg.startswith("--storage-shards=") for arg in server_args):
+        return tempfile.mkdtemp(prefix="chat-smoke-")
     db_fd, db_path = tempfile.mkstemp(prefix="chat-smoke-", suffix=".db")
     os.close(db_fd)
+    return db_path
+
+
+def remove_db(db_path: str) -> None:
+    if os.path.isdir(db_path):
+        shutil.rmtree(db_path)
+    elif os.path.exists(db_path):
+        os.remove(db_path)
+    for suffix in (".snapshot", "-wal", "-shm"):
+        with contextlib.suppress(FileNotFoundError):
+            os.remove(db_path + suffix)
+
+
+def start_server(port: int, db_path: str, server_args: list[str]) -> subprocess.Popen | None:
     server = subprocess.Popen(
-        [str(SERVER_BIN), str(PORT), db_path],
+        [str(SERVER_BIN), str(port), db_path, *server_args],
         stdout=subprocess.PIPE,
         stderr=subprocess.PIPE,
         text=True,
@@ -78,18 +174,159 @@ def main() -> int:
     if server.poll() is not None:
         stderr = server.stderr.read()
         print(f"Server failed to start: {stderr}", file=sys.stderr)
-        return 1
+        return None
     deadline = time.time() + 5
     while time.time() < deadline:
         with contextlib.suppress(OSError):
-            probe = socket.create_connection(("127.0.0.1", PORT), timeout=0.2)
+            probe = socket.create_connection(("127.0.0.1", port), timeout=0.2)
             probe.close()
-            break
+            return server
+        time.sleep(0.1)
+    print("Timed out waiting for server port", file=sys.stderr)
+    stop_server(server)
+    return None
+
+
+def stop_server(server: subprocess.Popen) -> None:
+    server.send_signal(signal.SIGINT)
+    try:
+        server.wait(timeout=2)
+    except subprocess.TimeoutExpired:
+        server.kill()
+        server.wait()
+
+
+def peer_args(server_args: list[str]) -> list[str] | None:
+    """The same arguments for node 1, or None outside cluster mode."""
+    if not any(arg.startswith("--cluster=") for arg in server_args):
+        return None
+    return ["--cluster-node=1" if arg.startswith("--cluster-node=") else arg for arg in server_args]
+
+
+def hello_frame(nonce: bytes, secret: str) -> bytes:
+    fields = (3, 2, 1)  # protocol version, member count, node index
+    data = nonce + b"".join(value.to_bytes(8, "big") for value in fields)
+    mac = hmac.new(secret.encode(), data, hashlib.sha256).digest()
+    body = b"".join(varint(value) for value in fields) + varint(len(mac)) + mac
+    return bytes([0x01]) + varint(len(body)) + body
+
+
+def wait_listed(username: str, port: int, online: bool = True) -> None:
+    """Waits until USERS on `port` shows a user who logged in or out elsewhere."""
+    sock = connect_user("watcher", port)
+    try:
+        deadline = time.time() + 5
+        while time.time() < deadline:
+            send_line(sock, "USERS")
+            users = []
+            while (entry := recv_line(sock)) != "USERS_END":
+                users.append(entry)
+            if (f"USER {username}" in users) == online:
+                return
+            time.sleep(0.1)
+        raise TimeoutError(f"{username} never {'appeared' if online else 'left'} on port {port}")
+    finally:
+        sock.close()
+
+
+def wait_linked(port: int) -> None:
+    """Waits until logins on `port` stop failing for want of a cluster link."""
+    deadline = time.time() + 5
+    while time.time() < deadline:
+        # several names, so some are homed on the other node and need both link directions
+        replies = []
+        for name in ("probe-a", "probe-b", "probe-c", "probe-d", "probe-e", "probe-f"):
+            sock = socket.create_connection(("127.0.0.1", port), timeout=TIMEOUT)
+            recv_line(sock)
+            send_line(sock, f"AUTH {name}")
+            replies.append(recv_line(sock))
+            sock.close()
+        if all(reply.startswith("OK") for reply in replies):
+            return
         time.sleep(0.1)
-    else:
-        print("Timed out waiting for server port", file=sys.stderr)
-        server.terminate()
+    raise TimeoutError(f"cluster links never came up for port {port}")
+
+
+def run_cluster_checks(alice: socket.socket) -> None:
+    """alice is on node 0; node 1 listens on PORT + 1 and cluster port 7301."""
+    erin = connect_user("erin", PORT + 1)
+    wait_listed("erin", PORT)
+    send_line(alice, "SEND erin across")
+    assert recv_line(alice) == "OK Message queued"
+    assert recv_line(erin) == "MESSAGE alice across"
+    send_line(erin, "SEND alice back")
+    assert recv_line(erin) == "OK Message queued"
+    assert recv_line(alice) == "MESSAGE erin back"
+    send_line(erin, "GET alice")
+    rows = []
+    while (line := recv_line(erin)) != "OK History end":
+        rows.append(line.rsplit(" ", 1)[1])
+    assert rows == ["across", "back"], rows
+
+    # a name is online once in the whole cluster, whichever node is asked
+    twin = socket.create_connection(("127.0.0.1", PORT), timeout=TIMEOUT)
+    recv_line(twin)
+    send_line(twin, "AUTH erin")
+    assert recv_line(twin) == "ERROR Username taken"
+    twin.close()
+
+    # a link whose HELLO is keyed by another secret is closed after the challenge
+    link = socket.create_connection(("127.0.0.1", 7301), timeout=TIMEOUT)
+    opcode, body = recv_frame(link)
+    length, start = read_varint(body, 0)
+    assert opcode == 0x07 and length == 16, (opcode, body)
+    link.sendall(hello_frame(body[start:start + length], "wrong-secret"))
+    with contextlib.suppress(ConnectionResetError):
+        assert link.recv(1) == b""
+    link.close()
+
+    # node 1 owns erin and gus's conversation: its push to node 0 counts as
+    # delivered once written there, so gus's inbox stays empty
+    gus = connect_user("gus")
+    wait_listed("gus", PORT + 1)
+    send_line(erin, "SEND gus pushed")
+    assert recv_line(erin) == "OK Message queued"
+    assert recv_line(gus) == "MESSAGE erin pushed"
+    gus.close()
+    wait_listed("gus", PORT + 1, online=False)
+    gus = connect_user("gus")
+    send_line(gus, "INBOX")
+    assert recv_line(gus) == "OK Inbox end"
+    gus.close()
+
+    # stored messages for an offline user reach them on their next login only once
+    erin.close()
+    wait_listed("erin", PORT, online=False)
+    send_line(alice, "SEND erin offline")
+    assert recv_line(alice) == "OK Message queued"
+    erin = connect_user("erin", PORT + 1)
+    assert recv_line(erin).endswith(" alice offline")
+    assert recv_line(erin) == "OK Inbox end"
+    erin.close()
+    wait_listed("erin", PORT, online=False)
+    erin = connect_user("erin", PORT + 1)
+    send_line(erin, "INBOX")
+    assert recv_line(erin) == "OK Inbox end"
+    erin.close()
+
+
+def run_scenario(server_args: list[str]) -> int:
+    db_path = temp_db(server_args)
+    server = start_server(PORT, db_path, server_args)
+    if server is None:
+        remove_db(db_path)
         return 1
+    second = peer_args(server_args)
+    peer_db = peer = None
+    if second is not None:
+        peer_db = temp_db(second)
+        peer = start_server(PORT + 1, peer_db, second)
+        if peer is None:
+            stop_server(server)
+            remove_db(db_path)
+            remove_db(peer_db)
+            return 1
+        wait_linked(PORT)
     alice = None
     bob = None
     try:
@@ -112,8 +349,31 @@ def main() -> int:
             if line == "OK History end" or line.startswith("INFO "):
                 break
 
+        # page backwards through the conversation two messages at a time
+        for body in ("second", "third"):
+            send_line(alice, f"SEND bob {body}")
+            assert recv_line(alice).startswith("OK"), "send failed"
+            assert recv_line(bob) == f"MESSAGE alice {body}"
+        send_line(bob, "GET alice 2")
+        page = [recv_line(bob) for _ in range(2)]
+        assert [line.rsplit(" ", 1)[1] for line in page] == ["second", "third"], page
+        trailer = recv_line(bob)
+        assert trailer.startswith("OK History more "), trailer
+        send_line(bob, f"GET alice 2 {trailer.rsplit(' ', 1)[1]}")
+        assert recv_line(bob).endswith("hello-bob")
+        assert recv_line(bob) == "OK History end"
+
+        # a client holding everything up to "second" fetches only what follows
+        second_id = trailer.rsplit(" ", 1)[1]
+        send_line(bob, f"#5 SYNC alice {second_id}")
+        row = recv_line(bob)
+        assert row.startswith("#5 SYNC ") and row.endswith(" alice third"), row
+        assert recv_line(bob) == f"#5 OK Sync end {row.split()[2]}"
+
         send_line(bob, "DELETE alice")
         assert recv_line(bob).startswith("OK"), "delete failed"
+        send_line(bob, "GET alice")
+        assert recv_line(bob) == "INFO No messages with alice"
 
         send_line(alice, "USERS")
         assert recv_line(alice) == "USERS_BEGIN"
@@ -126,6 +386,161 @@ def main() -> int:
                 users.append(entry.split(" ", 1)[1])
         assert set(users) >= {"alice", "bob"}
 
+        send_line(alice, "#9 PING")
+        assert recv_line(alice) == "#9 PONG"
+
+        send_line(alice, "STATS")
+        assert recv_line(alice) == "STATS_BEGIN"
+        stats = []
+        while (entry := recv_line(alice)) != "STATS_END":
+            stats.append(entry)
+        assert any(line.startswith("STAT command_us count=") for line in stats), stats
+
+        # pipelined commands with request ids; commit acks may arrive late
+        alice.sendall(b"#1 SEND bob p1\n#2 SEND bob p2\n#3 USERS\n")
+        pending = {"#1 OK Message queued", "#2 OK Message queued", "#3 USERS_END"}
+        while pending:
+            line = recv_line(alice)
+            assert line.startswith(("#1 ", "#2 ", "#3 ")), line
+            pending.discard(line)
+        assert [recv_line(bob), recv_line(bob)] == ["MESSAGE alice p1", "MESSAGE alice p2"]
+
+        # group send: one stored message, each distinct recipient pushed once
+        send_line(alice, "GROUP bob,alice,bob all-hands")
+        assert recv_line(alice) == "MESSAGE alice all-hands"
+        assert recv_line(alice) == "OK Message queued"
+        assert recv_line(bob) == "MESSAGE alice all-hands"
+        send_line(bob, "GET alice 1")
+        assert recv_line(bob).endswith(" alice all-hands")
+        assert recv_line(bob).startswith("OK History more ")
+
+        # messages to an offline user wait in their inbox until AUTH
+        send_line(alice, "SEND dave while-away")
+        assert recv_line(alice) == "OK Message queued"
+        send_line(bob, "PRESENCE ON")
+        assert recv_line(bob) == "OK Presence on"
+        dave = connect_user("dave")
+        assert recv_line(dave).endswith(" alice while-away")
+        assert recv_line(dave) == "OK Inbox end"
+        joined, version = recv_line(bob).rsplit(" ", 1)
+        assert joined == "JOIN dave", joined
+        dave.close()
+        assert recv_line(bob) == f"LEAVE dave {int(version) + 1}"
+        send_line(bob, f"USERS {int(version) - 1}")
+        assert recv_line(bob) == f"USERS_BEGIN {int(version) + 1} delta"
+        assert recv_line(bob) == f"JOIN dave {version}"
+        assert recv_line(bob) == f"LEAVE dave {int(version) + 1}"
+        assert recv_line(bob) == "USERS_END"
+        send_line(bob, "PRESENCE OFF")
+        assert recv_line(bob) == "OK Presence off"
+
+        # a pipelined INBOX after AUTH sees the first page's cursor move
+        for sender in ("s0", "s1", "s2"):
+            sock = connect_user(sender)
+            sock.sendall("".join(f"SEND gina {sender}-{i}\n" for i in range(334)).encode())
+            for _ in range(334):
+                assert recv_line(sock) == "OK Message queued"
+            sock.close()
+        gina = socket.create_connection(("127.0.0.1", PORT), timeout=TIMEOUT)
+        recv_line(gina)  # welcome banner
+        gina.sendall(b"AUTH gina\nINBOX\n")
+        assert recv_line(gina).startswith("OK Authenticated as gina")
+        rows = [recv_line(gina) for _ in range(1000)]
+        assert recv_line(gina) == "OK Inbox more"
+        rows += [recv_line(gina), recv_line(gina)]
+        assert recv_line(gina) == "OK Inbox end"
+        assert len({row.rsplit(" ", 1)[1] for row in rows}) == 1002, "inbox page repeated"
+        gina.close()
+
+        if "--compress=dictionary" in server_args:
+            # past 1000 messages the writer trains a dictionary and compresses with it
+            body = "dictionary-trained-" * 8
+            send_line(alice, f"SEND bob {body}")
+            assert recv_line(alice) == "OK Message queued"
+            assert recv_line(bob) == f"MESSAGE alice {body}"
+            send_line(alice, "GET bob 1")
+            assert recv_line(alice).endswith(f" alice {body}")
+            assert recv_line(alice).startswith("OK History more ")
+            with contextlib.closing(sqlite3.connect(db_path)) as db:
+                assert db.execute("SELECT count(*) FROM body_dictionaries").fetchone()[0] == 1
+                stored = db.execute("SELECT body FROM messages ORDER BY id DESC LIMIT 1").fetchone()[0]
+                assert isinstance(stored, bytes) and stored[:2] == b"\x01\x01", "not compressed with the dictionary"
+                # another server sharing the file trains its own dictionary and stores a row with it
+                foreign = b"from-another-node-" * 16
+                packer = zlib.compressobj(wbits=-15, zdict=foreign)
+                body = "from-another-node-" * 4
+                blob = b"\x01" + varint(2) + varint(len(body)) + packer.compress(body.encode()) + packer.flush()
+                db.execute("INSERT INTO body_dictionaries (id, trained_upto, dict) VALUES (2, 0, ?)", (foreign,))
+                db.execute(
+                    "INSERT INTO messages (sender, receiver, body, conversation) VALUES ('zed', 'alice', ?, ?)",
+                    (blob, "alice\nzed"),
+                )
+                db.commit()
+            send_line(alice, "GET zed")
+            assert recv_line(alice).endswith(f" zed {body}")
+            assert recv_line(alice) == "OK History end"
+
+        # the token handed out at AUTH resumes the session, PRESENCE ON included
+        erin, reply = login("erin")
+        token = reply.rsplit(" ", 1)[1]
+        assert reply == f"OK Authenticated as erin {token}", reply
+        send_line(erin, "PRESENCE ON")
+        assert recv_line(erin) == "OK Presence on"
+        send_line(erin, "QUIT")
+        assert recv_line(erin) == "BYE"
+        assert erin.recv(1) == b""  # closed once the logout is recorded
+        erin.close()
+        erin, reply = login("erin", token)
+        assert reply == f"OK Resumed as erin {token}", reply
+        frank = connect_user("frank")
+        assert recv_line(erin).startswith("JOIN frank "), "presence not resumed"
+        frank.close()
+        erin.close()
+
+        # binary framing: bodies may exceed a text line and contain newlines
+        carol = connect_binary("carol")
+        long_body = "first line\n" + "x" * 5000
+        send_frame(carol, 0x02, text_field("alice") + text_field(long_body))
+        assert recv_frame(carol) == (0x41, text_field("Message queued")), "binary send failed"
+        assert recv_line(alice).startswith("MESSAGE carol first line xxx")
+        send_frame(carol, 0x03, text_field("alice") + varint(0) + varint(0))
+        opcode, body = recv_frame(carol)
+        assert opcode == 0x51, opcode
+        _, pos = read_varint(body, 0)
+        fields = []
+        for _ in range(3):
+            length, pos = read_varint(body, pos)
+            fields.append(body[pos : pos + length].decode())
+            pos += length
+        assert fields[1:] == ["carol", long_body], fields[1:]
+        assert recv_frame(carol) == (0x41, text_field("History end"))
+        send_frame(carol, 0x82, varint(7) + text_field("alice") + text_field("tagged"))
+        assert recv_frame(carol) == (0xC1, varint(7) + text_field("Message queued"))
+        assert recv_line(alice) == "MESSAGE carol tagged"
+        # with compression on, the history chunk arrives as one deflated frame
+        send_frame(carol, 0x0D, varint(1))
+        assert recv_frame(carol) == (0x41, text_field("Compression on"))
+        send_frame(carol, 0x03, text_field("alice") + varint(0) + varint(0))
+        opcode, body = recv_frame(carol)
+        assert opcode == 0x53, opcode
+        plain_len, pos = read_varint(body, 0)
+        plain = zlib.decompress(body[pos:], -15)
+        assert len(plain) == plain_len
+        opcodes, pos = [], 0
+        while pos < len(plain):
+            length, start = read_varint(plain, pos + 1)
+            opcodes.append(plain[pos])
+            pos = start + length
+        assert opcodes == [0x51, 0x51], opcodes
+        assert plain.endswith(text_field("carol") + text_field("tagged"))
+        assert recv_frame(carol) == (0x41, text_field("History end"))
+        send_frame(carol, 0x06, b"")
+        assert recv_frame(carol)[0] == 0x44
+        carol.close()
+
+        if peer is not None:
+            run_cluster_checks(alice)
+
         send_line(alice, "QUIT")
         send_line(bob, "QUIT")
     finally:
@@ -135,13 +550,79 @@ def main() -> int:
                     sock.close()
                 except OSError:
                     pass
-        server.send_signal(signal.SIGINT)
-        try:
-            server.wait(timeout=2)
-        except subprocess.TimeoutExpired:
-            server.kill()
-        if os.path.exists(db_path):
-            os.remove(db_path)
+        stop_server(server)
+        remove_db(db_path)
+        if peer is not None:
+            stop_server(peer)
+            remove_db(peer_db)
+    return 0
+
+
+def run_admission_scenario() -> int:
+    """Per-session token buckets and load shedding on the SEND path."""
+    server_args = ["--send-rate=5", "--ack=enqueue"]
+    db_path = temp_db(server_args)
+    server = start_server(PORT, db_path, server_args)
+    if server is None:
+        remove_db(db_path)
+        return 1
+    try:
+        # a two-second burst of 5/s admits 10 sends, then the bucket is empty
+        hana = connect_user("hana")
+        hana.sendall("".join(f"SEND ivan flood-{i}\n" for i in range(15)).encode())
+        replies = [recv_line(hana) for _ in range(15)]
+        assert replies[:10] == ["OK Message queued"] * 10, replies
+        for reply in replies[10:]:
+            assert reply.startswith("ERROR Rate limited, retry in "), reply
+            assert 0 < int(reply.split()[-2]) <= 201, reply  # one token every 200 ms
+        time.sleep(0.5)  # two tokens' worth
+        hana.sendall(b"SEND ivan again-1\nSEND ivan again-2\nSEND ivan again-3\n")
+        assert [recv_line(hana) for _ in range(2)] == ["OK Message queued"] * 2
+        assert recv_line(hana).startswith("ERROR Rate limited, retry in ")
+        hana.close()
+    finally:
+        stop_server(server)
+        remove_db(db_path)
+
+    # the writer holds a partial batch back, so the queue fills past the limit
+    server_args = ["--shed-storage-queue=3", "--write-batch=1000", "--write-delay-ms=1500", "--ack=enqueue"]
+    db_path = temp_db(server_args)
+    server = start_server(PORT, db_path, server_args)
+    if server is None:
+        remove_db(db_path)
+        return 1
+    try:
+        jack = connect_user("jack")
+        jack.sendall("".join(f"SEND kim busy-{i}\n" for i in range(8)).encode())
+        replies = [recv_line(jack) for _ in range(8)]
+        assert replies[:4] == ["OK Message queued"] * 4, replies
+        assert replies[4:] == ["ERROR Busy"] * 4, replies
+        time.sleep(2)  # the delayed batch commits and the queue empties
+        send_line(jack, "SEND kim after-busy")
+        assert recv_line(jack) == "OK Message queued"
+        send_line(jack, "GET kim")
+        rows = []
+        while (line := recv_line(jack)) != "OK History end":
+            rows.append(line.rsplit(" ", 1)[1])
+        assert rows == [f"busy-{i}" for i in range(4)] + ["after-busy"], rows
+        jack.close()
+    finally:
+        stop_server(server)
+        remove_db(db_path)
+    return 0
+
+
+def main() -> int:
+    if not SERVER_BIN.exists():
+        print("Build the project first: make", file=sys.stderr)
+        return 1
+    for server_args in IO_MODES:
+        if run_scenario(server_args) != 0:
+            print(f"Smoke test failed for {' '.join(server_args)}", file=sys.stderr)
+            return 1
+    if run_admission_scenario() != 0:
+        print("Smoke test failed for admission control", file=sys.stderr)
+        return 1
     print("Smoke test passed")
     return 0
 